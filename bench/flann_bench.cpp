@@ -0,0 +1,462 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+/*
+ * flann_bench: measures build time, memory, throughput, recall and latency of
+ * FLANN indexes on standard ANN benchmark datasets.
+ *
+ * Usage:
+ *   flann_bench --base sift_base.fvecs --query sift_query.fvecs [--gt sift_groundtruth.ivecs]
+ *               [--k 10] [--index kdtree:trees=8] [--index kmeans:branching=32,iterations=5] ...
+ *               [--checks 16,32,64,128] [--threads 1,4,8] [--max-base N] [--max-query N]
+ *               [--output results.json]
+ *
+ * The datasets are read from .fvecs (float), .bvecs (unsigned char) and .ivecs
+ * (ground truth) files, or from HDF5 files holding "dataset", "query" and
+ * "match" datasets. Without a ground truth file the exact neighbors are computed
+ * with a linear search. The results are written as JSON.
+ */
+
+#include <flann/flann.hpp>
+#ifdef FLANN_BENCH_HDF5
+#include <flann/io/hdf5.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace flann;
+
+namespace
+{
+
+struct Options
+{
+    Options() : k(10), max_base(0), max_query(0), output("flann_bench.json") {}
+
+    std::string base;
+    std::string query;
+    std::string gt;
+    size_t k;
+    size_t max_base;
+    size_t max_query;
+    std::string output;
+    std::vector<std::string> indexes;
+    std::vector<int> checks;
+    std::vector<int> threads;
+};
+
+struct LatencyStats
+{
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+double wall_time()
+{
+    return Deadline::now();
+}
+
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.size()>=suffix.size() && str.compare(str.size()-suffix.size(), suffix.size(), suffix)==0;
+}
+
+std::vector<int> parse_int_list(const std::string& str)
+{
+    std::vector<int> values;
+    size_t start = 0;
+    while (start<str.size()) {
+        size_t end = str.find(',', start);
+        if (end==std::string::npos) end = str.size();
+        values.push_back(atoi(str.substr(start, end-start).c_str()));
+        start = end+1;
+    }
+    return values;
+}
+
+/**
+ * Reads a .fvecs, .bvecs or .ivecs file: each vector is stored as its int32
+ * dimensionality followed by its components.
+ */
+template<typename T, typename FileType>
+Matrix<T> load_vecs(const std::string& filename, size_t max_rows)
+{
+    FILE* fin = fopen(filename.c_str(), "rb");
+    if (fin==NULL) {
+        throw FLANNException("Cannot open file "+filename);
+    }
+    int dim;
+    if (fread(&dim, sizeof(dim), 1, fin)!=1 || dim<=0) {
+        fclose(fin);
+        throw FLANNException("Invalid vecs file "+filename);
+    }
+    fseek(fin, 0, SEEK_END);
+    size_t vector_size = sizeof(int)+dim*sizeof(FileType);
+    size_t rows = ftell(fin)/vector_size;
+    if (max_rows>0 && rows>max_rows) rows = max_rows;
+    fseek(fin, 0, SEEK_SET);
+
+    Matrix<T> data(new T[rows*dim], rows, dim);
+    std::vector<FileType> buffer(dim);
+    for (size_t i=0;i<rows;++i) {
+        if (fread(&dim, sizeof(dim), 1, fin)!=1 || fread(&buffer[0], sizeof(FileType), dim, fin)!=(size_t)dim) {
+            fclose(fin);
+            delete[] data.ptr();
+            throw FLANNException("Truncated vecs file "+filename);
+        }
+        std::copy(buffer.begin(), buffer.end(), data[i]);
+    }
+    fclose(fin);
+    return data;
+}
+
+template<typename T>
+Matrix<T> load_matrix(const std::string& filename, const std::string& name, size_t max_rows)
+{
+    if (ends_with(filename, ".fvecs")) return load_vecs<T, float>(filename, max_rows);
+    if (ends_with(filename, ".bvecs")) return load_vecs<T, unsigned char>(filename, max_rows);
+    if (ends_with(filename, ".ivecs")) return load_vecs<T, int>(filename, max_rows);
+#ifdef FLANN_BENCH_HDF5
+    if (ends_with(filename, ".h5") || ends_with(filename, ".hdf5")) {
+        Matrix<T> data;
+        load_from_file(data, filename, name);
+        if (max_rows>0 && data.rows>max_rows) {
+            data = Matrix<T>(data.ptr(), max_rows, data.cols);
+        }
+        return data;
+    }
+#endif
+    throw FLANNException("Unsupported file format: "+filename);
+}
+
+/**
+ * Creates the index parameters from a specification like "kdtree:trees=8",
+ * "kmeans:branching=32,iterations=5" or "sharded:shards=4,shard:trees=4".
+ */
+IndexParams parse_index(const std::string& spec)
+{
+    std::string name = spec.substr(0, spec.find(':'));
+    IndexParams params;
+    if (name=="linear") params = LinearIndexParams();
+    else if (name=="kdtree") params = KDTreeIndexParams();
+    else if (name=="kmeans") params = KMeansIndexParams();
+    else if (name=="composite") params = CompositeIndexParams();
+    else if (name=="kdtree_single") params = KDTreeSingleIndexParams();
+    else if (name=="hierarchical") params = HierarchicalClusteringIndexParams();
+    else if (name=="lsh") params = LshIndexParams();
+    else if (name=="autotuned") params = AutotunedIndexParams();
+    else if (name=="sharded") params = ShardedIndexParams();
+    else throw FLANNException("Unknown index type: "+name);
+
+    if (spec.find(':')==std::string::npos) return params;
+    std::string args = spec.substr(spec.find(':')+1);
+    size_t start = 0;
+    while (start<args.size()) {
+        size_t end = args.find(',', start);
+        if (end==std::string::npos) end = args.size();
+        std::string arg = args.substr(start, end-start);
+        size_t eq = arg.find('=');
+        if (eq==std::string::npos) throw FLANNException("Invalid index parameter: "+arg);
+        std::string key = arg.substr(0, eq);
+        std::string value = arg.substr(eq+1);
+        // the keys may carry a prefix, as the shard parameters of the sharded index
+        if (ends_with(key, "cb_index") || ends_with(key, "target_precision") || ends_with(key, "build_weight") ||
+                ends_with(key, "memory_weight") || ends_with(key, "sample_fraction") ||
+                ends_with(key, "latency_budget_us") || ends_with(key, "compaction_threshold")) {
+            params[key] = (float)atof(value.c_str());
+        }
+        else if (ends_with(key, "algorithm")) {
+            params[key] = (flann_algorithm_t)atoi(value.c_str());
+        }
+        else if (ends_with(key, "centers_init")) {
+            params[key] = (flann_centers_init_t)atoi(value.c_str());
+        }
+        else if (key=="partition") {
+            params[key] = (flann_partition_t)atoi(value.c_str());
+        }
+        else if (ends_with(key, "precision_metric")) {
+            params[key] = (flann_precision_metric_t)atoi(value.c_str());
+        }
+        else if (ends_with(key, "save_compression")) {
+            params[key] = (flann_compression_t)atoi(value.c_str());
+        }
+        else if (ends_with(key, "reorder") || ends_with(key, "save_dataset") || ends_with(key, "background_rebuild")) {
+            params[key] = atoi(value.c_str())!=0;
+        }
+        else if (ends_with(key, "tuning_profile")) {
+            params[key] = value;
+        }
+        else {
+            params[key] = atoi(value.c_str());
+        }
+        start = end+1;
+    }
+    return params;
+}
+
+LatencyStats latency_stats(std::vector<double> latencies)
+{
+    LatencyStats stats;
+    std::sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    double sum = 0;
+    for (size_t i=0;i<n;++i) sum += latencies[i];
+    stats.mean = sum/n;
+    stats.p50 = latencies[std::min(n-1, size_t(n*0.5))];
+    stats.p90 = latencies[std::min(n-1, size_t(n*0.9))];
+    stats.p99 = latencies[std::min(n-1, size_t(n*0.99))];
+    stats.max = latencies[n-1];
+    return stats;
+}
+
+/**
+ * Fraction of the k true nearest neighbors that were found.
+ */
+double recall_at_k(const Matrix<size_t>& indices, const Matrix<int>& gt, size_t k)
+{
+    size_t found = 0;
+    size_t gt_k = std::min(k, gt.cols);
+    for (size_t i=0;i<indices.rows;++i) {
+        for (size_t j=0;j<gt_k;++j) {
+            for (size_t l=0;l<k;++l) {
+                if (indices[i][l]==(size_t)gt[i][j]) {
+                    found++;
+                    break;
+                }
+            }
+        }
+    }
+    return double(found)/(indices.rows*gt_k);
+}
+
+template<typename Distance>
+void run(const Options& options, FILE* out)
+{
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType DistanceType;
+
+    printf("Loading %s\n", options.base.c_str());
+    Matrix<ElementType> base = load_matrix<ElementType>(options.base, "dataset", options.max_base);
+    printf("Loading %s\n", options.query.c_str());
+    Matrix<ElementType> query = load_matrix<ElementType>(options.query, "query", options.max_query);
+    if (base.cols!=query.cols) {
+        throw FLANNException("The base and query vectors have different dimensionality");
+    }
+    size_t k = options.k;
+
+    Matrix<int> gt;
+    if (!options.gt.empty()) {
+        printf("Loading %s\n", options.gt.c_str());
+        gt = load_matrix<int>(options.gt, "match", query.rows);
+        if (gt.rows<query.rows) {
+            throw FLANNException("The ground truth has fewer rows than there are queries");
+        }
+        if (options.max_base>0) {
+            printf("Warning: the ground truth was computed for the whole base set\n");
+        }
+    }
+    else {
+        printf("Computing the ground truth with a linear search\n");
+        gt = Matrix<int>(new int[query.rows*k], query.rows, k);
+        Matrix<DistanceType> gt_dists(new DistanceType[query.rows*k], query.rows, k);
+        Index<Distance> linear(base, LinearIndexParams());
+        linear.buildIndex();
+        SearchParams params;
+        params.cores = 0;
+        linear.knnSearch(query, gt, gt_dists, k, params);
+        delete[] gt_dists.ptr();
+    }
+
+    fprintf(out, "{\n  \"base\": \"%s\",\n  \"query\": \"%s\",\n", options.base.c_str(), options.query.c_str());
+    fprintf(out, "  \"rows\": %zu,\n  \"dim\": %zu,\n  \"queries\": %zu,\n  \"k\": %zu,\n",
+            base.rows, base.cols, query.rows, k);
+    fprintf(out, "  \"results\": [");
+
+    Matrix<size_t> indices(new size_t[query.rows*k], query.rows, k);
+    Matrix<DistanceType> dists(new DistanceType[query.rows*k], query.rows, k);
+    std::vector<double> latencies(query.rows);
+
+    for (size_t s=0;s<options.indexes.size();++s) {
+        const std::string& spec = options.indexes[s];
+        Index<Distance> index(base, parse_index(spec));
+        printf("Building %s... ", spec.c_str());
+        fflush(stdout);
+        double start = wall_time();
+        index.buildIndex();
+        double build_time = wall_time()-start;
+        printf("done (%g s, %zu bytes)\n", build_time, index.usedMemory());
+
+        fprintf(out, "%s\n    {\n      \"index\": \"%s\",\n", s>0 ? "," : "", spec.c_str());
+        fprintf(out, "      \"build_time_s\": %g,\n      \"memory_bytes\": %zu,\n", build_time, index.usedMemory());
+        fprintf(out, "      \"searches\": [");
+
+        bool first = true;
+        for (size_t c=0;c<options.checks.size();++c) {
+            SearchParams params(options.checks[c]);
+            params.cores = 1;
+            for (size_t t=0;t<options.threads.size();++t) {
+                int threads = options.threads[t];
+                // one query at a time to measure the latency, the threads share the queries
+                start = wall_time();
+#pragma omp parallel for schedule(dynamic, 16) num_threads(threads)
+                for (int i=0;i<(int)query.rows;++i) {
+                    Matrix<size_t> query_indices(indices[i], 1, k);
+                    Matrix<DistanceType> query_dists(dists[i], 1, k);
+                    double query_start = wall_time();
+                    index.knnSearch(Matrix<ElementType>(query[i], 1, query.cols), query_indices, query_dists, k, params);
+                    latencies[i] = (wall_time()-query_start)*1e6;
+                }
+                double search_time = wall_time()-start;
+                double qps = query.rows/search_time;
+                double recall = recall_at_k(indices, gt, k);
+                LatencyStats latency = latency_stats(latencies);
+                printf("  checks %6d threads %3d: %10.1f QPS, recall@%zu %.4f, latency p50 %.1f us p99 %.1f us\n",
+                        options.checks[c], threads, qps, k, recall, latency.p50, latency.p99);
+
+                fprintf(out, "%s\n        {\"checks\": %d, \"threads\": %d, \"qps\": %g, \"recall\": %g, ",
+                        first ? "" : ",", options.checks[c], threads, qps, recall);
+                fprintf(out, "\"latency_us\": {\"mean\": %g, \"p50\": %g, \"p90\": %g, \"p99\": %g, \"max\": %g}}",
+                        latency.mean, latency.p50, latency.p90, latency.p99, latency.max);
+                first = false;
+            }
+        }
+        fprintf(out, "\n      ]\n    }");
+        fflush(out);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    delete[] indices.ptr();
+    delete[] dists.ptr();
+    delete[] gt.ptr();
+    delete[] base.ptr();
+    delete[] query.ptr();
+}
+
+void usage()
+{
+    printf("Usage: flann_bench --base FILE --query FILE [options]\n"
+            "  --base FILE        base vectors (.fvecs, .bvecs, .h5)\n"
+            "  --query FILE       query vectors (.fvecs, .bvecs, .h5)\n"
+            "  --gt FILE          ground truth (.ivecs, .h5), computed if not given\n"
+            "  --k N              number of neighbors (default 10)\n"
+            "  --index SPEC       index to benchmark, e.g. kdtree:trees=8 (repeatable)\n"
+            "  --checks LIST      comma separated checks values (default 16,32,...,1024)\n"
+            "  --threads LIST     comma separated thread counts (default 1 and all cores)\n"
+            "  --max-base N       only use the first N base vectors\n"
+            "  --max-query N      only use the first N queries\n"
+            "  --output FILE      JSON results file (default flann_bench.json)\n");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i=1;i<argc;++i) {
+        std::string arg = argv[i];
+        if (arg=="--help" || arg=="-h") {
+            usage();
+            return 0;
+        }
+        if (i+1>=argc) {
+            usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg=="--base") options.base = value;
+        else if (arg=="--query") options.query = value;
+        else if (arg=="--gt") options.gt = value;
+        else if (arg=="--k") options.k = atoi(value.c_str());
+        else if (arg=="--index") options.indexes.push_back(value);
+        else if (arg=="--checks") options.checks = parse_int_list(value);
+        else if (arg=="--threads") options.threads = parse_int_list(value);
+        else if (arg=="--max-base") options.max_base = atoi(value.c_str());
+        else if (arg=="--max-query") options.max_query = atoi(value.c_str());
+        else if (arg=="--output") options.output = value;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (options.base.empty() || options.query.empty()) {
+        usage();
+        return 1;
+    }
+    if (options.indexes.empty()) {
+        options.indexes.push_back("kdtree:trees=1");
+        options.indexes.push_back("kdtree:trees=4");
+        options.indexes.push_back("kdtree:trees=8");
+        options.indexes.push_back("kmeans:branching=32,iterations=5");
+        options.indexes.push_back("hierarchical:branching=32,trees=4");
+    }
+    if (options.checks.empty()) {
+        for (int checks=16;checks<=1024;checks*=2) options.checks.push_back(checks);
+    }
+    if (options.threads.empty()) {
+        options.threads.push_back(1);
+#ifdef _OPENMP
+        if (omp_get_max_threads()>1) options.threads.push_back(omp_get_max_threads());
+#endif
+    }
+
+    FILE* out = fopen(options.output.c_str(), "w");
+    if (out==NULL) {
+        fprintf(stderr, "Cannot open %s\n", options.output.c_str());
+        return 1;
+    }
+    try {
+        if (ends_with(options.base, ".bvecs")) {
+            run<L2<unsigned char> >(options, out);
+        }
+        else {
+            run<L2<float> >(options, out);
+        }
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        fclose(out);
+        return 1;
+    }
+    fclose(out);
+    printf("Results written to %s\n", options.output.c_str());
+
+    return 0;
+}
@@ -0,0 +1,371 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+/*
+ * flann_microbench: measures the building blocks of the search algorithms in
+ * isolation, the distance functors from dist.h and the result sets and heaps
+ * used to collect neighbors and branches.
+ *
+ * Usage:
+ *   flann_microbench [--filter SUBSTRING] [--min-time SECONDS] [--output results.json]
+ *
+ * Distance functors are reported in ns per distance and GB/s of vector data
+ * read (both operands), result sets and heaps in ns per inserted element and
+ * millions of inserts per second.
+ */
+
+#include <flann/algorithms/dist.h>
+#include <flann/util/heap.h>
+#include <flann/util/result_set.h>
+#include <flann/util/timer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace flann;
+
+namespace
+{
+
+struct Options
+{
+    Options() : min_time(0.1) {}
+
+    std::string filter;
+    double min_time;
+    std::string output;
+};
+
+struct Measurement
+{
+    std::string name;
+    double ns_per_op;
+    double throughput;
+    const char* unit;
+};
+
+/** Keeps the compiler from optimizing away the benchmarked computations */
+volatile double sink;
+
+/**
+ * Runs bench(iterations) with an increasing number of iterations until it
+ * takes at least min_time seconds and returns the time per iteration in ns.
+ */
+template<typename Bench>
+double measure(Bench& bench, double min_time)
+{
+    size_t iterations = 64;
+    for (;;) {
+        double start = Deadline::now();
+        sink = bench(iterations);
+        double elapsed = Deadline::now()-start;
+        if (elapsed>=min_time || iterations>=(size_t(1)<<40)) {
+            return elapsed*1e9/iterations;
+        }
+        // aim for 1.5x the minimum time on the next run
+        double scale = elapsed>0 ? 1.5*min_time/elapsed : 100;
+        if (scale>100) scale = 100;
+        if (scale<2) scale = 2;
+        iterations = size_t(iterations*scale);
+    }
+}
+
+template<typename T>
+T random_value()
+{
+    // strictly positive so that the KL divergence and Hellinger distance are defined
+    return T(1+rand()%255);
+}
+
+template<>
+float random_value<float>()
+{
+    return (rand()+1.0f)/(RAND_MAX+1.0f);
+}
+
+template<>
+double random_value<double>()
+{
+    return (rand()+1.0)/(RAND_MAX+1.0);
+}
+
+/**
+ * Computes the distance from a query to a working set of vectors that fits
+ * in the L2 cache, cycling through the set.
+ */
+template<typename Distance>
+struct DistanceBench
+{
+    typedef typename Distance::ElementType ElementType;
+
+    DistanceBench(const Distance& distance, size_t dim) : distance_(distance), dim_(dim)
+    {
+        rows_ = std::max(size_t(16), (256*1024)/(dim*sizeof(ElementType)));
+        data_.resize(rows_*dim);
+        query_.resize(dim);
+        for (size_t i=0;i<data_.size();++i) data_[i] = random_value<ElementType>();
+        for (size_t i=0;i<dim;++i) query_[i] = random_value<ElementType>();
+    }
+
+    double operator()(size_t iterations)
+    {
+        double sum = 0;
+        size_t row = 0;
+        for (size_t i=0;i<iterations;++i) {
+            sum += distance_(&data_[row*dim_], &query_[0], dim_);
+            if (++row==rows_) row = 0;
+        }
+        return sum;
+    }
+
+    Distance distance_;
+    size_t dim_;
+    size_t rows_;
+    std::vector<ElementType> data_;
+    std::vector<ElementType> query_;
+};
+
+/**
+ * Adds a stream of random distances to a result set, as a search does when
+ * checking the points of a leaf. The result set is cleared every 1024 points.
+ */
+template<typename ResultSetType>
+struct ResultSetBench
+{
+    ResultSetBench(size_t k) : result_(k), dists_(1024)
+    {
+        for (size_t i=0;i<dists_.size();++i) dists_[i] = random_value<float>();
+    }
+
+    double operator()(size_t iterations)
+    {
+        size_t j = 0;
+        for (size_t i=0;i<iterations;++i) {
+            result_.addPoint(dists_[j], i);
+            if (++j==dists_.size()) {
+                j = 0;
+                result_.clear();
+            }
+        }
+        return result_.worstDist();
+    }
+
+    ResultSetType result_;
+    std::vector<float> dists_;
+};
+
+/**
+ * Fills a heap with k branches and then empties it, as the branch heaps of the
+ * tree searches are used. One iteration is an insert and a pop.
+ */
+template<typename HeapType>
+struct HeapBench
+{
+    typedef BranchStruct<int, float> BranchSt;
+
+    HeapBench(size_t k) : heap_(k), k_(k), branches_(1024)
+    {
+        for (size_t i=0;i<branches_.size();++i) branches_[i] = BranchSt(int(i), random_value<float>());
+    }
+
+    double operator()(size_t iterations)
+    {
+        double sum = 0;
+        size_t j = 0;
+        BranchSt branch;
+        for (size_t i=0;i<iterations;i+=k_) {
+            for (size_t l=0;l<k_;++l) {
+                heap_.insert(branches_[j]);
+                if (++j==branches_.size()) j = 0;
+            }
+            while (heap_.popMin(branch)) sum += branch.mindist;
+        }
+        return sum;
+    }
+
+    HeapType heap_;
+    size_t k_;
+    std::vector<BranchSt> branches_;
+};
+
+class Runner
+{
+public:
+    Runner(const Options& options) : options_(options) {}
+
+    template<typename Distance>
+    void distance(const std::string& name, const Distance& distance, size_t dim)
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s/dim:%zu", name.c_str(), dim);
+        if (!selected(buf)) return;
+        DistanceBench<Distance> bench(distance, dim);
+        double ns = measure(bench, options_.min_time);
+        report(buf, ns, 2*dim*sizeof(typename Distance::ElementType)/ns, "GB/s");
+    }
+
+    template<typename Bench>
+    void inserts(const std::string& name, size_t k)
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s/k:%zu", name.c_str(), k);
+        if (!selected(buf)) return;
+        Bench bench(k);
+        double ns = measure(bench, options_.min_time);
+        report(buf, ns, 1e3/ns, "Mops/s");
+    }
+
+    bool write(const std::string& filename)
+    {
+        FILE* out = fopen(filename.c_str(), "w");
+        if (out==NULL) return false;
+        fprintf(out, "{\n  \"benchmarks\": [");
+        for (size_t i=0;i<results_.size();++i) {
+            fprintf(out, "%s\n    {\"name\": \"%s\", \"ns_per_op\": %g, \"throughput\": %g, \"unit\": \"%s\"}",
+                    i>0 ? "," : "", results_[i].name.c_str(), results_[i].ns_per_op, results_[i].throughput, results_[i].unit);
+        }
+        fprintf(out, "\n  ]\n}\n");
+        fclose(out);
+        return true;
+    }
+
+private:
+    bool selected(const char* name) const
+    {
+        return options_.filter.empty() || strstr(name, options_.filter.c_str())!=NULL;
+    }
+
+    void report(const char* name, double ns, double throughput, const char* unit)
+    {
+        printf("%-56s %10.2f ns/op %10.2f %s\n", name, ns, throughput, unit);
+        fflush(stdout);
+        Measurement m;
+        m.name = name;
+        m.ns_per_op = ns;
+        m.throughput = throughput;
+        m.unit = unit;
+        results_.push_back(m);
+    }
+
+    const Options& options_;
+    std::vector<Measurement> results_;
+};
+
+template<typename T>
+void distance_benchmarks(Runner& runner, const std::string& type)
+{
+    const size_t dims[] = { 3, 16, 64, 128, 960 };
+    for (size_t i=0;i<sizeof(dims)/sizeof(dims[0]);++i) {
+        size_t dim = dims[i];
+        runner.distance("L2_Simple<"+type+">", L2_Simple<T>(), dim);
+        runner.distance("L2<"+type+">", L2<T>(), dim);
+        runner.distance("L1<"+type+">", L1<T>(), dim);
+        runner.distance("MinkowskiDistance<"+type+">", MinkowskiDistance<T>(3), dim);
+        runner.distance("MaxDistance<"+type+">", MaxDistance<T>(), dim);
+        runner.distance("HistIntersectionDistance<"+type+">", HistIntersectionDistance<T>(), dim);
+        runner.distance("HellingerDistance<"+type+">", HellingerDistance<T>(), dim);
+        runner.distance("ChiSquareDistance<"+type+">", ChiSquareDistance<T>(), dim);
+        runner.distance("KL_Divergence<"+type+">", KL_Divergence<T>(), dim);
+    }
+    runner.distance("L2_3D<"+type+">", L2_3D<T>(), 3);
+}
+
+void hamming_benchmarks(Runner& runner)
+{
+    // binary descriptors, the size is in bytes
+    const size_t dims[] = { 32, 64, 128 };
+    for (size_t i=0;i<sizeof(dims)/sizeof(dims[0]);++i) {
+        size_t dim = dims[i];
+        runner.distance("HammingLUT", HammingLUT(), dim);
+        runner.distance("HammingPopcnt<unsigned char>", HammingPopcnt<unsigned char>(), dim);
+        runner.distance("Hamming<unsigned char>", Hamming<unsigned char>(), dim);
+    }
+}
+
+void insert_benchmarks(Runner& runner)
+{
+    const size_t ks[] = { 1, 10, 100, 1000 };
+    for (size_t i=0;i<sizeof(ks)/sizeof(ks[0]);++i) {
+        size_t k = ks[i];
+        runner.inserts<ResultSetBench<KNNSimpleResultSet<float> > >("KNNSimpleResultSet", k);
+        runner.inserts<ResultSetBench<KNNResultSet<float> > >("KNNResultSet", k);
+        runner.inserts<ResultSetBench<KNNResultSet2<float> > >("KNNResultSet2", k);
+        runner.inserts<ResultSetBench<KNNUniqueResultSet<float> > >("KNNUniqueResultSet", k);
+        runner.inserts<HeapBench<Heap<BranchStruct<int, float> > > >("Heap", k);
+        runner.inserts<HeapBench<IntervalHeap<BranchStruct<int, float> > > >("IntervalHeap", k);
+    }
+}
+
+void usage()
+{
+    printf("Usage: flann_microbench [options]\n"
+            "  --filter STRING    only run the benchmarks whose name contains STRING\n"
+            "  --min-time SECONDS minimum measuring time per benchmark (default 0.1)\n"
+            "  --output FILE      also write the results to a JSON file\n");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i=1;i<argc;++i) {
+        std::string arg = argv[i];
+        if (arg=="--help" || arg=="-h" || i+1>=argc) {
+            usage();
+            return arg=="--help" || arg=="-h" ? 0 : 1;
+        }
+        std::string value = argv[++i];
+        if (arg=="--filter") options.filter = value;
+        else if (arg=="--min-time") options.min_time = atof(value.c_str());
+        else if (arg=="--output") options.output = value;
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    srand(0);
+    Runner runner(options);
+    distance_benchmarks<float>(runner, "float");
+    distance_benchmarks<double>(runner, "double");
+    distance_benchmarks<unsigned char>(runner, "unsigned char");
+    hamming_benchmarks(runner);
+    insert_benchmarks(runner);
+
+    if (!options.output.empty() && !runner.write(options.output)) {
+        fprintf(stderr, "Cannot open %s\n", options.output.c_str());
+        return 1;
+    }
+    return 0;
+}
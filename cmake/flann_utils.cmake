@@ -88,6 +88,28 @@ macro(flann_add_gtest exe src)
     )
 endmacro(flann_add_gtest)
 
+macro(flann_add_mpi_gtest exe src processes)
+    # add build target
+    add_executable(${exe} EXCLUDE_FROM_ALL ${src})
+    target_link_libraries(${exe} ${googletest_LIBRARIES} ${ARGN})
+    # add dependency to 'tests' target
+    add_dependencies(${exe} googletest)
+    add_dependencies(flann_gtests ${exe})
+
+    # add target for running test on several processes
+    if (MPIEXEC_EXECUTABLE)
+        set(_mpiexec ${MPIEXEC_EXECUTABLE})
+    else()
+        set(_mpiexec ${MPIEXEC})
+    endif()
+    string(REPLACE "/" "_" _testname ${exe})
+    add_test(
+        NAME test_${_testname}
+        COMMAND ${_mpiexec} ${MPIEXEC_NUMPROC_FLAG} ${processes} ${MPIEXEC_PREFLAGS} $<TARGET_FILE:${exe}> --gtest_print_time
+        WORKING_DIRECTORY ${PROJECT_SOURCE_DIR}/test
+    )
+endmacro(flann_add_mpi_gtest)
+
 macro(flann_add_cuda_gtest exe src)
     # add build target
     cuda_add_executable(${exe} EXCLUDE_FROM_ALL ${src})
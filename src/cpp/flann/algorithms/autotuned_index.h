@@ -30,6 +30,18 @@
 #ifndef FLANN_AUTOTUNED_INDEX_H_
 #define FLANN_AUTOTUNED_INDEX_H_
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <typeinfo>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
 #include "flann/nn/ground_truth.h"
@@ -54,7 +66,9 @@ inline NNIndex<Distance>*
 
 struct AutotunedIndexParams : public IndexParams
 {
-    AutotunedIndexParams(float target_precision = 0.8f, float build_weight = 0.01f, float memory_weight = 0.f, float sample_fraction = 0.1f)
+    AutotunedIndexParams(float target_precision = 0.8f, float build_weight = 0.01f, float memory_weight = 0.f, float sample_fraction = 0.1f,
+            int target_nn = 1, flann_precision_metric_t precision_metric = FLANN_PRECISION_AT_K, float latency_budget_us = 0.f,
+            int cores = 1)
     {
         (*this)["algorithm"] = FLANN_INDEX_AUTOTUNED;
         // precision desired (used for autotuning, -1 otherwise)
@@ -65,10 +79,157 @@ struct AutotunedIndexParams : public IndexParams
         (*this)["memory_weight"] = memory_weight;
         // what fraction of the dataset to use for autotuning
         (*this)["sample_fraction"] = sample_fraction;
+        // number of neighbors the precision is measured for
+        (*this)["target_nn"] = target_nn;
+        // how the precision is measured (precision@k, recall@k, distance ratio)
+        (*this)["precision_metric"] = precision_metric;
+        // maximum search time per query in microseconds (0 for no limit)
+        (*this)["latency_budget_us"] = latency_budget_us;
+        // number of parameter combinations evaluated in parallel (0 for auto)
+        (*this)["cores"] = cores;
     }
+
+    AutotunedIndexParams(const std::string& tuning_profile, float target_precision = 0.8f, float build_weight = 0.01f,
+            float memory_weight = 0.f, float sample_fraction = 0.1f, int target_nn = 1,
+            flann_precision_metric_t precision_metric = FLANN_PRECISION_AT_K, float latency_budget_us = 0.f, int cores = 1)
+    {
+        *this = AutotunedIndexParams(target_precision, build_weight, memory_weight, sample_fraction,
+                target_nn, precision_metric, latency_budget_us, cores);
+        // file the autotuning starts from, if it exists, and the result is saved to
+        (*this)["tuning_profile"] = tuning_profile;
+    }
+};
+
+
+/**
+ * Index and search parameters measured by the autotuning, on the sampled dataset
+ */
+struct AutotunedOperatingPoint
+{
+    IndexParams index_params;
+    SearchParams search_params;
+    float precision;    // search quality, as measured by the precision metric
+    float qps;          // queries per second
+    float build_time;   // index build time in seconds
+    float memory_cost;  // index memory relative to the dataset memory
 };
 
 
+/**
+ * The result of an autotuning and the dataset statistics it was obtained for, saved
+ * separately from the index so that the tuning for a similar dataset can start from it
+ */
+struct AutotunedProfile
+{
+    AutotunedProfile() : rows(0), veclen(0), intrinsic_dim(0), target_precision(0), target_nn(1),
+        precision_metric(FLANN_PRECISION_AT_K), algorithm(FLANN_INDEX_LINEAR), trees(0), branching(0), iterations(0),
+        cb_index(0), checks(0), speedup(0)
+    {
+    }
+
+    // dataset statistics
+    std::string distance;
+    size_t rows;
+    size_t veclen;
+    float intrinsic_dim;
+
+    // autotuning targets
+    float target_precision;
+    int target_nn;
+    flann_precision_metric_t precision_metric;
+
+    // tuned parameters
+    flann_algorithm_t algorithm;
+    int trees;
+    int branching;
+    int iterations;
+    float cb_index;
+    int checks;
+    float speedup;
+
+    /**
+     * Checks if the tuned parameters are a good starting point for a tuning with the
+     * targets and dataset statistics of another profile
+     */
+    bool matches(const AutotunedProfile& other) const
+    {
+        const float MAX_SIZE_RATIO = 2;
+        const float MAX_DIM_DIFFERENCE = 0.25f;
+
+        return distance == other.distance && veclen == other.veclen &&
+                target_precision == other.target_precision && target_nn == other.target_nn &&
+                precision_metric == other.precision_metric &&
+                rows <= other.rows * MAX_SIZE_RATIO && other.rows <= rows * MAX_SIZE_RATIO &&
+                std::fabs(intrinsic_dim - other.intrinsic_dim) <= MAX_DIM_DIFFERENCE * other.intrinsic_dim;
+    }
+};
+
+#define FLANN_PROFILE_SIGNATURE_ "FLANN_AUTOTUNED_PROFILE"
+
+/**
+ * Saves an autotuning profile to a text file, one "name value" pair per line
+ */
+inline void save_profile(const std::string& filename, const AutotunedProfile& profile)
+{
+    FILE* fout = fopen(filename.c_str(), "w");
+    if (fout == NULL) {
+        throw FLANNException("Cannot open file");
+    }
+    fprintf(fout, "%s\n", FLANN_PROFILE_SIGNATURE_);
+    fprintf(fout, "distance %s\n", profile.distance.c_str());
+    fprintf(fout, "rows %lu\n", (unsigned long)profile.rows);
+    fprintf(fout, "veclen %lu\n", (unsigned long)profile.veclen);
+    fprintf(fout, "intrinsic_dim %g\n", profile.intrinsic_dim);
+    fprintf(fout, "target_precision %g\n", profile.target_precision);
+    fprintf(fout, "target_nn %d\n", profile.target_nn);
+    fprintf(fout, "precision_metric %d\n", (int)profile.precision_metric);
+    fprintf(fout, "algorithm %d\n", (int)profile.algorithm);
+    fprintf(fout, "trees %d\n", profile.trees);
+    fprintf(fout, "branching %d\n", profile.branching);
+    fprintf(fout, "iterations %d\n", profile.iterations);
+    fprintf(fout, "cb_index %g\n", profile.cb_index);
+    fprintf(fout, "checks %d\n", profile.checks);
+    fprintf(fout, "speedup %g\n", profile.speedup);
+    fclose(fout);
+}
+
+/**
+ * Loads an autotuning profile saved by save_profile()
+ * @return false if the file does not exist
+ */
+inline bool load_profile(const std::string& filename, AutotunedProfile& profile)
+{
+    FILE* fin = fopen(filename.c_str(), "r");
+    if (fin == NULL) {
+        return false;
+    }
+    char name[256];
+    char value[256];
+    if (fscanf(fin, "%255s", name) != 1 || strcmp(name, FLANN_PROFILE_SIGNATURE_) != 0) {
+        fclose(fin);
+        throw FLANNException("Invalid autotuning profile, wrong signature");
+    }
+    while (fscanf(fin, "%255s %255s", name, value) == 2) {
+        if (strcmp(name, "distance") == 0) profile.distance = value;
+        else if (strcmp(name, "rows") == 0) profile.rows = strtoul(value, NULL, 10);
+        else if (strcmp(name, "veclen") == 0) profile.veclen = strtoul(value, NULL, 10);
+        else if (strcmp(name, "intrinsic_dim") == 0) profile.intrinsic_dim = (float)atof(value);
+        else if (strcmp(name, "target_precision") == 0) profile.target_precision = (float)atof(value);
+        else if (strcmp(name, "target_nn") == 0) profile.target_nn = atoi(value);
+        else if (strcmp(name, "precision_metric") == 0) profile.precision_metric = (flann_precision_metric_t)atoi(value);
+        else if (strcmp(name, "algorithm") == 0) profile.algorithm = (flann_algorithm_t)atoi(value);
+        else if (strcmp(name, "trees") == 0) profile.trees = atoi(value);
+        else if (strcmp(name, "branching") == 0) profile.branching = atoi(value);
+        else if (strcmp(name, "iterations") == 0) profile.iterations = atoi(value);
+        else if (strcmp(name, "cb_index") == 0) profile.cb_index = (float)atof(value);
+        else if (strcmp(name, "checks") == 0) profile.checks = atoi(value);
+        else if (strcmp(name, "speedup") == 0) profile.speedup = (float)atof(value);
+    }
+    fclose(fin);
+    return true;
+}
+
+
 template <typename Distance>
 class AutotunedIndex : public NNIndex<Distance>
 {
@@ -89,6 +250,12 @@ public:
         build_weight_ =  get_param(params,"build_weight", 0.01f);
         memory_weight_ = get_param(params, "memory_weight", 0.0f);
         sample_fraction_ = get_param(params,"sample_fraction", 0.1f);
+        target_nn_ = get_param(params, "target_nn", 1);
+        precision_metric_ = get_param(params, "precision_metric", FLANN_PRECISION_AT_K);
+        latency_budget_us_ = get_param(params, "latency_budget_us", 0.0f);
+        cores_ = get_param(params, "cores", 1);
+        profile_file_ = get_param(params, "tuning_profile", std::string());
+        has_warm_start_ = false;
     }
 
     AutotunedIndex(const IndexParams& params = AutotunedIndexParams(), Distance d = Distance()) :
@@ -98,6 +265,12 @@ public:
         build_weight_ =  get_param(params,"build_weight", 0.01f);
         memory_weight_ = get_param(params, "memory_weight", 0.0f);
         sample_fraction_ = get_param(params,"sample_fraction", 0.1f);
+        target_nn_ = get_param(params, "target_nn", 1);
+        precision_metric_ = get_param(params, "precision_metric", FLANN_PRECISION_AT_K);
+        latency_budget_us_ = get_param(params, "latency_budget_us", 0.0f);
+        cores_ = get_param(params, "cores", 1);
+        profile_file_ = get_param(params, "tuning_profile", std::string());
+        has_warm_start_ = false;
     }
 
     AutotunedIndex(const AutotunedIndex& other) : BaseClass(other),
@@ -108,7 +281,16 @@ public:
     		target_precision_(other.target_precision_),
     		build_weight_(other.build_weight_),
     		memory_weight_(other.memory_weight_),
-    		sample_fraction_(other.sample_fraction_)
+    		sample_fraction_(other.sample_fraction_),
+    		target_nn_(other.target_nn_),
+    		precision_metric_(other.precision_metric_),
+    		latency_budget_us_(other.latency_budget_us_),
+    		cores_(other.cores_),
+    		profile_file_(other.profile_file_),
+    		profile_(other.profile_),
+    		warm_start_(other.warm_start_),
+    		has_warm_start_(other.has_warm_start_),
+    		pareto_frontier_(other.pareto_frontier_)
     {
     		bestIndex_ = other.bestIndex_->clone();
     }
@@ -134,24 +316,7 @@ public:
      */
     void buildIndex()
     {
-        bestParams_ = estimateBuildParams();
-        Logger::info("----------------------------------------------------\n");
-        Logger::info("Autotuned parameters:\n");
-        if (Logger::getLevel()>=FLANN_LOG_INFO)
-        	print_params(bestParams_);
-        Logger::info("----------------------------------------------------\n");
-
-        flann_algorithm_t index_type = get_param<flann_algorithm_t>(bestParams_,"algorithm");
-        bestIndex_ = create_index_by_type(index_type, dataset_, bestParams_, distance_);
-        bestIndex_->buildIndex();
-        speedup_ = estimateSearchParams(bestSearchParams_);
-        Logger::info("----------------------------------------------------\n");
-        Logger::info("Search parameters:\n");
-        if (Logger::getLevel()>=FLANN_LOG_INFO)
-        	print_params(bestSearchParams_);
-        Logger::info("----------------------------------------------------\n");
-        bestParams_["search_params"] = bestSearchParams_;
-        bestParams_["speedup"] = speedup_;
+        buildBestIndex(NULL);
     }
     
     void buildIndex(const Matrix<ElementType>& dataset)
@@ -161,12 +326,47 @@ public:
     }
 
 
+    void buildIndex(const Matrix<ElementType>& dataset, const std::vector<size_t>& ids)
+    {
+        if (ids.size()!=dataset.rows) {
+            throw FLANNException("The number of ids is different than the number of points");
+        }
+        dataset_ = dataset;
+        buildBestIndex(&ids);
+    }
+
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2.f)
     {
         if (bestIndex_) {
             bestIndex_->addPoints(points, rebuild_threshold);
         }
     }
+
+    void addPoints(const Matrix<ElementType>& points, const std::vector<size_t>& ids, float rebuild_threshold = 2.f)
+    {
+        if (bestIndex_) {
+            bestIndex_->addPoints(points, ids, rebuild_threshold);
+        }
+    }
+
+    void rebuildWithPoints(const std::vector<Matrix<ElementType> >& points)
+    {
+        if (bestIndex_) {
+            bestIndex_->rebuildWithPoints(points);
+        }
+    }
+
+    void initRemovedPoints()
+    {
+        if (bestIndex_) {
+            bestIndex_->initRemovedPoints();
+        }
+    }
+
+    size_t nextId() const
+    {
+        return bestIndex_ ? bestIndex_->nextId() : NNIndex<Distance>::nextId();
+    }
     
     void removePoint(size_t id)
     {
@@ -175,6 +375,20 @@ public:
         }
     }
 
+    void markRemoved(size_t id)
+    {
+        if (bestIndex_) {
+            bestIndex_->markRemoved(id);
+        }
+    }
+
+    void compactRemovedPoints()
+    {
+        if (bestIndex_) {
+            bestIndex_->compactRemovedPoints();
+        }
+    }
+
     
     template<typename Archive>
     void serialize(Archive& ar)
@@ -235,12 +449,7 @@ public:
             size_t knn,
             const SearchParams& params) const
     {
-        if (params.checks == FLANN_CHECKS_AUTOTUNED) {
-            return bestIndex_->knnSearch(queries, indices, dists, knn, bestSearchParams_);
-        }
-        else {
-            return bestIndex_->knnSearch(queries, indices, dists, knn, params);
-        }
+        return bestIndex_->knnSearch(queries, indices, dists, knn, tunedSearchParams(params));
     }
 
     int knnSearch(const Matrix<ElementType>& queries,
@@ -249,13 +458,7 @@ public:
             size_t knn,
             const SearchParams& params) const
     {
-        if (params.checks == FLANN_CHECKS_AUTOTUNED) {
-            return bestIndex_->knnSearch(queries, indices, dists, knn, bestSearchParams_);
-        }
-        else {
-            return bestIndex_->knnSearch(queries, indices, dists, knn, params);
-        }
-
+        return bestIndex_->knnSearch(queries, indices, dists, knn, tunedSearchParams(params));
     }
     
     int radiusSearch(const Matrix<ElementType>& queries,
@@ -264,12 +467,7 @@ public:
             DistanceType radius,
             const SearchParams& params) const
     {
-        if (params.checks == FLANN_CHECKS_AUTOTUNED) {
-            return bestIndex_->radiusSearch(queries, indices, dists, radius, bestSearchParams_);
-        }
-        else {
-            return bestIndex_->radiusSearch(queries, indices, dists, radius, params);
-        }
+        return bestIndex_->radiusSearch(queries, indices, dists, radius, tunedSearchParams(params));
     }
 
     int radiusSearch(const Matrix<ElementType>& queries,
@@ -278,12 +476,7 @@ public:
             DistanceType radius,
             const SearchParams& params) const
     {
-        if (params.checks == FLANN_CHECKS_AUTOTUNED) {
-            return bestIndex_->radiusSearch(queries, indices, dists, radius, bestSearchParams_);
-        }
-        else {
-            return bestIndex_->radiusSearch(queries, indices, dists, radius, params);
-        }        
+        return bestIndex_->radiusSearch(queries, indices, dists, radius, tunedSearchParams(params));
     }
 
     
@@ -312,6 +505,36 @@ public:
         return speedup_;
     }
 
+    /**
+     * The measured index and search parameters no other measured parameters are both
+     * more precise and faster than, sorted by decreasing precision. Available after
+     * the index is built.
+     */
+    const std::vector<AutotunedOperatingPoint>& getParetoFrontier() const
+    {
+        return pareto_frontier_;
+    }
+
+    /**
+     * The tuned parameters and the statistics of the dataset they were tuned for.
+     * Available after the index is built.
+     */
+    const AutotunedProfile& getProfile() const
+    {
+        return profile_;
+    }
+
+    /**
+     * Sets a profile from a previous autotuning to start from. If it matches the
+     * dataset statistics and the autotuning targets, only the parameters of the
+     * same algorithm close to the profile ones are explored.
+     */
+    void setWarmStart(const AutotunedProfile& profile)
+    {
+        warm_start_ = profile;
+        has_warm_start_ = true;
+    }
+
 
     /**
      *      Number of features in this index.
@@ -332,7 +555,7 @@ public:
     /**
      * The amount of memory (in bytes) this index uses.
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
         return bestIndex_->usedMemory();
     }
@@ -358,6 +581,19 @@ protected:
 
 private:
 
+    /**
+     * The search parameters with the tuned number of checks if checks is
+     * FLANN_CHECKS_AUTOTUNED, the other parameters are the caller's.
+     */
+    SearchParams tunedSearchParams(const SearchParams& params) const
+    {
+        SearchParams search_params = params;
+        if (params.checks == FLANN_CHECKS_AUTOTUNED) {
+            search_params.checks = bestSearchParams_.checks;
+        }
+        return search_params;
+    }
+
     struct CostData
     {
         float searchTimeCost;
@@ -367,16 +603,199 @@ private:
         IndexParams params;
     };
 
-    void evaluate_kmeans(CostData& cost)
+    /**
+     * Records the precision and speed measured for each number of checks tried
+     */
+    void addOperatingPoints(const CostData& cost, const std::vector<PrecisionSample>& samples)
+    {
+        for (size_t i=0;i<samples.size();++i) {
+            AutotunedOperatingPoint point;
+            point.index_params = cost.params;
+            point.search_params.checks = samples[i].checks;
+            point.precision = samples[i].precision;
+            point.qps = (samples[i].time>0) ? testDataset_.rows/samples[i].time : 0;
+            point.build_time = cost.buildTimeCost;
+            point.memory_cost = cost.memoryCost;
+            operating_points_.push_back(point);
+        }
+    }
+
+    static bool morePrecise(const AutotunedOperatingPoint& a, const AutotunedOperatingPoint& b)
     {
-        StartStopTimer t;
+        return (a.precision>b.precision) || (a.precision==b.precision && a.qps>b.qps);
+    }
+
+    /**
+     * Keeps the operating points that are not dominated in both precision and speed
+     */
+    void computeParetoFrontier()
+    {
+        std::sort(operating_points_.begin(), operating_points_.end(), morePrecise);
+        pareto_frontier_.clear();
+        for (size_t i=0;i<operating_points_.size();++i) {
+            if (pareto_frontier_.empty() || operating_points_[i].qps>pareto_frontier_.back().qps) {
+                pareto_frontier_.push_back(operating_points_[i]);
+            }
+        }
+        operating_points_.clear();
+    }
+
+    /**
+     * Checks if the search time measured for a number of queries is within the latency budget
+     */
+    bool withinLatencyBudget(float searchTime, size_t queries) const
+    {
+        return latency_budget_us_<=0 || searchTime*1e6f/queries <= latency_budget_us_;
+    }
+
+    /**
+     * Search time for a number of queries after which the search for the
+     * required number of checks is abandoned (0 for no limit)
+     */
+    float maxSearchTime(size_t queries) const
+    {
+        return latency_budget_us_*1e-6f*queries;
+    }
+
+    /**
+     * Computes the cost of each parameter combination: its weighted build and search
+     * time relative to the best one, plus its weighted memory cost.
+     */
+    void computeTotalCosts(std::vector<CostData>& costs)
+    {
+        float bestTimeCost = costs[0].buildTimeCost * build_weight_ + costs[0].searchTimeCost;
+        for (size_t i = 0; i < costs.size(); ++i) {
+            float timeCost = costs[i].buildTimeCost * build_weight_ + costs[i].searchTimeCost;
+            Logger::debug("Time cost: %g\n", timeCost);
+            if (timeCost < bestTimeCost) {
+                bestTimeCost = timeCost;
+            }
+        }
+        Logger::debug("Best time cost: %g\n", bestTimeCost);
+
+        for (size_t i = 0; i < costs.size(); ++i) {
+            if (bestTimeCost > 0) {
+                costs[i].totalCost = (costs[i].buildTimeCost * build_weight_ + costs[i].searchTimeCost) / bestTimeCost +
+                        memory_weight_ * costs[i].memoryCost;
+            }
+            else {
+                costs[i].totalCost = 0;
+            }
+            Logger::debug("Cost: %g\n", costs[i].totalCost);
+        }
+    }
+
+    static bool lowerCost(const CostData& a, const CostData& b)
+    {
+        return a.totalCost < b.totalCost;
+    }
+
+    /**
+     * Evaluates the candidate parameters by successive halving: all of them are evaluated
+     * on a small subset of the sampled dataset, the best third of them on a three times
+     * larger subset and so on, until the remaining ones are evaluated on the whole sampled
+     * dataset and added to the costs.
+     */
+    void evaluateCandidates(std::vector<CostData>& candidates, std::vector<CostData>& costs)
+    {
+        const size_t HALVING_RATE = 3;
+        const size_t MIN_SUBSET_SIZE = 1000;
+
+        int rounds = 0;
+        size_t count = candidates.size();
+        size_t rows = sampledDataset_.rows;
+        while (count >= HALVING_RATE && rows / HALVING_RATE >= MIN_SUBSET_SIZE) {
+            count = (count + HALVING_RATE - 1) / HALVING_RATE;
+            rows /= HALVING_RATE;
+            rounds++;
+        }
+
+        for (int round = rounds; round >= 0; --round) {
+            if (round > 0) {
+                // the sampled dataset is in random order, so its first rows are a random subset
+                Matrix<ElementType> subset(sampledDataset_.ptr(), rows, sampledDataset_.cols);
+                Matrix<size_t> gt_matches(new size_t[testDataset_.rows*gt_matches_.cols], testDataset_.rows, gt_matches_.cols);
+                compute_ground_truth<Distance>(subset, testDataset_, gt_matches, 0, distance_);
+
+                Logger::info("Evaluating %d candidates on %d points\n", candidates.size(), rows);
+                evaluateRound(candidates, subset, gt_matches, false);
+                delete[] gt_matches.ptr();
+
+                computeTotalCosts(candidates);
+                std::sort(candidates.begin(), candidates.end(), lowerCost);
+                candidates.resize((candidates.size() + HALVING_RATE - 1) / HALVING_RATE);
+                rows *= HALVING_RATE;
+            }
+            else {
+                Logger::info("Evaluating %d candidates on %d points\n", candidates.size(), sampledDataset_.rows);
+                evaluateRound(candidates, sampledDataset_, gt_matches_, true);
+            }
+        }
+
+        costs.insert(costs.end(), candidates.begin(), candidates.end());
+    }
+
+    /**
+     * Evaluates the candidate parameters in parallel. The search for the number of checks
+     * needed is abandoned for candidates whose search is several times slower than the
+     * fastest one evaluated so far.
+     */
+    void evaluateRound(std::vector<CostData>& candidates, const Matrix<ElementType>& dataset, const Matrix<size_t>& gt_matches,
+            bool record_operating_points)
+    {
+        const float PRUNE_FACTOR = 4;
+        float bestSearchTime = -1;
+
+        int cores = cores_;
+#ifdef _OPENMP
+        if (cores <= 0) cores = omp_get_max_threads();
+#endif
+        int count = int(candidates.size());
+#pragma omp parallel for schedule(dynamic) num_threads(std::max(cores, 1))
+        for (int i = 0; i < count; ++i) {
+            CostData& cost = candidates[i];
+            float maxTime = maxSearchTime(testDataset_.rows);
+#pragma omp critical (autotune_best_time)
+            {
+                if (bestSearchTime > 0 && (maxTime <= 0 || PRUNE_FACTOR * bestSearchTime < maxTime)) {
+                    maxTime = PRUNE_FACTOR * bestSearchTime;
+                }
+            }
+
+            std::vector<PrecisionSample> samples;
+            if (get_param<flann_algorithm_t>(cost.params, "algorithm") == FLANN_INDEX_KMEANS) {
+                evaluate_kmeans(cost, dataset, gt_matches, maxTime, samples);
+            }
+            else {
+                evaluate_kdtree(cost, dataset, gt_matches, maxTime, samples);
+            }
+
+#pragma omp critical (autotune_best_time)
+            {
+                if (record_operating_points) {
+                    addOperatingPoints(cost, samples);
+                }
+                if (maxTime > 0 && cost.searchTimeCost > maxTime) {
+                    // did not reach the target precision in time
+                    cost.searchTimeCost = (std::numeric_limits<float>::max)();
+                }
+                else if (bestSearchTime < 0 || cost.searchTimeCost < bestSearchTime) {
+                    bestSearchTime = cost.searchTimeCost;
+                }
+            }
+        }
+    }
+
+    void evaluate_kmeans(CostData& cost, const Matrix<ElementType>& dataset, const Matrix<size_t>& gt_matches,
+            float maxTime, std::vector<PrecisionSample>& samples)
+    {
+        ThreadTimer t;
         int checks;
-        const int nn = 1;
 
         Logger::info("KMeansTree using params: max_iterations=%d, branching=%d\n",
                      get_param<int>(cost.params,"iterations"),
                      get_param<int>(cost.params,"branching"));
-        KMeansIndex<Distance> kmeans(sampledDataset_, cost.params, distance_);
+        KMeansIndex<Distance> kmeans(dataset, cost.params, distance_);
         // measure index build time
         t.start();
         kmeans.buildIndex();
@@ -384,9 +803,10 @@ private:
         float buildTime = (float)t.value;
 
         // measure search time
-        float searchTime = test_index_precision(kmeans, sampledDataset_, testDataset_, gt_matches_, target_precision_, checks, distance_, nn);
+        float searchTime = test_index_precision(kmeans, dataset, testDataset_, gt_matches, target_precision_, checks, distance_,
+                int(gt_matches.cols), 0, precision_metric_, &samples, maxTime);
 
-        float datasetMemory = float(sampledDataset_.rows * sampledDataset_.cols * sizeof(float));
+        float datasetMemory = float(dataset.rows * dataset.cols * sizeof(float));
         cost.memoryCost = (kmeans.usedMemory() + datasetMemory) / datasetMemory;
         cost.searchTimeCost = searchTime;
         cost.buildTimeCost = buildTime;
@@ -394,14 +814,14 @@ private:
     }
 
 
-    void evaluate_kdtree(CostData& cost)
+    void evaluate_kdtree(CostData& cost, const Matrix<ElementType>& dataset, const Matrix<size_t>& gt_matches,
+            float maxTime, std::vector<PrecisionSample>& samples)
     {
-        StartStopTimer t;
+        ThreadTimer t;
         int checks;
-        const int nn = 1;
 
         Logger::info("KDTree using params: trees=%d\n", get_param<int>(cost.params,"trees"));
-        KDTreeIndex<Distance> kdtree(sampledDataset_, cost.params, distance_);
+        KDTreeIndex<Distance> kdtree(dataset, cost.params, distance_);
 
         t.start();
         kdtree.buildIndex();
@@ -409,9 +829,10 @@ private:
         float buildTime = (float)t.value;
 
         //measure search time
-        float searchTime = test_index_precision(kdtree, sampledDataset_, testDataset_, gt_matches_, target_precision_, checks, distance_, nn);
+        float searchTime = test_index_precision(kdtree, dataset, testDataset_, gt_matches, target_precision_, checks, distance_,
+                int(gt_matches.cols), 0, precision_metric_, &samples, maxTime);
 
-        float datasetMemory = float(sampledDataset_.rows * sampledDataset_.cols * sizeof(float));
+        float datasetMemory = float(dataset.rows * dataset.cols * sizeof(float));
         cost.memoryCost = (kdtree.usedMemory() + datasetMemory) / datasetMemory;
         cost.searchTimeCost = searchTime;
         cost.buildTimeCost = buildTime;
@@ -469,28 +890,32 @@ private:
 
     void optimizeKMeans(std::vector<CostData>& costs)
     {
-        Logger::info("KMEANS, Step 1: Exploring parameter space\n");
-
         // explore kmeans parameters space using combinations of the parameters below
         int maxIterations[] = { 1, 5, 10, 15 };
         int branchingFactors[] = { 16, 32, 64, 128, 256 };
 
-        int kmeansParamSpaceSize = FLANN_ARRAY_LEN(maxIterations) * FLANN_ARRAY_LEN(branchingFactors);
-        costs.reserve(costs.size() + kmeansParamSpaceSize);
+        optimizeKMeans(costs, std::vector<int>(maxIterations, maxIterations + FLANN_ARRAY_LEN(maxIterations)),
+                std::vector<int>(branchingFactors, branchingFactors + FLANN_ARRAY_LEN(branchingFactors)));
+    }
+
+    void optimizeKMeans(std::vector<CostData>& costs, const std::vector<int>& maxIterations, const std::vector<int>& branchingFactors)
+    {
+        Logger::info("KMEANS, Step 1: Exploring parameter space\n");
+        std::vector<CostData> candidates;
 
         // evaluate kmeans for all parameter combinations
-        for (size_t i = 0; i < FLANN_ARRAY_LEN(maxIterations); ++i) {
-            for (size_t j = 0; j < FLANN_ARRAY_LEN(branchingFactors); ++j) {
+        for (size_t i = 0; i < maxIterations.size(); ++i) {
+            for (size_t j = 0; j < branchingFactors.size(); ++j) {
                 CostData cost;
                 cost.params["algorithm"] = FLANN_INDEX_KMEANS;
                 cost.params["centers_init"] = FLANN_CENTERS_RANDOM;
                 cost.params["iterations"] = maxIterations[i];
                 cost.params["branching"] = branchingFactors[j];
 
-                evaluate_kmeans(cost);
-                costs.push_back(cost);
+                candidates.push_back(cost);
             }
         }
+        evaluateCandidates(candidates, costs);
 
         //         Logger::info("KMEANS, Step 2: simplex-downhill optimization\n");
         //
@@ -517,20 +942,26 @@ private:
 
     void optimizeKDTree(std::vector<CostData>& costs)
     {
-        Logger::info("KD-TREE, Step 1: Exploring parameter space\n");
-
         // explore kd-tree parameters space using the parameters below
         int testTrees[] = { 1, 4, 8, 16, 32 };
 
+        optimizeKDTree(costs, std::vector<int>(testTrees, testTrees + FLANN_ARRAY_LEN(testTrees)));
+    }
+
+    void optimizeKDTree(std::vector<CostData>& costs, const std::vector<int>& testTrees)
+    {
+        Logger::info("KD-TREE, Step 1: Exploring parameter space\n");
+        std::vector<CostData> candidates;
+
         // evaluate kdtree for all parameter combinations
-        for (size_t i = 0; i < FLANN_ARRAY_LEN(testTrees); ++i) {
+        for (size_t i = 0; i < testTrees.size(); ++i) {
             CostData cost;
             cost.params["algorithm"] = FLANN_INDEX_KDTREE;
             cost.params["trees"] = testTrees[i];
 
-            evaluate_kdtree(cost);
-            costs.push_back(cost);
+            candidates.push_back(cost);
         }
+        evaluateCandidates(candidates, costs);
 
         //         Logger::info("KD-TREE, Step 2: simplex-downhill optimization\n");
         //
@@ -552,6 +983,72 @@ private:
         //         }
     }
 
+    /**
+     * Parameter values to explore around a previously tuned value
+     */
+    static std::vector<int> nearbyValues(int value, int min_value)
+    {
+        std::vector<int> values;
+        if (value / 2 >= min_value) values.push_back(value / 2);
+        values.push_back(std::max(value, min_value));
+        values.push_back(std::max(value, min_value) * 2);
+        return values;
+    }
+
+    /**
+     * Explores only the parameters of the same algorithm close to the warm start ones
+     */
+    void optimizeNearWarmStart(std::vector<CostData>& costs)
+    {
+        Logger::info("Warm start from the autotuning profile\n");
+        if (warm_start_.algorithm == FLANN_INDEX_KMEANS) {
+            optimizeKMeans(costs, std::vector<int>(1, warm_start_.iterations), nearbyValues(warm_start_.branching, 2));
+        }
+        else if (warm_start_.algorithm == FLANN_INDEX_KDTREE) {
+            optimizeKDTree(costs, nearbyValues(warm_start_.trees, 1));
+        }
+    }
+
+    /**
+     * Estimates the intrinsic dimension of the sampled dataset using the ratio of the
+     * distances to the two nearest neighbors of the test points (TwoNN estimator). For
+     * squared distances, such as L2, this is half the intrinsic dimension.
+     */
+    float estimateIntrinsicDimension()
+    {
+        const size_t MAX_POINTS = 500;
+        size_t count = std::min(testDataset_.rows, MAX_POINTS);
+        if (sampledDataset_.rows < 2) return 0;
+
+        size_t matches[2];
+        double log_sum = 0;
+        int used = 0;
+        for (size_t i = 0; i < count; ++i) {
+            find_nearest<Distance>(sampledDataset_, testDataset_[i], matches, 2, 0, distance_);
+            DistanceType r1 = distance_(sampledDataset_[matches[0]], testDataset_[i], sampledDataset_.cols);
+            DistanceType r2 = distance_(sampledDataset_[matches[1]], testDataset_[i], sampledDataset_.cols);
+            if (r1 > 0 && r2 > r1) {
+                log_sum += std::log(double(r2) / double(r1));
+                used++;
+            }
+        }
+        return (log_sum > 0) ? float(used / log_sum) : 0;
+    }
+
+    /**
+     * Records the tuned parameters in the autotuning profile
+     */
+    void updateProfile()
+    {
+        profile_.algorithm = get_param<flann_algorithm_t>(bestParams_, "algorithm");
+        profile_.trees = get_param(bestParams_, "trees", 0);
+        profile_.branching = get_param(bestParams_, "branching", 0);
+        profile_.iterations = get_param(bestParams_, "iterations", 0);
+        profile_.cb_index = get_param(bestParams_, "cb_index", 0.0f);
+        profile_.checks = bestSearchParams_.checks;
+        profile_.speedup = speedup_;
+    }
+
     /**
      *  Chooses the best nearest-neighbor algorithm and estimates the optimal
      *  parameters to use when building the index (for a given precision).
@@ -564,7 +1061,17 @@ private:
         int sampleSize = int(sample_fraction_ * dataset_.rows);
         int testSampleSize = std::min(sampleSize / 10, 1000);
 
-        Logger::info("Entering autotuning, dataset size: %d, sampleSize: %d, testSampleSize: %d, target precision: %g\n", dataset_.rows, sampleSize, testSampleSize, target_precision_);
+        Logger::info("Entering autotuning, dataset size: %d, sampleSize: %d, testSampleSize: %d, target precision: %g, target nn: %d\n",
+                dataset_.rows, sampleSize, testSampleSize, target_precision_, target_nn_);
+        pareto_frontier_.clear();
+
+        profile_ = AutotunedProfile();
+        profile_.distance = typeid(Distance).name();
+        profile_.rows = dataset_.rows;
+        profile_.veclen = dataset_.cols;
+        profile_.target_precision = target_precision_;
+        profile_.target_nn = target_nn_;
+        profile_.precision_metric = precision_metric_;
 
         // For a very small dataset, it makes no sense to build any fancy index, just
         // use linear search
@@ -577,10 +1084,13 @@ private:
         sampledDataset_ = random_sample(dataset_, sampleSize);
         // We use a cross-validation approach, first we sample a testset from the dataset
         testDataset_ = random_sample(sampledDataset_, testSampleSize, true);
+        profile_.intrinsic_dim = estimateIntrinsicDimension();
+        Logger::info("Intrinsic dimension estimate: %g\n", profile_.intrinsic_dim);
 
         // We compute the ground truth using linear search
         Logger::info("Computing ground truth... \n");
-        gt_matches_ = Matrix<size_t>(new size_t[testDataset_.rows], testDataset_.rows, 1);
+        size_t nn = std::max(1, std::min(target_nn_, int(sampledDataset_.rows)));
+        gt_matches_ = Matrix<size_t>(new size_t[testDataset_.rows*nn], testDataset_.rows, nn);
         StartStopTimer t;
         int repeats = 0;
         t.reset();
@@ -598,37 +1108,46 @@ private:
         linear_cost.params["algorithm"] = FLANN_INDEX_LINEAR;
 
         costs.push_back(linear_cost);
+        PrecisionSample linear_sample = { FLANN_CHECKS_UNLIMITED, 1.0f, linear_cost.searchTimeCost };
+        addOperatingPoints(linear_cost, std::vector<PrecisionSample>(1, linear_sample));
 
         // Start parameter autotune process
         Logger::info("Autotuning parameters...\n");
 
-        optimizeKMeans(costs);
-        optimizeKDTree(costs);
+        if (has_warm_start_ && warm_start_.matches(profile_)) {
+            optimizeNearWarmStart(costs);
+        }
+        else {
+            optimizeKMeans(costs);
+            optimizeKDTree(costs);
+        }
+        computeParetoFrontier();
 
-        float bestTimeCost = costs[0].buildTimeCost * build_weight_ + costs[0].searchTimeCost;
+        // only consider the parameters meeting the latency budget, if any do
+        std::vector<CostData> eligible;
         for (size_t i = 0; i < costs.size(); ++i) {
-            float timeCost = costs[i].buildTimeCost * build_weight_ + costs[i].searchTimeCost;
-            Logger::debug("Time cost: %g\n", timeCost);
-            if (timeCost < bestTimeCost) {
-                bestTimeCost = timeCost;
+            if (withinLatencyBudget(costs[i].searchTimeCost, testDataset_.rows)) {
+                eligible.push_back(costs[i]);
             }
         }
-        Logger::debug("Best time cost: %g\n", bestTimeCost);
+        if (eligible.empty()) {
+            Logger::warn("No parameters found within the latency budget of %g us\n", latency_budget_us_);
+        }
+        else {
+            costs.swap(eligible);
+        }
+
+        computeTotalCosts(costs);
 
     	IndexParams bestParams = costs[0].params;
-        if (bestTimeCost > 0) {
-        	float bestCost = (costs[0].buildTimeCost * build_weight_ + costs[0].searchTimeCost) / bestTimeCost;
-        	for (size_t i = 0; i < costs.size(); ++i) {
-        		float crtCost = (costs[i].buildTimeCost * build_weight_ + costs[i].searchTimeCost) / bestTimeCost +
-        				memory_weight_ * costs[i].memoryCost;
-        		Logger::debug("Cost: %g\n", crtCost);
-        		if (crtCost < bestCost) {
-        			bestCost = crtCost;
-        			bestParams = costs[i].params;
-        		}
-        	}
-            Logger::debug("Best cost: %g\n", bestCost);
-        }
+    	float bestCost = costs[0].totalCost;
+    	for (size_t i = 0; i < costs.size(); ++i) {
+    		if (costs[i].totalCost < bestCost) {
+    			bestCost = costs[i].totalCost;
+    			bestParams = costs[i].params;
+    		}
+    	}
+    	Logger::debug("Best cost: %g\n", bestCost);
 
         delete[] gt_matches_.ptr();
         delete[] testDataset_.ptr();
@@ -639,14 +1158,57 @@ private:
 
 
 
+    /**
+     * Chooses the algorithm and its parameters, then builds it (with the point
+     * ids if not NULL) and estimates the search parameters.
+     */
+    void buildBestIndex(const std::vector<size_t>* ids)
+    {
+        if (!profile_file_.empty()) {
+            AutotunedProfile profile;
+            if (load_profile(profile_file_, profile)) {
+                setWarmStart(profile);
+            }
+        }
+
+        bestParams_ = estimateBuildParams();
+        Logger::info("----------------------------------------------------\n");
+        Logger::info("Autotuned parameters:\n");
+        if (Logger::getLevel()>=FLANN_LOG_INFO)
+        	print_params(bestParams_);
+        Logger::info("----------------------------------------------------\n");
+
+        flann_algorithm_t index_type = get_param<flann_algorithm_t>(bestParams_,"algorithm");
+        bestIndex_ = create_index_by_type(index_type, dataset_, bestParams_, distance_);
+        if (ids!=NULL) {
+            bestIndex_->buildIndex(dataset_, *ids);
+        }
+        else {
+            bestIndex_->buildIndex();
+        }
+        speedup_ = estimateSearchParams(bestSearchParams_, ids);
+        Logger::info("----------------------------------------------------\n");
+        Logger::info("Search parameters:\n");
+        if (Logger::getLevel()>=FLANN_LOG_INFO)
+        	print_params(bestSearchParams_);
+        Logger::info("----------------------------------------------------\n");
+        bestParams_["search_params"] = bestSearchParams_;
+        bestParams_["speedup"] = speedup_;
+
+        updateProfile();
+        if (!profile_file_.empty()) {
+            save_profile(profile_file_, profile_);
+        }
+    }
+
     /**
      *  Estimates the search time parameters needed to get the desired precision.
+     *  The ground truth is expressed with the point ids when they are given.
      *  Precondition: the index is built
      *  Postcondition: the searchParams will have the optimum params set, also the speedup obtained over linear search.
      */
-    float estimateSearchParams(SearchParams& searchParams)
+    float estimateSearchParams(SearchParams& searchParams, const std::vector<size_t>* ids)
     {
-        const int nn = 1;
         const size_t SAMPLE_COUNT = 1000;
 
         assert(bestIndex_ != NULL); // must have a valid index
@@ -660,7 +1222,8 @@ private:
             Logger::info("Computing ground truth\n");
 
             // we need to compute the ground truth first
-            Matrix<size_t> gt_matches(new size_t[testDataset.rows], testDataset.rows, 1);
+            int nn = std::max(1, std::min(target_nn_, int(dataset_.rows)-1));
+            Matrix<size_t> gt_matches(new size_t[testDataset.rows*nn], testDataset.rows, nn);
             StartStopTimer t;
             int repeats = 0;
             t.reset();
@@ -671,12 +1234,21 @@ private:
                 t.stop();
             }
             float linear = (float)t.value/repeats;
+            if (ids!=NULL) {
+                // the index returns the ids of the points
+                for (size_t i=0;i<gt_matches.rows;++i) {
+                    for (size_t j=0;j<gt_matches.cols;++j) {
+                        gt_matches[i][j] = (*ids)[gt_matches[i][j]];
+                    }
+                }
+            }
 
             int checks;
             Logger::info("Estimating number of checks\n");
 
             float searchTime;
             float cb_index;
+            float maxTime = maxSearchTime(testDataset.rows);
             if (bestIndex_->getType() == FLANN_INDEX_KMEANS) {
                 Logger::info("KMeans algorithm, estimating cluster border factor\n");
                 KMeansIndex<Distance>* kmeans = static_cast<KMeansIndex<Distance>*>(bestIndex_);
@@ -685,7 +1257,8 @@ private:
                 int best_checks = -1;
                 for (cb_index = 0; cb_index < 1.1f; cb_index += 0.2f) {
                     kmeans->set_cb_index(cb_index);
-                    searchTime = test_index_precision(*kmeans, dataset_, testDataset, gt_matches, target_precision_, checks, distance_, nn, 1);
+                    searchTime = test_index_precision(*kmeans, dataset_, testDataset, gt_matches, target_precision_, checks, distance_, nn, 1,
+                            precision_metric_, NULL, maxTime);
                     if ((searchTime < bestSearchTime) || (bestSearchTime == -1)) {
                         bestSearchTime = searchTime;
                         best_cb_index = cb_index;
@@ -701,7 +1274,15 @@ private:
                 bestParams_["cb_index"] = cb_index;
             }
             else {
-                searchTime = test_index_precision(*bestIndex_, dataset_, testDataset, gt_matches, target_precision_, checks, distance_, nn, 1);
+                searchTime = test_index_precision(*bestIndex_, dataset_, testDataset, gt_matches, target_precision_, checks, distance_, nn, 1,
+                        precision_metric_, NULL, maxTime);
+            }
+
+            if (!withinLatencyBudget(searchTime, testDataset.rows)) {
+                // the search for the checks was abandoned after doubling them past the budget,
+                // keep the last number of checks searched within it
+                Logger::warn("The target precision cannot be reached within the latency budget of %g us\n", latency_budget_us_);
+                checks = std::max(checks/2, 1);
             }
 
             Logger::info("Required number of checks: %d \n", checks);
@@ -729,6 +1310,15 @@ private:
     	std::swap(build_weight_, other.build_weight_);
     	std::swap(memory_weight_, other.memory_weight_);
     	std::swap(sample_fraction_, other.sample_fraction_);
+    	std::swap(target_nn_, other.target_nn_);
+    	std::swap(precision_metric_, other.precision_metric_);
+    	std::swap(latency_budget_us_, other.latency_budget_us_);
+    	std::swap(cores_, other.cores_);
+    	std::swap(profile_file_, other.profile_file_);
+    	std::swap(profile_, other.profile_);
+    	std::swap(warm_start_, other.warm_start_);
+    	std::swap(has_warm_start_, other.has_warm_start_);
+    	std::swap(pareto_frontier_, other.pareto_frontier_);
     }
 
 private:
@@ -755,6 +1345,24 @@ private:
     float build_weight_;
     float memory_weight_;
     float sample_fraction_;
+    int target_nn_;
+    flann_precision_metric_t precision_metric_;
+    float latency_budget_us_;
+    int cores_;
+
+    /**
+     * Autotuning profile file, profile of the current tuning and the one to start from
+     */
+    std::string profile_file_;
+    AutotunedProfile profile_;
+    AutotunedProfile warm_start_;
+    bool has_warm_start_;
+
+    /**
+     * Measured parameters, and the ones on the Pareto frontier
+     */
+    std::vector<AutotunedOperatingPoint> operating_points_;
+    std::vector<AutotunedOperatingPoint> pareto_frontier_;
 
     USING_BASECLASS_SYMBOLS
 };
@@ -149,7 +149,7 @@ public:
     /**
      * \returns The amount of memory (in bytes) used by the index.
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
         return kmeans_index_->usedMemory() + kdtree_index_->usedMemory();
     }
@@ -166,18 +166,59 @@ public:
         kdtree_index_->buildIndex();
     }
     
+    void buildIndex(const Matrix<ElementType>& dataset, const std::vector<size_t>& ids)
+    {
+        kmeans_index_->buildIndex(dataset, ids);
+        kdtree_index_->buildIndex(dataset, ids);
+    }
+
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2.f)
     {
         kmeans_index_->addPoints(points, rebuild_threshold);
         kdtree_index_->addPoints(points, rebuild_threshold);
     }
 
+    void addPoints(const Matrix<ElementType>& points, const std::vector<size_t>& ids, float rebuild_threshold = 2.f)
+    {
+        kmeans_index_->addPoints(points, ids, rebuild_threshold);
+        kdtree_index_->addPoints(points, ids, rebuild_threshold);
+    }
+
+    void rebuildWithPoints(const std::vector<Matrix<ElementType> >& points)
+    {
+        kmeans_index_->rebuildWithPoints(points);
+        kdtree_index_->rebuildWithPoints(points);
+    }
+
+    void initRemovedPoints()
+    {
+        kmeans_index_->initRemovedPoints();
+        kdtree_index_->initRemovedPoints();
+    }
+
+    size_t nextId() const
+    {
+        return kdtree_index_->nextId();
+    }
+
     void removePoint(size_t index)
     {
         kmeans_index_->removePoint(index);
         kdtree_index_->removePoint(index);
     }
 
+    void markRemoved(size_t index)
+    {
+        kmeans_index_->markRemoved(index);
+        kdtree_index_->markRemoved(index);
+    }
+
+    void compactRemovedPoints()
+    {
+        kmeans_index_->compactRemovedPoints();
+        kdtree_index_->compactRemovedPoints();
+    }
+
 
     /**
      * \brief Saves the index to a stream
@@ -199,12 +199,13 @@ public:
      * Computes the inde memory usage
      * Returns: memory used by the index
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
         return pool_.usedMemory+pool_.wastedMemory+memoryCounter_;
     }
     
     using BaseClass::buildIndex;
+    using BaseClass::addPoints;
 
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
@@ -226,6 +227,17 @@ public:
     }
 
 
+    /**
+     * Removes the removed points from the leaves of the trees.
+     */
+    void compactRemovedPoints()
+    {
+        if (!removed_) return;
+        for (size_t i=0; i<tree_roots_.size(); ++i) {
+            compactNode(tree_roots_[i]);
+        }
+    }
+
     flann_algorithm_t getType() const
     {
         return FLANN_INDEX_HIERARCHICAL;
@@ -443,6 +455,24 @@ private:
     	pool_.free();
     }
 
+    void compactNode(NodePtr node)
+    {
+        if (node->childs.empty()) {
+            size_t last = 0;
+            for (size_t i=0; i<node->points.size(); ++i) {
+                if (!removed_points_.test(node->points[i].index)) {
+                    node->points[last++] = node->points[i];
+                }
+            }
+            node->points.resize(last);
+        }
+        else {
+            for (size_t i=0; i<node->childs.size(); ++i) {
+                compactNode(node->childs[i]);
+            }
+        }
+    }
+
     void copyTree(NodePtr& dst, const NodePtr& src)
     {
     	dst = new(pool_) Node();
@@ -561,10 +591,17 @@ private:
             findNN<with_removed>(tree_roots_[i], result, vec, checks, maxChecks, heap, checked);
         }
 
+        result.startStallDetection(searchParams.stall_checks, checks);
+
         BranchSt branch;
         while (heap->popMin(branch) && (checks<maxChecks || !result.full())) {
+            FLANN_SEARCH_STAT(result, HEAP_POPS, 1);
             NodePtr node = branch.node;
             findNN<with_removed>(node, result, vec, checks, maxChecks, heap, checked);
+
+            if (result.expired(checks) || result.stalled(checks)) {
+                break;
+            }
         }
 
         delete heap;
@@ -587,17 +624,23 @@ private:
     void findNN(NodePtr node, ResultSet<DistanceType>& result, const ElementType* vec, int& checks, int maxChecks,
                 Heap<BranchSt>* heap,  DynamicBitset& checked) const
     {
+        FLANN_SEARCH_STAT(result, NODES_VISITED, 1);
         if (node->childs.empty()) {
             if (checks>=maxChecks) {
                 if (result.full()) return;
             }
 
+            FLANN_SEARCH_STAT(result, LEAVES_SCANNED, 1);
             for (size_t i=0; i<node->points.size(); ++i) {
             	PointInfo& pointInfo = node->points[i];
             	if (with_removed) {
-            		if (removed_points_.test(pointInfo.index)) continue;
+            		if (removed_points_.test(pointInfo.index)) {
+            			FLANN_SEARCH_STAT(result, REMOVED_SKIPS, 1);
+            			continue;
+            		}
             	}
                 if (checked.test(pointInfo.index)) continue;
+                FLANN_SEARCH_STAT(result, DISTANCE_EVALS, 1);
                 DistanceType dist = distance_(pointInfo.point, vec, veclen_);
                 result.addPoint(dist, pointInfo.index);
                 checked.set(pointInfo.index);
@@ -620,6 +663,8 @@ private:
                 }
             }
             delete[] domain_distances;
+            FLANN_SEARCH_STAT(result, DISTANCE_EVALS, branching_);
+            FLANN_SEARCH_STAT(result, HEAP_PUSHES, branching_-1);
             findNN<with_removed>(node->childs[best_index],result,vec, checks, maxChecks, heap, checked);
         }
     }
@@ -693,7 +738,7 @@ private:
     /**
      * Memory occupied by the index.
      */
-    int memoryCounter_;
+    size_t memoryCounter_;
 
     /** index parameters */
     /**
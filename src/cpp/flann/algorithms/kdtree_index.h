@@ -139,6 +139,7 @@ public:
     }
 
     using BaseClass::buildIndex;
+    using BaseClass::addPoints;
     
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
@@ -159,6 +160,19 @@ public:
         }        
     }
 
+    /**
+     * Unlinks the leaves of the removed points from the trees.
+     */
+    void compactRemovedPoints()
+    {
+        if (!removed_) return;
+        for (size_t i=0;i<tree_roots_.size();++i) {
+            NodePtr root = compactTree(tree_roots_[i]);
+            // keep the old root if all the points were removed
+            if (root!=NULL) tree_roots_[i] = root;
+        }
+    }
+
     flann_algorithm_t getType() const
     {
         return FLANN_INDEX_KDTREE;
@@ -209,9 +223,9 @@ public:
      * Computes the inde memory usage
      * Returns: memory used by the index
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
-        return int(pool_.usedMemory+pool_.wastedMemory+size_*sizeof(int));  // pool memory and vind array memory
+        return pool_.usedMemory+pool_.wastedMemory+size_*sizeof(int);  // pool memory and vind array memory
     }
 
     /**
@@ -238,10 +252,10 @@ public:
         }
         else {
         	if (removed_) {
-        		getNeighbors<true>(result, vec, maxChecks, epsError);
+        		getNeighbors<true>(result, vec, maxChecks, searchParams.stall_checks, epsError);
         	}
         	else {
-        		getNeighbors<false>(result, vec, maxChecks, epsError);
+        		getNeighbors<false>(result, vec, maxChecks, searchParams.stall_checks, epsError);
         	}
         }
     }
@@ -370,6 +384,25 @@ private:
     	}
     }
 
+    /**
+     * Replaces the internal nodes left with a single child by that child. The
+     * unlinked nodes stay in the pool until the index is rebuilt.
+     * @return The compacted subtree, NULL if all its points were removed
+     */
+    NodePtr compactTree(NodePtr node)
+    {
+        if (node->child1==NULL && node->child2==NULL) {
+            return removed_points_.test(node->divfeat) ? NULL : node;
+        }
+        NodePtr child1 = compactTree(node->child1);
+        NodePtr child2 = compactTree(node->child2);
+        if (child1==NULL) return child2;
+        if (child2==NULL) return child1;
+        node->child1 = child1;
+        node->child2 = child2;
+        return node;
+    }
+
     /**
      * Create a tree node that subdivides the list of vecs from vind[first]
      * to vind[last].  The routine is called recursively on each sublist.
@@ -540,10 +573,10 @@ private:
     /**
      * Performs the approximate nearest-neighbor search. The search is approximate
      * because the tree traversal is abandoned after a given number of descends in
-     * the tree.
+     * the tree, or after stallCheck checks that did not improve the result.
      */
     template<bool with_removed>
-    void getNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, int maxCheck, float epsError) const
+    void getNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, int maxCheck, int stallCheck, float epsError) const
     {
         int i;
         BranchSt branch;
@@ -558,8 +591,14 @@ private:
         }
 
         /* Keep searching other branches from heap until finished. */
+        result.startStallDetection(stallCheck, checkCount);
         while ( heap->popMin(branch) && (checkCount < maxCheck || !result.full() )) {
+            FLANN_SEARCH_STAT(result, HEAP_POPS, 1);
             searchLevel<with_removed>(result, vec, branch.node, branch.mindist, checkCount, maxCheck, epsError, heap, checked);
+
+            if (result.expired(checkCount) || result.stalled(checkCount)) {
+                break;
+            }
         }
 
         delete heap;
@@ -575,8 +614,10 @@ private:
     void searchLevel(ResultSet<DistanceType>& result_set, const ElementType* vec, NodePtr node, DistanceType mindist, int& checkCount, int maxCheck,
                      float epsError, Heap<BranchSt>* heap, DynamicBitset& checked) const
     {
+        FLANN_SEARCH_STAT(result_set, NODES_VISITED, 1);
         if (result_set.worstDist()<mindist) {
             //			printf("Ignoring branch, too far\n");
+            FLANN_SEARCH_STAT(result_set, EARLY_ABANDONS, 1);
             return;
         }
 
@@ -584,13 +625,18 @@ private:
         if ((node->child1 == NULL)&&(node->child2 == NULL)) {
             int index = node->divfeat;
             if (with_removed) {
-            	if (removed_points_.test(index)) return;
+            	if (removed_points_.test(index)) {
+            		FLANN_SEARCH_STAT(result_set, REMOVED_SKIPS, 1);
+            		return;
+            	}
             }
             /*  Do not check same node more than once when searching multiple trees. */
             if ( checked.test(index) || ((checkCount>=maxCheck)&& result_set.full()) ) return;
             checked.set(index);
             checkCount++;
 
+            FLANN_SEARCH_STAT(result_set, LEAVES_SCANNED, 1);
+            FLANN_SEARCH_STAT(result_set, DISTANCE_EVALS, 1);
             DistanceType dist = distance_(node->point, vec, veclen_);
             result_set.addPoint(dist,index);
             return;
@@ -613,6 +659,7 @@ private:
         DistanceType new_distsq = mindist + distance_.accum_dist(val, node->divval, node->divfeat);
         //		if (2 * checkCount < maxCheck  ||  !result.full()) {
         if ((new_distsq*epsError < result_set.worstDist())||  !result_set.full()) {
+            FLANN_SEARCH_STAT(result_set, HEAP_PUSHES, 1);
             heap->insert( BranchSt(otherChild, new_distsq) );
         }
 
@@ -626,12 +673,18 @@ private:
     template<bool with_removed>
     void searchLevelExact(ResultSet<DistanceType>& result_set, const ElementType* vec, const NodePtr node, DistanceType mindist, const float epsError) const
     {
+        FLANN_SEARCH_STAT(result_set, NODES_VISITED, 1);
         /* If this is a leaf node, then do check and return. */
         if ((node->child1 == NULL)&&(node->child2 == NULL)) {
             int index = node->divfeat;
             if (with_removed) {
-            	if (removed_points_.test(index)) return; // ignore removed points
+            	if (removed_points_.test(index)) { // ignore removed points
+            		FLANN_SEARCH_STAT(result_set, REMOVED_SKIPS, 1);
+            		return;
+            	}
             }
+            FLANN_SEARCH_STAT(result_set, LEAVES_SCANNED, 1);
+            FLANN_SEARCH_STAT(result_set, DISTANCE_EVALS, 1);
             DistanceType dist = distance_(node->point, vec, veclen_);
             result_set.addPoint(dist,index);
 
@@ -660,6 +713,9 @@ private:
         if (mindist*epsError<=result_set.worstDist()) {
             searchLevelExact<with_removed>(result_set, vec, otherChild, new_distsq, epsError);
         }
+        else {
+            FLANN_SEARCH_STAT(result_set, EARLY_ABANDONS, 1);
+        }
     }
     
     void addPointToTree(NodePtr node, int ind)
@@ -38,6 +38,7 @@
 
 #include "flann/general.h"
 #include "flann/algorithms/nn_index.h"
+#include "flann/algorithms/dist.h"
 #include "flann/util/matrix.h"
 #include "flann/util/result_set.h"
 #include "flann/util/heap.h"
@@ -83,7 +84,7 @@ public:
      *          params = parameters passed to the kdtree algorithm
      */
     KDTreeSingleIndex(const IndexParams& params = KDTreeSingleIndexParams(), Distance d = Distance() ) :
-        BaseClass(params, d), root_node_(NULL)
+        BaseClass(params, d), data_capacity_(0), vind_garbage_(0), root_node_(NULL)
     {
         leaf_max_size_ = get_param(params,"leaf_max_size",10);
         reorder_ = get_param(params, "reorder", true);
@@ -97,7 +98,7 @@ public:
      *          params = parameters passed to the kdtree algorithm
      */
     KDTreeSingleIndex(const Matrix<ElementType>& inputData, const IndexParams& params = KDTreeSingleIndexParams(),
-                      Distance d = Distance() ) : BaseClass(params, d), root_node_(NULL)
+                      Distance d = Distance() ) : BaseClass(params, d), data_capacity_(0), vind_garbage_(0), root_node_(NULL)
     {
         leaf_max_size_ = get_param(params,"leaf_max_size",10);
         reorder_ = get_param(params, "reorder", true);
@@ -110,11 +111,15 @@ public:
             leaf_max_size_(other.leaf_max_size_),
             reorder_(other.reorder_),
             vind_(other.vind_),
-            root_bbox_(other.root_bbox_)
+            data_capacity_(0),
+            vind_garbage_(other.vind_garbage_),
+            root_bbox_(other.root_bbox_),
+            free_ranges_(other.free_ranges_)
     {
         if (reorder_) {
-            data_ = flann::Matrix<ElementType>(new ElementType[size_*veclen_], size_, veclen_);
-            std::copy(other.data_[0], other.data_[0]+size_*veclen_, data_[0]);
+            data_capacity_ = other.data_.rows;
+            data_ = flann::Matrix<ElementType>(new ElementType[data_capacity_*veclen_], data_capacity_, veclen_);
+            std::copy(other.data_[0], other.data_[0]+data_capacity_*veclen_, data_[0]);
         }
         copyTree(root_node_, other.root_node_);
     }
@@ -139,12 +144,59 @@ public:
     }
 
     using BaseClass::buildIndex;
+    using BaseClass::addPoints;
 
+    /**
+     * @brief Incrementally add points to the index.
+     *
+     * The new points are inserted in the leaves of the existing tree, splitting
+     * the leaves that grow past leaf_max_size. When an insertion makes the tree
+     * too deep, the smallest unbalanced subtree on the insertion path is rebuilt
+     * with median splits (dropping the points removed from it), so the search
+     * stays exact and the tree stays balanced without full rebuilds.
+     *
+     * @param points Matrix with points to be added
+     * @param rebuild_threshold The whole index is rebuilt when its size grows by
+     *      this factor since the last build. Values <=1 disable full rebuilds.
+     */
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
         assert(points.cols==veclen_);
+
+        size_t old_size = size_;
         extendDataset(points);
-        buildIndex();
+
+        if (root_node_==NULL || (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_)) {
+            buildIndex();
+        }
+        else {
+            switch (veclen_) {
+            case 2:
+                insertPoints<2>(old_size);
+                break;
+            case 3:
+                insertPoints<3>(old_size);
+                break;
+            case 4:
+                insertPoints<4>(old_size);
+                break;
+            default:
+                insertPoints<0>(old_size);
+            }
+        }
+    }
+
+    /**
+     * Removes the removed points from the leaves of the tree. The entries freed
+     * in vind_ are reclaimed like the ones left behind by insertions.
+     */
+    void compactRemovedPoints()
+    {
+        if (!removed_ || root_node_==NULL) return;
+        compactLeaves(root_node_);
+        if (vind_garbage_>vind_.size()/2) {
+            compactIndices();
+        }
     }
 
     flann_algorithm_t getType() const
@@ -178,6 +230,10 @@ public:
         ar & *root_node_;
 
         if (Archive::is_loading::value) {
+            data_capacity_ = data_.rows;
+            vind_garbage_ = vind_.size()-countIndices(root_node_);
+            free_ranges_.clear();
+
             index_params_["algorithm"] = getType();
             index_params_["leaf_max_size"] = leaf_max_size_;
             index_params_["reorder"] = reorder_;
@@ -203,9 +259,10 @@ public:
      * Computes the inde memory usage
      * Returns: memory used by the index
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
-        return pool_.usedMemory+pool_.wastedMemory+size_*sizeof(int);  // pool memory and vind array memory
+        // pool memory, vind array memory and reordered data memory
+        return pool_.usedMemory+pool_.wastedMemory+vind_.capacity()*sizeof(int)+data_capacity_*veclen_*sizeof(ElementType);
     }
 
     /**
@@ -219,18 +276,89 @@ public:
      */
     void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
     {
-        float epsError = 1+searchParams.eps;
+        switch (veclen_) {
+        case 2:
+            findNeighborsImpl<2>(result, vec, searchParams);
+            break;
+        case 3:
+            findNeighborsImpl<3>(result, vec, searchParams);
+            break;
+        case 4:
+            findNeighborsImpl<4>(result, vec, searchParams);
+            break;
+        default:
+            findNeighborsImpl<0>(result, vec, searchParams);
+        }
+    }
 
-        std::vector<DistanceType> dists(veclen_,0);
-        DistanceType distsq = computeInitialDistances(vec, dists);
-        if (removed_) {
-            searchLevel<true>(result, vec, root_node_, distsq, dists, epsError);
+    /**
+     * @brief Perform k-nearest neighbor search for a batch of queries using packet traversal
+     *
+     * The queries are first ordered along a Morton (Z-order) curve over the root bounding
+     * box and then grouped in packets of spatially coherent queries. All the queries in a
+     * packet descend the tree together, so each node and leaf is fetched once per packet
+     * instead of once per query. Each query still visits the tree nodes in the same order
+     * as in findNeighbors(), so the results are identical to the ones of knnSearch().
+     *
+     * @param[in] queries The query points for which to find the nearest neighbors
+     * @param[out] indices The indices of the nearest neighbors found
+     * @param[out] dists Distances to the nearest neighbors found
+     * @param[in] knn Number of nearest neighbors to return
+     * @param[in] params Search parameters
+     * @param[in] packet_size Number of queries traversing the tree together
+     * @return Number of neighbors found
+     */
+    int knnSearchBatch(const Matrix<ElementType>& queries,
+            Matrix<size_t>& indices,
+            Matrix<DistanceType>& dists,
+            size_t knn,
+            const SearchParams& params,
+            size_t packet_size = 64) const
+    {
+        assert(queries.cols == veclen_);
+        assert(indices.rows >= queries.rows);
+        assert(dists.rows >= queries.rows);
+        assert(indices.cols >= knn);
+        assert(dists.cols >= knn);
+        bool use_heap;
+
+        if (params.use_heap==FLANN_Undefined) {
+            use_heap = (knn>KNN_HEAP_THRESHOLD)?true:false;
         }
         else {
-            searchLevel<false>(result, vec, root_node_, distsq, dists, epsError);
+            use_heap = (params.use_heap==FLANN_True)?true:false;
+        }
+
+        std::vector<size_t> order;
+        computeMortonOrder(queries, order);
+
+        if (use_heap) {
+            return searchPackets<KNNResultSet2<DistanceType> >(queries, order, indices, dists, knn, params, packet_size);
+        }
+        else {
+            return searchPackets<KNNSimpleResultSet<DistanceType> >(queries, order, indices, dists, knn, params, packet_size);
         }
     }
 
+    int knnSearchBatch(const Matrix<ElementType>& queries,
+            Matrix<int>& indices,
+            Matrix<DistanceType>& dists,
+            size_t knn,
+            const SearchParams& params,
+            size_t packet_size = 64) const
+    {
+        flann::Matrix<size_t> indices_(new size_t[indices.rows*indices.cols], indices.rows, indices.cols);
+        int result = knnSearchBatch(queries, indices_, dists, knn, params, packet_size);
+
+        for (size_t i=0;i<indices.rows;++i) {
+            for (size_t j=0;j<indices.cols;++j) {
+                indices[i][j] = indices_[i][j];
+            }
+        }
+        delete[] indices_.ptr();
+        return result;
+    }
+
 protected:
 
     /**
@@ -244,10 +372,23 @@ protected:
             vind_[i] = i;
         }
 
-        computeBoundingBox(root_bbox_);
-        root_node_ = divideTree(0, size_, root_bbox_ );   // construct the tree
+        switch (veclen_) {
+        case 2:
+            buildTree<2>();
+            break;
+        case 3:
+            buildTree<3>();
+            break;
+        case 4:
+            buildTree<4>();
+            break;
+        default:
+            buildTree<0>();
+        }
 
+        vind_garbage_ = 0;
         if (reorder_) {
+            data_capacity_ = size_;
             data_ = flann::Matrix<ElementType>(new ElementType[size_*veclen_], size_, veclen_);
             for (size_t i=0; i<size_; ++i) {
                 std::copy(points_[vind_[i]], points_[vind_[i]]+veclen_, data_[i]);
@@ -269,6 +410,11 @@ private:
     	 * Dimension used for subdivision.
     	 */
     	int divfeat;
+    	/**
+    	 * Number of entries in the leaves of the subtree, including the removed
+    	 * points not dropped yet. Not saved, recomputed when loading.
+    	 */
+    	int count;
     	/**
     	 * The values used for subdivision.
     	 */
@@ -336,6 +482,49 @@ private:
     typedef BranchStruct<NodePtr, DistanceType> BranchSt;
     typedef BranchSt* Branch;
 
+    /**
+     * Query of a packet that is active at a tree node
+     */
+    struct PacketEntry
+    {
+        PacketEntry() {}
+        PacketEntry(size_t slot_, DistanceType mindist_) : slot(slot_), mindist(mindist_), saved(0) {}
+
+        /**
+         * Position of the query in the packet
+         */
+        size_t slot;
+        /**
+         * Minimum distance from the query to the node cell
+         */
+        DistanceType mindist;
+        /**
+         * Per-dimension distance replaced when entering the far child
+         */
+        DistanceType saved;
+    };
+
+    /**
+     * Search state of a group of queries traversing the tree together
+     */
+    template <typename ResultSetType>
+    struct QueryPacket
+    {
+        QueryPacket(size_t capacity, size_t veclen, size_t knn) :
+            vecs(capacity), dists(capacity*veclen, 0), results(capacity, ResultSetType(knn))
+        {
+            entries.reserve(4*capacity);
+        }
+
+        std::vector<const ElementType*> vecs;
+        std::vector<DistanceType> dists;
+        std::vector<ResultSetType> results;
+        /**
+         * Stack of active query lists, one per level of the traversal
+         */
+        std::vector<PacketEntry> entries;
+    };
+
 
     
     void freeIndex()
@@ -344,7 +533,11 @@ private:
             delete[] data_.ptr();
             data_ = flann::Matrix<ElementType>();
         }
+        data_capacity_ = 0;
         if (root_node_) root_node_->~Node();
+        root_node_ = NULL;
+        free_nodes_.clear();
+        free_ranges_.clear();
         pool_.free();
     }
     
@@ -360,17 +553,65 @@ private:
 
 
 
-    void computeBoundingBox(BoundingBox& bbox)
+    /**
+     * Dimensionality used by the tree kernels. The kernels are instantiated with a
+     * compile-time dimension (DIM>0) for 2, 3 and 4 dimensional data, so that the
+     * loops over the point coordinates can be fully unrolled, and with DIM=0 for
+     * any other dimensionality, in which case veclen_ is used.
+     */
+    template <int DIM>
+    inline size_t dimension() const
+    {
+        return (DIM>0) ? size_t(DIM) : veclen_;
+    }
+
+    template <int DIM>
+    void buildTree()
+    {
+        computeBoundingBox<DIM>(root_bbox_, 0, size_);
+        root_node_ = divideTree<DIM>(0, size_, root_bbox_ );   // construct the tree
+    }
+
+    template <int DIM>
+    void findNeighborsImpl(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
+    {
+        float epsError = 1+searchParams.eps;
+
+        // with a compile-time dimension the per-dimension distances are kept on the stack
+        DistanceType fixed_dists[DIM>0 ? DIM : 1];
+        std::vector<DistanceType> dynamic_dists;
+        DistanceType* dists = fixed_dists;
+        if (DIM==0) {
+            dynamic_dists.resize(veclen_);
+            dists = &dynamic_dists[0];
+        }
+        std::fill(dists, dists+dimension<DIM>(), DistanceType(0));
+
+        DistanceType distsq = computeInitialDistances<DIM>(vec, dists);
+        if (removed_) {
+            searchLevel<true, DIM>(result, vec, root_node_, distsq, dists, epsError);
+        }
+        else {
+            searchLevel<false, DIM>(result, vec, root_node_, distsq, dists, epsError);
+        }
+    }
+
+    /**
+     * Computes the bounding box of the points vind_[left..right)
+     */
+    template <int DIM>
+    void computeBoundingBox(BoundingBox& bbox, int left, int right)
     {
         bbox.resize(veclen_);
-        for (size_t i=0; i<veclen_; ++i) {
-            bbox[i].low = (DistanceType)points_[0][i];
-            bbox[i].high = (DistanceType)points_[0][i];
+        for (size_t i=0; i<dimension<DIM>(); ++i) {
+            bbox[i].low = (DistanceType)points_[vind_[left]][i];
+            bbox[i].high = (DistanceType)points_[vind_[left]][i];
         }
-        for (size_t k=1; k<size_; ++k) {
-            for (size_t i=0; i<veclen_; ++i) {
-                if (points_[k][i]<bbox[i].low) bbox[i].low = (DistanceType)points_[k][i];
-                if (points_[k][i]>bbox[i].high) bbox[i].high = (DistanceType)points_[k][i];
+        for (int k=left+1; k<right; ++k) {
+            ElementType* point = points_[vind_[k]];
+            for (size_t i=0; i<dimension<DIM>(); ++i) {
+                if (point[i]<bbox[i].low) bbox[i].low = (DistanceType)point[i];
+                if (point[i]>bbox[i].high) bbox[i].high = (DistanceType)point[i];
             }
         }
     }
@@ -384,10 +625,14 @@ private:
      * Params: pTree = the new node to create
      *                  first = index of the first vector
      *                  last = index of the last vector
+     *                  balanced = split at the median instead of the middle of the
+     *                      largest span, bounding the height of the subtree
      */
-    NodePtr divideTree(int left, int right, BoundingBox& bbox)
+    template <int DIM>
+    NodePtr divideTree(int left, int right, BoundingBox& bbox, bool balanced = false, NodePtr node = NULL)
     {
-        NodePtr node = new (pool_) Node(); // allocate memory
+        if (node==NULL) node = newNode();
+        node->count = right-left;
 
         /* If too few exemplars remain, then make this a leaf node. */
         if ( (right-left) <= leaf_max_size_) {
@@ -396,12 +641,12 @@ private:
             node->right = right;
 
             // compute bounding-box of leaf points
-            for (size_t i=0; i<veclen_; ++i) {
+            for (size_t i=0; i<dimension<DIM>(); ++i) {
                 bbox[i].low = (DistanceType)points_[vind_[left]][i];
                 bbox[i].high = (DistanceType)points_[vind_[left]][i];
             }
             for (int k=left+1; k<right; ++k) {
-                for (size_t i=0; i<veclen_; ++i) {
+                for (size_t i=0; i<dimension<DIM>(); ++i) {
                     if (bbox[i].low>points_[vind_[k]][i]) bbox[i].low=(DistanceType)points_[vind_[k]][i];
                     if (bbox[i].high<points_[vind_[k]][i]) bbox[i].high=(DistanceType)points_[vind_[k]][i];
                 }
@@ -411,22 +656,27 @@ private:
             int idx;
             int cutfeat;
             DistanceType cutval;
-            middleSplit(&vind_[0]+left, right-left, idx, cutfeat, cutval, bbox);
+            if (balanced) {
+                medianSplit<DIM>(&vind_[0]+left, right-left, idx, cutfeat, cutval, bbox);
+            }
+            else {
+                middleSplit<DIM>(&vind_[0]+left, right-left, idx, cutfeat, cutval, bbox);
+            }
 
             node->divfeat = cutfeat;
 
             BoundingBox left_bbox(bbox);
             left_bbox[cutfeat].high = cutval;
-            node->child1 = divideTree(left, left+idx, left_bbox);
+            node->child1 = divideTree<DIM>(left, left+idx, left_bbox, balanced);
 
             BoundingBox right_bbox(bbox);
             right_bbox[cutfeat].low = cutval;
-            node->child2 = divideTree(left+idx, right, right_bbox);
+            node->child2 = divideTree<DIM>(left+idx, right, right_bbox, balanced);
 
             node->divlow = left_bbox[cutfeat].high;
             node->divhigh = right_bbox[cutfeat].low;
 
-            for (size_t i=0; i<veclen_; ++i) {
+            for (size_t i=0; i<dimension<DIM>(); ++i) {
             	bbox[i].low = std::min(left_bbox[i].low, right_bbox[i].low);
             	bbox[i].high = std::max(left_bbox[i].high, right_bbox[i].high);
             }
@@ -435,6 +685,43 @@ private:
         return node;
     }
 
+    /**
+     * Compares two points by one of their coordinates
+     */
+    struct CoordinateLess
+    {
+        CoordinateLess(const std::vector<ElementType*>& points, int dim) : points_(points), dim_(dim) {}
+
+        bool operator()(int a, int b) const
+        {
+            return points_[a][dim_]<points_[b][dim_];
+        }
+
+        const std::vector<ElementType*>& points_;
+        int dim_;
+    };
+
+    /**
+     * Splits the points at the median of the dimension with the largest span.
+     */
+    template <int DIM>
+    void medianSplit(int* ind, int count, int& index, int& cutfeat, DistanceType& cutval, const BoundingBox& bbox)
+    {
+        DistanceType max_span = bbox[0].high-bbox[0].low;
+        cutfeat = 0;
+        for (size_t i=1; i<dimension<DIM>(); ++i) {
+            DistanceType span = bbox[i].high-bbox[i].low;
+            if (span>max_span) {
+                max_span = span;
+                cutfeat = i;
+            }
+        }
+
+        index = count/2;
+        std::nth_element(ind, ind+index, ind+count, CoordinateLess(points_, cutfeat));
+        cutval = (DistanceType)points_[ind[index]][cutfeat];
+    }
+
     void computeMinMax(int* ind, int count, int dim, ElementType& min_elem, ElementType& max_elem)
     {
         min_elem = points_[ind[0]][dim];
@@ -446,13 +733,14 @@ private:
         }
     }
 
+    template <int DIM>
     void middleSplit(int* ind, int count, int& index, int& cutfeat, DistanceType& cutval, const BoundingBox& bbox)
     {
         // find the largest span from the approximate bounding box
         ElementType max_span = bbox[0].high-bbox[0].low;
         cutfeat = 0;
         cutval = (bbox[0].high+bbox[0].low)/2;
-        for (size_t i=1; i<veclen_; ++i) {
+        for (size_t i=1; i<dimension<DIM>(); ++i) {
             ElementType span = bbox[i].high-bbox[i].low;
             if (span>max_span) {
                 max_span = span;
@@ -469,7 +757,7 @@ private:
 
         // check if a dimension of a largest span exists
         size_t k = cutfeat;
-        for (size_t i=0; i<veclen_; ++i) {
+        for (size_t i=0; i<dimension<DIM>(); ++i) {
             if (i==k) continue;
             ElementType span = bbox[i].high-bbox[i].low;
             if (span>max_span) {
@@ -568,11 +856,372 @@ private:
         lim2 = left;
     }
 
-    DistanceType computeInitialDistances(const ElementType* vec, std::vector<DistanceType>& dists) const
+    /**
+     * Inserts the points points_[first..size_) in the tree.
+     */
+    template <int DIM>
+    void insertPoints(size_t first)
+    {
+        std::vector<NodePtr> path;
+        for (size_t i=first; i<size_; ++i) {
+            insertPoint<DIM>(i, path);
+        }
+
+        // leaves moved to the end of vind_ leave unused entries behind, reclaim
+        // them once they outnumber the used ones
+        if (vind_garbage_>vind_.size()/2) {
+            compactIndices();
+        }
+    }
+
+    template <int DIM>
+    void insertPoint(size_t index, std::vector<NodePtr>& path)
+    {
+        const ElementType* point = points_[index];
+        for (size_t i=0; i<dimension<DIM>(); ++i) {
+            if (point[i]<root_bbox_[i].low) root_bbox_[i].low = (DistanceType)point[i];
+            if (point[i]>root_bbox_[i].high) root_bbox_[i].high = (DistanceType)point[i];
+        }
+
+        /* Descend to the leaf, widening the split bounds if the point falls between them. */
+        path.clear();
+        NodePtr node = root_node_;
+        while (node->child1!=NULL && node->child2!=NULL) {
+            path.push_back(node);
+            DistanceType val = (DistanceType)point[node->divfeat];
+            if (val<=node->divlow) {
+                node = node->child1;
+            }
+            else if (val>=node->divhigh) {
+                node = node->child2;
+            }
+            else if (val-node->divlow<node->divhigh-val) {
+                node->divlow = val;
+                node = node->child1;
+            }
+            else {
+                node->divhigh = val;
+                node = node->child2;
+            }
+        }
+
+        /* The leaf must be followed by a free entry to grow. If it is not at the end of
+           vind_, it is moved to a free range or to the end, dropping its removed points. */
+        int dropped = 0;
+        if (node->right==(int)vind_.size()) {
+            vind_.push_back(index);
+        }
+        else {
+            dropped = moveLeaf(node);
+            vind_[node->right] = index;
+        }
+        node->right++;
+        node->count = node->right-node->left;
+        updateData(node->left, node->right);
+        for (size_t i=0; i<path.size(); ++i) {
+            path[i]->count += 1-dropped;
+        }
+
+        if (node->right-node->left>leaf_max_size_) {
+            BoundingBox bbox;
+            computeBoundingBox<DIM>(bbox, node->left, node->right);
+            int left = node->left;
+            int right = node->right;
+            divideTree<DIM>(left, right, bbox, false, node);
+            updateData(left, right);
+
+            size_t depth = path.size()+treeHeight(node);
+            if (depth>heightLimit(size_)) {
+                rebalance<DIM>(node, path, depth);
+            }
+        }
+    }
+
+    /**
+     * Walks up the insertion path and rebuilds the first subtree that is too
+     * deep for the number of points it contains.
+     */
+    template <int DIM>
+    void rebalance(NodePtr node, const std::vector<NodePtr>& path, size_t depth)
+    {
+        for (int k=(int)path.size()-1; k>=0; --k) {
+            if (depth-k>heightLimit(path[k]->count)) {
+                int dropped = rebuildSubtree<DIM>(path[k]);
+                for (int i=0; i<k; ++i) {
+                    path[i]->count -= dropped;
+                }
+                return;
+            }
+        }
+    }
+
+    /**
+     * Rebuilds a subtree in place with median splits, dropping the removed points.
+     * Returns the number of points dropped.
+     */
+    template <int DIM>
+    int rebuildSubtree(NodePtr node)
+    {
+        int start = vind_.size();
+        appendIndices(node);
+        int end = vind_.size();
+        int dropped = node->count-(end-start);
+
+        if (start==end) {
+            releaseChildren(node);
+            node->child1 = node->child2 = NULL;
+            node->left = start;
+            node->right = end;
+            node->count = 0;
+            return dropped;
+        }
+
+        // the nodes below are rebuilt from the free list, then the pool
+        releaseChildren(node);
+        BoundingBox bbox;
+        computeBoundingBox<DIM>(bbox, start, end);
+        divideTree<DIM>(start, end, bbox, true, node);
+        updateData(start, end);
+        return dropped;
+    }
+
+    /**
+     * Moves a leaf to a free range (or to the end of vind_) with room for one more
+     * entry, dropping its removed points. Returns the number of points dropped.
+     */
+    int moveLeaf(NodePtr node)
+    {
+        int count = 0;
+        for (int i=node->left; i<node->right; ++i) {
+            if (!removed_ || !removed_points_.test(vind_[i])) ++count;
+        }
+        int start = allocateRange(count+1);
+        if (start<0) {
+            start = vind_.size();
+            vind_.resize(start+count+1);
+        }
+        int last = start;
+        for (int i=node->left; i<node->right; ++i) {
+            if (!removed_ || !removed_points_.test(vind_[i])) {
+                vind_[last++] = vind_[i];
+            }
+        }
+        int dropped = node->right-node->left-count;
+        freeRange(node->left, node->right);
+        node->left = start;
+        node->right = last;
+        return dropped;
+    }
+
+    /**
+     * Adds the entries vind_[start..end) to the free ranges, which are reused
+     * by the leaves moved when they grow.
+     */
+    void freeRange(int start, int end)
+    {
+        vind_garbage_ += end-start;
+        size_t max_size = leaf_max_size_+1;
+        if (free_ranges_.size()<=max_size) {
+            free_ranges_.resize(max_size+1);
+        }
+        while (start<end) {
+            int size = std::min(end-start, int(max_size));
+            free_ranges_[size].push_back(start);
+            start += size;
+        }
+    }
+
+    /**
+     * Takes a free range of size entries, splitting a larger one if needed.
+     * Returns -1 if there is none.
+     */
+    int allocateRange(int size)
+    {
+        for (size_t s=size; s<free_ranges_.size(); ++s) {
+            if (!free_ranges_[s].empty()) {
+                int start = free_ranges_[s].back();
+                free_ranges_[s].pop_back();
+                if (s>size_t(size)) {
+                    free_ranges_[s-size].push_back(start+size);
+                }
+                vind_garbage_ -= size;
+                return start;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Allocates a node, reusing the nodes dropped by rebuildSubtree() before
+     * taking memory from the pool.
+     */
+    NodePtr newNode()
+    {
+        if (free_nodes_.empty()) {
+            return new(pool_) Node();
+        }
+        NodePtr node = free_nodes_.back();
+        free_nodes_.pop_back();
+        return new(node) Node();
+    }
+
+    /**
+     * Adds the nodes below a node to the free nodes.
+     */
+    void releaseChildren(NodePtr node)
+    {
+        if (node->child1!=NULL && node->child2!=NULL) {
+            releaseChildren(node->child1);
+            releaseChildren(node->child2);
+            free_nodes_.push_back(node->child1);
+            free_nodes_.push_back(node->child2);
+        }
+    }
+
+    /**
+     * Appends the indices in the leaves of a subtree to the end of vind_, skipping
+     * the removed points. The old entries are counted as unused.
+     */
+    void appendIndices(const NodePtr node)
+    {
+        if (node->child1==NULL && node->child2==NULL) {
+            for (int i=node->left; i<node->right; ++i) {
+                int index = vind_[i];
+                if (!removed_ || !removed_points_.test(index)) {
+                    vind_.push_back(index);
+                }
+            }
+            freeRange(node->left, node->right);
+        }
+        else {
+            appendIndices(node->child1);
+            appendIndices(node->child2);
+        }
+    }
+
+    /**
+     * Rewrites vind_ (and the reordered data) without the unused entries.
+     */
+    void compactIndices()
+    {
+        std::vector<int> vind;
+        vind.reserve(vind_.size()-vind_garbage_);
+        compactIndices(root_node_, vind);
+        vind_.swap(vind);
+        vind_garbage_ = 0;
+        free_ranges_.clear();
+
+        if (reorder_) {
+            delete[] data_.ptr();
+            data_ = flann::Matrix<ElementType>();
+            data_capacity_ = 0;
+            updateData(0, vind_.size());
+        }
+    }
+
+    void compactIndices(NodePtr node, std::vector<int>& vind)
+    {
+        if (node->child1==NULL && node->child2==NULL) {
+            int start = vind.size();
+            vind.insert(vind.end(), vind_.begin()+node->left, vind_.begin()+node->right);
+            node->left = start;
+            node->right = vind.size();
+        }
+        else {
+            compactIndices(node->child1, vind);
+            compactIndices(node->child2, vind);
+        }
+    }
+
+    /**
+     * Copies the points of vind_[start..end) to the reordered data, growing it to
+     * the size of vind_ if necessary.
+     */
+    void updateData(size_t start, size_t end)
+    {
+        if (!reorder_) return;
+
+        if (vind_.size()>data_capacity_) {
+            size_t capacity = std::max(vind_.size(), 2*data_capacity_);
+            ElementType* data = new ElementType[capacity*veclen_];
+            if (data_.ptr()) {
+                std::copy(data_[0], data_[0]+data_.rows*veclen_, data);
+                delete[] data_.ptr();
+            }
+            data_capacity_ = capacity;
+            data_ = flann::Matrix<ElementType>(data, vind_.size(), veclen_);
+        }
+        else {
+            data_ = flann::Matrix<ElementType>(data_.ptr(), vind_.size(), veclen_);
+        }
+
+        for (size_t i=start; i<end; ++i) {
+            std::copy(points_[vind_[i]], points_[vind_[i]]+veclen_, data_[i]);
+        }
+    }
+
+    int compactLeaves(NodePtr node)
+    {
+        if (node->child1==NULL && node->child2==NULL) {
+            int last = node->left;
+            for (int i=node->left; i<node->right; ++i) {
+                if (!removed_points_.test(vind_[i])) {
+                    if (reorder_ && last!=i) {
+                        std::copy(data_[i], data_[i]+veclen_, data_[last]);
+                    }
+                    vind_[last++] = vind_[i];
+                }
+            }
+            freeRange(last, node->right);
+            node->right = last;
+            node->count = last-node->left;
+        }
+        else {
+            node->count = compactLeaves(node->child1)+compactLeaves(node->child2);
+        }
+        return node->count;
+    }
+
+    /**
+     * Sets the counts of a loaded subtree, returns the count of its root.
+     */
+    int countIndices(NodePtr node)
+    {
+        if (node->child1==NULL && node->child2==NULL) {
+            node->count = node->right-node->left;
+        }
+        else {
+            node->count = countIndices(node->child1)+countIndices(node->child2);
+        }
+        return node->count;
+    }
+
+    size_t treeHeight(const NodePtr node) const
+    {
+        if (node->child1==NULL && node->child2==NULL) {
+            return 0;
+        }
+        return 1+std::max(treeHeight(node->child1), treeHeight(node->child2));
+    }
+
+    /**
+     * Maximum height tolerated for a subtree holding count points before it is
+     * rebuilt, twice the height of a balanced tree plus some slack.
+     */
+    size_t heightLimit(size_t count) const
+    {
+        size_t leaves = count/leaf_max_size_+1;
+        size_t height = 0;
+        while ((size_t(1)<<height)<leaves) ++height;
+        return 2*height+2;
+    }
+
+    template <int DIM>
+    DistanceType computeInitialDistances(const ElementType* vec, DistanceType* dists) const
     {
         DistanceType distsq = 0.0;
 
-        for (size_t i = 0; i < veclen_; ++i) {
+        for (size_t i = 0; i < dimension<DIM>(); ++i) {
             if (vec[i] < root_bbox_[i].low) {
                 dists[i] = distance_.accum_dist(vec[i], root_bbox_[i].low, i);
                 distsq += dists[i];
@@ -589,9 +1238,9 @@ private:
     /**
      * Performs an exact search in the tree starting from a node.
      */
-    template <bool with_removed>
+    template <bool with_removed, int DIM>
     void searchLevel(ResultSet<DistanceType>& result_set, const ElementType* vec, const NodePtr node, DistanceType mindistsq,
-                     std::vector<DistanceType>& dists, const float epsError) const
+                     DistanceType* dists, const float epsError) const
     {
         /* If this is a leaf node, then do check and return. */
         if ((node->child1 == NULL)&&(node->child2 == NULL)) {
@@ -601,7 +1250,7 @@ private:
                     if (removed_points_.test(vind_[i])) continue;
                 }
                 ElementType* point = reorder_ ? data_[i] : points_[vind_[i]];
-                DistanceType dist = distance_(vec, point, veclen_, worst_dist);
+                DistanceType dist = distance_(vec, point, dimension<DIM>(), worst_dist);
                 if (dist<worst_dist) {
                     result_set.addPoint(dist,vind_[i]);
                 }
@@ -630,17 +1279,251 @@ private:
         }
 
         /* Call recursively to search next level down. */
-        searchLevel<with_removed>(result_set, vec, bestChild, mindistsq, dists, epsError);
+        searchLevel<with_removed, DIM>(result_set, vec, bestChild, mindistsq, dists, epsError);
 
         DistanceType dst = dists[idx];
         mindistsq = mindistsq + cut_dist - dst;
         dists[idx] = cut_dist;
         if (mindistsq*epsError<=result_set.worstDist()) {
-            searchLevel<with_removed>(result_set, vec, otherChild, mindistsq, dists, epsError);
+            searchLevel<with_removed, DIM>(result_set, vec, otherChild, mindistsq, dists, epsError);
         }
         dists[idx] = dst;
     }
 
+    /**
+     * Computes the order in which the queries are grouped into packets, by sorting them
+     * along a Morton curve over the root bounding box. For high dimensional data only the
+     * first 63 dimensions contribute to the curve.
+     */
+    void computeMortonOrder(const Matrix<ElementType>& queries, std::vector<size_t>& order) const
+    {
+        order.resize(queries.rows);
+        for (size_t i=0; i<queries.rows; ++i) {
+            order[i] = i;
+        }
+        if (queries.rows<2) return;
+
+        size_t dims = std::min(veclen_, size_t(63));
+        int bits = std::min(int(63/dims), 21);
+        DistanceType cells = DistanceType((1<<bits)-1);
+
+        std::vector<std::pair<uint64_t, size_t> > codes(queries.rows);
+        std::vector<uint64_t> cell(dims);
+        for (size_t i=0; i<queries.rows; ++i) {
+            const ElementType* vec = queries[i];
+            for (size_t d=0; d<dims; ++d) {
+                DistanceType span = root_bbox_[d].high-root_bbox_[d].low;
+                DistanceType pos = (span>0) ? (vec[d]-root_bbox_[d].low)/span*cells : 0;
+                if (pos<0) pos = 0;
+                if (pos>cells) pos = cells;
+                cell[d] = uint64_t(pos);
+            }
+            uint64_t code = 0;
+            for (int b=bits-1; b>=0; --b) {
+                for (size_t d=0; d<dims; ++d) {
+                    code = (code<<1) | ((cell[d]>>b)&1);
+                }
+            }
+            codes[i] = std::make_pair(code, i);
+        }
+        std::sort(codes.begin(), codes.end());
+        for (size_t i=0; i<queries.rows; ++i) {
+            order[i] = codes[i].second;
+        }
+    }
+
+    /**
+     * Searches the queries packet by packet, in the given order.
+     */
+    template <typename ResultSetType>
+    int searchPackets(const Matrix<ElementType>& queries, const std::vector<size_t>& order,
+            Matrix<size_t>& indices, Matrix<DistanceType>& dists, size_t knn,
+            const SearchParams& params, size_t packet_size) const
+    {
+        switch (veclen_) {
+        case 2:
+            return searchPackets<ResultSetType, 2>(queries, order, indices, dists, knn, params, packet_size);
+        case 3:
+            return searchPackets<ResultSetType, 3>(queries, order, indices, dists, knn, params, packet_size);
+        case 4:
+            return searchPackets<ResultSetType, 4>(queries, order, indices, dists, knn, params, packet_size);
+        default:
+            return searchPackets<ResultSetType, 0>(queries, order, indices, dists, knn, params, packet_size);
+        }
+    }
+
+    template <typename ResultSetType, int DIM>
+    int searchPackets(const Matrix<ElementType>& queries, const std::vector<size_t>& order,
+            Matrix<size_t>& indices, Matrix<DistanceType>& dists, size_t knn,
+            const SearchParams& params, size_t packet_size) const
+    {
+        if (packet_size==0) packet_size = 1;
+        float epsError = 1+params.eps;
+        int packet_count = (int)((queries.rows+packet_size-1)/packet_size);
+        int count = 0;
+
+#pragma omp parallel num_threads(params.cores)
+        {
+            QueryPacket<ResultSetType> packet(packet_size, veclen_, knn);
+#pragma omp for schedule(static) reduction(+:count)
+            for (int p = 0; p < packet_count; ++p) {
+                size_t first = p*packet_size;
+                size_t last = std::min(first+packet_size, queries.rows);
+
+                packet.entries.clear();
+                for (size_t j=first; j<last; ++j) {
+                    size_t slot = j-first;
+                    DistanceType* qdists = &packet.dists[slot*veclen_];
+                    std::fill(qdists, qdists+veclen_, DistanceType(0));
+                    packet.vecs[slot] = queries[order[j]];
+                    packet.results[slot].clear();
+                    packet.entries.push_back(PacketEntry(slot, computeInitialDistances<DIM>(packet.vecs[slot], qdists)));
+                }
+
+                if (removed_) {
+                    searchLevelPacket<true, DIM>(packet, 0, last-first, root_node_, epsError);
+                }
+                else {
+                    searchLevelPacket<false, DIM>(packet, 0, last-first, root_node_, epsError);
+                }
+
+                for (size_t j=first; j<last; ++j) {
+                    size_t q = order[j];
+                    ResultSetType& result_set = packet.results[j-first];
+                    size_t n = std::min(result_set.size(), knn);
+                    result_set.copy(indices[q], dists[q], n, params.sorted);
+                    indices_to_ids(indices[q], indices[q], n);
+                    count += n;
+                }
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Performs an exact search in the tree for a packet of queries starting from a node.
+     * The queries active at the node are packet.entries[first..first+count).
+     *
+     * The packet is split by the child each query takes first. The first child is visited
+     * with the queries for which it is the closer one, the second child with the queries
+     * for which it is the closer one plus the queries coming back from the first child that
+     * still need to cross the splitting plane, and finally the first child again for the
+     * queries coming back from the second one. This preserves the per-query visiting order
+     * of searchLevel().
+     */
+    template <bool with_removed, int DIM, typename ResultSetType>
+    void searchLevelPacket(QueryPacket<ResultSetType>& packet, size_t first, size_t count, const NodePtr node,
+                           const float epsError) const
+    {
+        std::vector<PacketEntry>& entries = packet.entries;
+        size_t end = first+count;
+
+        /* If this is a leaf node, then check it for all the queries. */
+        if ((node->child1 == NULL)&&(node->child2 == NULL)) {
+            for (size_t e=first; e<end; ++e) {
+                const ElementType* vec = packet.vecs[entries[e].slot];
+                ResultSetType& result_set = packet.results[entries[e].slot];
+                DistanceType worst_dist = result_set.worstDist();
+                for (int i=node->left; i<node->right; ++i) {
+                    if (with_removed) {
+                        if (removed_points_.test(vind_[i])) continue;
+                    }
+                    ElementType* point = reorder_ ? data_[i] : points_[vind_[i]];
+                    DistanceType dist = distance_(vec, point, dimension<DIM>(), worst_dist);
+                    if (dist<worst_dist) {
+                        result_set.addPoint(dist,vind_[i]);
+                    }
+                }
+            }
+            return;
+        }
+
+        int idx = node->divfeat;
+        size_t base = entries.size();
+
+        /* Queries for which child1 is the closer branch. */
+        for (size_t e=first; e<end; ++e) {
+            PacketEntry entry = entries[e];
+            if (closerToChild1(packet.vecs[entry.slot][idx], node)) {
+                entries.push_back(entry);
+            }
+        }
+        size_t near1_end = entries.size();
+        if (near1_end>base) {
+            searchLevelPacket<with_removed, DIM>(packet, base, near1_end-base, node->child1, epsError);
+        }
+
+        /* Queries for child2: first those for which it is the closer branch... */
+        size_t second = entries.size();
+        for (size_t e=first; e<end; ++e) {
+            PacketEntry entry = entries[e];
+            if (!closerToChild1(packet.vecs[entry.slot][idx], node)) {
+                entries.push_back(entry);
+            }
+        }
+        size_t near2_end = entries.size();
+        /* ...then those returning from child1 that are close enough to the other side. */
+        for (size_t e=base; e<near1_end; ++e) {
+            PacketEntry entry = entries[e];
+            DistanceType cut_dist = distance_.accum_dist(packet.vecs[entry.slot][idx], node->divhigh, idx);
+            if (enterFarChild(packet, entry, idx, cut_dist, epsError)) {
+                entries.push_back(entry);
+            }
+        }
+        size_t far2_end = entries.size();
+        if (far2_end>second) {
+            searchLevelPacket<with_removed, DIM>(packet, second, far2_end-second, node->child2, epsError);
+        }
+        for (size_t e=near2_end; e<far2_end; ++e) {
+            packet.dists[entries[e].slot*veclen_+idx] = entries[e].saved;
+        }
+
+        /* Queries returning from child2 that are close enough to child1. */
+        size_t third = entries.size();
+        for (size_t e=second; e<near2_end; ++e) {
+            PacketEntry entry = entries[e];
+            DistanceType cut_dist = distance_.accum_dist(packet.vecs[entry.slot][idx], node->divlow, idx);
+            if (enterFarChild(packet, entry, idx, cut_dist, epsError)) {
+                entries.push_back(entry);
+            }
+        }
+        size_t far1_end = entries.size();
+        if (far1_end>third) {
+            searchLevelPacket<with_removed, DIM>(packet, third, far1_end-third, node->child1, epsError);
+        }
+        for (size_t e=third; e<far1_end; ++e) {
+            packet.dists[entries[e].slot*veclen_+idx] = entries[e].saved;
+        }
+
+        entries.resize(base);
+    }
+
+    inline bool closerToChild1(ElementType val, const NodePtr node) const
+    {
+        DistanceType diff1 = val - node->divlow;
+        DistanceType diff2 = val - node->divhigh;
+        return (diff1+diff2)<0;
+    }
+
+    /**
+     * Updates the query distance to the far child cell and checks if the child needs to be
+     * visited. If so, the per-dimension distance is replaced, the old value is kept in the
+     * entry to be restored after the visit.
+     */
+    template <typename ResultSetType>
+    inline bool enterFarChild(QueryPacket<ResultSetType>& packet, PacketEntry& entry, int idx,
+                              DistanceType cut_dist, const float epsError) const
+    {
+        DistanceType& dst = packet.dists[entry.slot*veclen_+idx];
+        entry.mindist = entry.mindist + cut_dist - dst;
+        if (entry.mindist*epsError<=packet.results[entry.slot].worstDist()) {
+            entry.saved = dst;
+            dst = cut_dist;
+            return true;
+        }
+        return false;
+    }
+
     
     void swap(KDTreeSingleIndex& other)
     {
@@ -649,9 +1532,13 @@ private:
         std::swap(reorder_, other.reorder_);
         std::swap(vind_, other.vind_);
         std::swap(data_, other.data_);
+        std::swap(data_capacity_, other.data_capacity_);
+        std::swap(vind_garbage_, other.vind_garbage_);
         std::swap(root_node_, other.root_node_);
         std::swap(root_bbox_, other.root_bbox_);
         std::swap(pool_, other.pool_);
+        std::swap(free_nodes_, other.free_nodes_);
+        std::swap(free_ranges_, other.free_ranges_);
     }
     
 private:
@@ -670,6 +1557,16 @@ private:
 
     Matrix<ElementType> data_;
 
+    /**
+     * Number of rows allocated for data_, it grows as points are inserted.
+     */
+    size_t data_capacity_;
+
+    /**
+     * Number of entries in vind_ no longer referenced by any leaf.
+     */
+    size_t vind_garbage_;
+
     /**
      * Array of k-d trees used to find neighbours.
      */
@@ -689,6 +1586,18 @@ private:
      */
     PooledAllocator pool_;
 
+    /**
+     * Nodes of the subtrees replaced by rebuildSubtree(), reused by newNode()
+     * so that the pool doesn't grow with the insertions.
+     */
+    std::vector<NodePtr> free_nodes_;
+
+    /**
+     * Unused ranges of vind_ by size, reused by moveLeaf() so that vind_ doesn't
+     * grow with the insertions.
+     */
+    std::vector<std::vector<int> > free_ranges_;
+
     USING_BASECLASS_SYMBOLS
 
 };   // class KDTreeSingleIndex
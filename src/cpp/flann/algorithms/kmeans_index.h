@@ -92,6 +92,15 @@ public:
 
 
 
+    /**
+     * Removes the removed points from the leaves of the tree.
+     */
+    void compactRemovedPoints()
+    {
+        if (!removed_ || root_==NULL) return;
+        compactNode(root_);
+    }
+
     flann_algorithm_t getType() const
     {
         return FLANN_INDEX_KMEANS;
@@ -205,12 +214,13 @@ public:
      * Computes the inde memory usage
      * Returns: memory used by the index
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
         return pool_.usedMemory+pool_.wastedMemory+memoryCounter_;
     }
 
     using BaseClass::buildIndex;
+    using BaseClass::addPoints;
 
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2.f)
     {
@@ -239,7 +249,10 @@ public:
 
     	ar & branching_;
     	ar & iterations_;
-    	ar & memoryCounter_;
+    	// stored as an int to keep the file format, it only feeds usedMemory()
+    	int memory_counter = int(std::min(memoryCounter_, size_t(std::numeric_limits<int>::max())));
+    	ar & memory_counter;
+    	memoryCounter_ = size_t(memory_counter);
     	ar & cb_index_;
     	ar & centers_init_;
 
@@ -465,6 +478,32 @@ private:
     	pool_.free();
     }
 
+    /**
+     * Removes the removed points from the leaves of a subtree
+     * @return Number of points removed from the subtree
+     */
+    int compactNode(NodePtr node)
+    {
+        int dropped = 0;
+        if (node->childs.empty()) {
+            size_t last = 0;
+            for (size_t i=0; i<node->points.size(); ++i) {
+                if (!removed_points_.test(node->points[i].index)) {
+                    node->points[last++] = node->points[i];
+                }
+            }
+            dropped = node->points.size()-last;
+            node->points.resize(last);
+        }
+        else {
+            for (size_t i=0; i<node->childs.size(); ++i) {
+                dropped += compactNode(node->childs[i]);
+            }
+        }
+        node->size -= dropped;
+        return dropped;
+    }
+
     void copyTree(NodePtr& dst, const NodePtr& src)
     {
     	dst = new(pool_) Node();
@@ -498,7 +537,7 @@ private:
         size_t size = indices.size();
 
         DistanceType* mean = new DistanceType[veclen_];
-        memoryCounter_ += int(veclen_*sizeof(DistanceType));
+        memoryCounter_ += veclen_*sizeof(DistanceType);
         memset(mean,0,veclen_*sizeof(DistanceType));
 
         for (size_t i=0; i<size; ++i) {
@@ -729,10 +768,17 @@ private:
             int checks = 0;
             findNN<with_removed>(root_, result, vec, checks, maxChecks, heap);
 
+            result.startStallDetection(searchParams.stall_checks, checks);
+
             BranchSt branch;
             while (heap->popMin(branch) && (checks<maxChecks || !result.full())) {
+                FLANN_SEARCH_STAT(result, HEAP_POPS, 1);
                 NodePtr node = branch.node;
                 findNN<with_removed>(node, result, vec, checks, maxChecks, heap);
+
+                if (result.expired(checks) || result.stalled(checks)) {
+                    break;
+                }
             }
 
             delete heap;
@@ -757,6 +803,8 @@ private:
     void findNN(NodePtr node, ResultSet<DistanceType>& result, const ElementType* vec, int& checks, int maxChecks,
                 Heap<BranchSt>* heap) const
     {
+        FLANN_SEARCH_STAT(result, NODES_VISITED, 1);
+        FLANN_SEARCH_STAT(result, DISTANCE_EVALS, 1);
         // Ignore those clusters that are too far away
         {
             DistanceType bsq = distance_(vec, node->pivot, veclen_);
@@ -768,6 +816,7 @@ private:
 
             //if (val>0) {
             if ((val>0)&&(val2>0)) {
+                FLANN_SEARCH_STAT(result, EARLY_ABANDONS, 1);
                 return;
             }
         }
@@ -776,18 +825,25 @@ private:
             if (checks>=maxChecks) {
                 if (result.full()) return;
             }
+            FLANN_SEARCH_STAT(result, LEAVES_SCANNED, 1);
             for (int i=0; i<node->size; ++i) {
             	PointInfo& point_info = node->points[i];
                 int index = point_info.index;
                 if (with_removed) {
-                	if (removed_points_.test(index)) continue;
+                	if (removed_points_.test(index)) {
+                		FLANN_SEARCH_STAT(result, REMOVED_SKIPS, 1);
+                		continue;
+                	}
                 }
+                FLANN_SEARCH_STAT(result, DISTANCE_EVALS, 1);
                 DistanceType dist = distance_(point_info.point, vec, veclen_);
                 result.addPoint(dist, index);
                 ++checks;
             }
         }
         else {
+            FLANN_SEARCH_STAT(result, DISTANCE_EVALS, branching_);
+            FLANN_SEARCH_STAT(result, HEAP_PUSHES, branching_-1);
             int closest_center = exploreNodeBranches(node, vec, heap);
             findNN<with_removed>(node->childs[closest_center],result,vec, checks, maxChecks, heap);
         }
@@ -1053,7 +1109,7 @@ private:
     /**
      * Memory occupied by the index.
      */
-    int memoryCounter_;
+    size_t memoryCounter_;
 
     /**
      * Algorithm used to choose initial centers
@@ -85,6 +85,8 @@ public:
     	return new LinearIndex(*this);
     }
 
+    using BaseClass::addPoints;
+
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
         assert(points.cols==veclen_);
@@ -97,7 +99,7 @@ public:
     }
 
 
-    int usedMemory() const
+    size_t usedMemory() const
     {
         return 0;
     }
@@ -130,7 +132,11 @@ public:
     {
     	if (removed_) {
     		for (size_t i = 0; i < points_.size(); ++i) {
-    			if (removed_points_.test(i)) continue;
+    			if (removed_points_.test(i)) {
+    				FLANN_SEARCH_STAT(resultSet, REMOVED_SKIPS, 1);
+    				continue;
+    			}
+    			FLANN_SEARCH_STAT(resultSet, DISTANCE_EVALS, 1);
     			DistanceType dist = distance_(points_[i], vec, veclen_);
     			resultSet.addPoint(dist, i);
     		}
@@ -140,6 +146,7 @@ public:
     			DistanceType dist = distance_(points_[i], vec, veclen_);
     			resultSet.addPoint(dist, i);
     		}
+    		FLANN_SEARCH_STAT(resultSet, DISTANCE_EVALS, points_.size());
     	}
     }
 protected:
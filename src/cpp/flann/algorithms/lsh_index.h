@@ -142,6 +142,7 @@ public:
     }
     
     using BaseClass::buildIndex;
+    using BaseClass::addPoints;
 
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
@@ -164,6 +165,17 @@ public:
     }
 
 
+    /**
+     * Removes the removed points from the buckets of the hash tables.
+     */
+    void compactRemovedPoints()
+    {
+        if (!removed_) return;
+        for (size_t i=0; i<tables_.size(); ++i) {
+            tables_[i].removeFeatures(removed_points_);
+        }
+    }
+
     flann_algorithm_t getType() const
     {
         return FLANN_INDEX_LSH;
@@ -208,7 +220,7 @@ public:
      * Computes the index memory usage
      * Returns: memory used by the index
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
         return size_ * sizeof(int);
     }
@@ -234,14 +246,16 @@ public:
         assert(dists.cols >= knn);
 
         int count = 0;
+        Deadline deadline(params.batch_time_budget_us);
         if (params.use_heap==FLANN_True) {
 #pragma omp parallel num_threads(params.cores)
         	{
         		KNNUniqueResultSet<DistanceType> resultSet(knn);
+        		SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
         		for (int i = 0; i < (int)queries.rows; i++) {
         			resultSet.clear();
-        			findNeighbors(resultSet, queries[i], params);
+        			findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
         			size_t n = std::min(resultSet.size(), knn);
         			resultSet.copy(indices[i], dists[i], n, params.sorted);
         			indices_to_ids(indices[i], indices[i], n);
@@ -253,10 +267,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
         	{
         		KNNResultSet<DistanceType> resultSet(knn);
+        		SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
         		for (int i = 0; i < (int)queries.rows; i++) {
         			resultSet.clear();
-        			findNeighbors(resultSet, queries[i], params);
+        			findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
         			size_t n = std::min(resultSet.size(), knn);
         			resultSet.copy(indices[i], dists[i], n, params.sorted);
         			indices_to_ids(indices[i], indices[i], n);
@@ -287,14 +302,16 @@ public:
 		if (dists.size() < queries.rows ) dists.resize(queries.rows);
 
 		int count = 0;
+		Deadline deadline(params.batch_time_budget_us);
 		if (params.use_heap==FLANN_True) {
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNUniqueResultSet<DistanceType> resultSet(knn);
+				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -310,10 +327,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNResultSet<DistanceType> resultSet(knn);
+				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -489,6 +507,7 @@ private:
      */
     void getNeighbors(const ElementType* vec, ResultSet<DistanceType>& result) const
     {
+        int checks = 0;
         typename std::vector<lsh::LshTable<ElementType> >::const_iterator table = tables_.begin();
         typename std::vector<lsh::LshTable<ElementType> >::const_iterator table_end = tables_.end();
         for (; table != table_end; ++table) {
@@ -496,9 +515,14 @@ private:
             std::vector<lsh::BucketKey>::const_iterator xor_mask = xor_masks_.begin();
             std::vector<lsh::BucketKey>::const_iterator xor_mask_end = xor_masks_.end();
             for (; xor_mask != xor_mask_end; ++xor_mask) {
+                // stop at the deadline with the candidates checked so far
+                if (result.expired(checks)) return;
+
                 size_t sub_key = key ^ (*xor_mask);
                 const lsh::Bucket* bucket = table->getBucketFromKey(sub_key);
                 if (bucket == 0) continue;
+                checks += bucket->size();
+                FLANN_SEARCH_STAT(result, LEAVES_SCANNED, 1);
 
                 // Go over each descriptor index
                 std::vector<lsh::FeatureIndex>::const_iterator training_index = bucket->begin();
@@ -507,8 +531,12 @@ private:
 
                 // Process the rest of the candidates
                 for (; training_index < last_training_index; ++training_index) {
-                	if (removed_ && removed_points_.test(*training_index)) continue;
+                	if (removed_ && removed_points_.test(*training_index)) {
+                		FLANN_SEARCH_STAT(result, REMOVED_SKIPS, 1);
+                		continue;
+                	}
                     // Compute the Hamming distance
+                    FLANN_SEARCH_STAT(result, DISTANCE_EVALS, 1);
                     hamming_distance = distance_(vec, points_[*training_index], veclen_);
                     result.addPoint(hamming_distance, *training_index);
                 }
@@ -32,6 +32,8 @@
 #define FLANN_NNINDEX_H
 
 #include <vector>
+#include <unordered_map>
+#include <atomic>
 
 #include "flann/general.h"
 #include "flann/util/matrix.h"
@@ -57,7 +59,7 @@ public:
 
     virtual flann_algorithm_t getType() const = 0;
 
-    virtual int usedMemory() const = 0;
+    virtual size_t usedMemory() const = 0;
 
     virtual IndexParams getParameters() const = 0;
 
@@ -77,12 +79,13 @@ public:
     typedef typename Distance::ResultType DistanceType;
 
 	NNIndex(Distance d) : distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
-			removed_(false), removed_count_(0), data_ptr_(NULL)
+			removed_(false), removed_count_(0), compacted_count_(0), hashed_ids_(false), pending_ids_(NULL), data_ptr_(NULL)
 	{
 	}
 
 	NNIndex(const IndexParams& params, Distance d) : distance_(d), last_id_(0), size_(0), size_at_build_(0), veclen_(0),
-			index_params_(params), removed_(false), removed_count_(0), data_ptr_(NULL)
+			index_params_(params), removed_(false), removed_count_(0), compacted_count_(0), hashed_ids_(false),
+			pending_ids_(NULL), data_ptr_(NULL)
 	{
 	}
 
@@ -95,8 +98,13 @@ public:
 		index_params_(other.index_params_),
 		removed_(other.removed_),
 		removed_points_(other.removed_points_),
-		removed_count_(other.removed_count_),
+		removed_count_(other.removed_count_.load()),
+		compacted_count_(other.compacted_count_),
 		ids_(other.ids_),
+		id_index_(other.id_index_),
+		id_index_map_(other.id_index_map_),
+		hashed_ids_(other.hashed_ids_),
+		pending_ids_(NULL),
 		points_(other.points_),
 		data_ptr_(NULL)
 	{
@@ -142,6 +150,28 @@ public:
         this->buildIndex();
     }
 
+    /**
+     * Builds the index using the specified dataset and point ids
+     * @param dataset the dataset to use
+     * @param ids the ids of the points, any distinct values
+     */
+    virtual void buildIndex(const Matrix<ElementType>& dataset, const std::vector<size_t>& ids)
+    {
+        if (ids.size()!=dataset.rows) {
+            throw FLANNException("The number of ids is different than the number of points");
+        }
+        setDataset(dataset);
+        initRemovedPoints();
+        clearIdIndex();
+        last_id_ = 0;
+        for (size_t i=0;i<size_;++i) {
+            ids_[i] = ids[i];
+            setIdIndex(ids[i], i);
+            last_id_ = (std::max)(last_id_, ids[i]+1);
+        }
+        this->buildIndex();
+    }
+
 	/**
 	 * @brief Incrementally add points to the index.
 	 * @param points Matrix with points to be added
@@ -152,11 +182,101 @@ public:
         throw FLANNException("Functionality not supported by this index");
     }
 
+    /**
+     * @brief Incrementally add points with user supplied ids to the index.
+     * @param points Matrix with points to be added
+     * @param ids The ids of the points, distinct from the ids already in the index
+     * @param rebuild_threshold
+     */
+    virtual void addPoints(const Matrix<ElementType>& points, const std::vector<size_t>& ids, float rebuild_threshold = 2)
+    {
+        if (ids.size()!=points.rows) {
+            throw FLANNException("The number of ids is different than the number of points");
+        }
+        initRemovedPoints();
+        pending_ids_ = ids.empty() ? NULL : &ids[0];
+        try {
+            addPoints(points, rebuild_threshold);
+        }
+        catch (...) {
+            pending_ids_ = NULL;
+            throw;
+        }
+        pending_ids_ = NULL;
+    }
+
+    /**
+     * @brief Appends points to the dataset and rebuilds the index, without inserting
+     * them in the existing structure first.
+     * @param points Matrices with points to be added
+     */
+    virtual void rebuildWithPoints(const std::vector<Matrix<ElementType> >& points)
+    {
+        for (size_t i=0;i<points.size();++i) {
+            if (veclen_==0) veclen_ = points[i].cols;
+            extendDataset(points[i]);
+        }
+        buildIndex();
+    }
+
+    /**
+     * @return The id that will be assigned to the next point added to the index
+     */
+    virtual size_t nextId() const
+    {
+        return removed_ ? last_id_ : size_;
+    }
+
     /**
      * Remove point from the index
      * @param index Index of point to be removed
      */
     virtual void removePoint(size_t id)
+    {
+    	markRemoved(id);
+
+    	// drop the removed points from the index structure once there are enough of them,
+    	// if enabled with the "compaction_threshold" parameter
+    	size_t pending = removed_count_-compacted_count_;
+    	float compaction_threshold = get_param(index_params_, "compaction_threshold", 0.0f);
+    	if (pending>0 && compaction_threshold>0 && pending>=compaction_threshold*size_) {
+    		compactRemovedPoints();
+    		compacted_count_ = removed_count_;
+    	}
+    }
+
+    /**
+     * Marks a point as removed without modifying the index structure, so that it
+     * can be done while other threads search the index.
+     * @param id Id of the point to remove
+     */
+    virtual void markRemoved(size_t id)
+    {
+    	initRemovedPoints();
+
+    	size_t point_index = id_to_index(id);
+    	if (point_index!=size_t(-1) && !removed_points_.test(point_index)) {
+    		removed_points_.set(point_index);
+    		removed_count_++;
+    	}
+    }
+
+    /**
+     * Drops the removed points from the index structure (tree leaves, buckets)
+     * without rebuilding it, so that searches no longer visit them. The points
+     * stay in the dataset until the next rebuild.
+     */
+    virtual void compactRemovedPoints()
+    {
+    }
+
+
+    /**
+     * Sets up the id mapping and the removed points bitset used by removePoint(). Once
+     * done, removing a point only sets its bit in the bitset, so it can be done while
+     * other threads search the index.
+     */
+    virtual void initRemovedPoints()
     {
     	if (!removed_) {
     		ids_.resize(size_);
@@ -167,16 +287,14 @@ public:
     		removed_points_.reset();
     		last_id_ = size_;
         	removed_ = true;
-    	}
-
-    	size_t point_index = id_to_index(id);
-    	if (point_index!=size_t(-1) && !removed_points_.test(point_index)) {
-    		removed_points_.set(point_index);
-    		removed_count_++;
+        	clearIdIndex();
+        	id_index_.resize(size_);
+        	for (size_t i=0;i<size_;++i) {
+        		id_index_[i] = i;
+        	}
     	}
     }
 
-
     /**
      * Get point with specific id
      * @param id
@@ -230,6 +348,7 @@ public:
             header.h.index_type = getType();
             header.h.rows = size_;
             header.h.cols = veclen_;
+            header.h.compression = get_param(index_params_, "save_compression", FLANN_COMPRESSION_LZ4);
     	}
     	ar & header;
 
@@ -250,8 +369,13 @@ public:
             }
             // TODO: check for distance type
 
+            // saved again with the compression it was loaded with, unless told otherwise
+            if (!has_param(index_params_, "save_compression")) {
+                index_params_["save_compression"] = flann_compression_t(header.h.compression);
+            }
     	}
 
+    	size_t dataset_veclen = veclen_;
     	ar & size_;
     	ar & veclen_;
     	ar & size_at_build_;
@@ -276,7 +400,13 @@ public:
     		}
     	} else {
     		if (points_.size()!=size_) {
-    			throw FLANNException("Saved index does not contain the dataset and no dataset was provided.");
+    			if (points_.empty()) {
+    				throw FLANNException("Saved index does not contain the dataset and no dataset was provided.");
+    			}
+    			throw FLANNException("The dataset provided has a different number of points than the saved index.");
+    		}
+    		if (Archive::is_loading::value && dataset_veclen!=veclen_) {
+    			throw FLANNException("The dataset provided has a different dimensionality than the saved index.");
     		}
     	}
 
@@ -286,7 +416,17 @@ public:
     	if (removed_) {
     		ar & removed_points_;
     	}
-    	ar & removed_count_;
+    	size_t removed_count = removed_count_;
+    	ar & removed_count;
+    	removed_count_ = removed_count;
+
+    	if (Archive::is_loading::value) {
+    		clearIdIndex();
+    		for (size_t i=0;i<ids_.size();++i) {
+    			setIdIndex(ids_[i], i);
+    		}
+    		compacted_count_ = 0;
+    	}
     }
 
 
@@ -318,15 +458,17 @@ public:
     		use_heap = (params.use_heap==FLANN_True)?true:false;
     	}
     	int count = 0;
+    	Deadline deadline(params.batch_time_budget_us);
 
     	if (use_heap) {
 #pragma omp parallel num_threads(params.cores)
     		{
     			KNNResultSet2<DistanceType> resultSet(knn);
+    			SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     			for (int i = 0; i < (int)queries.rows; i++) {
     				resultSet.clear();
-    				findNeighbors(resultSet, queries[i], params);
+    				findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     				size_t n = std::min(resultSet.size(), knn);
     				resultSet.copy(indices[i], dists[i], n, params.sorted);
     				indices_to_ids(indices[i], indices[i], n);
@@ -338,10 +480,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
     		{
     			KNNSimpleResultSet<DistanceType> resultSet(knn);
+    			SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     			for (int i = 0; i < (int)queries.rows; i++) {
     				resultSet.clear();
-    				findNeighbors(resultSet, queries[i], params);
+    				findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     				size_t n = std::min(resultSet.size(), knn);
     				resultSet.copy(indices[i], dists[i], n, params.sorted);
     				indices_to_ids(indices[i], indices[i], n);
@@ -407,14 +550,16 @@ public:
 		if (dists.size() < queries.rows ) dists.resize(queries.rows);
 
 		int count = 0;
+		Deadline deadline(params.batch_time_budget_us);
 		if (use_heap) {
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNResultSet2<DistanceType> resultSet(knn);
+				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -430,10 +575,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
 			{
 				KNNSimpleResultSet<DistanceType> resultSet(knn);
+				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
 				for (int i = 0; i < (int)queries.rows; i++) {
 					resultSet.clear();
-					findNeighbors(resultSet, queries[i], params);
+					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
 					size_t n = std::min(resultSet.size(), knn);
 					indices[i].resize(n);
 					dists[i].resize(n);
@@ -492,6 +638,7 @@ public:
     {
     	assert(queries.cols == veclen());
     	int count = 0;
+    	Deadline deadline(params.batch_time_budget_us);
     	size_t num_neighbors = std::min(indices.cols, dists.cols);
     	int max_neighbors = params.max_neighbors;
     	if (max_neighbors<0) max_neighbors = num_neighbors;
@@ -501,10 +648,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
     		{
     			CountRadiusResultSet<DistanceType> resultSet(radius);
+    			SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     			for (int i = 0; i < (int)queries.rows; i++) {
     				resultSet.clear();
-    				findNeighbors(resultSet, queries[i], params);
+    				findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     				count += resultSet.size();
     			}
     		}
@@ -516,10 +664,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
     			{
     				RadiusResultSet<DistanceType> resultSet(radius);
+    				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     				for (int i = 0; i < (int)queries.rows; i++) {
     					resultSet.clear();
-    					findNeighbors(resultSet, queries[i], params);
+    					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     					size_t n = resultSet.size();
     					count += n;
     					if (n>num_neighbors) n = num_neighbors;
@@ -537,10 +686,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
     			{
     				KNNRadiusResultSet<DistanceType> resultSet(radius, max_neighbors);
+    				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     				for (int i = 0; i < (int)queries.rows; i++) {
     					resultSet.clear();
-    					findNeighbors(resultSet, queries[i], params);
+    					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     					size_t n = resultSet.size();
     					count += n;
     					if ((int)n>max_neighbors) n = max_neighbors;
@@ -602,15 +752,17 @@ public:
     {
         assert(queries.cols == veclen());
     	int count = 0;
+    	Deadline deadline(params.batch_time_budget_us);
     	// just count neighbors
     	if (params.max_neighbors==0) {
 #pragma omp parallel num_threads(params.cores)
     		{
     			CountRadiusResultSet<DistanceType> resultSet(radius);
+    			SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     			for (int i = 0; i < (int)queries.rows; i++) {
     				resultSet.clear();
-    				findNeighbors(resultSet, queries[i], params);
+    				findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     				count += resultSet.size();
     			}
     		}
@@ -624,10 +776,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
     			{
     				RadiusResultSet<DistanceType> resultSet(radius);
+    				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     				for (int i = 0; i < (int)queries.rows; i++) {
     					resultSet.clear();
-    					findNeighbors(resultSet, queries[i], params);
+    					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     					size_t n = resultSet.size();
     					count += n;
     					indices[i].resize(n);
@@ -644,10 +797,11 @@ public:
 #pragma omp parallel num_threads(params.cores)
     			{
     				KNNRadiusResultSet<DistanceType> resultSet(radius, params.max_neighbors);
+    				SearchStatisticsBuffer stats_buffer(params.stats);
 #pragma omp for schedule(static) reduction(+:count)
     				for (int i = 0; i < (int)queries.rows; i++) {
     					resultSet.clear();
-    					findNeighbors(resultSet, queries[i], params);
+    					findNeighborsWithDeadline(resultSet, queries[i], i, params, deadline, stats_buffer);
     					size_t n = resultSet.size();
     					count += n;
     					if ((int)n>params.max_neighbors) n = params.max_neighbors;
@@ -694,6 +848,42 @@ public:
 
 protected:
 
+    /**
+     * Searches the neighbors of one query of a batch, stopping the search at the
+     * time budget of the query or at the deadline of the batch, whichever comes first.
+     * Records the statistics of the search if requested.
+     * @param result Result set receiving the neighbors found
+     * @param vec The query point
+     * @param i Position of the query in the batch
+     * @param params Search parameters
+     * @param deadline Deadline of the whole batch
+     * @param stats_buffer Statistics of the searches of the calling thread
+     */
+    void findNeighborsWithDeadline(ResultSet<DistanceType>& result, const ElementType* vec, size_t i,
+    		const SearchParams& params, const Deadline& deadline, SearchStatisticsBuffer& stats_buffer) const
+    {
+    	result.setDeadline(Deadline(params.time_budget_us, deadline));
+#ifdef FLANN_SEARCH_STATS
+    	if (params.stats!=NULL) {
+    		SearchStats stats;
+    		result.setStats(&stats);
+    		double start = Deadline::now();
+    		findNeighbors(result, vec, params);
+    		stats.counters[SearchStats::ELAPSED_US] = size_t((Deadline::now()-start)*1e6);
+    		result.setStats(NULL);
+    		stats_buffer.add(stats);
+    	}
+    	else {
+    		findNeighbors(result, vec, params);
+    	}
+#else
+    	findNeighbors(result, vec, params);
+#endif
+    	if (params.timed_out!=NULL) {
+    		params.timed_out[i] = result.timedOut();
+    	}
+    }
+
     virtual void freeIndex() = 0;
 
     virtual void buildIndexImpl() = 0;
@@ -703,30 +893,47 @@ protected:
     	if (ids_.size()==0) {
     		return id;
     	}
-    	size_t point_index = size_t(-1);
-    	if (id < ids_.size() && ids_[id]==id) {
-    		return id;
+    	if (hashed_ids_) {
+    		typename std::unordered_map<size_t,size_t>::const_iterator it = id_index_map_.find(id);
+    		return (it!=id_index_map_.end()) ? it->second : size_t(-1);
     	}
-    	else {
-    		// binary search
-    		size_t start = 0;
-    		size_t end = ids_.size();
-
-    		while (start<end) {
-    			size_t mid = (start+end)/2;
-    			if (ids_[mid]==id) {
-    				point_index = mid;
-    				break;
-    			}
-    			else if (ids_[mid]<id) {
-    				start = mid + 1;
-    			}
-    			else {
-    				end = mid;
+    	return (id<id_index_.size()) ? id_index_[id] : size_t(-1);
+    }
+
+    /**
+     * Sets the index of a point id in the id index, size_t(-1) removes the id.
+     * Ids are indexed directly while they are dense enough, hashed otherwise.
+     */
+    void setIdIndex(size_t id, size_t index)
+    {
+    	if (!hashed_ids_ && id>=id_index_.size()) {
+    		if (index==size_t(-1)) return;
+    		if (id<2*(size_+1024)) {
+    			id_index_.resize(std::max(id+1, 2*id_index_.size()), size_t(-1));
+    		}
+    		else {
+    			for (size_t i=0;i<id_index_.size();++i) {
+    				if (id_index_[i]!=size_t(-1)) id_index_map_[i] = id_index_[i];
     			}
+    			std::vector<size_t>().swap(id_index_);
+    			hashed_ids_ = true;
     		}
     	}
-    	return point_index;
+
+    	if (hashed_ids_) {
+    		if (index==size_t(-1)) id_index_map_.erase(id);
+    		else id_index_map_[id] = index;
+    	}
+    	else {
+    		id_index_[id] = index;
+    	}
+    }
+
+    void clearIdIndex()
+    {
+    	std::vector<size_t>().swap(id_index_);
+    	id_index_map_.clear();
+    	hashed_ids_ = false;
     }
 
 
@@ -746,9 +953,11 @@ protected:
     	last_id_ = 0;
 
     	ids_.clear();
+    	clearIdIndex();
     	removed_points_.clear();
     	removed_ = false;
     	removed_count_ = 0;
+    	compacted_count_ = 0;
 
     	points_.resize(size_);
     	for (size_t i=0;i<size_;++i) {
@@ -767,7 +976,14 @@ protected:
     	for (size_t i=size_;i<new_size;++i) {
     		points_[i] = new_points[i-size_];
     		if (removed_) {
-    			ids_[i] = last_id_++;
+    			if (pending_ids_) {
+    				ids_[i] = pending_ids_[i-size_];
+    				last_id_ = std::max(last_id_, ids_[i]+1);
+    			}
+    			else {
+    				ids_[i] = last_id_++;
+    			}
+    			setIdIndex(ids_[i], i);
     			removed_points_.reset(i);
     		}
     	}
@@ -784,15 +1000,20 @@ protected:
     		if (!removed_points_.test(i)) {
     			points_[last_idx] = points_[i];
     			ids_[last_idx] = ids_[i];
+    			setIdIndex(ids_[last_idx], last_idx);
     			removed_points_.reset(last_idx);
     			++last_idx;
     		}
+    		else {
+    			setIdIndex(ids_[i], size_t(-1));
+    		}
     	}
     	points_.resize(last_idx);
     	ids_.resize(last_idx);
     	removed_points_.resize(last_idx);
     	size_ = last_idx;
     	removed_count_ = 0;
+    	compacted_count_ = 0;
     }
 
     void swap(NNIndex& other)
@@ -805,8 +1026,12 @@ protected:
     	std::swap(index_params_, other.index_params_);
     	std::swap(removed_, other.removed_);
     	std::swap(removed_points_, other.removed_points_);
-    	std::swap(removed_count_, other.removed_count_);
+    	removed_count_ = other.removed_count_.exchange(removed_count_);
+    	std::swap(compacted_count_, other.compacted_count_);
     	std::swap(ids_, other.ids_);
+    	std::swap(id_index_, other.id_index_);
+    	std::swap(id_index_map_, other.id_index_map_);
+    	std::swap(hashed_ids_, other.hashed_ids_);
     	std::swap(points_, other.points_);
     	std::swap(data_ptr_, other.data_ptr_);
     }
@@ -857,15 +1082,41 @@ protected:
     DynamicBitset removed_points_;
 
     /**
-     * Number of points removed from the index
+     * Number of points removed from the index, atomic since size() may be read
+     * by searching threads while markRemoved() runs
+     */
+    std::atomic<size_t> removed_count_;
+
+    /**
+     * Number of removed points already dropped from the index structure
      */
-    size_t removed_count_;
+    size_t compacted_count_;
 
     /**
      * Array of point IDs, returned by nearest-neighbour operations
      */
     std::vector<size_t> ids_;
 
+    /**
+     * Index of each point ID, directly indexed by ID (size_t(-1) for unused IDs)...
+     */
+    std::vector<size_t> id_index_;
+
+    /**
+     * ...or hashed, when the IDs are too sparse
+     */
+    std::unordered_map<size_t, size_t> id_index_map_;
+
+    /**
+     * Flag indicating if the ID index is hashed
+     */
+    bool hashed_ids_;
+
+    /**
+     * IDs of the points being added by addPoints(), NULL to assign them sequentially
+     */
+    const size_t* pending_ids_;
+
     /**
      * Point data
      */
@@ -893,7 +1144,8 @@ protected:
 		using NNIndex<Distance>::extendDataset;\
 		using NNIndex<Distance>::setDataset;\
 		using NNIndex<Distance>::cleanRemovedPoints;\
-		using NNIndex<Distance>::indices_to_ids;
+		using NNIndex<Distance>::indices_to_ids;\
+		using NNIndex<Distance>::findNeighborsWithDeadline;
 
 
 
@@ -0,0 +1,845 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_SHARDED_INDEX_H_
+#define FLANN_SHARDED_INDEX_H_
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "flann/general.h"
+#include "flann/algorithms/nn_index.h"
+#include "flann/algorithms/center_chooser.h"
+#include "flann/algorithms/kdtree_index.h"
+#include "flann/util/dynamic_bitset.h"
+#include "flann/util/heap.h"
+#include "flann/util/matrix.h"
+#include "flann/util/random.h"
+#include "flann/util/result_set.h"
+#include "flann/util/saving.h"
+
+namespace flann
+{
+
+template<typename Distance>
+inline NNIndex<Distance>*
+  create_index_by_type(const flann_algorithm_t index_type,
+        const Matrix<typename Distance::ElementType>& dataset, const IndexParams& params, const Distance& distance);
+
+
+/**
+ * Index parameters for the ShardedIndex.
+ *
+ * The parameters of the shard indexes are stored with a "shard:" prefix, or
+ * with a "shard<i>:" prefix for the parameters of shard i only, so that the
+ * shards can use different algorithms.
+ */
+struct ShardedIndexParams : public IndexParams
+{
+    ShardedIndexParams(int shards = 4, flann_partition_t partition = FLANN_PARTITION_RANDOM,
+                       const IndexParams& shard_params = KDTreeIndexParams(), int cores = 0)
+    {
+        (*this)["algorithm"] = FLANN_INDEX_SHARDED;
+        // number of shards the dataset is split into
+        (*this)["shards"] = shards;
+        // how the points are assigned to the shards (random, k-means or range)
+        (*this)["partition"] = partition;
+        // number of shards built in parallel (0 for auto)
+        (*this)["cores"] = cores;
+        setShardParams(shard_params);
+    }
+
+    /**
+     * Sets the index parameters of all the shards.
+     */
+    void setShardParams(const IndexParams& params)
+    {
+        for (IndexParams::const_iterator it = params.begin(); it!=params.end(); ++it) {
+            (*this)["shard:"+it->first] = it->second;
+        }
+    }
+
+    /**
+     * Sets the index parameters of one shard, overriding those of all the shards.
+     */
+    void setShardParams(int shard, const IndexParams& params)
+    {
+        std::ostringstream prefix;
+        prefix << "shard" << shard << ":";
+        for (IndexParams::const_iterator it = params.begin(); it!=params.end(); ++it) {
+            (*this)[prefix.str()+it->first] = it->second;
+        }
+    }
+};
+
+
+/**
+ * Result set used to search a shard: maps the indices of the shard points to
+ * indices in the sharded index, skips the removed points and passes the
+ * neighbors on to the result set of the query.
+ */
+template <typename DistanceType>
+class ShardResultSet : public ResultSet<DistanceType>
+{
+public:
+    ShardResultSet(ResultSet<DistanceType>& target) : target_(&target), indices_(NULL), removed_(NULL)
+    {
+    }
+
+    /**
+     * Sets the shard searched next.
+     * @param indices Index in the sharded index of each shard point
+     * @param removed The removed points of the sharded index, NULL if none were removed
+     */
+    void setShard(const size_t* indices, const DynamicBitset* removed)
+    {
+        indices_ = indices;
+        removed_ = removed;
+    }
+
+    bool full() const
+    {
+        return target_->full();
+    }
+
+    void addPoint(DistanceType dist, size_t index)
+    {
+        size_t point = indices_[index];
+        if (removed_!=NULL && removed_->test(point)) {
+            FLANN_SEARCH_STAT(*this, REMOVED_SKIPS, 1);
+            return;
+        }
+        target_->addPoint(dist, point);
+    }
+
+    DistanceType worstDist() const
+    {
+        return target_->worstDist();
+    }
+
+private:
+    ResultSet<DistanceType>* target_;
+    const size_t* indices_;
+    const DynamicBitset* removed_;
+};
+
+
+/**
+ * In-process sharded index. The dataset is partitioned (randomly, by k-means
+ * clustering or by ranges of the coordinate of highest variance) and each shard
+ * gets its own copy of its points and its own index, built in parallel. A batch
+ * of queries is searched in all the shards concurrently and the per-shard
+ * neighbors of each query are merged with a tournament tree.
+ *
+ * The shards are built and searched in shard major order, so that each thread
+ * mostly works on the same shard, whose points it touched first: on NUMA
+ * machines they are allocated on its node.
+ */
+template <typename Distance>
+class ShardedIndex : public NNIndex<Distance>
+{
+public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType DistanceType;
+
+    typedef NNIndex<Distance> BaseClass;
+
+    ShardedIndex(const IndexParams& params = ShardedIndexParams(), Distance d = Distance()) :
+        BaseClass(params, d)
+    {
+        shard_count_ = get_param(index_params_, "shards", 4);
+        partition_ = get_param(index_params_, "partition", FLANN_PARTITION_RANDOM);
+        cores_ = get_param(index_params_, "cores", 0);
+        range_dim_ = 0;
+    }
+
+    ShardedIndex(const Matrix<ElementType>& dataset, const IndexParams& params = ShardedIndexParams(),
+                 Distance d = Distance()) : BaseClass(params, d)
+    {
+        shard_count_ = get_param(index_params_, "shards", 4);
+        partition_ = get_param(index_params_, "partition", FLANN_PARTITION_RANDOM);
+        cores_ = get_param(index_params_, "cores", 0);
+        range_dim_ = 0;
+
+        setDataset(dataset);
+    }
+
+    /**
+     * The shard indexes are cloned, their points are shared as they are never
+     * modified once copied.
+     */
+    ShardedIndex(const ShardedIndex& other) : BaseClass(other),
+        shard_count_(other.shard_count_),
+        partition_(other.partition_),
+        cores_(other.cores_),
+        shard_points_(other.shard_points_),
+        shard_blocks_(other.shard_blocks_),
+        centers_(other.centers_),
+        range_dim_(other.range_dim_),
+        range_bounds_(other.range_bounds_)
+    {
+        shards_.resize(other.shards_.size());
+        for (size_t i=0;i<shards_.size();++i) {
+            shards_[i] = other.shards_[i] ? other.shards_[i]->clone() : NULL;
+        }
+    }
+
+    ShardedIndex& operator=(ShardedIndex other)
+    {
+        this->swap(other);
+        return *this;
+    }
+
+    virtual ~ShardedIndex()
+    {
+        freeIndex();
+    }
+
+    BaseClass* clone() const
+    {
+        return new ShardedIndex(*this);
+    }
+
+    using BaseClass::buildIndex;
+    using BaseClass::addPoints;
+    using BaseClass::knnSearch;
+
+    void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
+    {
+        assert(points.cols==veclen_);
+        size_t old_size = size_;
+
+        extendDataset(points);
+
+        if (shards_.empty() || (rebuild_threshold>1 && size_at_build_*rebuild_threshold<size_)) {
+            buildIndex();
+            return;
+        }
+
+        std::vector<std::vector<size_t> > added(shards_.size());
+        for (size_t i=old_size;i<size_;++i) {
+            added[assignShard(points_[i])].push_back(i);
+        }
+        for (size_t s=0;s<shards_.size();++s) {
+            if (added[s].empty()) continue;
+            Matrix<ElementType> block = copyPoints(s, added[s]);
+            shard_points_[s].insert(shard_points_[s].end(), added[s].begin(), added[s].end());
+            if (shards_[s]==NULL) {
+                shards_[s] = create_index_by_type<Distance>(shardAlgorithm(s), block, shardParams(s), distance_);
+                shards_[s]->buildIndex();
+            }
+            else {
+                shards_[s]->addPoints(block, rebuild_threshold);
+            }
+        }
+    }
+
+    flann_algorithm_t getType() const
+    {
+        return FLANN_INDEX_SHARDED;
+    }
+
+    /**
+     * @return The number of shards
+     */
+    size_t shards() const
+    {
+        return shards_.size();
+    }
+
+    /**
+     * @return The index of a shard, NULL if the shard has no points
+     */
+    const BaseClass* shard(size_t i) const
+    {
+        return shards_[i];
+    }
+
+    size_t usedMemory() const
+    {
+        size_t memory = 0;
+        for (size_t s=0;s<shards_.size();++s) {
+            if (shards_[s]) memory += shards_[s]->usedMemory();
+            memory += shard_points_[s].size()*(veclen_*sizeof(ElementType)+sizeof(size_t));
+        }
+        return memory;
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar.setObject(this);
+
+        ar & *static_cast<NNIndex<Distance>*>(this);
+
+        ar & shard_count_;
+        ar & partition_;
+        ar & shard_points_;
+        ar & range_dim_;
+        ar & range_bounds_;
+
+        size_t centers = centers_.size();
+        ar & centers;
+        if (Archive::is_loading::value) {
+            centers_.resize(centers);
+        }
+        for (size_t i=0;i<centers;++i) {
+            if (Archive::is_loading::value) {
+                centers_[i].resize(veclen_);
+            }
+            ar & serialization::make_binary_object(&centers_[i][0], veclen_*sizeof(ElementType));
+        }
+
+        // the algorithm of each shard, -1 for the shards without points
+        std::vector<int> shard_types;
+        if (Archive::is_saving::value) {
+            for (size_t s=0;s<shards_.size();++s) {
+                shard_types.push_back(shards_[s] ? int(shards_[s]->getType()) : -1);
+            }
+        }
+        ar & shard_types;
+
+        if (Archive::is_loading::value) {
+            index_params_["algorithm"] = getType();
+            index_params_["shards"] = shard_count_;
+            index_params_["partition"] = partition_;
+
+            // the shard indexes follow, their points are copied from the dataset
+            shards_.assign(shard_types.size(), NULL);
+            shard_blocks_.assign(shard_types.size(), std::vector<std::shared_ptr<ElementType> >());
+            for (size_t s=0;s<shard_types.size();++s) {
+                if (shard_types[s]<0) continue;
+                Matrix<ElementType> block = copyPoints(s, shard_points_[s]);
+                shards_[s] = create_index_by_type<Distance>((flann_algorithm_t)shard_types[s], block, shardParams(s), distance_);
+            }
+        }
+    }
+
+    void saveIndex(FILE* stream)
+    {
+        {
+            serialization::SaveArchive sa(stream);
+            sa & *this;
+        }
+        for (size_t s=0;s<shards_.size();++s) {
+            if (shards_[s]) {
+                shards_[s]->saveIndex(stream);
+            }
+        }
+    }
+
+    void loadIndex(FILE* stream)
+    {
+        freeIndex();
+        {
+            serialization::LoadArchive la(stream);
+            la & *this;
+        }
+        for (size_t s=0;s<shards_.size();++s) {
+            if (shards_[s]) {
+                shards_[s]->loadIndex(stream);
+            }
+        }
+    }
+
+    /**
+     * Searches the queries in all the shards concurrently, in shard major order,
+     * and merges the neighbors found in the shards. The per query time budget
+     * applies to the search of each shard.
+     */
+    int knnSearch(const Matrix<ElementType>& queries,
+                  Matrix<size_t>& indices,
+                  Matrix<DistanceType>& dists,
+                  size_t knn,
+                  const SearchParams& params) const
+    {
+        assert(queries.cols == veclen_);
+        assert(indices.rows >= queries.rows);
+        assert(dists.rows >= queries.rows);
+        assert(indices.cols >= knn);
+        assert(dists.cols >= knn);
+
+        std::vector<size_t> counts;
+        return searchShards(queries, indices, dists, counts, knn, params);
+    }
+
+    int knnSearch(const Matrix<ElementType>& queries,
+                  std::vector< std::vector<size_t> >& indices,
+                  std::vector<std::vector<DistanceType> >& dists,
+                  size_t knn,
+                  const SearchParams& params) const
+    {
+        assert(queries.cols == veclen_);
+        Matrix<size_t> indices_(new size_t[queries.rows*knn], queries.rows, knn);
+        Matrix<DistanceType> dists_(new DistanceType[queries.rows*knn], queries.rows, knn);
+        std::vector<size_t> counts;
+        int count = searchShards(queries, indices_, dists_, counts, knn, params);
+
+        if (indices.size() < queries.rows ) indices.resize(queries.rows);
+        if (dists.size() < queries.rows ) dists.resize(queries.rows);
+        for (size_t i=0;i<queries.rows;++i) {
+            indices[i].assign(indices_[i], indices_[i]+counts[i]);
+            dists[i].assign(dists_[i], dists_[i]+counts[i]);
+        }
+        delete[] indices_.ptr();
+        delete[] dists_.ptr();
+        return count;
+    }
+
+    /**
+     * Searches the shards one after the other, used by the radius searches.
+     */
+    void findNeighbors(ResultSet<DistanceType>& result, const ElementType* vec, const SearchParams& searchParams) const
+    {
+        ShardResultSet<DistanceType> shardResult(result);
+        for (size_t s=0;s<shards_.size();++s) {
+            if (shards_[s]==NULL) continue;
+            shardResult.copySearchState(result);
+            shardResult.setShard(&shard_points_[s][0], removed_ ? &removed_points_ : NULL);
+            shards_[s]->findNeighbors(shardResult, vec, searchParams);
+            result.copySearchState(shardResult);
+        }
+    }
+
+protected:
+    void buildIndexImpl()
+    {
+        if (shard_count_<1) {
+            throw FLANNException("The number of shards must be at least 1");
+        }
+        std::vector<size_t> indices(size_);
+        for (size_t i=0;i<size_;++i) indices[i] = i;
+
+        shard_points_.assign(shard_count_, std::vector<size_t>());
+        centers_.clear();
+        range_bounds_.clear();
+        if (partition_==FLANN_PARTITION_KMEANS) {
+            chooseCenters();
+            for (size_t i=0;i<size_;++i) {
+                shard_points_[assignShard(points_[i])].push_back(i);
+            }
+        }
+        else if (partition_==FLANN_PARTITION_RANGE) {
+            chooseRanges(indices);
+            for (size_t i=0;i<size_;++i) {
+                shard_points_[(i*shard_count_)/size_].push_back(indices[i]);
+            }
+        }
+        else {
+            // seeded from rand(), so seed_random() makes the partition reproducible
+            std::mt19937 g(rand_int());
+            std::shuffle(indices.begin(), indices.end(), g);
+            for (size_t i=0;i<size_;++i) {
+                shard_points_[i%shard_count_].push_back(indices[i]);
+            }
+        }
+
+        // the indexes are created serially, as creating them may throw, and the
+        // points are copied by the thread building the shard
+        shards_.assign(shard_count_, NULL);
+        shard_blocks_.assign(shard_count_, std::vector<std::shared_ptr<ElementType> >());
+        std::vector<Matrix<ElementType> > blocks(shard_count_);
+        for (int s=0;s<shard_count_;++s) {
+            if (shard_points_[s].empty()) continue;
+            size_t rows = shard_points_[s].size();
+            shard_blocks_[s].push_back(std::shared_ptr<ElementType>(new ElementType[rows*veclen_], std::default_delete<ElementType[]>()));
+            blocks[s] = Matrix<ElementType>(shard_blocks_[s].back().get(), rows, veclen_);
+            shards_[s] = create_index_by_type<Distance>(shardAlgorithm(s), blocks[s], shardParams(s), distance_);
+        }
+
+        int cores = cores_;
+#ifdef _OPENMP
+        if (cores <= 0) cores = omp_get_max_threads();
+#endif
+        std::string error;
+#pragma omp parallel for schedule(static, 1) num_threads(std::max(cores, 1))
+        for (int s=0;s<shard_count_;++s) {
+            if (shards_[s]==NULL) continue;
+            for (size_t i=0;i<shard_points_[s].size();++i) {
+                std::copy(points_[shard_points_[s][i]], points_[shard_points_[s][i]]+veclen_, blocks[s][i]);
+            }
+            try {
+                shards_[s]->buildIndex();
+            }
+            catch (const std::exception& e) {
+#pragma omp critical (sharded_build_error)
+                error = e.what();
+            }
+        }
+        if (!error.empty()) {
+            throw FLANNException(error);
+        }
+    }
+
+    void freeIndex()
+    {
+        for (size_t s=0;s<shards_.size();++s) {
+            delete shards_[s];
+        }
+        shards_.clear();
+        shard_blocks_.clear();
+    }
+
+private:
+    typedef DistanceIndex<DistanceType> DistIndex;
+
+    /**
+     * The neighbors found for each query in each shard, in shard major order
+     */
+    struct ShardResults
+    {
+        ShardResults(size_t searches, size_t knn) :
+            neighbors(searches*knn, DistIndex(0, 0)), counts(searches, 0), timed_out(searches, 0)
+        {
+        }
+
+        std::vector<DistIndex> neighbors;
+        std::vector<size_t> counts;
+        std::vector<char> timed_out;
+#ifdef FLANN_SEARCH_STATS
+        std::vector<SearchStats> stats;
+#endif
+    };
+
+    int searchShards(const Matrix<ElementType>& queries, Matrix<size_t>& indices, Matrix<DistanceType>& dists,
+                     std::vector<size_t>& counts, size_t knn, const SearchParams& params) const
+    {
+        size_t rows = queries.rows;
+        size_t shards = shards_.size();
+        ShardResults results(shards*rows, knn);
+#ifdef FLANN_SEARCH_STATS
+        if (params.stats!=NULL) results.stats.resize(shards*rows);
+#endif
+        bool use_heap;
+        if (params.use_heap==FLANN_Undefined) {
+            use_heap = (knn>KNN_HEAP_THRESHOLD)?true:false;
+        }
+        else {
+            use_heap = (params.use_heap==FLANN_True)?true:false;
+        }
+        if (use_heap) {
+            searchShards<KNNResultSet2<DistanceType> >(queries, knn, params, results);
+        }
+        else {
+            searchShards<KNNSimpleResultSet<DistanceType> >(queries, knn, params, results);
+        }
+
+        counts.resize(rows);
+        int count = 0;
+#pragma omp parallel num_threads(params.cores)
+        {
+            TournamentTree<DistIndex> tree;
+            SearchStatisticsBuffer stats_buffer(params.stats);
+#pragma omp for schedule(static) reduction(+:count)
+            for (int i = 0; i < (int)rows; i++) {
+                tree.init(shards);
+                bool timed_out = false;
+#ifdef FLANN_SEARCH_STATS
+                SearchStats stats;
+#endif
+                for (size_t s=0;s<shards;++s) {
+                    size_t search = s*rows+i;
+                    const DistIndex* neighbors = &results.neighbors[search*knn];
+                    tree.setRun(s, neighbors, neighbors+results.counts[search]);
+                    timed_out = timed_out || results.timed_out[search];
+#ifdef FLANN_SEARCH_STATS
+                    if (params.stats!=NULL) {
+                        for (int c=0;c<SearchStats::COUNTERS;++c) {
+                            stats.counters[c] += results.stats[search].counters[c];
+                        }
+                    }
+#endif
+                }
+                tree.build();
+                size_t n = 0;
+                for (; n<knn && !tree.empty(); ++n) {
+                    indices[i][n] = tree.top().index_;
+                    dists[i][n] = tree.top().dist_;
+                    tree.pop();
+                }
+                indices_to_ids(indices[i], indices[i], n);
+                counts[i] = n;
+                count += n;
+                if (params.timed_out!=NULL) {
+                    params.timed_out[i] = timed_out;
+                }
+#ifdef FLANN_SEARCH_STATS
+                if (params.stats!=NULL) {
+                    stats_buffer.add(stats);
+                }
+#endif
+            }
+        }
+        return count;
+    }
+
+    template <typename ResultSetType>
+    void searchShards(const Matrix<ElementType>& queries, size_t knn, const SearchParams& params,
+                      ShardResults& results) const
+    {
+        size_t rows = queries.rows;
+        int searches = int(shards_.size()*rows);
+        Deadline deadline(params.batch_time_budget_us);
+#pragma omp parallel num_threads(params.cores)
+        {
+            ResultSetType resultSet(knn);
+            ShardResultSet<DistanceType> shardResult(resultSet);
+            std::vector<size_t> indices(knn);
+            std::vector<DistanceType> dists(knn);
+#pragma omp for schedule(static)
+            for (int search = 0; search < searches; search++) {
+                size_t s = search/rows;
+                size_t i = search%rows;
+                if (shards_[s]==NULL) continue;
+                resultSet.clear();
+                shardResult.setShard(&shard_points_[s][0], removed_ ? &removed_points_ : NULL);
+                shardResult.setDeadline(Deadline(params.time_budget_us, deadline));
+#ifdef FLANN_SEARCH_STATS
+                double start = Deadline::now();
+                shardResult.setStats(params.stats!=NULL ? &results.stats[search] : NULL);
+#endif
+                shards_[s]->findNeighbors(shardResult, queries[i], params);
+#ifdef FLANN_SEARCH_STATS
+                if (params.stats!=NULL) {
+                    results.stats[search].counters[SearchStats::ELAPSED_US] = size_t((Deadline::now()-start)*1e6);
+                }
+#endif
+                size_t n = std::min(resultSet.size(), knn);
+                if (n>0) {
+                    resultSet.copy(&indices[0], &dists[0], n, true);
+                }
+                DistIndex* neighbors = &results.neighbors[search*knn];
+                for (size_t j=0;j<n;++j) {
+                    neighbors[j] = DistIndex(dists[j], indices[j]);
+                }
+                results.counts[search] = n;
+                results.timed_out[search] = shardResult.timedOut();
+            }
+        }
+    }
+
+    /**
+     * Copies points of the dataset into a new block of shard s.
+     */
+    Matrix<ElementType> copyPoints(size_t s, const std::vector<size_t>& indices)
+    {
+        size_t rows = indices.size();
+        shard_blocks_[s].push_back(std::shared_ptr<ElementType>(new ElementType[rows*veclen_], std::default_delete<ElementType[]>()));
+        Matrix<ElementType> block(shard_blocks_[s].back().get(), rows, veclen_);
+        for (size_t i=0;i<rows;++i) {
+            std::copy(points_[indices[i]], points_[indices[i]]+veclen_, block[i]);
+        }
+        return block;
+    }
+
+    /**
+     * @return The shard a new point goes to
+     */
+    size_t assignShard(const ElementType* point) const
+    {
+        if (partition_==FLANN_PARTITION_KMEANS && !centers_.empty()) {
+            size_t best = 0;
+            DistanceType best_dist = distance_(point, &centers_[0][0], veclen_);
+            for (size_t c=1;c<centers_.size();++c) {
+                DistanceType dist = distance_(point, &centers_[c][0], veclen_);
+                if (dist<best_dist) {
+                    best_dist = dist;
+                    best = c;
+                }
+            }
+            return best;
+        }
+        else if (partition_==FLANN_PARTITION_RANGE && !range_bounds_.empty()) {
+            return std::upper_bound(range_bounds_.begin(), range_bounds_.end(), double(point[range_dim_]))-range_bounds_.begin();
+        }
+        else {
+            // the smallest shard
+            size_t best = 0;
+            for (size_t s=1;s<shard_points_.size();++s) {
+                if (shard_points_[s].size()<shard_points_[best].size()) best = s;
+            }
+            return best;
+        }
+    }
+
+    /**
+     * Chooses the shard centers by k-means clustering of a sample of the points.
+     */
+    void chooseCenters()
+    {
+        const int ITERATIONS = 5;
+        size_t sample_size = std::min(size_, size_t(shard_count_)*1000);
+        std::vector<int> sample(sample_size);
+        UniqueRandom r((int)size_);
+        for (size_t i=0;i<sample_size;++i) sample[i] = r.next();
+
+        std::vector<int> centers(shard_count_);
+        int centers_length;
+        KMeansppCenterChooser<Distance> chooser(distance_, points_);
+        chooser.setDataSize(veclen_);
+        chooser(shard_count_, &sample[0], int(sample_size), &centers[0], centers_length);
+        centers_.resize(centers_length);
+        for (int c=0;c<centers_length;++c) {
+            centers_[c].assign(points_[centers[c]], points_[centers[c]]+veclen_);
+        }
+
+        std::vector<double> sums;
+        std::vector<size_t> counts;
+        for (int iteration=0;iteration<ITERATIONS;++iteration) {
+            sums.assign(centers_.size()*veclen_, 0);
+            counts.assign(centers_.size(), 0);
+            for (size_t i=0;i<sample_size;++i) {
+                const ElementType* point = points_[sample[i]];
+                size_t c = assignShard(point);
+                for (size_t j=0;j<veclen_;++j) sums[c*veclen_+j] += point[j];
+                counts[c]++;
+            }
+            for (size_t c=0;c<centers_.size();++c) {
+                if (counts[c]==0) continue;
+                for (size_t j=0;j<veclen_;++j) {
+                    centers_[c][j] = ElementType(sums[c*veclen_+j]/counts[c]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Sorts the points by their coordinate of highest variance and records the
+     * coordinate values between the shards.
+     */
+    void chooseRanges(std::vector<size_t>& indices)
+    {
+        size_t sample_size = std::min(size_, size_t(1000));
+        std::vector<double> mean(veclen_, 0), var(veclen_, 0);
+        for (size_t i=0;i<sample_size;++i) {
+            const ElementType* point = points_[(i*size_)/sample_size];
+            for (size_t j=0;j<veclen_;++j) mean[j] += point[j];
+        }
+        for (size_t j=0;j<veclen_;++j) mean[j] /= sample_size;
+        for (size_t i=0;i<sample_size;++i) {
+            const ElementType* point = points_[(i*size_)/sample_size];
+            for (size_t j=0;j<veclen_;++j) var[j] += (point[j]-mean[j])*(point[j]-mean[j]);
+        }
+        range_dim_ = std::max_element(var.begin(), var.end())-var.begin();
+
+        std::vector<std::pair<double, size_t> > values(size_);
+        for (size_t i=0;i<size_;++i) {
+            values[i] = std::make_pair(double(points_[indices[i]][range_dim_]), indices[i]);
+        }
+        std::sort(values.begin(), values.end());
+        for (size_t i=0;i<size_;++i) {
+            indices[i] = values[i].second;
+        }
+        for (int s=1;s<shard_count_;++s) {
+            range_bounds_.push_back(values[(s*size_)/shard_count_].first);
+        }
+    }
+
+    flann_algorithm_t shardAlgorithm(size_t s) const
+    {
+        return get_param(shardParams(s), "algorithm", FLANN_INDEX_KDTREE);
+    }
+
+    /**
+     * @return The index parameters of shard s, the shards are saved with the
+     * compression of the sharded index
+     */
+    IndexParams shardParams(size_t s) const
+    {
+        IndexParams params;
+        if (has_param(index_params_, "save_compression")) {
+            params["save_compression"] = index_params_.at("save_compression");
+        }
+        std::ostringstream shard_prefix;
+        shard_prefix << "shard" << s << ":";
+        const std::string prefixes[] = { "shard:", shard_prefix.str() };
+        for (size_t p=0;p<2;++p) {
+            for (IndexParams::const_iterator it = index_params_.begin(); it!=index_params_.end(); ++it) {
+                if (it->first.compare(0, prefixes[p].size(), prefixes[p])==0) {
+                    params[it->first.substr(prefixes[p].size())] = it->second;
+                }
+            }
+        }
+        return params;
+    }
+
+    void swap(ShardedIndex& other)
+    {
+        BaseClass::swap(other);
+        std::swap(shard_count_, other.shard_count_);
+        std::swap(partition_, other.partition_);
+        std::swap(cores_, other.cores_);
+        std::swap(shards_, other.shards_);
+        std::swap(shard_points_, other.shard_points_);
+        std::swap(shard_blocks_, other.shard_blocks_);
+        std::swap(centers_, other.centers_);
+        std::swap(range_dim_, other.range_dim_);
+        std::swap(range_bounds_, other.range_bounds_);
+    }
+
+private:
+    /** Number of shards */
+    int shard_count_;
+
+    /** How the points are assigned to the shards */
+    flann_partition_t partition_;
+
+    /** Number of shards built in parallel */
+    int cores_;
+
+    /** The shard indexes, NULL for the shards without points */
+    std::vector<BaseClass*> shards_;
+
+    /** For each shard, the index in this index of each of its points */
+    std::vector<std::vector<size_t> > shard_points_;
+
+    /** For each shard, the blocks holding the copies of its points */
+    std::vector<std::vector<std::shared_ptr<ElementType> > > shard_blocks_;
+
+    /** The shard centers, for the k-means partition */
+    std::vector<std::vector<ElementType> > centers_;
+
+    /** The coordinate and its values between the shards, for the range partition */
+    size_t range_dim_;
+    std::vector<double> range_bounds_;
+
+    USING_BASECLASS_SYMBOLS
+};
+
+}
+
+#endif //FLANN_SHARDED_INDEX_H_
@@ -33,7 +33,7 @@
 #ifdef FLANN_VERSION_
 #undef FLANN_VERSION_
 #endif
-#define FLANN_VERSION_ "1.9.2"
+#define FLANN_VERSION_ "1.10.0"
 
 #ifdef FLANN_VERSION_MAJOR_
 #undef FLANN_VERSION_MAJOR_
@@ -43,12 +43,12 @@
 #ifdef FLANN_VERSION_MINOR_
 #undef FLANN_VERSION_MINOR_
 #endif
-#define FLANN_VERSION_MINOR_ 9
+#define FLANN_VERSION_MINOR_ 10
 
 #ifdef FLANN_VERSION_PATCH_
 #undef FLANN_VERSION_PATCH_
 #endif
-#define FLANN_VERSION_PATCH_ 2
+#define FLANN_VERSION_PATCH_ 0
 
 
 #endif /* FLANN_CONFIG_H_ */
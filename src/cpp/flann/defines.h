@@ -85,6 +85,7 @@ enum flann_algorithm_t
     FLANN_INDEX_KDTREE_SINGLE 	= 4,
     FLANN_INDEX_HIERARCHICAL 	= 5,
     FLANN_INDEX_LSH 			= 6,
+    FLANN_INDEX_SHARDED 		= 8,
 #ifdef FLANN_USE_CUDA
     FLANN_INDEX_KDTREE_CUDA 	= 7,
 #endif
@@ -100,6 +101,20 @@ enum flann_centers_init_t
     FLANN_CENTERS_GROUPWISE = 3,
 };
 
+enum flann_partition_t
+{
+    FLANN_PARTITION_RANDOM = 0,
+    FLANN_PARTITION_KMEANS = 1,
+    FLANN_PARTITION_RANGE = 2,
+};
+
+enum flann_precision_metric_t
+{
+    FLANN_PRECISION_AT_K = 0,
+    FLANN_RECALL_AT_K = 1,
+    FLANN_DISTANCE_RATIO = 2,
+};
+
 enum flann_log_level_t
 {
     FLANN_LOG_NONE = 0,
@@ -143,6 +158,13 @@ enum flann_datatype_t
     FLANN_FLOAT64 	= 9
 };
 
+enum flann_compression_t
+{
+    FLANN_COMPRESSION_NONE = 0,
+    FLANN_COMPRESSION_LZ4 = 1,
+    FLANN_COMPRESSION_LZ4HC = 2
+};
+
 enum flann_checks_t {
     FLANN_CHECKS_UNLIMITED = -1,
     FLANN_CHECKS_AUTOTUNED = -2,
@@ -29,6 +29,7 @@
 #define FLANN_FIRST_MATCH
 
 #include "flann.h"
+#include "flann/io/mapped_dataset.h"
 
 
 struct FLANNParameters DEFAULT_FLANN_PARAMETERS = {
@@ -38,7 +39,9 @@ struct FLANNParameters DEFAULT_FLANN_PARAMETERS = {
     4, 4,
     32, 11, FLANN_CENTERS_RANDOM, 0.2f,
     0.9f, 0.01f, 0, 0.1f,
-    FLANN_LOG_NONE, 0
+    12, 20, 2,
+    FLANN_LOG_NONE, 0,
+    (flann_distance_t)0, 3
 };
 
 
@@ -200,23 +203,330 @@ int flann_get_distance_order() {
 }
 
 
+/**
+ * Returns the distance selected by flann_params, or the default distance set
+ * with flann_set_distance_type() if flann_params doesn't select one.
+ */
+void get_distance(FLANNParameters* flann_params, flann_distance_t& distance_type, int& order)
+{
+    if (flann_params != NULL && flann_params->distance_type != 0) {
+        distance_type = flann_params->distance_type;
+        order = flann_params->distance_order;
+    }
+    else {
+        distance_type = flann_distance_type;
+        order = flann_distance_order;
+    }
+}
+
+
+namespace {
+
+/**
+ * The object a flann_index_t points to. The distance is chosen once, when the index is
+ * built or loaded, and the C functions then reach the index through the virtual functions
+ * below instead of dispatching on the distance type on every call.
+ */
+class IndexHandle
+{
+public:
+    IndexHandle(flann_distance_t distance_type) : distance_type_(distance_type) {}
+
+    virtual ~IndexHandle() {}
+
+    flann_distance_t distanceType() const { return distance_type_; }
+
+    virtual void buildIndex() = 0;
+    virtual size_t veclen() const = 0;
+    virtual size_t size() const = 0;
+    virtual size_t usedMemory() const = 0;
+    virtual void removePoint(size_t point_id) = 0;
+    virtual void save(const std::string& filename) = 0;
+    virtual IndexParams getParameters() const = 0;
+
+private:
+    flann_distance_t distance_type_;
+};
+
+/**
+ * Index handle operations that depend on the element type.
+ */
+template<typename T>
+class ElementIndexHandle : public IndexHandle
+{
+public:
+    ElementIndexHandle(flann_distance_t distance_type) : IndexHandle(distance_type) {}
+
+    virtual void addPoints(const Matrix<T>& points, float rebuild_threshold) = 0;
+    virtual T* getPoint(size_t point_id) = 0;
+};
+
+/**
+ * Index handle operations that depend on the element and the distance result types.
+ */
+template<typename T, typename R>
+class SearchIndexHandle : public ElementIndexHandle<T>
+{
+public:
+    SearchIndexHandle(flann_distance_t distance_type) : ElementIndexHandle<T>(distance_type) {}
+
+    virtual int knnSearch(const Matrix<T>& queries, Matrix<int>& indices, Matrix<R>& dists,
+                          size_t knn, const SearchParams& params) = 0;
+    virtual int radiusSearch(const Matrix<T>& queries, Matrix<int>& indices, Matrix<R>& dists,
+                             float radius, const SearchParams& params) = 0;
+    virtual int knnSearch(const Matrix<T>& queries, Matrix<size_t>& indices, Matrix<R>& dists,
+                          size_t knn, const SearchParams& params) = 0;
+    virtual int radiusSearch(const Matrix<T>& queries, Matrix<size_t>& indices, Matrix<R>& dists,
+                             float radius, const SearchParams& params) = 0;
+};
+
 template<typename Distance>
-flann_index_t __flann_build_index(typename Distance::ElementType* dataset, int rows, int cols, float* speedup,
-                                  FLANNParameters* flann_params, Distance d = Distance())
+class DistanceIndexHandle : public SearchIndexHandle<typename Distance::ElementType, typename Distance::ResultType>
 {
+public:
     typedef typename Distance::ElementType ElementType;
-    try {
+    typedef typename Distance::ResultType DistanceType;
 
-        init_flann_parameters(flann_params);
-        if (flann_params == NULL) {
-            throw FLANNException("The flann_params argument must be non-null");
+    DistanceIndexHandle(flann_distance_t distance_type, const Matrix<ElementType>& dataset,
+                        const IndexParams& params, Distance d) :
+        SearchIndexHandle<ElementType, DistanceType>(distance_type), index_(dataset, params, d)
+    {
+    }
+
+    /**
+     * Loads an index against a mapped dataset, which is kept mapped as long as the handle exists.
+     */
+    DistanceIndexHandle(flann_distance_t distance_type, const std::shared_ptr<MappedDataset<ElementType> >& mapping,
+                        const IndexParams& params, Distance d) :
+        SearchIndexHandle<ElementType, DistanceType>(distance_type), mapping_(mapping),
+        index_(mapping->matrix(), params, d)
+    {
+    }
+
+    void buildIndex() { index_.buildIndex(); }
+    size_t veclen() const { return index_.veclen(); }
+    size_t size() const { return index_.size(); }
+    size_t usedMemory() const { return index_.usedMemory(); }
+    void removePoint(size_t point_id) { index_.removePoint(point_id); }
+    void save(const std::string& filename) { index_.save(filename); }
+    IndexParams getParameters() const { return index_.getParameters(); }
+
+    void addPoints(const Matrix<ElementType>& points, float rebuild_threshold)
+    {
+        index_.addPoints(points, rebuild_threshold);
+    }
+
+    ElementType* getPoint(size_t point_id) { return index_.getPoint(point_id); }
+
+    int knnSearch(const Matrix<ElementType>& queries, Matrix<int>& indices, Matrix<DistanceType>& dists,
+                  size_t knn, const SearchParams& params)
+    {
+        return index_.knnSearch(queries, indices, dists, knn, params);
+    }
+
+    int radiusSearch(const Matrix<ElementType>& queries, Matrix<int>& indices, Matrix<DistanceType>& dists,
+                     float radius, const SearchParams& params)
+    {
+        return index_.radiusSearch(queries, indices, dists, radius, params);
+    }
+
+    int knnSearch(const Matrix<ElementType>& queries, Matrix<size_t>& indices, Matrix<DistanceType>& dists,
+                  size_t knn, const SearchParams& params)
+    {
+        return index_.knnSearch(queries, indices, dists, knn, params);
+    }
+
+    int radiusSearch(const Matrix<ElementType>& queries, Matrix<size_t>& indices, Matrix<DistanceType>& dists,
+                     float radius, const SearchParams& params)
+    {
+        return index_.radiusSearch(queries, indices, dists, radius, params);
+    }
+
+private:
+    /** Declared before index_, so the dataset is unmapped only after the index is destroyed */
+    std::shared_ptr<MappedDataset<ElementType> > mapping_;
+    Index<Distance> index_;
+};
+
+/**
+ * Returns the handle behind index_ptr as a Handle, checking that the index
+ * was built for the element (and distance result) type of the caller.
+ */
+template<typename Handle>
+Handle* get_handle(flann_index_t index_ptr)
+{
+    if (index_ptr==NULL) {
+        throw FLANNException("Invalid index");
+    }
+    Handle* handle = dynamic_cast<Handle*>(static_cast<IndexHandle*>(index_ptr));
+    if (handle==NULL) {
+        throw FLANNException("The index was built for a different element or distance type");
+    }
+    return handle;
+}
+
+/**
+ * The indexes use int point ids, the _64 functions reject the indexes they
+ * cannot hold instead of letting the ids wrap around.
+ */
+inline void check_index_size(size_t rows)
+{
+    if (rows>size_t((std::numeric_limits<int>::max)())) {
+        throw FLANNException("The index cannot hold more than INT_MAX points");
+    }
+}
+
+/**
+ * Calls visitor(distance_type, distance) with the distance functor for distance_type.
+ * This is the only place the C bindings dispatch on the distance type.
+ */
+template<typename T, typename Visitor>
+void visit_distance(flann_distance_t distance_type, int order, Visitor& visitor)
+{
+    switch (distance_type) {
+    case FLANN_DIST_EUCLIDEAN:
+        visitor(distance_type, L2<T>());
+        break;
+    case FLANN_DIST_MANHATTAN:
+        visitor(distance_type, L1<T>());
+        break;
+    case FLANN_DIST_MINKOWSKI:
+        visitor(distance_type, MinkowskiDistance<T>(order));
+        break;
+    case FLANN_DIST_HIST_INTERSECT:
+        visitor(distance_type, HistIntersectionDistance<T>());
+        break;
+    case FLANN_DIST_HELLINGER:
+        visitor(distance_type, HellingerDistance<T>());
+        break;
+    case FLANN_DIST_CHI_SQUARE:
+        visitor(distance_type, ChiSquareDistance<T>());
+        break;
+    case FLANN_DIST_KULLBACK_LEIBLER:
+        visitor(distance_type, KL_Divergence<T>());
+        break;
+    default:
+        throw FLANNException("Distance type unsupported in the C bindings, use the C++ bindings instead");
+    }
+}
+
+/**
+ * Creates the index handle for a distance chosen by visit_distance().
+ */
+template<typename T>
+struct IndexHandleFactory
+{
+    typedef SearchIndexHandle<T, typename Accumulator<T>::Type> Handle;
+
+    IndexHandleFactory(const Matrix<T>& dataset_, const IndexParams& params_) :
+        dataset(dataset_), params(params_), handle(NULL)
+    {
+    }
+
+    IndexHandleFactory(const std::shared_ptr<MappedDataset<T> >& mapping_, const IndexParams& params_) :
+        mapping(mapping_), params(params_), handle(NULL)
+    {
+    }
+
+    template<typename Distance>
+    void operator()(flann_distance_t distance_type, const Distance& d)
+    {
+        if (mapping) {
+            handle = new DistanceIndexHandle<Distance>(distance_type, mapping, params, d);
         }
-        IndexParams params = create_parameters(flann_params);
-        Index<Distance>* index = new Index<Distance>(Matrix<ElementType>(dataset,rows,cols), params, d);
-        index->buildIndex();
+        else {
+            handle = new DistanceIndexHandle<Distance>(distance_type, dataset, params, d);
+        }
+    }
+
+    Matrix<T> dataset;
+    std::shared_ptr<MappedDataset<T> > mapping;
+    IndexParams params;
+    Handle* handle;
+};
+
+template<typename T>
+struct ClusterCentersVisitor
+{
+    typedef typename Accumulator<T>::Type R;
+
+    ClusterCentersVisitor(const Matrix<T>& dataset_, const Matrix<R>& centers_, const KMeansIndexParams& params_) :
+        dataset(dataset_), centers(centers_), params(params_), clusters(0)
+    {
+    }
+
+    template<typename Distance>
+    void operator()(flann_distance_t, const Distance& d)
+    {
+        clusters = hierarchicalClustering<Distance>(dataset, centers, params, d);
+    }
+
+    Matrix<T> dataset;
+    Matrix<R> centers;
+    KMeansIndexParams params;
+    int clusters;
+};
+
+template<typename T>
+typename IndexHandleFactory<T>::Handle* create_index_handle(const Matrix<T>& dataset, const IndexParams& params,
+                                                            FLANNParameters* flann_params)
+{
+    flann_distance_t distance_type;
+    int order;
+    get_distance(flann_params, distance_type, order);
+
+    IndexHandleFactory<T> factory(dataset, params);
+    visit_distance<T>(distance_type, order, factory);
+    return factory.handle;
+}
+
+/**
+ * Maps the dataset an index was saved without. Files named *vecs are read in the
+ * .fvecs/.ivecs/.bvecs format, other files as packed rows with the number of
+ * columns recorded in the index file.
+ */
+template<typename T>
+std::shared_ptr<MappedDataset<T> > map_index_dataset(const char* filename, const char* dataset_file)
+{
+    FILE* fin = fopen(filename, "rb");
+    if (fin==NULL) {
+        throw FLANNException(std::string("Cannot open index file: ")+filename);
+    }
+    IndexHeader header;
+    try {
+        header = load_header(fin);
+    }
+    catch (...) {
+        fclose(fin);
+        throw;
+    }
+    fclose(fin);
+    if (header.h.data_type != flann_datatype_value<T>::value) {
+        throw FLANNException("Datatype of saved index is different than of the one to be loaded.");
+    }
+
+    std::shared_ptr<MappedDataset<T> > mapping(new MappedDataset<T>());
+    std::string name(dataset_file);
+    if (name.size()>=4 && name.compare(name.size()-4, 4, "vecs")==0) {
+        mapping->openVecs(name);
+    }
+    else {
+        mapping->openRaw(name, header.h.cols);
+    }
+    return mapping;
+}
+
+/**
+ * Builds the index of a new handle and copies the parameters chosen by
+ * autotuning back to flann_params. The handle is deleted if building fails.
+ */
+flann_index_t build_index_handle(IndexHandle* handle, float* speedup, FLANNParameters* flann_params)
+{
+    try {
+        handle->buildIndex();
 
         if (flann_params->algorithm==FLANN_INDEX_AUTOTUNED) {
-            IndexParams params = index->getParameters();
+            IndexParams params = handle->getParameters();
             update_flann_parameters(params,flann_params);
             SearchParams search_params = get_param<SearchParams>(params,"search_params");
             *speedup = get_param<float>(params,"speedup");
@@ -224,191 +534,231 @@ flann_index_t __flann_build_index(typename Distance::ElementType* dataset, int r
             flann_params->eps = search_params.eps;
             flann_params->cb_index = get_param<float>(params,"cb_index",0.0);
         }
+    }
+    catch (...) {
+        delete handle;
+        throw;
+    }
+    return handle;
+}
 
-        return index;
+}
+
+
+flann_distance_t flann_get_index_distance_type(flann_index_t index_ptr)
+{
+    try {
+        return get_handle<IndexHandle>(index_ptr)->distanceType();
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
-        return NULL;
+        return (flann_distance_t)0;
     }
 }
 
+
+
 template<typename T>
-flann_index_t _flann_build_index(T* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
+flann_index_t _flann_build_index(T* dataset, size_t rows, size_t cols, size_t stride, float* speedup, FLANNParameters* flann_params)
 {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_build_index<L2<T> >(dataset, rows, cols, speedup, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_build_index<L1<T> >(dataset, rows, cols, speedup, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_build_index<MinkowskiDistance<T> >(dataset, rows, cols, speedup, flann_params, MinkowskiDistance<T>(flann_distance_order));
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_build_index<HistIntersectionDistance<T> >(dataset, rows, cols, speedup, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_build_index<HellingerDistance<T> >(dataset, rows, cols, speedup, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_build_index<ChiSquareDistance<T> >(dataset, rows, cols, speedup, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_build_index<KL_Divergence<T> >(dataset, rows, cols, speedup, flann_params);
+    try {
+        init_flann_parameters(flann_params);
+        if (flann_params == NULL) {
+            throw FLANNException("The flann_params argument must be non-null");
+        }
+        check_index_size(rows);
+        IndexParams params = create_parameters(flann_params);
+        return build_index_handle(create_index_handle(Matrix<T>(dataset,rows,cols,stride), params, flann_params),
+                                  speedup, flann_params);
     }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
         return NULL;
     }
 }
 
 flann_index_t flann_build_index(float* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
 {
-    return _flann_build_index<float>(dataset, rows, cols, speedup, flann_params);
+    return _flann_build_index<float>(dataset, rows, cols, 0, speedup, flann_params);
 }
 
 flann_index_t flann_build_index_float(float* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
 {
-    return _flann_build_index<float>(dataset, rows, cols, speedup, flann_params);
+    return _flann_build_index<float>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_strided_float(float* dataset, int rows, int cols, size_t stride, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<float>(dataset, rows, cols, stride, speedup, flann_params);
 }
 
 flann_index_t flann_build_index_double(double* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
 {
-    return _flann_build_index<double>(dataset, rows, cols, speedup, flann_params);
+    return _flann_build_index<double>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_strided_double(double* dataset, int rows, int cols, size_t stride, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<double>(dataset, rows, cols, stride, speedup, flann_params);
 }
 
 flann_index_t flann_build_index_byte(unsigned char* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
 {
-    return _flann_build_index<unsigned char>(dataset, rows, cols, speedup, flann_params);
+    return _flann_build_index<unsigned char>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_strided_byte(unsigned char* dataset, int rows, int cols, size_t stride, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<unsigned char>(dataset, rows, cols, stride, speedup, flann_params);
 }
 
 flann_index_t flann_build_index_int(int* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
 {
-    return _flann_build_index<int>(dataset, rows, cols, speedup, flann_params);
+    return _flann_build_index<int>(dataset, rows, cols, 0, speedup, flann_params);
 }
 
-template <typename Distance>
-int __flann_add_points(flann_index_t index_ptr,
-                 typename Distance::ElementType* points, int rows, int columns,
-                 float rebuild_threshold) {
-    typedef typename Distance::ElementType ElementType;
+flann_index_t flann_build_index_strided_int(int* dataset, int rows, int cols, size_t stride, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<int>(dataset, rows, cols, stride, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_64_float(float* dataset, size_t rows, size_t cols, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<float>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_64_double(double* dataset, size_t rows, size_t cols, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<double>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_64_byte(unsigned char* dataset, size_t rows, size_t cols, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<unsigned char>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_64_int(int* dataset, size_t rows, size_t cols, float* speedup, FLANNParameters* flann_params)
+{
+    return _flann_build_index<int>(dataset, rows, cols, 0, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_hamming(unsigned char* dataset, int rows, int cols, float* speedup, FLANNParameters* flann_params)
+{
+    return flann_build_index_64_hamming(dataset, rows, cols, speedup, flann_params);
+}
+
+flann_index_t flann_build_index_64_hamming(unsigned char* dataset, size_t rows, size_t cols, float* speedup, FLANNParameters* flann_params)
+{
+    typedef Hamming<unsigned char> Distance;
     try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
+        init_flann_parameters(flann_params);
+        if (flann_params == NULL) {
+            throw FLANNException("The flann_params argument must be non-null");
         }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        index->addPoints(Matrix<ElementType>(points, rows, columns),
-                         rebuild_threshold);
-        return 0;
+        check_index_size(rows);
+        IndexParams params = create_parameters(flann_params);
+        return build_index_handle(new DistanceIndexHandle<Distance>(FLANN_DIST_HAMMING, Matrix<unsigned char>(dataset,rows,cols),
+                                                                    params, Distance()),
+                                  speedup, flann_params);
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
-        return -1;
+        return NULL;
     }
-    return -1;
 }
 
 template <typename T>
-int _flann_add_points(flann_index_t index_ptr, T* points, int rows, int columns,
-                float rebuild_threshold) {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_add_points<L2<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_add_points<L1<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_add_points<MinkowskiDistance<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_add_points<HistIntersectionDistance<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_add_points<HellingerDistance<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_add_points<ChiSquareDistance<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_add_points<KL_Divergence<T> >(index_ptr, points, rows, columns, rebuild_threshold);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+int _flann_add_points(flann_index_t index_ptr, T* points, size_t rows, size_t columns, size_t stride,
+                      float rebuild_threshold)
+{
+    try {
+        ElementIndexHandle<T>* handle = get_handle<ElementIndexHandle<T> >(index_ptr);
+        check_index_size(handle->size()+rows);
+        handle->addPoints(Matrix<T>(points, rows, columns, stride), rebuild_threshold);
         return 0;
     }
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
+        return -1;
+    }
 }
 
 int flann_add_points(flann_index_t index_ptr, float* points, int rows, int columns, float rebuild_threshold)
 {
-    return _flann_add_points<float>(index_ptr, points, rows, columns, rebuild_threshold);
+    return _flann_add_points<float>(index_ptr, points, rows, columns, 0, rebuild_threshold);
 }
 
 int flann_add_points_float(flann_index_t index_ptr, float* points, int rows, int columns, float rebuild_threshold)
 {
-    return _flann_add_points<float>(index_ptr, points, rows, columns, rebuild_threshold);
+    return _flann_add_points<float>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+int flann_add_points_strided_float(flann_index_t index_ptr, float* points, int rows, int columns, size_t stride, float rebuild_threshold)
+{
+    return _flann_add_points<float>(index_ptr, points, rows, columns, stride, rebuild_threshold);
 }
 
 int flann_add_points_double(flann_index_t index_ptr, double* points, int rows, int columns, float rebuild_threshold)
 {
-    return _flann_add_points<double>(index_ptr, points, rows, columns, rebuild_threshold);
+    return _flann_add_points<double>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+int flann_add_points_strided_double(flann_index_t index_ptr, double* points, int rows, int columns, size_t stride, float rebuild_threshold)
+{
+    return _flann_add_points<double>(index_ptr, points, rows, columns, stride, rebuild_threshold);
 }
 
 int flann_add_points_byte(flann_index_t index_ptr, unsigned char* points, int rows, int columns, float rebuild_threshold)
 {
-    return _flann_add_points<unsigned char>(index_ptr, points, rows, columns, rebuild_threshold);
+    return _flann_add_points<unsigned char>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+int flann_add_points_strided_byte(flann_index_t index_ptr, unsigned char* points, int rows, int columns, size_t stride, float rebuild_threshold)
+{
+    return _flann_add_points<unsigned char>(index_ptr, points, rows, columns, stride, rebuild_threshold);
 }
 
 int flann_add_points_int(flann_index_t index_ptr, int* points, int rows, int columns, float rebuild_threshold)
 {
-    return _flann_add_points<int>(index_ptr, points, rows, columns, rebuild_threshold);
+    return _flann_add_points<int>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+int flann_add_points_strided_int(flann_index_t index_ptr, int* points, int rows, int columns, size_t stride, float rebuild_threshold)
+{
+    return _flann_add_points<int>(index_ptr, points, rows, columns, stride, rebuild_threshold);
+}
+
+int flann_add_points_64_float(flann_index_t index_ptr, float* points, size_t rows, size_t columns, float rebuild_threshold)
+{
+    return _flann_add_points<float>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+int flann_add_points_64_double(flann_index_t index_ptr, double* points, size_t rows, size_t columns, float rebuild_threshold)
+{
+    return _flann_add_points<double>(index_ptr, points, rows, columns, 0, rebuild_threshold);
 }
 
-template <typename Distance>
-int __flann_remove_point(flann_index_t index_ptr, unsigned int point_id_uint) {
-    size_t point_id(point_id_uint);
+int flann_add_points_64_byte(flann_index_t index_ptr, unsigned char* points, size_t rows, size_t columns, float rebuild_threshold)
+{
+    return _flann_add_points<unsigned char>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+int flann_add_points_64_int(flann_index_t index_ptr, int* points, size_t rows, size_t columns, float rebuild_threshold)
+{
+    return _flann_add_points<int>(index_ptr, points, rows, columns, 0, rebuild_threshold);
+}
+
+template <typename T>
+int _flann_remove_point(flann_index_t index_ptr, size_t point_id)
+{
     try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        index->removePoint(point_id);
+        get_handle<ElementIndexHandle<T> >(index_ptr)->removePoint(point_id);
         return 0;
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
         return -1;
     }
-    return -1;
-}
-
-template <typename T>
-int _flann_remove_point(flann_index_t index_ptr, unsigned int point_id) {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_remove_point<L2<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_remove_point<L1<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_remove_point<MinkowskiDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_remove_point<HistIntersectionDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_remove_point<HellingerDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_remove_point<ChiSquareDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_remove_point<KL_Divergence<T> >(index_ptr, point_id);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return 0;
-    }
 }
 
 int flann_remove_point(flann_index_t index_ptr, unsigned int point_id)
@@ -436,48 +786,34 @@ int flann_remove_point_int(flann_index_t index_ptr, unsigned int point_id)
     return _flann_remove_point<int>(index_ptr, point_id);
 }
 
-template <typename Distance>
-typename Distance::ElementType* __flann_get_point(flann_index_t index_ptr,
-                                         unsigned int point_id_uint) {
-    size_t point_id(point_id_uint);
-    try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        return index->getPoint(point_id);
-    }
-    catch (std::runtime_error& e) {
-        Logger::error("Caught exception: %s\n",e.what());
-        return NULL;
-    }
+int flann_remove_point_64_float(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_remove_point<float>(index_ptr, point_id);
+}
+
+int flann_remove_point_64_double(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_remove_point<double>(index_ptr, point_id);
+}
+
+int flann_remove_point_64_byte(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_remove_point<unsigned char>(index_ptr, point_id);
+}
+
+int flann_remove_point_64_int(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_remove_point<int>(index_ptr, point_id);
 }
 
 template <typename T>
-T* _flann_get_point(flann_index_t index_ptr, unsigned int point_id) {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_get_point<L2<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_get_point<L1<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_get_point<MinkowskiDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_get_point<HistIntersectionDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_get_point<HellingerDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_get_point<ChiSquareDistance<T> >(index_ptr, point_id);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_get_point<KL_Divergence<T> >(index_ptr, point_id);
+T* _flann_get_point(flann_index_t index_ptr, size_t point_id)
+{
+    try {
+        return get_handle<ElementIndexHandle<T> >(index_ptr)->getPoint(point_id);
     }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
         return NULL;
     }
 }
@@ -507,46 +843,34 @@ int* flann_get_point_int(flann_index_t index_ptr, unsigned int point_id)
     return _flann_get_point<int>(index_ptr, point_id);
 }
 
-template <typename Distance>
-unsigned int __flann_veclen(flann_index_t index_ptr) {
-    try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        return index->veclen();
-    }
-    catch (std::runtime_error& e) {
-        Logger::error("Caught exception: %s\n",e.what());
-        return 0;
-    }
+float* flann_get_point_64_float(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_get_point<float>(index_ptr, point_id);
+}
+
+double* flann_get_point_64_double(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_get_point<double>(index_ptr, point_id);
+}
+
+unsigned char* flann_get_point_64_byte(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_get_point<unsigned char>(index_ptr, point_id);
+}
+
+int* flann_get_point_64_int(flann_index_t index_ptr, size_t point_id)
+{
+    return _flann_get_point<int>(index_ptr, point_id);
 }
 
 template <typename T>
-unsigned int _flann_veclen(flann_index_t index_ptr) {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_veclen<L2<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_veclen<L1<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_veclen<MinkowskiDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_veclen<HistIntersectionDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_veclen<HellingerDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_veclen<ChiSquareDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_veclen<KL_Divergence<T> >(index_ptr);
+unsigned int _flann_veclen(flann_index_t index_ptr)
+{
+    try {
+        return get_handle<ElementIndexHandle<T> >(index_ptr)->veclen();
     }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
         return 0;
     }
 }
@@ -576,14 +900,11 @@ unsigned int flann_veclen_int(flann_index_t index_ptr)
     return _flann_veclen<int>(index_ptr);
 }
 
-template <typename Distance>
-unsigned int __flann_size(flann_index_t index_ptr) {
+template <typename T>
+size_t _flann_size(flann_index_t index_ptr)
+{
     try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        return index->size();
+        return get_handle<ElementIndexHandle<T> >(index_ptr)->size();
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
@@ -591,68 +912,56 @@ unsigned int __flann_size(flann_index_t index_ptr) {
     }
 }
 
-template <typename T>
-unsigned int _flann_size(flann_index_t index_ptr) {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_size<L2<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_size<L1<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_size<MinkowskiDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_size<HistIntersectionDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_size<HellingerDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_size<ChiSquareDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_size<KL_Divergence<T> >(index_ptr);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return 0;
-    }
-}
-
 unsigned int flann_size(flann_index_t index_ptr)
 {
-    return _flann_size<float>(index_ptr);
+    return (unsigned int)(_flann_size<float>(index_ptr));
 }
 
 unsigned int flann_size_float(flann_index_t index_ptr)
 {
-    return _flann_size<float>(index_ptr);
+    return (unsigned int)(_flann_size<float>(index_ptr));
 }
 
 unsigned int flann_size_double(flann_index_t index_ptr)
 {
-    return _flann_size<double>(index_ptr);
+    return (unsigned int)(_flann_size<double>(index_ptr));
 }
 
 unsigned int flann_size_byte(flann_index_t index_ptr)
 {
-    return _flann_size<unsigned char>(index_ptr);
+    return (unsigned int)(_flann_size<unsigned char>(index_ptr));
 }
 
 unsigned int flann_size_int(flann_index_t index_ptr)
+{
+    return (unsigned int)(_flann_size<int>(index_ptr));
+}
+
+size_t flann_size_64_float(flann_index_t index_ptr)
+{
+    return _flann_size<float>(index_ptr);
+}
+
+size_t flann_size_64_double(flann_index_t index_ptr)
+{
+    return _flann_size<double>(index_ptr);
+}
+
+size_t flann_size_64_byte(flann_index_t index_ptr)
+{
+    return _flann_size<unsigned char>(index_ptr);
+}
+
+size_t flann_size_64_int(flann_index_t index_ptr)
 {
     return _flann_size<int>(index_ptr);
 }
 
-template <typename Distance>
-int __flann_used_memory(flann_index_t index_ptr) {
+template <typename T>
+size_t _flann_used_memory(flann_index_t index_ptr)
+{
     try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        return index->usedMemory();
+        return get_handle<ElementIndexHandle<T> >(index_ptr)->usedMemory();
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
@@ -660,105 +969,60 @@ int __flann_used_memory(flann_index_t index_ptr) {
     }
 }
 
-template <typename T>
-int _flann_used_memory(flann_index_t index_ptr) {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_used_memory<L2<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_used_memory<L1<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_used_memory<MinkowskiDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_used_memory<HistIntersectionDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_used_memory<HellingerDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_used_memory<ChiSquareDistance<T> >(index_ptr);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_used_memory<KL_Divergence<T> >(index_ptr);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return 0;
-    }
-}
-
 int flann_used_memory(flann_index_t index_ptr)
 {
-    return _flann_used_memory<float>(index_ptr);
+    return int(_flann_used_memory<float>(index_ptr));
 }
 
 int flann_used_memory_float(flann_index_t index_ptr)
 {
-    return _flann_used_memory<float>(index_ptr);
+    return int(_flann_used_memory<float>(index_ptr));
 }
 
 int flann_used_memory_double(flann_index_t index_ptr)
 {
-    return _flann_used_memory<double>(index_ptr);
+    return int(_flann_used_memory<double>(index_ptr));
 }
 
 int flann_used_memory_byte(flann_index_t index_ptr)
 {
-    return _flann_used_memory<unsigned char>(index_ptr);
+    return int(_flann_used_memory<unsigned char>(index_ptr));
 }
 
 int flann_used_memory_int(flann_index_t index_ptr)
 {
-    return _flann_used_memory<int>(index_ptr);
+    return int(_flann_used_memory<int>(index_ptr));
 }
 
-template<typename Distance>
-int __flann_save_index(flann_index_t index_ptr, char* filename)
+size_t flann_used_memory_64_float(flann_index_t index_ptr)
 {
-    try {
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
+    return _flann_used_memory<float>(index_ptr);
+}
 
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        index->save(filename);
+size_t flann_used_memory_64_double(flann_index_t index_ptr)
+{
+    return _flann_used_memory<double>(index_ptr);
+}
 
-        return 0;
-    }
-    catch (std::runtime_error& e) {
-        Logger::error("Caught exception: %s\n",e.what());
-        return -1;
-    }
+size_t flann_used_memory_64_byte(flann_index_t index_ptr)
+{
+    return _flann_used_memory<unsigned char>(index_ptr);
+}
+
+size_t flann_used_memory_64_int(flann_index_t index_ptr)
+{
+    return _flann_used_memory<int>(index_ptr);
 }
 
 template<typename T>
 int _flann_save_index(flann_index_t index_ptr, char* filename)
 {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_save_index<L2<T> >(index_ptr, filename);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_save_index<L1<T> >(index_ptr, filename);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_save_index<MinkowskiDistance<T> >(index_ptr, filename);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_save_index<HistIntersectionDistance<T> >(index_ptr, filename);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_save_index<HellingerDistance<T> >(index_ptr, filename);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_save_index<ChiSquareDistance<T> >(index_ptr, filename);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_save_index<KL_Divergence<T> >(index_ptr, filename);
+    try {
+        get_handle<ElementIndexHandle<T> >(index_ptr)->save(filename);
+        return 0;
     }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
         return -1;
     }
 }
@@ -789,13 +1053,13 @@ int flann_save_index_int(flann_index_t index_ptr, char* filename)
 }
 
 
-template<typename Distance>
-flann_index_t __flann_load_index(char* filename, typename Distance::ElementType* dataset, int rows, int cols,
-                                 Distance d = Distance())
+template<typename T>
+flann_index_t _flann_load_index(char* filename, T* dataset, size_t rows, size_t cols, FLANNParameters* flann_params)
 {
     try {
-        Index<Distance>* index = new Index<Distance>(Matrix<typename Distance::ElementType>(dataset,rows,cols), SavedIndexParams(filename), d);
-        return index;
+        init_flann_parameters(flann_params);
+        check_index_size(rows);
+        return create_index_handle(Matrix<T>(dataset,rows,cols), SavedIndexParams(filename), flann_params);
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
@@ -803,120 +1067,174 @@ flann_index_t __flann_load_index(char* filename, typename Distance::ElementType*
     }
 }
 
-template<typename T>
-flann_index_t _flann_load_index(char* filename, T* dataset, int rows, int cols)
-{
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_load_index<L2<T> >(filename, dataset, rows, cols);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_load_index<L1<T> >(filename, dataset, rows, cols);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_load_index<MinkowskiDistance<T> >(filename, dataset, rows, cols, MinkowskiDistance<T>(flann_distance_order));
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_load_index<HistIntersectionDistance<T> >(filename, dataset, rows, cols);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_load_index<HellingerDistance<T> >(filename, dataset, rows, cols);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_load_index<ChiSquareDistance<T> >(filename, dataset, rows, cols);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_load_index<KL_Divergence<T> >(filename, dataset, rows, cols);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return NULL;
-    }
-}
-
 
 flann_index_t flann_load_index(char* filename, float* dataset, int rows, int cols)
 {
-    return _flann_load_index<float>(filename, dataset, rows, cols);
+    return _flann_load_index<float>(filename, dataset, rows, cols, NULL);
 }
 
 flann_index_t flann_load_index_float(char* filename, float* dataset, int rows, int cols)
 {
-    return _flann_load_index<float>(filename, dataset, rows, cols);
+    return _flann_load_index<float>(filename, dataset, rows, cols, NULL);
 }
 
 flann_index_t flann_load_index_double(char* filename, double* dataset, int rows, int cols)
 {
-    return _flann_load_index<double>(filename, dataset, rows, cols);
+    return _flann_load_index<double>(filename, dataset, rows, cols, NULL);
 }
 
 flann_index_t flann_load_index_byte(char* filename, unsigned char* dataset, int rows, int cols)
 {
-    return _flann_load_index<unsigned char>(filename, dataset, rows, cols);
+    return _flann_load_index<unsigned char>(filename, dataset, rows, cols, NULL);
 }
 
 flann_index_t flann_load_index_int(char* filename, int* dataset, int rows, int cols)
 {
-    return _flann_load_index<int>(filename, dataset, rows, cols);
+    return _flann_load_index<int>(filename, dataset, rows, cols, NULL);
+}
+
+flann_index_t flann_load_index_with_params_float(char* filename, float* dataset, int rows, int cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<float>(filename, dataset, rows, cols, flann_params);
 }
 
+flann_index_t flann_load_index_with_params_double(char* filename, double* dataset, int rows, int cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<double>(filename, dataset, rows, cols, flann_params);
+}
 
+flann_index_t flann_load_index_with_params_byte(char* filename, unsigned char* dataset, int rows, int cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<unsigned char>(filename, dataset, rows, cols, flann_params);
+}
 
-template<typename Distance>
-int __flann_find_nearest_neighbors(typename Distance::ElementType* dataset,  int rows, int cols, typename Distance::ElementType* testset, int tcount,
-                                   int* result, typename Distance::ResultType* dists, int nn, FLANNParameters* flann_params, Distance d = Distance())
+flann_index_t flann_load_index_with_params_int(char* filename, int* dataset, int rows, int cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<int>(filename, dataset, rows, cols, flann_params);
+}
+
+flann_index_t flann_load_index_64_float(char* filename, float* dataset, size_t rows, size_t cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<float>(filename, dataset, rows, cols, flann_params);
+}
+
+flann_index_t flann_load_index_64_double(char* filename, double* dataset, size_t rows, size_t cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<double>(filename, dataset, rows, cols, flann_params);
+}
+
+flann_index_t flann_load_index_64_byte(char* filename, unsigned char* dataset, size_t rows, size_t cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<unsigned char>(filename, dataset, rows, cols, flann_params);
+}
+
+flann_index_t flann_load_index_64_int(char* filename, int* dataset, size_t rows, size_t cols, FLANNParameters* flann_params)
+{
+    return _flann_load_index<int>(filename, dataset, rows, cols, flann_params);
+}
+
+flann_index_t flann_load_index_hamming(char* filename, unsigned char* dataset, int rows, int cols)
+{
+    return flann_load_index_64_hamming(filename, dataset, rows, cols);
+}
+
+flann_index_t flann_load_index_64_hamming(char* filename, unsigned char* dataset, size_t rows, size_t cols)
+{
+    typedef Hamming<unsigned char> Distance;
+    try {
+        check_index_size(rows);
+        return new DistanceIndexHandle<Distance>(FLANN_DIST_HAMMING, Matrix<unsigned char>(dataset,rows,cols),
+                                                 SavedIndexParams(filename), Distance());
+    }
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
+        return NULL;
+    }
+}
+
+
+
+template<typename T>
+flann_index_t _flann_load_index_mapped(char* filename, char* dataset_file, FLANNParameters* flann_params)
 {
-    typedef typename Distance::ElementType ElementType;
-    typedef typename Distance::ResultType DistanceType;
     try {
         init_flann_parameters(flann_params);
+        flann_distance_t distance_type;
+        int order;
+        get_distance(flann_params, distance_type, order);
 
-        IndexParams params = create_parameters(flann_params);
-        Index<Distance>* index = new Index<Distance>(Matrix<ElementType>(dataset,rows,cols), params, d);
-        index->buildIndex();
-        Matrix<int> m_indices(result,tcount, nn);
-        Matrix<DistanceType> m_dists(dists,tcount, nn);
-        SearchParams search_params = create_search_params(flann_params);
-        index->knnSearch(Matrix<ElementType>(testset, tcount, index->veclen()),
-                         m_indices,
-                         m_dists, nn, search_params );
-        delete index;
-        return 0;
+        IndexHandleFactory<T> factory(map_index_dataset<T>(filename, dataset_file), SavedIndexParams(filename));
+        visit_distance<T>(distance_type, order, factory);
+        return factory.handle;
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
-        return -1;
+        return NULL;
     }
+}
+
+flann_index_t flann_load_index_mapped_float(char* filename, char* dataset_file, FLANNParameters* flann_params)
+{
+    return _flann_load_index_mapped<float>(filename, dataset_file, flann_params);
+}
 
-    return -1;
+flann_index_t flann_load_index_mapped_double(char* filename, char* dataset_file, FLANNParameters* flann_params)
+{
+    return _flann_load_index_mapped<double>(filename, dataset_file, flann_params);
+}
+
+flann_index_t flann_load_index_mapped_byte(char* filename, char* dataset_file, FLANNParameters* flann_params)
+{
+    return _flann_load_index_mapped<unsigned char>(filename, dataset_file, flann_params);
+}
+
+flann_index_t flann_load_index_mapped_int(char* filename, char* dataset_file, FLANNParameters* flann_params)
+{
+    return _flann_load_index_mapped<int>(filename, dataset_file, flann_params);
+}
+
+flann_index_t flann_load_index_mapped_hamming(char* filename, char* dataset_file)
+{
+    typedef Hamming<unsigned char> Distance;
+    try {
+        return new DistanceIndexHandle<Distance>(FLANN_DIST_HAMMING, map_index_dataset<unsigned char>(filename, dataset_file),
+                                                 SavedIndexParams(filename), Distance());
+    }
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
+        return NULL;
+    }
 }
 
+
+
 template<typename T, typename R>
 int _flann_find_nearest_neighbors(T* dataset,  int rows, int cols, T* testset, int tcount,
                                   int* result, R* dists, int nn, FLANNParameters* flann_params)
 {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_find_nearest_neighbors<L2<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_find_nearest_neighbors<L1<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_find_nearest_neighbors<MinkowskiDistance<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params, MinkowskiDistance<T>(flann_distance_order));
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_find_nearest_neighbors<HistIntersectionDistance<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_find_nearest_neighbors<HellingerDistance<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_find_nearest_neighbors<ChiSquareDistance<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_find_nearest_neighbors<KL_Divergence<T> >(dataset, rows, cols, testset, tcount, result, dists, nn, flann_params);
+    try {
+        init_flann_parameters(flann_params);
+
+        IndexParams params = create_parameters(flann_params);
+        SearchIndexHandle<T,R>* handle = create_index_handle(Matrix<T>(dataset,rows,cols), params, flann_params);
+        try {
+            handle->buildIndex();
+            Matrix<int> m_indices(result,tcount, nn);
+            Matrix<R> m_dists(dists,tcount, nn);
+            SearchParams search_params = create_search_params(flann_params);
+            handle->knnSearch(Matrix<T>(testset, tcount, handle->veclen()),
+                              m_indices,
+                              m_dists, nn, search_params );
+        }
+        catch (...) {
+            delete handle;
+            throw;
+        }
+        delete handle;
+        return 0;
     }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
         return -1;
     }
 }
@@ -947,27 +1265,28 @@ int flann_find_nearest_neighbors_int(int* dataset,  int rows, int cols, int* tes
 }
 
 
-template<typename Distance>
-int __flann_find_nearest_neighbors_index(flann_index_t index_ptr, typename Distance::ElementType* testset, int tcount,
-                                         int* result, typename Distance::ResultType* dists, int nn, FLANNParameters* flann_params)
+template<typename T, typename R, typename I>
+int _flann_find_nearest_neighbors_index(flann_index_t index_ptr, T* testset, size_t tcount, size_t testset_stride,
+                                        I* result, size_t result_stride, R* dists, size_t dists_stride,
+                                        size_t nn, FLANNParameters* flann_params)
 {
-    typedef typename Distance::ElementType ElementType;
-    typedef typename Distance::ResultType DistanceType;
-
     try {
         init_flann_parameters(flann_params);
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
+        SearchIndexHandle<T,R>* handle = get_handle<SearchIndexHandle<T,R> >(index_ptr);
+
+        Matrix<I> m_indices(result,tcount, nn, result_stride);
+        Matrix<R> m_dists(dists, tcount, nn, dists_stride);
 
-        Matrix<int> m_indices(result,tcount, nn);
-        Matrix<DistanceType> m_dists(dists, tcount, nn);
+        // the slots of the neighbors not found (more than the index size) are left as missing
+        for (size_t i=0;i<tcount;++i) {
+            std::fill(m_indices[i], m_indices[i]+nn, I(-1));
+            std::fill(m_dists[i], m_dists[i]+nn, (std::numeric_limits<R>::max)());
+        }
 
         SearchParams search_params = create_search_params(flann_params);
-        index->knnSearch(Matrix<ElementType>(testset, tcount, index->veclen()),
-                         m_indices,
-                         m_dists, nn, search_params );
+        handle->knnSearch(Matrix<T>(testset, tcount, handle->veclen(), testset_stride),
+                          m_indices,
+                          m_dists, nn, search_params );
 
         return 0;
     }
@@ -975,135 +1294,117 @@ int __flann_find_nearest_neighbors_index(flann_index_t index_ptr, typename Dista
         Logger::error("Caught exception: %s\n",e.what());
         return -1;
     }
-
-    return -1;
 }
 
-template<typename T, typename R>
-int _flann_find_nearest_neighbors_index(flann_index_t index_ptr, T* testset, int tcount,
-                                        int* result, R* dists, int nn, FLANNParameters* flann_params)
+int flann_find_nearest_neighbors_index(flann_index_t index_ptr, float* testset, int tcount, int* result, float* dists, int nn, FLANNParameters* flann_params)
 {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_find_nearest_neighbors_index<L2<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_find_nearest_neighbors_index<L1<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_find_nearest_neighbors_index<MinkowskiDistance<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_find_nearest_neighbors_index<HistIntersectionDistance<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_find_nearest_neighbors_index<HellingerDistance<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_find_nearest_neighbors_index<ChiSquareDistance<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_find_nearest_neighbors_index<KL_Divergence<T> >(index_ptr, testset, tcount, result, dists, nn, flann_params);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return -1;
-    }
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
 }
 
-
-int flann_find_nearest_neighbors_index(flann_index_t index_ptr, float* testset, int tcount, int* result, float* dists, int nn, FLANNParameters* flann_params)
+int flann_find_nearest_neighbors_index_float(flann_index_t index_ptr, float* testset, int tcount, int* result, float* dists, int nn, FLANNParameters* flann_params)
 {
-    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, result, dists, nn, flann_params);
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
 }
 
-int flann_find_nearest_neighbors_index_float(flann_index_t index_ptr, float* testset, int tcount, int* result, float* dists, int nn, FLANNParameters* flann_params)
+int flann_find_nearest_neighbors_index_strided_float(flann_index_t index_ptr, float* testset, int tcount, size_t testset_stride,
+                                                  int* result, size_t result_stride, float* dists, size_t dists_stride,
+                                                  int nn, FLANNParameters* flann_params)
 {
-    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, result, dists, nn, flann_params);
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, testset_stride, result, result_stride, dists, dists_stride, nn, flann_params);
 }
 
 int flann_find_nearest_neighbors_index_double(flann_index_t index_ptr, double* testset, int tcount, int* result, double* dists, int nn, FLANNParameters* flann_params)
 {
-    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, result, dists, nn, flann_params);
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
+
+int flann_find_nearest_neighbors_index_strided_double(flann_index_t index_ptr, double* testset, int tcount, size_t testset_stride,
+                                                  int* result, size_t result_stride, double* dists, size_t dists_stride,
+                                                  int nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, testset_stride, result, result_stride, dists, dists_stride, nn, flann_params);
 }
 
 int flann_find_nearest_neighbors_index_byte(flann_index_t index_ptr, unsigned char* testset, int tcount, int* result, float* dists, int nn, FLANNParameters* flann_params)
 {
-    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, result, dists, nn, flann_params);
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
+
+int flann_find_nearest_neighbors_index_strided_byte(flann_index_t index_ptr, unsigned char* testset, int tcount, size_t testset_stride,
+                                                  int* result, size_t result_stride, float* dists, size_t dists_stride,
+                                                  int nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, testset_stride, result, result_stride, dists, dists_stride, nn, flann_params);
 }
 
 int flann_find_nearest_neighbors_index_int(flann_index_t index_ptr, int* testset, int tcount, int* result, float* dists, int nn, FLANNParameters* flann_params)
 {
-    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, result, dists, nn, flann_params);
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
 }
 
+int flann_find_nearest_neighbors_index_strided_int(flann_index_t index_ptr, int* testset, int tcount, size_t testset_stride,
+                                                  int* result, size_t result_stride, float* dists, size_t dists_stride,
+                                                  int nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, testset_stride, result, result_stride, dists, dists_stride, nn, flann_params);
+}
 
-template<typename Distance>
-int __flann_radius_search(flann_index_t index_ptr,
-                          typename Distance::ElementType* query,
-                          int* indices,
-                          typename Distance::ResultType* dists,
-                          int max_nn,
-                          float radius,
-                          FLANNParameters* flann_params)
+int flann_find_nearest_neighbors_index_hamming(flann_index_t index_ptr, unsigned char* testset, int tcount, int* result, unsigned int* dists, int nn, FLANNParameters* flann_params)
 {
-    typedef typename Distance::ElementType ElementType;
-    typedef typename Distance::ResultType DistanceType;
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
 
-    try {
-        init_flann_parameters(flann_params);
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
+int flann_find_nearest_neighbors_index_64_float(flann_index_t index_ptr, float* testset, size_t tcount, size_t* result, float* dists, size_t nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
 
-        Matrix<int> m_indices(indices, 1, max_nn);
-        Matrix<DistanceType> m_dists(dists, 1, max_nn);
-        SearchParams search_params = create_search_params(flann_params);
-        int count = index->radiusSearch(Matrix<ElementType>(query, 1, index->veclen()),
-                                        m_indices,
-                                        m_dists, radius, search_params );
+int flann_find_nearest_neighbors_index_64_double(flann_index_t index_ptr, double* testset, size_t tcount, size_t* result, double* dists, size_t nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
+
+int flann_find_nearest_neighbors_index_64_byte(flann_index_t index_ptr, unsigned char* testset, size_t tcount, size_t* result, float* dists, size_t nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
 
+int flann_find_nearest_neighbors_index_64_int(flann_index_t index_ptr, int* testset, size_t tcount, size_t* result, float* dists, size_t nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
+}
 
-        return count;
-    }
-    catch (std::runtime_error& e) {
-        Logger::error("Caught exception: %s\n",e.what());
-        return -1;
-    }
+int flann_find_nearest_neighbors_index_64_hamming(flann_index_t index_ptr, unsigned char* testset, size_t tcount, size_t* result, unsigned int* dists, size_t nn, FLANNParameters* flann_params)
+{
+    return _flann_find_nearest_neighbors_index(index_ptr, testset, tcount, 0, result, 0, dists, 0, nn, flann_params);
 }
 
-template<typename T, typename R>
+
+template<typename T, typename R, typename I>
 int _flann_radius_search(flann_index_t index_ptr,
                          T* query,
-                         int* indices,
+                         I* indices,
                          R* dists,
-                         int max_nn,
+                         size_t max_nn,
                          float radius,
                          FLANNParameters* flann_params)
 {
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_radius_search<L2<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_radius_search<L1<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_radius_search<MinkowskiDistance<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_radius_search<HistIntersectionDistance<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_radius_search<HellingerDistance<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_radius_search<ChiSquareDistance<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_radius_search<KL_Divergence<T> >(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+    try {
+        init_flann_parameters(flann_params);
+        SearchIndexHandle<T,R>* handle = get_handle<SearchIndexHandle<T,R> >(index_ptr);
+
+        Matrix<I> m_indices(indices, 1, max_nn);
+        Matrix<R> m_dists(dists, 1, max_nn);
+        SearchParams search_params = create_search_params(flann_params);
+        int count = handle->radiusSearch(Matrix<T>(query, 1, handle->veclen()),
+                                         m_indices,
+                                         m_dists, radius, search_params );
+
+
+        return count;
     }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
+    catch (std::runtime_error& e) {
+        Logger::error("Caught exception: %s\n",e.what());
         return -1;
     }
 }
@@ -1163,17 +1464,79 @@ int flann_radius_search_int(flann_index_t index_ptr,
     return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
 }
 
+int flann_radius_search_hamming(flann_index_t index_ptr,
+                                unsigned char* query,
+                                int* indices,
+                                unsigned int* dists,
+                                int max_nn,
+                                float radius,
+                                FLANNParameters* flann_params)
+{
+    return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+}
 
-template<typename Distance>
-int __flann_free_index(flann_index_t index_ptr, FLANNParameters* flann_params)
+int flann_radius_search_64_float(flann_index_t index_ptr,
+                                 float* query,
+                                 size_t* indices,
+                                 float* dists,
+                                 size_t max_nn,
+                                 float radius,
+                                 FLANNParameters* flann_params)
+{
+    return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+}
+
+int flann_radius_search_64_double(flann_index_t index_ptr,
+                                  double* query,
+                                  size_t* indices,
+                                  double* dists,
+                                  size_t max_nn,
+                                  float radius,
+                                  FLANNParameters* flann_params)
+{
+    return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+}
+
+int flann_radius_search_64_byte(flann_index_t index_ptr,
+                                unsigned char* query,
+                                size_t* indices,
+                                float* dists,
+                                size_t max_nn,
+                                float radius,
+                                FLANNParameters* flann_params)
+{
+    return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+}
+
+int flann_radius_search_64_int(flann_index_t index_ptr,
+                               int* query,
+                               size_t* indices,
+                               float* dists,
+                               size_t max_nn,
+                               float radius,
+                               FLANNParameters* flann_params)
+{
+    return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+}
+
+int flann_radius_search_64_hamming(flann_index_t index_ptr,
+                                   unsigned char* query,
+                                   size_t* indices,
+                                   unsigned int* dists,
+                                   size_t max_nn,
+                                   float radius,
+                                   FLANNParameters* flann_params)
+{
+    return _flann_radius_search(index_ptr, query, indices, dists, max_nn, radius, flann_params);
+}
+
+
+int _flann_free_index(flann_index_t index_ptr, FLANNParameters* flann_params)
 {
     try {
         init_flann_parameters(flann_params);
-        if (index_ptr==NULL) {
-            throw FLANNException("Invalid index");
-        }
-        Index<Distance>* index = (Index<Distance>*)index_ptr;
-        delete index;
+        // any index can be freed, whatever the element type of the function called
+        delete get_handle<IndexHandle>(index_ptr);
 
         return 0;
     }
@@ -1183,78 +1546,49 @@ int __flann_free_index(flann_index_t index_ptr, FLANNParameters* flann_params)
     }
 }
 
-template<typename T>
-int _flann_free_index(flann_index_t index_ptr, FLANNParameters* flann_params)
-{
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_free_index<L2<T> >(index_ptr, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_free_index<L1<T> >(index_ptr, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_free_index<MinkowskiDistance<T> >(index_ptr, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_free_index<HistIntersectionDistance<T> >(index_ptr, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_free_index<HellingerDistance<T> >(index_ptr, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_free_index<ChiSquareDistance<T> >(index_ptr, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_free_index<KL_Divergence<T> >(index_ptr, flann_params);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return -1;
-    }
-}
-
 int flann_free_index(flann_index_t index_ptr, FLANNParameters* flann_params)
 {
-    return _flann_free_index<float>(index_ptr, flann_params);
+    return _flann_free_index(index_ptr, flann_params);
 }
 
 int flann_free_index_float(flann_index_t index_ptr, FLANNParameters* flann_params)
 {
-    return _flann_free_index<float>(index_ptr, flann_params);
+    return _flann_free_index(index_ptr, flann_params);
 }
 
 int flann_free_index_double(flann_index_t index_ptr, FLANNParameters* flann_params)
 {
-    return _flann_free_index<double>(index_ptr, flann_params);
+    return _flann_free_index(index_ptr, flann_params);
 }
 
 int flann_free_index_byte(flann_index_t index_ptr, FLANNParameters* flann_params)
 {
-    return _flann_free_index<unsigned char>(index_ptr, flann_params);
+    return _flann_free_index(index_ptr, flann_params);
 }
 
 int flann_free_index_int(flann_index_t index_ptr, FLANNParameters* flann_params)
 {
-    return _flann_free_index<int>(index_ptr, flann_params);
+    return _flann_free_index(index_ptr, flann_params);
 }
 
 
-template<typename Distance>
-int __flann_compute_cluster_centers(typename Distance::ElementType* dataset, int rows, int cols, int clusters,
-                                    typename Distance::ResultType* result, FLANNParameters* flann_params, Distance d = Distance())
+template<typename T, typename R>
+int _flann_compute_cluster_centers(T* dataset, int rows, int cols, int clusters, R* result, FLANNParameters* flann_params)
 {
-    typedef typename Distance::ElementType ElementType;
-    typedef typename Distance::ResultType DistanceType;
-
     try {
         init_flann_parameters(flann_params);
 
-        Matrix<ElementType> inputData(dataset,rows,cols);
+        flann_distance_t distance_type;
+        int order;
+        get_distance(flann_params, distance_type, order);
+
+        Matrix<T> inputData(dataset,rows,cols);
         KMeansIndexParams params(flann_params->branching, flann_params->iterations, flann_params->centers_init, flann_params->cb_index);
-        Matrix<DistanceType> centers(result,clusters,cols);
-        int clusterNum = hierarchicalClustering<Distance>(inputData, centers, params, d);
+        Matrix<R> centers(result,clusters,cols);
+        ClusterCentersVisitor<T> visitor(inputData, centers, params);
+        visit_distance<T>(distance_type, order, visitor);
 
-        return clusterNum;
+        return visitor.clusters;
     }
     catch (std::runtime_error& e) {
         Logger::error("Caught exception: %s\n",e.what());
@@ -1262,37 +1596,6 @@ int __flann_compute_cluster_centers(typename Distance::ElementType* dataset, int
     }
 }
 
-
-template<typename T, typename R>
-int _flann_compute_cluster_centers(T* dataset, int rows, int cols, int clusters, R* result, FLANNParameters* flann_params)
-{
-    if (flann_distance_type==FLANN_DIST_EUCLIDEAN) {
-        return __flann_compute_cluster_centers<L2<T> >(dataset, rows, cols, clusters, result, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MANHATTAN) {
-        return __flann_compute_cluster_centers<L1<T> >(dataset, rows, cols, clusters, result, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_MINKOWSKI) {
-        return __flann_compute_cluster_centers<MinkowskiDistance<T> >(dataset, rows, cols, clusters, result, flann_params, MinkowskiDistance<T>(flann_distance_order));
-    }
-    else if (flann_distance_type==FLANN_DIST_HIST_INTERSECT) {
-        return __flann_compute_cluster_centers<HistIntersectionDistance<T> >(dataset, rows, cols, clusters, result, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_HELLINGER) {
-        return __flann_compute_cluster_centers<HellingerDistance<T> >(dataset, rows, cols, clusters, result, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_CHI_SQUARE) {
-        return __flann_compute_cluster_centers<ChiSquareDistance<T> >(dataset, rows, cols, clusters, result, flann_params);
-    }
-    else if (flann_distance_type==FLANN_DIST_KULLBACK_LEIBLER) {
-        return __flann_compute_cluster_centers<KL_Divergence<T> >(dataset, rows, cols, clusters, result, flann_params);
-    }
-    else {
-        Logger::error( "Distance type unsupported in the C bindings, use the C++ bindings instead\n");
-        return -1;
-    }
-}
-
 int flann_compute_cluster_centers(float* dataset, int rows, int cols, int clusters, float* result, FLANNParameters* flann_params)
 {
     return _flann_compute_cluster_centers(dataset, rows, cols, clusters, result, flann_params);
@@ -1317,4 +1620,3 @@ int flann_compute_cluster_centers_int(int* dataset, int rows, int cols, int clus
 {
     return _flann_compute_cluster_centers(dataset, rows, cols, clusters, result, flann_params);
 }
-
@@ -31,6 +31,8 @@
 #ifndef FLANN_H_
 #define FLANN_H_
 
+#include <stddef.h>
+
 #include "defines.h"
 
 #ifdef __cplusplus
@@ -75,6 +77,10 @@ struct FLANNParameters
     /* other parameters */
     enum flann_log_level_t log_level;    /* determines the verbosity of each flann function */
     long random_seed;            /* random seed to use */
+
+    /* distance parameters */
+    enum flann_distance_t distance_type; /* distance of the index, 0 for the default set by flann_set_distance_type */
+    int distance_order;          /* order of the minkowski distance */
 };
 
 
@@ -94,9 +100,15 @@ FLANN_EXPORT void flann_log_verbosity(int level);
 
 
 /**
- * Sets the distance type to use throughout FLANN.
+ * Sets the default distance type, used when the distance_type field of
+ * FLANNParameters is 0 (and by the functions that don't take FLANNParameters,
+ * such as flann_load_index).
  * If distance type specified is MINKOWSKI, the second argument
  * specifies which order the minkowski distance should have.
+ *
+ * The distance is resolved when an index is built or loaded and is kept in
+ * the index, so changing it doesn't affect existing indexes. Prefer setting
+ * distance_type in FLANNParameters, which doesn't depend on global state.
  */
 FLANN_EXPORT void flann_set_distance_type(enum flann_distance_t distance_type, int order);
 
@@ -111,6 +123,11 @@ FLANN_EXPORT enum flann_distance_t flann_get_distance_type();
  */
 FLANN_EXPORT int flann_get_distance_order();
 
+/**
+ * Gets the distance type an index was built or loaded with.
+ */
+FLANN_EXPORT enum flann_distance_t flann_get_index_distance_type(flann_index_t index_ptr);
+
 /**
    Builds and returns an index. It uses autotuning if the target_precision field of index_params
    is between 0 and 1, or the parameters specified if it's -1.
@@ -155,6 +172,61 @@ FLANN_EXPORT flann_index_t flann_build_index_int(int* dataset,
                                                  float* speedup,
                                                  struct FLANNParameters* flann_params);
 
+/**
+  Same as flann_build_index, for a dataset whose rows are not contiguous.
+  Consecutive rows start stride bytes apart (0 means rows*cols*sizeof(element)
+  contiguous data). As with flann_build_index, the dataset is not copied and
+  must remain valid while the index is used.
+ */
+FLANN_EXPORT flann_index_t flann_build_index_strided_float(float* dataset, int rows, int cols, size_t stride,
+                                                           float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_strided_double(double* dataset, int rows, int cols, size_t stride,
+                                                            float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_strided_byte(unsigned char* dataset, int rows, int cols, size_t stride,
+                                                          float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_strided_int(int* dataset, int rows, int cols, size_t stride,
+                                                         float* speedup, struct FLANNParameters* flann_params);
+
+/**
+  Builds an index of binary features (cols bytes each) using the Hamming
+  distance. The distance_type field of flann_params is ignored and the
+  algorithm must support Hamming distances (FLANN_INDEX_LSH,
+  FLANN_INDEX_HIERARCHICAL or FLANN_INDEX_LINEAR). The other _byte functions
+  can be used with the returned index, except for searching, which is done
+  with flann_find_nearest_neighbors_index_hamming and
+  flann_radius_search_hamming.
+ */
+FLANN_EXPORT flann_index_t flann_build_index_hamming(unsigned char* dataset,
+                                                     int rows,
+                                                     int cols,
+                                                     float* speedup,
+                                                     struct FLANNParameters* flann_params);
+
+/**
+  The _64 functions are the same as the functions without the suffix, with
+  size_t counts, point ids and result indices. The indexes still use int point
+  ids, so building, loading or adding points to an index of more than INT_MAX
+  points fails. A missing neighbor (when nn is larger than the index size) is
+  reported as (size_t)-1, with the largest distance of the distance type.
+ */
+FLANN_EXPORT flann_index_t flann_build_index_64_float(float* dataset, size_t rows, size_t cols,
+                                                      float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_64_double(double* dataset, size_t rows, size_t cols,
+                                                       float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_64_byte(unsigned char* dataset, size_t rows, size_t cols,
+                                                     float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_64_int(int* dataset, size_t rows, size_t cols,
+                                                    float* speedup, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_build_index_64_hamming(unsigned char* dataset, size_t rows, size_t cols,
+                                                        float* speedup, struct FLANNParameters* flann_params);
+
 /**
   Adds points to pre-built index.
 
@@ -189,6 +261,33 @@ FLANN_EXPORT int flann_add_points_int(flann_index_t index_ptr, int* points,
                                       int rows, int columns,
                                       float rebuild_threshold);
 
+/**
+  Same as flann_add_points, for points whose rows start stride bytes apart.
+ */
+FLANN_EXPORT int flann_add_points_strided_float(flann_index_t index_ptr, float* points, int rows, int columns,
+                                                size_t stride, float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_strided_double(flann_index_t index_ptr, double* points, int rows, int columns,
+                                                 size_t stride, float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_strided_byte(flann_index_t index_ptr, unsigned char* points, int rows, int columns,
+                                               size_t stride, float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_strided_int(flann_index_t index_ptr, int* points, int rows, int columns,
+                                              size_t stride, float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_64_float(flann_index_t index_ptr, float* points, size_t rows, size_t columns,
+                                           float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_64_double(flann_index_t index_ptr, double* points, size_t rows, size_t columns,
+                                            float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_64_byte(flann_index_t index_ptr, unsigned char* points, size_t rows, size_t columns,
+                                          float rebuild_threshold);
+
+FLANN_EXPORT int flann_add_points_64_int(flann_index_t index_ptr, int* points, size_t rows, size_t columns,
+                                         float rebuild_threshold);
+
 /**
  * Removes a point from a pre-built index.
  *
@@ -210,6 +309,14 @@ FLANN_EXPORT int flann_remove_point_byte(flann_index_t index_ptr,
 FLANN_EXPORT int flann_remove_point_int(flann_index_t index_ptr,
                                         unsigned int point_id);
 
+FLANN_EXPORT int flann_remove_point_64_float(flann_index_t index_ptr, size_t point_id);
+
+FLANN_EXPORT int flann_remove_point_64_double(flann_index_t index_ptr, size_t point_id);
+
+FLANN_EXPORT int flann_remove_point_64_byte(flann_index_t index_ptr, size_t point_id);
+
+FLANN_EXPORT int flann_remove_point_64_int(flann_index_t index_ptr, size_t point_id);
+
 /**
  * Gets a point from a given index position.
  *
@@ -233,6 +340,14 @@ FLANN_EXPORT unsigned char* flann_get_point_byte(flann_index_t index_ptr,
 FLANN_EXPORT int* flann_get_point_int(flann_index_t index_ptr,
                                       unsigned int point_id);
 
+FLANN_EXPORT float* flann_get_point_64_float(flann_index_t index_ptr, size_t point_id);
+
+FLANN_EXPORT double* flann_get_point_64_double(flann_index_t index_ptr, size_t point_id);
+
+FLANN_EXPORT unsigned char* flann_get_point_64_byte(flann_index_t index_ptr, size_t point_id);
+
+FLANN_EXPORT int* flann_get_point_64_int(flann_index_t index_ptr, size_t point_id);
+
 /**
  * Returns the number of datapoints stored in index.
  *
@@ -265,6 +380,14 @@ FLANN_EXPORT unsigned int flann_size_byte(flann_index_t index_ptr);
 
 FLANN_EXPORT unsigned int flann_size_int(flann_index_t index_ptr);
 
+FLANN_EXPORT size_t flann_size_64_float(flann_index_t index_ptr);
+
+FLANN_EXPORT size_t flann_size_64_double(flann_index_t index_ptr);
+
+FLANN_EXPORT size_t flann_size_64_byte(flann_index_t index_ptr);
+
+FLANN_EXPORT size_t flann_size_64_int(flann_index_t index_ptr);
+
 /**
  * Returns the number of bytes consumed by the index.
  *
@@ -281,6 +404,14 @@ FLANN_EXPORT int flann_used_memory_byte(flann_index_t index_ptr);
 
 FLANN_EXPORT int flann_used_memory_int(flann_index_t index_ptr);
 
+FLANN_EXPORT size_t flann_used_memory_64_float(flann_index_t index_ptr);
+
+FLANN_EXPORT size_t flann_used_memory_64_double(flann_index_t index_ptr);
+
+FLANN_EXPORT size_t flann_used_memory_64_byte(flann_index_t index_ptr);
+
+FLANN_EXPORT size_t flann_used_memory_64_int(flann_index_t index_ptr);
+
 
 /**
  * Saves the index to a file. Only the index is saved into the file, the dataset corresponding to the index is not saved.
@@ -338,6 +469,70 @@ FLANN_EXPORT flann_index_t flann_load_index_int(char* filename,
                                                 int rows,
                                                 int cols);
 
+/**
+ * Same as flann_load_index, with the distance taken from the distance_type
+ * field of flann_params instead of the default distance.
+ */
+FLANN_EXPORT flann_index_t flann_load_index_with_params_float(char* filename, float* dataset, int rows, int cols,
+                                                              struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_with_params_double(char* filename, double* dataset, int rows, int cols,
+                                                               struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_with_params_byte(char* filename, unsigned char* dataset, int rows, int cols,
+                                                             struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_with_params_int(char* filename, int* dataset, int rows, int cols,
+                                                            struct FLANNParameters* flann_params);
+
+/**
+ * Loads an index saved from an index built with flann_build_index_hamming.
+ */
+FLANN_EXPORT flann_index_t flann_load_index_hamming(char* filename,
+                                                    unsigned char* dataset,
+                                                    int rows,
+                                                    int cols);
+
+FLANN_EXPORT flann_index_t flann_load_index_64_float(char* filename, float* dataset, size_t rows, size_t cols,
+                                                     struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_64_double(char* filename, double* dataset, size_t rows, size_t cols,
+                                                      struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_64_byte(char* filename, unsigned char* dataset, size_t rows, size_t cols,
+                                                    struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_64_int(char* filename, int* dataset, size_t rows, size_t cols,
+                                                   struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_64_hamming(char* filename, unsigned char* dataset, size_t rows, size_t cols);
+
+/**
+ * Loads an index saved without its dataset (the default) against a dataset file
+ * that is memory mapped read only instead of read, so that processes loading
+ * indexes of the same dataset share it in the page cache. The file is unmapped
+ * by flann_free_index.
+ *
+ * @param filename File to load the index from.
+ * @param dataset_file The dataset of the index, in the .fvecs/.ivecs/.bvecs format
+ *                     if its name ends with "vecs", otherwise the raw rows.
+ * @param flann_params Selects the distance, as for flann_load_index_with_params_float.
+ * @return the index, or NULL if the files don't match
+ */
+FLANN_EXPORT flann_index_t flann_load_index_mapped_float(char* filename, char* dataset_file,
+                                                         struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_mapped_double(char* filename, char* dataset_file,
+                                                          struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_mapped_byte(char* filename, char* dataset_file,
+                                                        struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_mapped_int(char* filename, char* dataset_file,
+                                                       struct FLANNParameters* flann_params);
+
+FLANN_EXPORT flann_index_t flann_load_index_mapped_hamming(char* filename, char* dataset_file);
+
 
 /**
    Builds an index and uses it to find nearest neighbors.
@@ -462,6 +657,71 @@ FLANN_EXPORT int flann_find_nearest_neighbors_index_int(flann_index_t index_id,
                                                         int nn,
                                                         struct FLANNParameters* flann_params);
 
+/**
+   Same as flann_find_nearest_neighbors_index, for a query set and result
+   matrices whose rows are not contiguous: each stride gives the distance in
+   bytes between the starts of consecutive rows (0 for contiguous rows).
+   This allows searching and writing the results in place in views of
+   larger arrays.
+ */
+FLANN_EXPORT int flann_find_nearest_neighbors_index_strided_float(flann_index_t index_id,
+                                                                  float* testset, int trows, size_t testset_stride,
+                                                                  int* indices, size_t indices_stride,
+                                                                  float* dists, size_t dists_stride,
+                                                                  int nn, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_strided_double(flann_index_t index_id,
+                                                                   double* testset, int trows, size_t testset_stride,
+                                                                   int* indices, size_t indices_stride,
+                                                                   double* dists, size_t dists_stride,
+                                                                   int nn, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_strided_byte(flann_index_t index_id,
+                                                                 unsigned char* testset, int trows, size_t testset_stride,
+                                                                 int* indices, size_t indices_stride,
+                                                                 float* dists, size_t dists_stride,
+                                                                 int nn, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_strided_int(flann_index_t index_id,
+                                                                int* testset, int trows, size_t testset_stride,
+                                                                int* indices, size_t indices_stride,
+                                                                float* dists, size_t dists_stride,
+                                                                int nn, struct FLANNParameters* flann_params);
+
+/**
+   Same as flann_find_nearest_neighbors_index, for an index built with
+   flann_build_index_hamming. The distances are numbers of differing bits.
+   As for the other types, the queries are searched in parallel on
+   flann_params->cores threads (0 for all the cores).
+ */
+FLANN_EXPORT int flann_find_nearest_neighbors_index_hamming(flann_index_t index_id,
+                                                            unsigned char* testset,
+                                                            int trows,
+                                                            int* indices,
+                                                            unsigned int* dists,
+                                                            int nn,
+                                                            struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_64_float(flann_index_t index_id, float* testset, size_t trows,
+                                                             size_t* indices, float* dists, size_t nn,
+                                                             struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_64_double(flann_index_t index_id, double* testset, size_t trows,
+                                                              size_t* indices, double* dists, size_t nn,
+                                                              struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_64_byte(flann_index_t index_id, unsigned char* testset, size_t trows,
+                                                            size_t* indices, float* dists, size_t nn,
+                                                            struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_64_int(flann_index_t index_id, int* testset, size_t trows,
+                                                           size_t* indices, float* dists, size_t nn,
+                                                           struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_find_nearest_neighbors_index_64_hamming(flann_index_t index_id, unsigned char* testset, size_t trows,
+                                                               size_t* indices, unsigned int* dists, size_t nn,
+                                                               struct FLANNParameters* flann_params);
+
 
 /**
  * Performs an radius search using an already constructed index.
@@ -517,8 +777,37 @@ FLANN_EXPORT int flann_radius_search_int(flann_index_t index_ptr, /* the index *
                                          float radius, /* search radius (squared radius for euclidian metric) */
                                          struct FLANNParameters* flann_params);
 
+FLANN_EXPORT int flann_radius_search_hamming(flann_index_t index_ptr, /* the index (see flann_build_index_hamming) */
+                                             unsigned char* query, /* query point */
+                                             int* indices, /* array for storing the indices found (will be modified) */
+                                             unsigned int* dists, /* similar, but for storing distances */
+                                             int max_nn,  /* size of arrays indices and dists */
+                                             float radius, /* search radius in bits */
+                                             struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_radius_search_64_float(flann_index_t index_ptr, float* query,
+                                              size_t* indices, float* dists, size_t max_nn,
+                                              float radius, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_radius_search_64_double(flann_index_t index_ptr, double* query,
+                                               size_t* indices, double* dists, size_t max_nn,
+                                               float radius, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_radius_search_64_byte(flann_index_t index_ptr, unsigned char* query,
+                                             size_t* indices, float* dists, size_t max_nn,
+                                             float radius, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_radius_search_64_int(flann_index_t index_ptr, int* query,
+                                            size_t* indices, float* dists, size_t max_nn,
+                                            float radius, struct FLANNParameters* flann_params);
+
+FLANN_EXPORT int flann_radius_search_64_hamming(flann_index_t index_ptr, unsigned char* query,
+                                                size_t* indices, unsigned int* dists, size_t max_nn,
+                                                float radius, struct FLANNParameters* flann_params);
+
 /**
-   Deletes an index and releases the memory used by it.
+   Deletes an index and releases the memory used by it. The index is freed
+   whatever the element type of the function called.
 
    Params:
     index_id = the index (constructed previously using flann_build_index).
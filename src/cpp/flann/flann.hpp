@@ -32,8 +32,16 @@
 #define FLANN_HPP_
 
 
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <limits>
 #include <cassert>
 #include <cstdio>
 
@@ -41,6 +49,8 @@
 #include "flann/util/matrix.h"
 #include "flann/util/params.h"
 #include "flann/util/saving.h"
+#include "flann/util/epoch.h"
+#include "flann/util/query_cache.h"
 
 #include "flann/algorithms/all_indices.h"
 
@@ -72,6 +82,27 @@ struct SavedIndexParams : public IndexParams
 
 
 
+/**
+ * Index wrapper.
+ *
+ * When the "background_rebuild" index parameter is set, addPoints() does not block
+ * on rebuilding the index: the new points are kept in a delta buffer that is searched
+ * linearly, while a copy of the index is rebuilt with them on a background thread.
+ * The rebuilt index is published to the readers with an atomic pointer swap, so
+ * searches never wait for a rebuild.
+ *
+ * This is also the concurrent mode of the index: searches can run from any number
+ * of threads while another thread modifies the index (searches beyond the 64 that
+ * run at the same time wait for one of them to finish). Readers take no locks, the
+ * replaced index versions are reclaimed once the searches using them are done
+ * (see EpochManager) and removed points are marked with atomic writes. Calls that
+ * modify the index (buildIndex, addPoints, removePoint, save) are serialized
+ * internally, so there is effectively a single writer.
+ *
+ * When the "cache_size" index parameter is set, the results of the most recent
+ * queries are kept in an LRU cache (see QueryCache) and repeated queries are
+ * answered from it. Any modification of the index empties the cache.
+ */
 template<typename Distance>
 class Index
 {
@@ -79,45 +110,65 @@ public:
     typedef typename Distance::ElementType ElementType;
     typedef typename Distance::ResultType DistanceType;
     typedef NNIndex<Distance> IndexType;
+    typedef QueryCache<ElementType, DistanceType> CacheType;
 
     Index(const IndexParams& params, Distance distance = Distance() )
-        : index_params_(params)
+        : distance_(distance), index_params_(params), rebuilding_(false)
     {
         flann_algorithm_t index_type = get_param<flann_algorithm_t>(params,"algorithm");
         loaded_ = false;
+        background_rebuild_ = get_param(params, "background_rebuild", false);
 
         Matrix<ElementType> features;
+        IndexType* nnIndex;
         if (index_type == FLANN_INDEX_SAVED) {
-            nnIndex_ = load_saved_index(features, get_param<std::string>(params,"filename"), distance);
+            nnIndex = load_saved_index(features, get_param<std::string>(params,"filename"), distance);
             loaded_ = true;
         }
         else {
         	flann_algorithm_t index_type = get_param<flann_algorithm_t>(params, "algorithm");
-            nnIndex_ = create_index_by_type<Distance>(index_type, features, params, distance);
+            nnIndex = create_index_by_type<Distance>(index_type, features, params, distance);
+        }
+        if (background_rebuild_ && nnIndex!=NULL) {
+            nnIndex->initRemovedPoints();
         }
+        snapshot_.store(new Snapshot(nnIndex));
+        initCache();
     }
 
 
     Index(const Matrix<ElementType>& features, const IndexParams& params, Distance distance = Distance() )
-        : index_params_(params)
+        : distance_(distance), index_params_(params), rebuilding_(false)
     {
         flann_algorithm_t index_type = get_param<flann_algorithm_t>(params,"algorithm");
         loaded_ = false;
+        background_rebuild_ = get_param(params, "background_rebuild", false);
 
+        IndexType* nnIndex;
         if (index_type == FLANN_INDEX_SAVED) {
-            nnIndex_ = load_saved_index(features, get_param<std::string>(params,"filename"), distance);
+            nnIndex = load_saved_index(features, get_param<std::string>(params,"filename"), distance);
             loaded_ = true;
         }
         else {
         	flann_algorithm_t index_type = get_param<flann_algorithm_t>(params, "algorithm");
-            nnIndex_ = create_index_by_type<Distance>(index_type, features, params, distance);
+            nnIndex = create_index_by_type<Distance>(index_type, features, params, distance);
+        }
+        if (background_rebuild_ && nnIndex!=NULL) {
+            nnIndex->initRemovedPoints();
         }
+        snapshot_.store(new Snapshot(nnIndex));
+        initCache();
     }
 
 
-    Index(const Index& other) : loaded_(other.loaded_), index_params_(other.index_params_)
+    Index(const Index& other) : distance_(other.distance_), loaded_(other.loaded_),
+        background_rebuild_(other.background_rebuild_), index_params_(other.index_params_), rebuilding_(false)
     {
-    	nnIndex_ = other.nnIndex_->clone();
+        ReadGuard snapshot(other);
+        Snapshot* copy = new Snapshot(*snapshot);
+        copy->index.reset(snapshot->index->clone());
+        snapshot_.store(copy);
+        initCache();
     }
 
     Index& operator=(Index other)
@@ -128,7 +179,10 @@ public:
 
     virtual ~Index()
     {
-        delete nnIndex_;
+        if (rebuild_thread_.joinable()) {
+            rebuild_thread_.join();
+        }
+        delete snapshot_.load();
     }
 
     /**
@@ -137,18 +191,113 @@ public:
     void buildIndex()
     {
         if (!loaded_) {
-            nnIndex_->buildIndex();
+            if (background_rebuild_) {
+                waitForRebuild();
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                const Snapshot* snapshot = snapshot_.load();
+                IndexType* index = snapshot->index->clone();
+                try {
+                    index->rebuildWithPoints(snapshot->delta);
+                }
+                catch (...) {
+                    delete index;
+                    throw;
+                }
+                publishRebuild(index, snapshot->delta.size());
+            }
+            else {
+                snapshot_.load()->index->buildIndex();
+                invalidateCache();
+            }
         }
     }
 
     void buildIndex(const Matrix<ElementType>& points)
     {
-    	nnIndex_->buildIndex(points);
+        if (background_rebuild_) {
+            waitForRebuild();
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            IndexType* index = createIndex();
+            try {
+                index->buildIndex(points);
+                index->initRemovedPoints();
+            }
+            catch (...) {
+                delete index;
+                throw;
+            }
+            publish(new Snapshot(index));
+        }
+        else {
+            snapshot_.load()->index->buildIndex(points);
+            invalidateCache();
+        }
+    }
+
+    /**
+     * Builds the index with user supplied point ids
+     * @param points The dataset
+     * @param ids The ids of the points, any distinct values
+     */
+    void buildIndex(const Matrix<ElementType>& points, const std::vector<size_t>& ids)
+    {
+        if (background_rebuild_) {
+            waitForRebuild();
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            IndexType* index = createIndex();
+            try {
+                index->buildIndex(points, ids);
+                index->initRemovedPoints();
+            }
+            catch (...) {
+                delete index;
+                throw;
+            }
+            publish(new Snapshot(index));
+        }
+        else {
+            snapshot_.load()->index->buildIndex(points, ids);
+            invalidateCache();
+        }
     }
 
     void addPoints(const Matrix<ElementType>& points, float rebuild_threshold = 2)
     {
-        nnIndex_->addPoints(points, rebuild_threshold);
+        if (!background_rebuild_) {
+            snapshot_.load()->index->addPoints(points, rebuild_threshold);
+            invalidateCache();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        checkRebuildError();
+        const Snapshot* snapshot = snapshot_.load();
+        Snapshot* next = new Snapshot(*snapshot);
+        next->delta_ids.push_back(nextId(*snapshot));
+        next->delta.push_back(points);
+        next->delta_size += points.rows;
+        publish(next);
+
+        // a threshold <= 1 means rebuilding whenever the delta buffer is not empty
+        size_t index_size = next->index->size();
+        if (!rebuilding_ && (rebuild_threshold<=1 || index_size*rebuild_threshold<index_size+next->delta_size)) {
+            startRebuild(*next);
+        }
+    }
+
+    /**
+     * Adds points with user supplied ids to the index
+     * @param points The points to add
+     * @param ids The ids of the points, distinct from the ids already in the index
+     * @param rebuild_threshold
+     */
+    void addPoints(const Matrix<ElementType>& points, const std::vector<size_t>& ids, float rebuild_threshold = 2)
+    {
+        if (background_rebuild_) {
+            throw FLANNException("Adding points with ids is not supported with background_rebuild");
+        }
+        snapshot_.load()->index->addPoints(points, ids, rebuild_threshold);
+        invalidateCache();
     }
 
     /**
@@ -157,7 +306,30 @@ public:
      */
     void removePoint(size_t point_id)
     {
-    	nnIndex_->removePoint(point_id);
+        if (!background_rebuild_) {
+            snapshot_.load()->index->removePoint(point_id);
+            invalidateCache();
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        const Snapshot* snapshot = snapshot_.load();
+        if (!snapshot->delta.empty() && point_id>=snapshot->delta_ids[0]) {
+            if (point_id<nextId(*snapshot) && snapshot->delta_removed.count(point_id)==0) {
+                Snapshot* next = new Snapshot(*snapshot);
+                next->delta_removed.insert(point_id);
+                publish(next);
+            }
+        }
+        else {
+            // compacting the index structure is left to the rebuilds, readers use it
+            snapshot->index->markRemoved(point_id);
+            if (rebuilding_) {
+                // the index being rebuilt is a copy taken before this removal
+                pending_removed_.push_back(point_id);
+            }
+            invalidateCache();
+        }
     }
 
     /**
@@ -167,7 +339,32 @@ public:
      */
     ElementType* getPoint(size_t point_id)
     {
-    	return nnIndex_->getPoint(point_id);
+        ReadGuard snapshot(*this);
+        for (size_t i=0;i<snapshot->delta.size();++i) {
+            if (point_id>=snapshot->delta_ids[i] && point_id<snapshot->delta_ids[i]+snapshot->delta[i].rows) {
+                if (snapshot->delta_removed.count(point_id)>0) return NULL;
+                return snapshot->delta[i][point_id-snapshot->delta_ids[i]];
+            }
+        }
+    	return snapshot->index->getPoint(point_id);
+    }
+
+    /**
+     * Waits for a background rebuild (if any) to finish and rethrows the
+     * exception it failed with.
+     */
+    void waitForRebuild()
+    {
+        std::thread thread;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            thread.swap(rebuild_thread_);
+        }
+        if (thread.joinable()) {
+            thread.join();
+        }
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        checkRebuildError();
     }
 
     /**
@@ -176,11 +373,15 @@ public:
      */
     void save(std::string filename)
     {
+        if (background_rebuild_ && !snapshot_.load()->delta.empty()) {
+            buildIndex();
+        }
         FILE* fout = fopen(filename.c_str(), "wb");
         if (fout == NULL) {
             throw FLANNException("Cannot open file");
         }
-        nnIndex_->saveIndex(fout);
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        snapshot_.load()->index->saveIndex(fout);
         fclose(fout);
     }
 
@@ -189,7 +390,7 @@ public:
      */
     size_t veclen() const
     {
-        return nnIndex_->veclen();
+        return ReadGuard(*this)->index->veclen();
     }
 
     /**
@@ -197,7 +398,8 @@ public:
      */
     size_t size() const
     {
-        return nnIndex_->size();
+        ReadGuard snapshot(*this);
+        return snapshot->index->size() + snapshot->delta_size - snapshot->delta_removed.size();
     }
 
     /**
@@ -205,15 +407,15 @@ public:
      */
     flann_algorithm_t getType() const
     {
-        return nnIndex_->getType();
+        return ReadGuard(*this)->index->getType();
     }
 
     /**
      * \returns The amount of memory (in bytes) used by the index.
      */
-    int usedMemory() const
+    size_t usedMemory() const
     {
-        return nnIndex_->usedMemory();
+        return ReadGuard(*this)->index->usedMemory();
     }
 
 
@@ -222,7 +424,23 @@ public:
      */
     IndexParams getParameters() const
     {
-        return nnIndex_->getParameters();
+        return ReadGuard(*this)->index->getParameters();
+    }
+
+    /**
+     * \returns The number of queries answered from the result cache.
+     */
+    size_t cacheHits() const
+    {
+        return cache_ ? cache_->hits() : 0;
+    }
+
+    /**
+     * \returns The number of queries that were not found in the result cache.
+     */
+    size_t cacheMisses() const
+    {
+        return cache_ ? cache_->misses() : 0;
     }
 
     /**
@@ -239,7 +457,22 @@ public:
                                  size_t knn,
                            const SearchParams& params) const
     {
-    	return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+        if (cache_ && knn>0) {
+            std::vector<std::vector<size_t> > indices_;
+            std::vector<std::vector<DistanceType> > dists_;
+            int result = cachedSearch(queries, indices_, dists_, knn, 0, params);
+            copyResults(indices_, dists_, indices, dists);
+            return result;
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->knnSearch(queries, indices, dists, knn, params);
+        }
+        std::vector<std::vector<size_t> > indices_;
+        std::vector<std::vector<DistanceType> > dists_;
+        int result = knnSearch(*snapshot, queries, indices_, dists_, knn, params);
+        copyResults(indices_, dists_, indices, dists);
+        return result;
     }
 
     /**
@@ -257,7 +490,22 @@ public:
                                  size_t knn,
                            const SearchParams& params) const
     {
-    	return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+        if (cache_ && knn>0) {
+            std::vector<std::vector<size_t> > indices_;
+            std::vector<std::vector<DistanceType> > dists_;
+            int result = cachedSearch(queries, indices_, dists_, knn, 0, params);
+            copyResults(indices_, dists_, indices, dists);
+            return result;
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->knnSearch(queries, indices, dists, knn, params);
+        }
+        std::vector<std::vector<size_t> > indices_;
+        std::vector<std::vector<DistanceType> > dists_;
+        int result = knnSearch(*snapshot, queries, indices_, dists_, knn, params);
+        copyResults(indices_, dists_, indices, dists);
+        return result;
     }
 
     /**
@@ -274,7 +522,14 @@ public:
                                  size_t knn,
                            const SearchParams& params) const
     {
-    	return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+        if (cache_ && knn>0) {
+            return cachedSearch(queries, indices, dists, knn, 0, params);
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->knnSearch(queries, indices, dists, knn, params);
+        }
+        return knnSearch(*snapshot, queries, indices, dists, knn, params);
     }
 
     /**
@@ -292,7 +547,20 @@ public:
                                  size_t knn,
                            const SearchParams& params) const
     {
-    	return nnIndex_->knnSearch(queries, indices, dists, knn, params);
+        if (cache_ && knn>0) {
+            std::vector<std::vector<size_t> > indices_;
+            int result = cachedSearch(queries, indices_, dists, knn, 0, params);
+            copyResults(indices_, indices);
+            return result;
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->knnSearch(queries, indices, dists, knn, params);
+        }
+        std::vector<std::vector<size_t> > indices_;
+        int result = knnSearch(*snapshot, queries, indices_, dists, knn, params);
+        copyResults(indices_, indices);
+        return result;
     }
 
     /**
@@ -310,7 +578,25 @@ public:
                                     float radius,
                               const SearchParams& params) const
     {
-    	return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+        SearchParams matrix_params = matrixSearchParams(params, indices, dists);
+        if (cache_ && matrix_params.max_neighbors!=0) {
+            std::vector<std::vector<size_t> > indices_;
+            std::vector<std::vector<DistanceType> > dists_;
+            cachedSearch(queries, indices_, dists_, 0, radius, matrix_params);
+            return copyRadiusResults(indices_, dists_, indices, dists, matrix_params);
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->radiusSearch(queries, indices, dists, radius, params);
+        }
+        std::vector<std::vector<size_t> > indices_;
+        std::vector<std::vector<DistanceType> > dists_;
+        int result = radiusSearch(*snapshot, queries, indices_, dists_, radius, matrix_params);
+        if (matrix_params.max_neighbors==0) {
+            // only counted
+            return result;
+        }
+        return copyRadiusResults(indices_, dists_, indices, dists, matrix_params);
     }
 
     /**
@@ -328,7 +614,25 @@ public:
                                     float radius,
                               const SearchParams& params) const
     {
-    	return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+        SearchParams matrix_params = matrixSearchParams(params, indices, dists);
+        if (cache_ && matrix_params.max_neighbors!=0) {
+            std::vector<std::vector<size_t> > indices_;
+            std::vector<std::vector<DistanceType> > dists_;
+            cachedSearch(queries, indices_, dists_, 0, radius, matrix_params);
+            return copyRadiusResults(indices_, dists_, indices, dists, matrix_params);
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->radiusSearch(queries, indices, dists, radius, params);
+        }
+        std::vector<std::vector<size_t> > indices_;
+        std::vector<std::vector<DistanceType> > dists_;
+        int result = radiusSearch(*snapshot, queries, indices_, dists_, radius, matrix_params);
+        if (matrix_params.max_neighbors==0) {
+            // only counted
+            return result;
+        }
+        return copyRadiusResults(indices_, dists_, indices, dists, matrix_params);
     }
 
     /**
@@ -346,7 +650,14 @@ public:
                                     float radius,
                               const SearchParams& params) const
     {
-    	return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+        if (cache_ && params.max_neighbors!=0) {
+            return cachedSearch(queries, indices, dists, 0, radius, params);
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->radiusSearch(queries, indices, dists, radius, params);
+        }
+        return radiusSearch(*snapshot, queries, indices, dists, radius, params);
     }
 
     /**
@@ -364,10 +675,479 @@ public:
                                     float radius,
                               const SearchParams& params) const
     {
-    	return nnIndex_->radiusSearch(queries, indices, dists, radius, params);
+        if (cache_ && params.max_neighbors!=0) {
+            std::vector<std::vector<size_t> > indices_;
+            int result = cachedSearch(queries, indices_, dists, 0, radius, params);
+            copyResults(indices_, indices);
+            return result;
+        }
+        ReadGuard snapshot(*this);
+        if (snapshot->delta.empty()) {
+            return snapshot->index->radiusSearch(queries, indices, dists, radius, params);
+        }
+        std::vector<std::vector<size_t> > indices_;
+        int result = radiusSearch(*snapshot, queries, indices_, dists, radius, params);
+        copyResults(indices_, indices);
+        return result;
     }
 
 private:
+    /**
+     * The index together with the points added to it since it was last (re)built.
+     * Snapshots are immutable once published, writers publish a modified copy.
+     */
+    struct Snapshot
+    {
+        Snapshot(IndexType* index_) : index(index_), delta_size(0) {}
+
+        /** Index */
+        std::shared_ptr<IndexType> index;
+        /** Points not yet in the index, searched linearly */
+        std::vector<Matrix<ElementType> > delta;
+        /** Id of the first point of each delta matrix */
+        std::vector<size_t> delta_ids;
+        /** Ids of the removed delta points */
+        std::set<size_t> delta_removed;
+        /** Number of delta points */
+        size_t delta_size;
+    };
+
+    /**
+     * Gives a reader access to the current snapshot, which is not deleted before
+     * the guard goes out of scope.
+     */
+    class ReadGuard
+    {
+    public:
+        ReadGuard(const Index& index) : index_(index), slot_(size_t(-1))
+        {
+            if (index_.background_rebuild_) {
+                slot_ = index_.epochs_.enter();
+            }
+            snapshot_ = index_.snapshot_.load();
+        }
+
+        ~ReadGuard()
+        {
+            if (slot_!=size_t(-1)) {
+                index_.epochs_.leave(slot_);
+            }
+        }
+
+        const Snapshot* operator->() const { return snapshot_; }
+        const Snapshot& operator*() const { return *snapshot_; }
+
+    private:
+        const Index& index_;
+        size_t slot_;
+        const Snapshot* snapshot_;
+    };
+
+    /**
+     * Replaces the current snapshot, the old one is deleted once no reader uses it.
+     * Must be called with the write mutex held.
+     */
+    void publish(const Snapshot* snapshot)
+    {
+        // removals must not reallocate structures used by concurrent readers
+        snapshot->index->initRemovedPoints();
+        epochs_.retire(snapshot_.exchange(snapshot));
+        invalidateCache();
+    }
+
+    void initCache()
+    {
+        int cache_size = get_param(index_params_, "cache_size", 0);
+        if (cache_size>0) {
+            cache_.reset(new CacheType(cache_size, get_param(index_params_, "cache_shards", 16)));
+        }
+    }
+
+    void invalidateCache()
+    {
+        if (cache_) {
+            cache_->clear();
+        }
+    }
+
+    /**
+     * Answers the queries found in the result cache from it, searches the others
+     * and caches their results. Results of searches stopped by a time budget are
+     * not cached.
+     * @param knn Number of neighbors of a knn search, 0 for a radius search
+     * @param radius Radius of a radius search
+     */
+    int cachedSearch(const Matrix<ElementType>& queries, std::vector<std::vector<size_t> >& indices,
+            std::vector<std::vector<DistanceType> >& dists, size_t knn, float radius, const SearchParams& params) const
+    {
+        size_t veclen = queries.cols;
+        size_t seed = CacheType::searchKey(knn, radius, params);
+        // read before searching, so that results computed before an update are not cached
+        size_t generation = cache_->generation();
+
+        if (indices.size() < queries.rows ) indices.resize(queries.rows);
+        if (dists.size() < queries.rows ) dists.resize(queries.rows);
+
+        std::vector<size_t> missed;
+        for (size_t i=0;i<queries.rows;++i) {
+            if (!cache_->find(queries[i], veclen, seed, indices[i], dists[i])) {
+                missed.push_back(i);
+            }
+            else if (params.timed_out!=NULL) {
+                params.timed_out[i] = false;
+            }
+        }
+
+        if (!missed.empty()) {
+            std::vector<ElementType> points(missed.size()*veclen);
+            for (size_t i=0;i<missed.size();++i) {
+                std::copy(queries[missed[i]], queries[missed[i]]+veclen, &points[i*veclen]);
+            }
+            Matrix<ElementType> missed_queries(&points[0], missed.size(), veclen);
+            std::vector<std::vector<size_t> > missed_indices;
+            std::vector<std::vector<DistanceType> > missed_dists;
+            std::unique_ptr<bool[]> timed_out(new bool[missed.size()]());
+            SearchParams missed_params = params;
+            missed_params.timed_out = timed_out.get();
+
+            {
+                ReadGuard snapshot(*this);
+                if (knn>0) {
+                    if (snapshot->delta.empty()) {
+                        snapshot->index->knnSearch(missed_queries, missed_indices, missed_dists, knn, missed_params);
+                    }
+                    else {
+                        knnSearch(*snapshot, missed_queries, missed_indices, missed_dists, knn, missed_params);
+                    }
+                }
+                else {
+                    if (snapshot->delta.empty()) {
+                        snapshot->index->radiusSearch(missed_queries, missed_indices, missed_dists, radius, missed_params);
+                    }
+                    else {
+                        radiusSearch(*snapshot, missed_queries, missed_indices, missed_dists, radius, missed_params);
+                    }
+                }
+            }
+
+            for (size_t i=0;i<missed.size();++i) {
+                size_t q = missed[i];
+                indices[q].swap(missed_indices[i]);
+                dists[q].swap(missed_dists[i]);
+                if (params.timed_out!=NULL) {
+                    params.timed_out[q] = timed_out[i];
+                }
+                if (!timed_out[i]) {
+                    cache_->insert(queries[q], veclen, seed, generation, indices[q], dists[q]);
+                }
+            }
+        }
+
+        int count = 0;
+        for (size_t i=0;i<queries.rows;++i) {
+            count += indices[i].size();
+        }
+        return count;
+    }
+
+    size_t nextId(const Snapshot& snapshot) const
+    {
+        if (snapshot.delta.empty()) {
+            return snapshot.index->nextId();
+        }
+        return snapshot.delta_ids.back() + snapshot.delta.back().rows;
+    }
+
+    /**
+     * Starts rebuilding a copy of the index with the delta points of the given
+     * snapshot. Must be called with the write mutex held.
+     */
+    void startRebuild(const Snapshot& snapshot)
+    {
+        if (rebuild_thread_.joinable()) {
+            // the previous rebuild already published its result
+            rebuild_thread_.join();
+        }
+        rebuilding_ = true;
+        rebuild_thread_ = std::thread(&Index::rebuild, this, snapshot.index, snapshot.delta);
+    }
+
+    /**
+     * Rebuilds a copy of the snapshot index with the delta points. The copy is
+     * taken here rather than by the writer: the snapshot index is only changed
+     * by markRemoved, whose removals are also kept in pending_removed_.
+     */
+    void rebuild(std::shared_ptr<IndexType> snapshot_index, std::vector<Matrix<ElementType> > delta)
+    {
+        IndexType* index = NULL;
+        try {
+            index = snapshot_index->clone();
+            index->rebuildWithPoints(delta);
+        }
+        catch (...) {
+            delete index;
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            rebuild_error_ = std::current_exception();
+            pending_removed_.clear();
+            rebuilding_ = false;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        for (size_t i=0;i<pending_removed_.size();++i) {
+            index->removePoint(pending_removed_[i]);
+        }
+        pending_removed_.clear();
+        publishRebuild(index, delta.size());
+        rebuilding_ = false;
+    }
+
+    /**
+     * Publishes a rebuilt index that contains the first delta_count delta matrices
+     * of the current snapshot. Must be called with the write mutex held.
+     */
+    void publishRebuild(IndexType* index, size_t delta_count)
+    {
+        const Snapshot* snapshot = snapshot_.load();
+        Snapshot* next = new Snapshot(index);
+        next->delta.assign(snapshot->delta.begin()+delta_count, snapshot->delta.end());
+        next->delta_ids.assign(snapshot->delta_ids.begin()+delta_count, snapshot->delta_ids.end());
+        for (size_t i=0;i<next->delta.size();++i) {
+            next->delta_size += next->delta[i].rows;
+        }
+        typename std::set<size_t>::const_iterator it;
+        for (it=snapshot->delta_removed.begin();it!=snapshot->delta_removed.end();++it) {
+            if (next->delta.empty() || *it<next->delta_ids[0]) {
+                index->removePoint(*it);
+            }
+            else {
+                next->delta_removed.insert(*it);
+            }
+        }
+        publish(next);
+    }
+
+    /**
+     * Creates an empty index of the type of the current one, to build it over
+     * new points without copying the current one.
+     */
+    IndexType* createIndex() const
+    {
+        const IndexType* current = snapshot_.load()->index.get();
+        flann_algorithm_t algorithm = loaded_ ? current->getType() : get_param<flann_algorithm_t>(index_params_, "algorithm");
+        IndexParams params = loaded_ ? current->getParameters() : index_params_;
+        return create_index_by_type<Distance>(algorithm, Matrix<ElementType>(), params, distance_);
+    }
+
+    void checkRebuildError()
+    {
+        if (rebuild_error_) {
+            std::exception_ptr error = rebuild_error_;
+            rebuild_error_ = std::exception_ptr();
+            std::rethrow_exception(error);
+        }
+    }
+
+    template <typename ResultSet>
+    void findDeltaNeighbors(const Snapshot& snapshot, ResultSet& resultSet, const ElementType* vec) const
+    {
+        for (size_t i=0;i<snapshot.delta.size();++i) {
+            const Matrix<ElementType>& points = snapshot.delta[i];
+            for (size_t j=0;j<points.rows;++j) {
+                size_t id = snapshot.delta_ids[i]+j;
+                if (!snapshot.delta_removed.empty() && snapshot.delta_removed.count(id)>0) continue;
+                resultSet.addPoint(distance_(vec, points[j], points.cols), id);
+            }
+        }
+    }
+
+    /**
+     * Merges the delta points into the neighbors found in the index for one query
+     * @return Number of neighbors found before truncating to max_count
+     */
+    template <typename ResultSet>
+    size_t mergeDeltaNeighbors(const Snapshot& snapshot, ResultSet& resultSet, const ElementType* vec,
+            std::vector<size_t>& indices, std::vector<DistanceType>& dists, size_t max_count, bool sorted) const
+    {
+        resultSet.clear();
+        for (size_t j=0;j<indices.size();++j) {
+            resultSet.addPoint(dists[j], indices[j]);
+        }
+        findDeltaNeighbors(snapshot, resultSet, vec);
+        size_t n = std::min(resultSet.size(), max_count);
+        indices.resize(n);
+        dists.resize(n);
+        if (n>0) {
+            resultSet.copy(&indices[0], &dists[0], n, sorted);
+        }
+        return resultSet.size();
+    }
+
+    int knnSearch(const Snapshot& snapshot, const Matrix<ElementType>& queries,
+            std::vector< std::vector<size_t> >& indices, std::vector<std::vector<DistanceType> >& dists,
+            size_t knn, const SearchParams& params) const
+    {
+        snapshot.index->knnSearch(queries, indices, dists, knn, params);
+
+        bool use_heap;
+        if (params.use_heap==FLANN_Undefined) {
+            use_heap = (knn>KNN_HEAP_THRESHOLD)?true:false;
+        }
+        else {
+            use_heap = (params.use_heap==FLANN_True)?true:false;
+        }
+        int count = 0;
+        if (use_heap) {
+#pragma omp parallel num_threads(params.cores)
+            {
+                KNNResultSet2<DistanceType> resultSet(knn);
+#pragma omp for schedule(static) reduction(+:count)
+                for (int i = 0; i < (int)queries.rows; i++) {
+                    mergeDeltaNeighbors(snapshot, resultSet, queries[i], indices[i], dists[i], knn, params.sorted);
+                    count += indices[i].size();
+                }
+            }
+        }
+        else {
+#pragma omp parallel num_threads(params.cores)
+            {
+                KNNSimpleResultSet<DistanceType> resultSet(knn);
+#pragma omp for schedule(static) reduction(+:count)
+                for (int i = 0; i < (int)queries.rows; i++) {
+                    mergeDeltaNeighbors(snapshot, resultSet, queries[i], indices[i], dists[i], knn, params.sorted);
+                    count += indices[i].size();
+                }
+            }
+        }
+        return count;
+    }
+
+    int radiusSearch(const Snapshot& snapshot, const Matrix<ElementType>& queries,
+            std::vector< std::vector<size_t> >& indices, std::vector<std::vector<DistanceType> >& dists,
+            float radius, const SearchParams& params) const
+    {
+        int count = snapshot.index->radiusSearch(queries, indices, dists, radius, params);
+
+        if (params.max_neighbors==0) {
+#pragma omp parallel num_threads(params.cores)
+            {
+                CountRadiusResultSet<DistanceType> resultSet(radius);
+#pragma omp for schedule(static) reduction(+:count)
+                for (int i = 0; i < (int)queries.rows; i++) {
+                    resultSet.clear();
+                    findDeltaNeighbors(snapshot, resultSet, queries[i]);
+                    count += resultSet.size();
+                }
+            }
+            return count;
+        }
+
+        count = 0;
+        if (params.max_neighbors<0) {
+#pragma omp parallel num_threads(params.cores)
+            {
+                RadiusResultSet<DistanceType> resultSet(radius);
+#pragma omp for schedule(static) reduction(+:count)
+                for (int i = 0; i < (int)queries.rows; i++) {
+                    count += mergeDeltaNeighbors(snapshot, resultSet, queries[i], indices[i], dists[i],
+                            size_t(-1), params.sorted);
+                }
+            }
+        }
+        else {
+#pragma omp parallel num_threads(params.cores)
+            {
+                KNNRadiusResultSet<DistanceType> resultSet(radius, params.max_neighbors);
+#pragma omp for schedule(static) reduction(+:count)
+                for (int i = 0; i < (int)queries.rows; i++) {
+                    count += mergeDeltaNeighbors(snapshot, resultSet, queries[i], indices[i], dists[i],
+                            params.max_neighbors, params.sorted);
+                }
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Search parameters of a radius search into fixed size matrices
+     */
+    template <typename IndicesType>
+    SearchParams matrixSearchParams(const SearchParams& params, const Matrix<IndicesType>& indices,
+            const Matrix<DistanceType>& dists) const
+    {
+        SearchParams matrix_params = params;
+        int num_neighbors = std::min(indices.cols, dists.cols);
+        if (matrix_params.max_neighbors<0 || matrix_params.max_neighbors>num_neighbors) {
+            matrix_params.max_neighbors = num_neighbors;
+        }
+        return matrix_params;
+    }
+
+    /**
+     * Copies the results of a radius search into fixed size matrices, keeping the
+     * matrix_params.max_neighbors closest neighbors of each query, as the search
+     * into the matrices does.
+     * @return The number of neighbors copied
+     */
+    template <typename IndicesType>
+    int copyRadiusResults(const std::vector<std::vector<size_t> >& indices_, const std::vector<std::vector<DistanceType> >& dists_,
+            Matrix<IndicesType>& indices, Matrix<DistanceType>& dists, const SearchParams& matrix_params) const
+    {
+        size_t max_neighbors = matrix_params.max_neighbors;
+        int count = 0;
+        std::vector<DistanceIndex<DistanceType> > neighbors;
+        for (size_t i=0;i<indices_.size();++i) {
+            size_t n = indices_[i].size();
+            if (n<=max_neighbors) {
+                for (size_t j=0;j<n;++j) {
+                    indices[i][j] = indices_[i][j];
+                    dists[i][j] = dists_[i][j];
+                }
+            }
+            else {
+                // the index returned more neighbors than asked for
+                neighbors.clear();
+                for (size_t j=0;j<n;++j) {
+                    neighbors.push_back(DistanceIndex<DistanceType>(dists_[i][j], indices_[i][j]));
+                }
+                std::partial_sort(neighbors.begin(), neighbors.begin()+max_neighbors, neighbors.end());
+                n = max_neighbors;
+                for (size_t j=0;j<n;++j) {
+                    indices[i][j] = neighbors[j].index_;
+                    dists[i][j] = neighbors[j].dist_;
+                }
+            }
+            // mark the next element in the output buffers as unused
+            if (n<indices.cols) indices[i][n] = IndicesType(-1);
+            if (n<dists.cols) dists[i][n] = std::numeric_limits<DistanceType>::infinity();
+            count += n;
+        }
+        return count;
+    }
+
+    template <typename IndicesType>
+    void copyResults(const std::vector<std::vector<size_t> >& indices_, const std::vector<std::vector<DistanceType> >& dists_,
+            Matrix<IndicesType>& indices, Matrix<DistanceType>& dists) const
+    {
+        for (size_t i=0;i<indices_.size();++i) {
+            size_t n = indices_[i].size();
+            for (size_t j=0;j<n;++j) {
+                indices[i][j] = indices_[i][j];
+                dists[i][j] = dists_[i][j];
+            }
+            // mark the next element in the output buffers as unused
+            if (n<indices.cols) indices[i][n] = IndicesType(-1);
+            if (n<dists.cols) dists[i][n] = std::numeric_limits<DistanceType>::infinity();
+        }
+    }
+
+    void copyResults(const std::vector<std::vector<size_t> >& indices_, std::vector<std::vector<int> >& indices) const
+    {
+        indices.resize(indices_.size());
+        for (size_t i=0;i<indices_.size();++i) {
+            indices[i].assign(indices_[i].begin(), indices_[i].end());
+        }
+    }
+
     IndexType* load_saved_index(const Matrix<ElementType>& dataset, const std::string& filename, Distance distance)
     {
         FILE* fin = fopen(filename.c_str(), "rb");
@@ -392,18 +1172,42 @@ private:
 
     void swap( Index& other)
     {
-    	std::swap(nnIndex_, other.nnIndex_);
+        waitForRebuild();
+    	const Snapshot* snapshot = snapshot_.load();
+    	snapshot_.store(other.snapshot_.load());
+    	other.snapshot_.store(snapshot);
+    	std::swap(distance_, other.distance_);
     	std::swap(loaded_, other.loaded_);
+    	std::swap(background_rebuild_, other.background_rebuild_);
     	std::swap(index_params_, other.index_params_);
+    	std::swap(cache_, other.cache_);
     }
 
 private:
-    /** Pointer to actual index class */
-    IndexType* nnIndex_;
+    /** The actual index and the points not yet added to it */
+    std::atomic<const Snapshot*> snapshot_;
+    /** Reclaims the snapshots replaced while readers may still use them */
+    mutable EpochManager<Snapshot> epochs_;
+    /** Distance used for searching the delta points */
+    Distance distance_;
     /** Indices if the index was loaded from a file */
     bool loaded_;
+    /** Whether the index is rebuilt on a background thread */
+    bool background_rebuild_;
     /** Parameters passed to the index */
     IndexParams index_params_;
+    /** Serializes the calls modifying the index */
+    std::mutex write_mutex_;
+    /** Thread rebuilding the index */
+    std::thread rebuild_thread_;
+    /** Whether a rebuild is in progress */
+    bool rebuilding_;
+    /** Ids removed from the index while it was being rebuilt */
+    std::vector<size_t> pending_removed_;
+    /** Exception thrown by the last background rebuild */
+    std::exception_ptr rebuild_error_;
+    /** Results of recent queries, NULL if caching is disabled */
+    std::unique_ptr<CacheType> cache_;
 };
 
 
@@ -32,7 +32,16 @@
 
 #include <hdf5.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "flann/util/matrix.h"
+#include "flann/io/mapped_dataset.h"
 
 
 namespace flann
@@ -74,8 +83,55 @@ hid_t get_hdf5_type<long double>() { return H5T_NATIVE_LDOUBLE; }
 
 #define CHECK_ERROR(x,y) if ((x)<0) throw FLANNException((y));
 
+namespace
+{
+
+hid_t open_hdf5_dataset(hid_t file_id, const std::string& name)
+{
+#if H5Dopen_vers == 2
+    return H5Dopen2(file_id, name.c_str(), H5P_DEFAULT);
+#else
+    return H5Dopen(file_id, name.c_str());
+#endif
+}
+
+/**
+ * Returns the offset in the file of a dataset that can be mapped in memory (stored
+ * contiguously, without filters, in the native format of T), or HADDR_UNDEF.
+ */
 template<typename T>
-void save_to_file(const flann::Matrix<T>& dataset, const std::string& filename, const std::string& name)
+haddr_t get_mappable_offset(hid_t dataset_id)
+{
+    hid_t plist_id = H5Dget_create_plist(dataset_id);
+    bool contiguous = H5Pget_layout(plist_id)==H5D_CONTIGUOUS && H5Pget_nfilters(plist_id)==0;
+    H5Pclose(plist_id);
+    hid_t type_id = H5Dget_type(dataset_id);
+    bool native = H5Tequal(type_id, get_hdf5_type<T>())>0;
+    H5Tclose(type_id);
+
+    return contiguous && native ? H5Dget_offset(dataset_id) : HADDR_UNDEF;
+}
+
+/** Size in bytes of the blocks of rows written by save_to_file() and read by stream_from_file() */
+const size_t HDF5_BLOCK_BYTES = 64<<20;
+
+/** Size in bytes of the chunks of the compressed datasets */
+const size_t HDF5_CHUNK_BYTES = 1<<20;
+
+}
+
+
+/**
+ * Saves a dataset to a hdf5 file, in blocks of rows.
+ * @param dataset Dataset to save
+ * @param filename HDF5 file name, created if it doesn't exist
+ * @param name Name of dataset inside file
+ * @param compression_level Deflate level (1-9) of a chunked and compressed dataset,
+ *        or 0 for a contiguous dataset that can be mapped with map_from_file()
+ */
+template<typename T>
+void save_to_file(const flann::Matrix<T>& dataset, const std::string& filename, const std::string& name,
+                  int compression_level = 0)
 {
 
 #if H5Eset_auto_vers == 2
@@ -97,65 +153,355 @@ void save_to_file(const flann::Matrix<T>& dataset, const std::string& filename,
     dimsf[1] = dataset.cols;
 
     hid_t space_id = H5Screate_simple(2, dimsf, NULL);
-    hid_t memspace_id = H5Screate_simple(2, dimsf, NULL);
+
+    size_t row_size = std::max(dataset.cols*sizeof(T), size_t(1));
+    size_t block_rows = std::max(HDF5_BLOCK_BYTES/row_size, size_t(1));
+    hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
+    if (compression_level>0 && dataset.rows>0 && dataset.cols>0) {
+        if (H5Zfilter_avail(H5Z_FILTER_DEFLATE)<=0) {
+            H5Pclose(plist_id);
+            H5Sclose(space_id);
+            H5Fclose(file_id);
+            throw FLANNException("The hdf5 library has no deflate filter, cannot compress the dataset.");
+        }
+        size_t chunk_rows = std::min(std::max(HDF5_CHUNK_BYTES/row_size, size_t(1)), dataset.rows);
+        hsize_t chunk[2];
+        chunk[0] = chunk_rows;
+        chunk[1] = dataset.cols;
+        H5Pset_chunk(plist_id, 2, chunk);
+        H5Pset_shuffle(plist_id);
+        H5Pset_deflate(plist_id, std::min(compression_level, 9));
+        // whole chunks per block, so that each chunk is compressed once
+        block_rows = std::max(block_rows/chunk_rows, size_t(1))*chunk_rows;
+    }
 
     hid_t dataset_id;
 #if H5Dcreate_vers == 2
-    dataset_id = H5Dcreate2(file_id, name.c_str(), get_hdf5_type<T>(), space_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    dataset_id = H5Dcreate2(file_id, name.c_str(), get_hdf5_type<T>(), space_id, H5P_DEFAULT, plist_id, H5P_DEFAULT);
 #else
-    dataset_id = H5Dcreate(file_id, name.c_str(), get_hdf5_type<T>(), space_id, H5P_DEFAULT);
+    dataset_id = H5Dcreate(file_id, name.c_str(), get_hdf5_type<T>(), space_id, plist_id);
 #endif
+    H5Pclose(plist_id);
 
     if (dataset_id<0) {
-#if H5Dopen_vers == 2
-        dataset_id = H5Dopen2(file_id, name.c_str(), H5P_DEFAULT);
-#else
-        dataset_id = H5Dopen(file_id, name.c_str());
-#endif
+        dataset_id = open_hdf5_dataset(file_id, name);
     }
     CHECK_ERROR(dataset_id,"Error creating or opening dataset in file.");
 
-    status = H5Dwrite(dataset_id, get_hdf5_type<T>(), memspace_id, space_id, H5P_DEFAULT, dataset.ptr() );
-    CHECK_ERROR(status, "Error writing to dataset");
+    // rows that are not packed are copied to a buffer before being written
+    bool packed = dataset.stride==dataset.cols*sizeof(T);
+    std::vector<T> buffer;
+    status = 0;
+    for (size_t first=0; first<dataset.rows && status>=0; first+=block_rows) {
+        hsize_t count[2] = { std::min(block_rows, dataset.rows-first), dataset.cols };
+        hsize_t offset[2] = { first, 0 };
+        const T* data = dataset[first];
+        if (!packed) {
+            buffer.resize(count[0]*count[1]);
+            for (size_t i=0;i<count[0];++i) {
+                std::copy(dataset[first+i], dataset[first+i]+dataset.cols, &buffer[i*dataset.cols]);
+            }
+            data = &buffer[0];
+        }
+        hid_t memspace_id = H5Screate_simple(2, count, NULL);
+        H5Sselect_hyperslab(space_id, H5S_SELECT_SET, offset, NULL, count, NULL);
+        status = H5Dwrite(dataset_id, get_hdf5_type<T>(), memspace_id, space_id, H5P_DEFAULT, data);
+        H5Sclose(memspace_id);
+    }
 
-    H5Sclose(memspace_id);
     H5Sclose(space_id);
     H5Dclose(dataset_id);
     H5Fclose(file_id);
 
+    CHECK_ERROR(status, "Error writing to dataset");
 }
 
 
+/**
+ * Reads ranges of rows of a two dimensional dataset of a hdf5 file.
+ *
+ * A dataset stored contiguously in the native format of T is mapped in memory
+ * and read on all the OpenMP threads (see MappedDataset::read()), and read() can
+ * then be called from several threads for disjoint ranges. Other datasets
+ * (chunked, compressed or needing a type conversion) are read through the hdf5
+ * library with hyperslab selections, and only one thread at a time can use the
+ * library unless it was built thread safe.
+ */
+template<typename T>
+class Hdf5DatasetReader
+{
+public:
+    /**
+     * @param filename HDF5 file name
+     * @param name Name of dataset inside file
+     */
+    Hdf5DatasetReader(const std::string& filename, const std::string& name) :
+        file_id_(-1), dataset_id_(-1), space_id_(-1), chunk_rows_(0)
+    {
+        file_id_ = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        CHECK_ERROR(file_id_,"Error opening hdf5 file.");
+        dataset_id_ = open_hdf5_dataset(file_id_, name);
+        if (dataset_id_<0) {
+            close();
+            throw FLANNException("Error opening dataset in file.");
+        }
+        space_id_ = H5Dget_space(dataset_id_);
+        dims_[0] = dims_[1] = 0;
+        if (H5Sget_simple_extent_ndims(space_id_)!=2) {
+            close();
+            throw FLANNException("Only two dimensional datasets can be read.");
+        }
+        H5Sget_simple_extent_dims(space_id_, dims_, NULL);
+
+        hid_t plist_id = H5Dget_create_plist(dataset_id_);
+        if (H5Pget_layout(plist_id)==H5D_CHUNKED) {
+            hsize_t chunk[2];
+            H5Pget_chunk(plist_id, 2, chunk);
+            chunk_rows_ = chunk[0];
+        }
+        H5Pclose(plist_id);
+
+        haddr_t offset = get_mappable_offset<T>(dataset_id_);
+        if (offset!=HADDR_UNDEF && dims_[0]>0 && dims_[1]>0) {
+            mapped_.open(filename, dims_[0], dims_[1], offset);
+        }
+    }
+
+    ~Hdf5DatasetReader()
+    {
+        close();
+    }
+
+    size_t rows() const
+    {
+        return dims_[0];
+    }
+
+    size_t cols() const
+    {
+        return dims_[1];
+    }
+
+    /**
+     * Whether the dataset is mapped in memory and can be read from several threads.
+     */
+    bool isMapped() const
+    {
+        return mapped_.isOpen();
+    }
+
+    /**
+     * A number of rows worth reading at once: about 64MB, in whole chunks
+     * for chunked datasets.
+     */
+    size_t blockRows() const
+    {
+        size_t row_size = std::max(size_t(dims_[1])*sizeof(T), size_t(1));
+        size_t block_rows = std::max(HDF5_BLOCK_BYTES/row_size, size_t(1));
+        if (chunk_rows_>0) {
+            block_rows = std::max(block_rows/chunk_rows_, size_t(1))*chunk_rows_;
+        }
+        return block_rows;
+    }
+
+    /**
+     * Reads rows [first, first+count) of the dataset.
+     * @param first First row to read
+     * @param count Number of rows to read
+     * @param dst Buffer of count*cols() elements
+     */
+    void read(size_t first, size_t count, T* dst)
+    {
+        if (first+count>rows()) {
+            throw FLANNException("Reading past the end of the dataset");
+        }
+        if (count==0) return;
+        if (mapped_.isOpen()) {
+            mapped_.read(first, count, dst);
+            return;
+        }
+        hsize_t offset[2] = { first, 0 };
+        hsize_t size[2] = { count, dims_[1] };
+        hid_t space_id = H5Scopy(space_id_);
+        hid_t memspace_id = H5Screate_simple(2, size, NULL);
+        H5Sselect_hyperslab(space_id, H5S_SELECT_SET, offset, NULL, size, NULL);
+        herr_t status = H5Dread(dataset_id_, get_hdf5_type<T>(), memspace_id, space_id, H5P_DEFAULT, dst);
+        H5Sclose(memspace_id);
+        H5Sclose(space_id);
+        CHECK_ERROR(status, "Error reading dataset");
+    }
+
+private:
+    Hdf5DatasetReader(const Hdf5DatasetReader&);
+    Hdf5DatasetReader& operator=(const Hdf5DatasetReader&);
+
+    void close()
+    {
+        if (space_id_>=0) H5Sclose(space_id_);
+        if (dataset_id_>=0) H5Dclose(dataset_id_);
+        if (file_id_>=0) H5Fclose(file_id_);
+        space_id_ = dataset_id_ = file_id_ = -1;
+    }
+
+    hid_t file_id_;
+    hid_t dataset_id_;
+    hid_t space_id_;
+    hsize_t dims_[2];
+    size_t chunk_rows_;
+    MappedDataset<T> mapped_;
+};
+
+
+/**
+ * Loads a dataset from a hdf5 file into a new matrix. The caller frees the
+ * matrix with delete[] dataset.ptr().
+ * @param dataset Dataset where the data is loaded
+ * @param filename HDF5 file name
+ * @param name Name of dataset inside file
+ */
 template<typename T>
 void load_from_file(flann::Matrix<T>& dataset, const std::string& filename, const std::string& name)
 {
-    herr_t status;
-    hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
-    CHECK_ERROR(file_id,"Error opening hdf5 file.");
+    Hdf5DatasetReader<T> reader(filename, name);
+    dataset = flann::Matrix<T>(new T[reader.rows()*reader.cols()], reader.rows(), reader.cols());
+    try {
+        reader.read(0, reader.rows(), dataset.ptr());
+    }
+    catch (...) {
+        delete[] dataset.ptr();
+        dataset = flann::Matrix<T>();
+        throw;
+    }
+}
 
-    hid_t dataset_id;
-#if H5Dopen_vers == 2
-    dataset_id = H5Dopen2(file_id, name.c_str(), H5P_DEFAULT);
-#else
-    dataset_id = H5Dopen(file_id, name.c_str());
-#endif
-    CHECK_ERROR(dataset_id,"Error opening dataset in file.");
 
-    hid_t space_id = H5Dget_space(dataset_id);
+/**
+ * Loads a dataset from a hdf5 file into a new matrix like load_from_file(), and
+ * calls callback(block) for each block of rows as soon as it is read, while the
+ * next blocks are read on another thread. An index can so be built while the
+ * dataset is being read:
+ *
+ *     Index<L2<float> >* index = NULL;
+ *     stream_from_file(dataset, "dataset.h5", "dataset", [&](const Matrix<float>& block) {
+ *         if (index==NULL) { index = new Index<L2<float> >(block, params); index->buildIndex(); }
+ *         else index->addPoints(block);
+ *     });
+ *
+ * The blocks are views of the rows of dataset. The hdf5 library must not be
+ * used by the callback, unless it was built thread safe.
+ * @param dataset Dataset where the data is loaded
+ * @param filename HDF5 file name
+ * @param name Name of dataset inside file
+ * @param callback Called with each block of rows, in order
+ * @param block_rows Number of rows of the blocks, 0 for about 64MB
+ */
+template<typename T, typename Callback>
+void stream_from_file(flann::Matrix<T>& dataset, const std::string& filename, const std::string& name,
+                      Callback callback, size_t block_rows = 0)
+{
+    Hdf5DatasetReader<T> reader(filename, name);
+    const size_t rows = reader.rows();
+    const size_t cols = reader.cols();
+    if (block_rows==0) {
+        block_rows = reader.blockRows();
+    }
+    dataset = flann::Matrix<T>(new T[rows*cols], rows, cols);
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    size_t rows_read = 0;
+    bool stop = false;
+    std::exception_ptr error;
+
+    std::thread io([&]() {
+        try {
+            for (size_t first=0; first<rows; first+=block_rows) {
+                size_t count = std::min(block_rows, rows-first);
+                reader.read(first, count, dataset[first]);
+                std::lock_guard<std::mutex> lock(mutex);
+                rows_read = first+count;
+                ready.notify_one();
+                if (stop) break;
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = std::current_exception();
+            ready.notify_one();
+        }
+    });
+
+    try {
+        size_t done = 0;
+        while (done<rows) {
+            size_t available;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&]() { return rows_read>done || error; });
+                if (rows_read<=done) break;
+                available = rows_read;
+            }
+            for (; done<available; done+=block_rows) {
+                callback(flann::Matrix<T>(dataset[done], std::min(block_rows, rows-done), cols));
+            }
+        }
+    }
+    catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        io.join();
+        delete[] dataset.ptr();
+        dataset = flann::Matrix<T>();
+        throw;
+    }
+    io.join();
+    if (error) {
+        delete[] dataset.ptr();
+        dataset = flann::Matrix<T>();
+        std::rethrow_exception(error);
+    }
+}
 
-    hsize_t dims_out[2];
-    H5Sget_simple_extent_dims(space_id, dims_out, NULL);
 
-    dataset = flann::Matrix<T>(new T[dims_out[0]*dims_out[1]], dims_out[0], dims_out[1]);
+/**
+ * Maps a dataset of a hdf5 file in memory instead of reading it, see MappedDataset.
+ * Only datasets stored contiguously, without compression, in the native
+ * format of T can be mapped.
+ * @param dataset Dataset where the file is mapped
+ * @param filename HDF5 file name
+ * @param name Name of dataset inside file
+ */
+template<typename T>
+void map_from_file(MappedDataset<T>& dataset, const std::string& filename, const std::string& name)
+{
+    hid_t file_id = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    CHECK_ERROR(file_id,"Error opening hdf5 file.");
+
+    hid_t dataset_id = open_hdf5_dataset(file_id, name);
+    if (dataset_id<0) {
+        H5Fclose(file_id);
+        throw FLANNException("Error opening dataset in file.");
+    }
 
-    status = H5Dread(dataset_id, get_hdf5_type<T>(), H5S_ALL, H5S_ALL, H5P_DEFAULT, dataset[0]);
-    CHECK_ERROR(status, "Error reading dataset");
+    hid_t space_id = H5Dget_space(dataset_id);
+    hsize_t dims[2] = {0, 0};
+    int ndims = H5Sget_simple_extent_dims(space_id, dims, NULL);
+    haddr_t offset = ndims==2 ? get_mappable_offset<T>(dataset_id) : HADDR_UNDEF;
 
     H5Sclose(space_id);
     H5Dclose(dataset_id);
     H5Fclose(file_id);
-}
 
+    if (ndims!=2) {
+        throw FLANNException("Only two dimensional datasets can be mapped.");
+    }
+    if (offset==HADDR_UNDEF) {
+        throw FLANNException("The dataset is chunked, compressed or not in the native format and cannot be mapped, use load_from_file().");
+    }
+    dataset.open(filename, dims[0], dims[1], offset);
+}
 
 #ifdef HAVE_MPI
 
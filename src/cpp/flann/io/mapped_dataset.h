@@ -0,0 +1,317 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_MAPPED_DATASET_H_
+#define FLANN_MAPPED_DATASET_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "flann/general.h"
+#include "flann/util/matrix.h"
+
+
+namespace flann
+{
+
+/**
+ * A dataset used in place from a read-only memory mapping of a file.
+ *
+ * The index only keeps pointers to the dataset rows, so an index saved without
+ * its dataset (the default, see the "save_dataset" parameter) can be loaded
+ * against matrix() without copying the points. Several processes mapping the
+ * same file share a single copy of it in the page cache, each with its own
+ * (small) index file. The mapping must outlive any index using it.
+ */
+template<typename T>
+class MappedDataset
+{
+public:
+    MappedDataset() : base_(NULL), length_(0)
+    {
+    }
+
+    ~MappedDataset()
+    {
+        close();
+    }
+
+    /**
+     * Maps a file and views part of it as a dataset.
+     * @param filename File to map
+     * @param rows Number of rows of the dataset
+     * @param cols Number of columns of the dataset
+     * @param offset Offset in bytes of the first row in the file
+     * @param stride Distance in bytes between the rows, or 0 for packed rows
+     */
+    void open(const std::string& filename, size_t rows, size_t cols, size_t offset = 0, size_t stride = 0)
+    {
+        map(filename);
+        setView(offset, rows, cols, stride);
+    }
+
+    /**
+     * Maps a file of packed rows of cols elements, the number of rows is
+     * given by the file size.
+     * @param filename File to map
+     * @param cols Number of columns of the dataset
+     * @param offset Size in bytes of a header preceding the data
+     */
+    void openRaw(const std::string& filename, size_t cols, size_t offset = 0)
+    {
+        map(filename);
+        size_t row_size = cols*sizeof(T);
+        if (cols==0 || length_<offset || (length_-offset)%row_size!=0) {
+            close();
+            throw FLANNException("The size of the dataset file is not a multiple of the row size");
+        }
+        setView(offset, (length_-offset)/row_size, cols);
+    }
+
+    /**
+     * Maps a file in the .fvecs/.ivecs/.bvecs format, where each row is
+     * preceded by its dimension stored as a 32 bit integer.
+     * @param filename File to map
+     */
+    void openVecs(const std::string& filename)
+    {
+        map(filename);
+        int32_t dim = 0;
+        if (length_>=sizeof(dim)) {
+            memcpy(&dim, base_, sizeof(dim));
+        }
+        size_t row_size = sizeof(dim)+size_t(dim)*sizeof(T);
+        if (dim<=0 || length_%row_size!=0) {
+            close();
+            throw FLANNException("Invalid vecs file, the file size does not match the dimension of the first row");
+        }
+        size_t rows = length_/row_size;
+        int32_t last_dim;
+        memcpy(&last_dim, static_cast<char*>(base_)+(rows-1)*row_size, sizeof(last_dim));
+        if (last_dim!=dim) {
+            close();
+            throw FLANNException("Invalid vecs file, the rows have different dimensions");
+        }
+        setView(sizeof(dim), rows, dim, row_size);
+    }
+
+    /**
+     * Unmaps the file. The indexes using the dataset must not be used afterwards.
+     */
+    void close()
+    {
+        if (base_!=NULL) {
+#ifdef WIN32
+            UnmapViewOfFile(base_);
+#else
+            munmap(base_, length_);
+#endif
+        }
+        base_ = NULL;
+        length_ = 0;
+        dataset_ = Matrix<T>();
+    }
+
+    bool isOpen() const
+    {
+        return base_!=NULL;
+    }
+
+    /**
+     * The mapped dataset. The memory is read only.
+     */
+    const Matrix<T>& matrix() const
+    {
+        return dataset_;
+    }
+
+    /**
+     * Copies rows [first, first+count) of the dataset to dst, packed, on all
+     * the OpenMP threads. The threads fault in disjoint ranges of the file, which
+     * is much faster than a single sequential read on storage with deep queues.
+     * @param first First row to copy
+     * @param count Number of rows to copy
+     * @param dst Buffer of count*cols() elements
+     */
+    void read(size_t first, size_t count, T* dst) const
+    {
+        if (first+count>dataset_.rows) {
+            throw FLANNException("Reading past the end of the mapped dataset");
+        }
+        if (count==0) return;
+        const char* begin = reinterpret_cast<const char*>(dataset_[first]);
+        size_t length = (count-1)*dataset_.stride+dataset_.cols*sizeof(T);
+#ifndef WIN32
+        // the rows are read once, start reading them ahead of the copy
+        size_t page = sysconf(_SC_PAGESIZE);
+        const char* aligned = begin - (size_t(begin)%page);
+        madvise(const_cast<char*>(aligned), length+(begin-aligned), MADV_WILLNEED);
+#endif
+        size_t row_size = dataset_.cols*sizeof(T);
+        if (dataset_.stride==row_size) {
+            const long blocks = long((length+READ_BLOCK_BYTES-1)/READ_BLOCK_BYTES);
+#pragma omp parallel for schedule(static)
+            for (long i=0;i<blocks;++i) {
+                size_t offset = size_t(i)*READ_BLOCK_BYTES;
+                memcpy(reinterpret_cast<char*>(dst)+offset, begin+offset, (std::min)(size_t(READ_BLOCK_BYTES), length-offset));
+            }
+        }
+        else {
+#pragma omp parallel for schedule(static)
+            for (long i=0;i<long(count);++i) {
+                memcpy(dst+i*dataset_.cols, begin+i*dataset_.stride, row_size);
+            }
+        }
+    }
+
+    size_t rows() const
+    {
+        return dataset_.rows;
+    }
+
+    size_t cols() const
+    {
+        return dataset_.cols;
+    }
+
+private:
+    /** Size of the ranges copied by one thread in read() */
+    enum { READ_BLOCK_BYTES = 1<<20 };
+
+    MappedDataset(const MappedDataset&);
+    MappedDataset& operator=(const MappedDataset&);
+
+    void map(const std::string& filename)
+    {
+        close();
+#ifdef WIN32
+        HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file==INVALID_HANDLE_VALUE) {
+            throw FLANNException("Cannot open dataset file: "+filename);
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart==0) {
+            CloseHandle(file);
+            throw FLANNException("Cannot map empty dataset file: "+filename);
+        }
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (mapping==NULL) {
+            throw FLANNException("Cannot map dataset file: "+filename);
+        }
+        void* base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (base==NULL) {
+            throw FLANNException("Cannot map dataset file: "+filename);
+        }
+        length_ = size_t(size.QuadPart);
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd<0) {
+            throw FLANNException("Cannot open dataset file: "+filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st)!=0 || st.st_size==0) {
+            ::close(fd);
+            throw FLANNException("Cannot map empty dataset file: "+filename);
+        }
+        void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base==MAP_FAILED) {
+            throw FLANNException("Cannot map dataset file: "+filename);
+        }
+        // tree searches touch the rows in no particular order, read ahead is wasted
+        madvise(base, st.st_size, MADV_RANDOM);
+        length_ = st.st_size;
+#endif
+        base_ = base;
+    }
+
+    void setView(size_t offset, size_t rows, size_t cols, size_t stride = 0)
+    {
+        if (stride==0) stride = cols*sizeof(T);
+        if (rows>0 && offset+(rows-1)*stride+cols*sizeof(T)>length_) {
+            close();
+            throw FLANNException("The dataset extends past the end of the mapped file");
+        }
+        dataset_ = Matrix<T>(reinterpret_cast<T*>(static_cast<char*>(base_)+offset), rows, cols, stride);
+    }
+
+    void* base_;
+    size_t length_;
+    Matrix<T> dataset_;
+};
+
+
+/**
+ * Reads a file of packed rows of cols elements, such as a dataset saved with
+ * fwrite(), into a new matrix. The caller frees the matrix with delete[] dataset.ptr().
+ * @param dataset Dataset where the file is read
+ * @param filename File name
+ * @param cols Number of columns of the dataset
+ * @param offset Size in bytes of a header preceding the data
+ */
+template<typename T>
+void load_raw_file(Matrix<T>& dataset, const std::string& filename, size_t cols, size_t offset = 0)
+{
+    MappedDataset<T> mapped;
+    mapped.openRaw(filename, cols, offset);
+    dataset = Matrix<T>(new T[mapped.rows()*mapped.cols()], mapped.rows(), mapped.cols());
+    mapped.read(0, mapped.rows(), dataset.ptr());
+}
+
+/**
+ * Reads a file in the .fvecs/.ivecs/.bvecs format into a new matrix. The caller
+ * frees the matrix with delete[] dataset.ptr().
+ * @param dataset Dataset where the file is read
+ * @param filename File name
+ */
+template<typename T>
+void load_vecs_file(Matrix<T>& dataset, const std::string& filename)
+{
+    MappedDataset<T> mapped;
+    mapped.openVecs(filename);
+    dataset = Matrix<T>(new T[mapped.rows()*mapped.cols()], mapped.rows(), mapped.cols());
+    mapped.read(0, mapped.rows(), dataset.ptr());
+}
+
+}
+
+#endif /* FLANN_MAPPED_DATASET_H_ */
@@ -31,7 +31,12 @@
 #define MPI_CLIENT_H_
 
 #include <cstdlib>
+#include <map>
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <flann/general.h>
 #include <flann/util/matrix.h>
 #include <flann/util/params.h>
 #include "queries.h"
@@ -40,46 +45,166 @@ namespace flann {
 namespace mpi {
 
 
+/**
+ * Client of flann_mpi_server. It keeps one connection to the server, on which
+ * several requests can be in flight: sendKnnSearch() sends a request and
+ * returns immediately, wait() reads the responses (in whatever order the
+ * server sends them) until the one of the given request has arrived.
+ */
 class Client
 {
+	struct PendingResponse
+	{
+		size_t rows;
+		size_t cols;
+		size_t size;
+		std::vector<boost::asio::mutable_buffer> buffers;
+		// the indices are received here and converted by store() when the
+		// caller's index type is not 64 bit
+		std::vector<boost::int64_t> indices;
+		boost::function<void (const std::vector<boost::int64_t>&)> store;
+		bool done;
+		std::string error;
+	};
+
+	template<typename IndexType>
+	static void storeIndices(const std::vector<boost::int64_t>& received, flann::Matrix<IndexType> indices)
+	{
+		for (size_t i=0;i<indices.rows;++i) {
+			for (size_t j=0;j<indices.cols;++j) {
+				indices[i][j] = IndexType(received[i*indices.cols+j]);
+			}
+		}
+	}
+
 public:
-	Client(const std::string& host, const std::string& service)
+	Client(const std::string& host, const std::string& service) : socket_(io_service_), next_id_(0)
 	{
 	    tcp::resolver resolver(io_service_);
 	    tcp::resolver::query query(tcp::v4(), host, service);
-	    iterator_ = resolver.resolve(query);
+	    boost::asio::connect(socket_, resolver.resolve(query));
+	    socket_.set_option(tcp::no_delay(true));
 	}
 
 
-	template<typename ElementType, typename DistanceType>
-	void knnSearch(const flann::Matrix<ElementType>& queries, flann::Matrix<int>& indices, flann::Matrix<DistanceType>& dists, int knn, const SearchParams& params)
+	template<typename ElementType, typename IndexType, typename DistanceType>
+	void knnSearch(const flann::Matrix<ElementType>& queries, flann::Matrix<IndexType>& indices, flann::Matrix<DistanceType>& dists, int knn, const SearchParams& params)
+	{
+		wait(sendKnnSearch(queries, indices, dists, knn, params));
+	}
+
+	/**
+	 * Sends a search request without waiting for its response. The neighbors
+	 * are written directly into indices and dists, which must stay valid until
+	 * wait() has been called with the returned id. The indices can be int or,
+	 * for datasets of more than 2^31 points, a 64 bit type such as size_t.
+	 * @return The id of the request
+	 */
+	template<typename ElementType, typename IndexType, typename DistanceType>
+	unsigned int sendKnnSearch(const flann::Matrix<ElementType>& queries, flann::Matrix<IndexType>& indices, flann::Matrix<DistanceType>& dists, int knn, const SearchParams& params)
 	{
-	    tcp::socket sock(io_service_);
-	    sock.connect(*iterator_);
-
-	    Request<ElementType> req;
-	    req.nn = knn;
-	    req.queries = queries;
-	    req.checks = params.checks;
-	    // send request
-	    write_object(sock,req);
-
-	    Response<DistanceType> resp;
-	    // read response
-	    read_object(sock, resp);
-
-	    for (size_t i=0;i<indices.rows;++i) {
-	    	for (size_t j=0;j<indices.cols;++j) {
-	    		indices[i][j] = resp.indices[i][j];
-	    		dists[i][j] = resp.dists[i][j];
-	    	}
-	    }
+		if (indices.rows<queries.rows || dists.rows<queries.rows ||
+				indices.cols!=size_t(knn) || dists.cols!=size_t(knn)) {
+			throw FLANNException("The result matrices do not match the queries and the number of neighbors");
+		}
+
+		MessageHeader header;
+		header.magic = FLANN_MPI_MAGIC;
+		header.id = next_id_++;
+		header.rows = queries.rows;
+		header.cols = queries.cols;
+		header.nn = knn;
+		header.checks = params.checks;
+		header.status = FLANN_MPI_OK;
+		header.size = queries.rows*queries.cols*sizeof(ElementType);
+
+		PendingResponse& pending = pending_[header.id];
+		pending.rows = queries.rows;
+		pending.cols = knn;
+		pending.size = queries.rows*knn*(sizeof(boost::int64_t)+sizeof(DistanceType));
+		pending.done = false;
+		if (sizeof(IndexType)==sizeof(boost::int64_t)) {
+			matrix_buffers(flann::Matrix<boost::int64_t>((boost::int64_t*)indices.ptr(), queries.rows, knn, indices.stride), pending.buffers);
+		}
+		else {
+			pending.indices.resize(queries.rows*knn);
+			matrix_buffers(flann::Matrix<boost::int64_t>(&pending.indices[0], queries.rows, knn), pending.buffers);
+			pending.store = boost::bind(&Client::storeIndices<IndexType>, _1,
+					flann::Matrix<IndexType>(indices.ptr(), queries.rows, knn, indices.stride));
+		}
+		matrix_buffers(flann::Matrix<DistanceType>(dists.ptr(), queries.rows, knn, dists.stride), pending.buffers);
+
+		unsigned int id = header.id;
+		hton_header(header);
+		std::vector<boost::asio::const_buffer> buffers;
+		buffers.push_back(boost::asio::buffer(&header, sizeof(header)));
+		matrix_buffers(queries, buffers);
+		try {
+			boost::asio::write(socket_, buffers);
+		}
+		catch (...) {
+			pending_.erase(id);
+			throw;
+		}
+
+		return id;
 	}
 
+	/**
+	 * Waits for the response to a request sent with sendKnnSearch().
+	 */
+	void wait(unsigned int id)
+	{
+		std::map<unsigned int, PendingResponse>::iterator it = pending_.find(id);
+		if (it==pending_.end()) {
+			throw FLANNException("Unknown request id");
+		}
+		while (!it->second.done) {
+			readResponse();
+		}
+		std::string error = it->second.error;
+		pending_.erase(it);
+		if (!error.empty()) {
+			throw FLANNException(error);
+		}
+	}
 
 private:
+	void readResponse()
+	{
+		MessageHeader header;
+		boost::asio::read(socket_, boost::asio::buffer(&header, sizeof(header)));
+		ntoh_header(header);
+		if (header.magic!=FLANN_MPI_MAGIC) {
+			throw FLANNException("Invalid response from server");
+		}
+
+		std::map<unsigned int, PendingResponse>::iterator it = pending_.find(header.id);
+		if (it==pending_.end() || header.status!=FLANN_MPI_OK ||
+				header.rows!=it->second.rows || header.cols!=it->second.cols || header.size!=it->second.size) {
+			// error message or unexpected payload
+			std::string message(header.size, '\0');
+			if (header.size>0) {
+				boost::asio::read(socket_, boost::asio::buffer(&message[0], message.size()));
+			}
+			if (it!=pending_.end()) {
+				it->second.error = header.status!=FLANN_MPI_OK ? message : "Invalid response from server";
+				it->second.done = true;
+			}
+			return;
+		}
+
+		boost::asio::read(socket_, it->second.buffers);
+		if (it->second.store) {
+			it->second.store(it->second.indices);
+		}
+		it->second.done = true;
+	}
+
 	boost::asio::io_service io_service_;
-	tcp::resolver::iterator iterator_;
+	tcp::socket socket_;
+	unsigned int next_id_;
+	std::map<unsigned int, PendingResponse> pending_;
 };
 
 
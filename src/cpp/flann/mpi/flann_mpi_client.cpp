@@ -68,7 +68,19 @@ int main(int argc, char* argv[])
 		flann::Matrix<float> dists(new float[query.rows*nn], query.rows, nn);
 
 		start_timer("Performing search...\n");
-		index.knnSearch(query, indices, dists, nn, flann::SearchParams(64));
+		// send the queries in several requests, all in flight at the same time
+		const size_t block = 1000;
+		std::vector<unsigned int> ids;
+		for (size_t i=0;i<query.rows;i+=block) {
+			size_t rows = std::min(block, query.rows-i);
+			flann::Matrix<float> query_block(query[i], rows, query.cols, query.stride);
+			flann::Matrix<int> indices_block(indices[i], rows, nn, indices.stride);
+			flann::Matrix<float> dists_block(dists[i], rows, nn, dists.stride);
+			ids.push_back(index.sendKnnSearch(query_block, indices_block, dists_block, nn, flann::SearchParams(64)));
+		}
+		for (size_t i=0;i<ids.size();++i) {
+			index.wait(ids[i]);
+		}
 		printf("Search done (%g seconds)\n", stop_timer());
 
 		printf("Checking results\n");
@@ -1,6 +1,7 @@
 #include <boost/mpi.hpp>
 #include <flann/mpi/server.h>
 #include <stdio.h>
+#include <fstream>
 #include <time.h>
 
 int main(int argc, char* argv[])
@@ -8,12 +9,20 @@ int main(int argc, char* argv[])
 	boost::mpi::environment env(argc, argv);
 
 	try {
-		if (argc != 4) {
-			std::cout << "Usage: " << argv[0] << " <file> <dataset> <port>\n";
+		if (argc != 4 && argc != 5) {
+			std::cout << "Usage: " << argv[0] << " <file> <dataset> <port> [<index>]\n";
 			return 1;
 		}
-		flann::mpi::Server<flann::L2<float> > server(argv[1], argv[2], std::atoi(argv[3]),
-				flann::KDTreeIndexParams(4));
+		// load the index if it was saved by a previous run, otherwise build and save it
+		bool saved = argc == 5 && std::ifstream(argv[4]).good();
+		flann::IndexParams params = flann::KDTreeIndexParams(4);
+		if (saved) {
+			params = flann::SavedIndexParams(argv[4]);
+		}
+		flann::mpi::Server<flann::L2<float> > server(argv[1], argv[2], std::atoi(argv[3]), params);
+		if (argc == 5 && !saved) {
+			server.save(argv[4]);
+		}
 
 		server.run();
 	}
@@ -30,8 +30,14 @@
 #ifndef FLANN_MPI_HPP_
 #define FLANN_MPI_HPP_
 
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include <boost/cstdint.hpp>
 #include <boost/mpi.hpp>
-#include <boost/serialization/array.hpp>
 #include <flann/flann.hpp>
 #include <flann/io/hdf5.h>
 
@@ -40,73 +46,138 @@ namespace flann
 namespace mpi
 {
 
+/**
+ * A neighbor as exchanged between the processes. The results of a chunk of
+ * queries are sent as fixed size arrays of neighbors, nn per query, sorted by
+ * distance and padded with index -1 at the maximum distance. The index is 64 bit
+ * so that the whole dataset can have more than 2^31 points.
+ */
 template<typename DistanceType>
-struct SearchResults
+struct Neighbor
 {
-    flann::Matrix<int> indices;
-    flann::Matrix<DistanceType> dists;
+    DistanceType dist;
+    boost::int64_t index;
 
-    template<typename Archive>
-    void serialize(Archive& ar, const unsigned int version)
+    bool operator<(const Neighbor& other) const
     {
-        ar& indices.rows;
-        ar& indices.cols;
-        if (Archive::is_loading::value) {
-            indices = Matrix<int>(new int[indices.rows*indices.cols], indices.rows, indices.cols);
-        }
-        ar& boost::serialization::make_array(indices.ptr(), indices.rows*indices.cols);
-        if (Archive::is_saving::value) {
-            delete[] indices.ptr();
+        return (dist < other.dist) || ((dist == other.dist) && index < other.index);
+    }
+};
+
+
+/**
+ * Describes an MPI index saved by Index::save(): the dataset it was built on
+ * and the index file saved by each process. It is used to check that an index
+ * is loaded on the same dataset and with the same number of processes.
+ */
+struct IndexManifest
+{
+    struct Part
+    {
+        size_t size;
+        size_t offset;
+        std::string filename;    // relative to the manifest
+        long file_size;
+    };
+
+    std::string file_name;
+    std::string dataset_name;
+    size_t veclen;
+    size_t size;
+    std::vector<Part> parts;
+
+    void save(const std::string& filename) const
+    {
+        std::ofstream out(filename.c_str());
+        if (!out) {
+            throw FLANNException("Cannot open file for writing: " + filename);
         }
-        ar& dists.rows;
-        ar& dists.cols;
-        if (Archive::is_loading::value) {
-            dists = Matrix<DistanceType>(new DistanceType[dists.rows*dists.cols], dists.rows, dists.cols);
+        out << "FLANN_MPI_INDEX 1\n";
+        out << "file " << file_name << "\n";
+        out << "dataset " << dataset_name << "\n";
+        out << "veclen " << veclen << "\n";
+        out << "size " << size << "\n";
+        out << "processes " << parts.size() << "\n";
+        for (size_t i = 0; i < parts.size(); ++i) {
+            out << "part " << i << " " << parts[i].size << " " << parts[i].offset << " "
+                << parts[i].file_size << " " << parts[i].filename << "\n";
         }
-        ar& boost::serialization::make_array(dists.ptr(), dists.rows*dists.cols);
-        if (Archive::is_saving::value) {
-            delete[] dists.ptr();
+        out.close();
+        if (!out) {
+            throw FLANNException("Error writing file: " + filename);
         }
     }
-};
 
-template<typename DistanceType>
-struct ResultsMerger
-{
-    SearchResults<DistanceType> operator()(SearchResults<DistanceType> a, SearchResults<DistanceType> b)
+    void load(const std::string& filename)
     {
-        SearchResults<DistanceType> results;
-        results.indices = flann::Matrix<int>(new int[a.indices.rows*a.indices.cols],a.indices.rows,a.indices.cols);
-        results.dists = flann::Matrix<DistanceType>(new DistanceType[a.dists.rows*a.dists.cols],a.dists.rows,a.dists.cols);
-
-
-        for (size_t i = 0; i < results.dists.rows; ++i) {
-            size_t idx = 0;
-            size_t a_idx = 0;
-            size_t b_idx = 0;
-            while (idx < results.dists.cols) {
-                if (a.dists[i][a_idx] <= b.dists[i][b_idx]) {
-                    results.dists[i][idx] = a.dists[i][a_idx];
-                    results.indices[i][idx] = a.indices[i][a_idx];
-                    idx++;
-                    a_idx++;
-                }
-                else {
-                    results.dists[i][idx] = b.dists[i][b_idx];
-                    results.indices[i][idx] = b.indices[i][b_idx];
-                    idx++;
-                    b_idx++;
+        std::ifstream in(filename.c_str());
+        if (!in) {
+            throw FLANNException("Cannot open file: " + filename);
+        }
+        std::string line, key;
+        size_t processes = 0;
+        std::getline(in, line);
+        if (line != "FLANN_MPI_INDEX 1") {
+            throw FLANNException("Not an MPI index manifest: " + filename);
+        }
+        parts.clear();
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            fields >> key;
+            if (key == "file" || key == "dataset") {
+                std::string value = line.size() > key.size() ? line.substr(key.size() + 1) : "";
+                (key == "file" ? file_name : dataset_name) = value;
+            }
+            else if (key == "veclen") fields >> veclen;
+            else if (key == "size") fields >> size;
+            else if (key == "processes") fields >> processes;
+            else if (key == "part") {
+                Part part;
+                size_t rank;
+                fields >> rank >> part.size >> part.offset >> part.file_size >> std::ws;
+                std::getline(fields, part.filename);
+                if (rank != parts.size()) {
+                    throw FLANNException("Invalid MPI index manifest: " + filename);
                 }
+                parts.push_back(part);
             }
+            // a missing or malformed value
+            if (fields.fail()) {
+                throw FLANNException("Invalid MPI index manifest: " + filename);
+            }
+        }
+        if (parts.size() != processes) {
+            throw FLANNException("Invalid MPI index manifest: " + filename);
         }
-        delete[] a.indices.ptr();
-        delete[] a.dists.ptr();
-        delete[] b.indices.ptr();
-        delete[] b.dists.ptr();
-        return results;
     }
 };
 
+/**
+ * Throws on all the processes if an operation failed on any of them, so that
+ * they do not block waiting for each other.
+ */
+inline void check_all(const boost::mpi::communicator& world, const std::string& error)
+{
+    int failed = error.empty() ? 0 : 1;
+    int any_failed;
+    boost::mpi::all_reduce(world, failed, any_failed, boost::mpi::maximum<int>());
+    if (failed) {
+        throw FLANNException(error);
+    }
+    if (any_failed) {
+        throw FLANNException("Operation failed in another MPI process");
+    }
+}
+
+inline long file_size(const std::string& filename)
+{
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
 
 
 template<typename Distance>
@@ -115,10 +186,27 @@ class Index
     typedef typename Distance::ElementType ElementType;
     typedef typename Distance::ResultType DistanceType;
 
+    typedef Neighbor<DistanceType> NeighborType;
+
     flann::Index<Distance>* flann_index;
     flann::Matrix<ElementType> dataset;
-    int size_;
-    int offset_;
+    std::string file_name_;
+    std::string dataset_name_;
+    size_t size_;
+    size_t offset_;
+    // number of queries searched and reduced at a time
+    size_t chunk_size_;
+
+    template<typename IndexType>
+    int searchChunks(const flann::Matrix<ElementType>& queries,
+                     flann::Matrix<IndexType>& indices,
+                     flann::Matrix<DistanceType>& dists,
+                     size_t nn, float radius,
+                     const SearchParams& params, bool radius_search);
+
+    void localSearch(const flann::Matrix<ElementType>& queries,
+                     NeighborType* neighbors, size_t nn, float radius,
+                     const SearchParams& params, bool radius_search);
 
 public:
     Index(const std::string& file_name,
@@ -132,26 +220,37 @@ public:
         flann_index->buildIndex();
     }
 
+    /**
+     * The indices can be returned as int or, for datasets of more than 2^31 points,
+     * as size_t (missing neighbors are then size_t(-1)).
+     */
+    template<typename IndexType>
     void knnSearch(const flann::Matrix<ElementType>& queries,
-                   flann::Matrix<int>& indices,
+                   flann::Matrix<IndexType>& indices,
                    flann::Matrix<DistanceType>& dists,
-                   int knn, const
+                   size_t knn, const
                    SearchParams& params);
 
+    template<typename IndexType>
     int radiusSearch(const flann::Matrix<ElementType>& query,
-                     flann::Matrix<int>& indices,
+                     flann::Matrix<IndexType>& indices,
                      flann::Matrix<DistanceType>& dists,
                      float radius,
                      const SearchParams& params);
 
-    // void save(std::string filename);
+    /**
+     * Saves the index, each process saves its part next to the manifest
+     * (in filename.<rank>), process 0 writes the manifest to filename.
+     * Must be called by all the processes.
+     */
+    void save(const std::string& filename);
 
-    int veclen() const
+    size_t veclen() const
     {
         return flann_index->veclen();
     }
 
-    int size() const
+    size_t size() const
     {
         return size_;
     }
@@ -164,19 +263,63 @@ public:
 
 
 template<typename Distance>
-Index<Distance>::Index(const std::string& file_name, const std::string& dataset_name, const IndexParams& params)
+Index<Distance>::Index(const std::string& file_name, const std::string& dataset_name, const IndexParams& params) :
+    flann_index(NULL), file_name_(file_name), dataset_name_(dataset_name)
 {
     boost::mpi::communicator world;
     flann_algorithm_t index_type = get_param<flann_algorithm_t>(params,"algorithm");
+    flann::mpi::load_from_file(dataset, file_name, dataset_name);
+    chunk_size_ = std::max(get_param(params, "chunk_size", 256), 1);
+
     if (index_type == FLANN_INDEX_SAVED) {
-        throw FLANNException("Saving/loading of MPI indexes is not currently supported.");
+        // every process loads its part of the index saved by save()
+        std::string manifest_file = get_param<std::string>(params,"filename");
+        std::string error;
+        std::string index_file;
+        try {
+            IndexManifest manifest;
+            manifest.load(manifest_file);
+            std::string dir;
+            size_t pos = manifest_file.find_last_of('/');
+            if (pos != std::string::npos) dir = manifest_file.substr(0, pos + 1);
+
+            if (manifest.parts.size() != size_t(world.size())) {
+                error = "The index was saved with a different number of MPI processes";
+            }
+            else if (manifest.file_name != file_name || manifest.dataset_name != dataset_name) {
+                error = "The index was saved for a different dataset";
+            }
+            else {
+                const IndexManifest::Part& part = manifest.parts[world.rank()];
+                index_file = dir + part.filename;
+                if (dataset.rows != part.size || dataset.cols != manifest.veclen) {
+                    error = "The dataset does not match the saved index";
+                }
+                else if (file_size(index_file) != part.file_size) {
+                    error = "Missing or incomplete index file: " + index_file;
+                }
+            }
+        }
+        catch (std::exception& e) {
+            error = e.what();
+        }
+        check_all(world, error);
+
+        try {
+            flann_index = new flann::Index<Distance>(dataset, SavedIndexParams(index_file));
+        }
+        catch (std::exception& e) {
+            error = e.what();
+        }
+        check_all(world, error);
+    }
+    else {
+        flann_index = new flann::Index<Distance>(dataset, params);
     }
-    flann::mpi::load_from_file(dataset, file_name, dataset_name);
-    flann_index = new flann::Index<Distance>(dataset, params);
 
-    std::vector<int> sizes;
+    std::vector<size_t> sizes;
     // get the sizes of all MPI indices
-    all_gather(world, (int)flann_index->size(), sizes);
+    all_gather(world, flann_index->size(), sizes);
     size_ = 0;
     offset_ = 0;
     for (size_t i = 0; i < sizes.size(); ++i) {
@@ -193,79 +336,217 @@ Index<Distance>::~Index()
 }
 
 template<typename Distance>
-void Index<Distance>::knnSearch(const flann::Matrix<ElementType>& queries, flann::Matrix<int>& indices, flann::Matrix<DistanceType>& dists, int knn, const SearchParams& params)
+void Index<Distance>::save(const std::string& filename)
 {
     boost::mpi::communicator world;
-    flann::Matrix<int> local_indices(new int[queries.rows*knn], queries.rows, knn);
-    flann::Matrix<DistanceType> local_dists(new DistanceType[queries.rows*knn], queries.rows, knn);
-
-    flann_index->knnSearch(queries, local_indices, local_dists, knn, params);
-    for (size_t i = 0; i < local_indices.rows; ++i) {
-        for (size_t j = 0; j < local_indices.cols; ++j) {
-            local_indices[i][j] += offset_;
-        }
+    std::string basename = filename.substr(filename.find_last_of('/') + 1);
+    std::ostringstream part_name;
+    part_name << basename << "." << world.rank();
+
+    // all processes save their part in parallel
+    std::string error;
+    long size = -1;
+    try {
+        std::string part_file = filename.substr(0, filename.size() - basename.size()) + part_name.str();
+        flann_index->save(part_file);
+        size = file_size(part_file);
     }
-    SearchResults<DistanceType> local_results;
-    local_results.indices = local_indices;
-    local_results.dists = local_dists;
-    SearchResults<DistanceType> results;
-
-    // perform MPI reduce
-    reduce(world, local_results, results, ResultsMerger<DistanceType>(), 0);
+    catch (std::exception& e) {
+        error = e.what();
+    }
+    check_all(world, error);
 
+    std::vector<long> file_sizes;
+    std::vector<size_t> sizes;
+    gather(world, size, file_sizes, 0);
+    gather(world, flann_index->size(), sizes, 0);
     if (world.rank() == 0) {
-        for (size_t i = 0; i < results.indices.rows; ++i) {
-            for (size_t j = 0; j < results.indices.cols; ++j) {
-                indices[i][j] = results.indices[i][j];
-                dists[i][j] = results.dists[i][j];
-            }
+        IndexManifest manifest;
+        manifest.file_name = file_name_;
+        manifest.dataset_name = dataset_name_;
+        manifest.veclen = veclen();
+        manifest.size = size_;
+        size_t offset = 0;
+        for (int i = 0; i < world.size(); ++i) {
+            IndexManifest::Part part;
+            std::ostringstream name;
+            name << basename << "." << i;
+            part.size = sizes[i];
+            part.offset = offset;
+            part.filename = name.str();
+            part.file_size = file_sizes[i];
+            manifest.parts.push_back(part);
+            offset += sizes[i];
+        }
+        try {
+            manifest.save(filename);
+        }
+        catch (std::exception& e) {
+            error = e.what();
         }
-        delete[] results.indices.ptr();
-        delete[] results.dists.ptr();
     }
+    check_all(world, error);
+}
+
+template<typename Distance>
+template<typename IndexType>
+void Index<Distance>::knnSearch(const flann::Matrix<ElementType>& queries, flann::Matrix<IndexType>& indices, flann::Matrix<DistanceType>& dists, size_t knn, const SearchParams& params)
+{
+    searchChunks(queries, indices, dists, knn, 0, params, false);
 }
 
 template<typename Distance>
-int Index<Distance>::radiusSearch(const flann::Matrix<ElementType>& query, flann::Matrix<int>& indices, flann::Matrix<DistanceType>& dists, float radius, const SearchParams& params)
+template<typename IndexType>
+int Index<Distance>::radiusSearch(const flann::Matrix<ElementType>& query, flann::Matrix<IndexType>& indices, flann::Matrix<DistanceType>& dists, float radius, const SearchParams& params)
 {
     boost::mpi::communicator world;
-    flann::Matrix<int> local_indices(new int[indices.rows*indices.cols], indices.rows, indices.cols);
-    flann::Matrix<DistanceType> local_dists(new DistanceType[dists.rows*dists.cols], dists.rows, dists.cols);
+    // the result matrices only need to be allocated in process 0
+    size_t nn = indices.cols;
+    boost::mpi::broadcast(world, nn, 0);
+    return searchChunks(query, indices, dists, nn, radius, params, true);
+}
 
-    flann_index->radiusSearch(query, local_indices, local_dists, radius, params);
-    for (size_t i = 0; i < local_indices.rows; ++i) {
-        for (size_t j = 0; j < local_indices.cols; ++j) {
-            local_indices[i][j] += offset_;
+/**
+ * Searches the queries in chunks of chunk_size_ queries. The results of each
+ * chunk are reduced to process 0 along a binomial tree: each process merges the
+ * results of its children with its own and sends them to its parent, with
+ * non-blocking messages, while it searches the next chunk.
+ * @return The number of neighbors found, in process 0
+ */
+template<typename Distance>
+template<typename IndexType>
+int Index<Distance>::searchChunks(const flann::Matrix<ElementType>& queries, flann::Matrix<IndexType>& indices,
+        flann::Matrix<DistanceType>& dists, size_t nn, float radius, const SearchParams& params, bool radius_search)
+{
+    boost::mpi::communicator world;
+    MPI_Comm comm = world;
+    int rank = world.rank();
+
+    // binomial tree rooted at process 0
+    int parent = -1;
+    std::vector<int> children;
+    for (int mask = 1; mask < world.size(); mask <<= 1) {
+        if (rank & mask) {
+            parent = rank - mask;
+            break;
         }
+        if (rank + mask < world.size()) children.push_back(rank + mask);
     }
-    SearchResults<DistanceType> local_results;
-    local_results.indices = local_indices;
-    local_results.dists = local_dists;
-    SearchResults<DistanceType> results;
 
-    // perform MPI reduce
-    reduce(world, local_results, results, ResultsMerger<DistanceType>(), 0);
+    SearchParams local_params(params);
+    local_params.sorted = true;
+
+    size_t chunk_rows = chunk_size_;
+    size_t chunks = (queries.rows + chunk_rows - 1) / chunk_rows;
+    size_t chunk_neighbors = chunk_rows * nn;
+    size_t runs = children.size() + 1;
+
+    // two sets of buffers, a chunk is reduced while the next one is searched: for
+    // each chunk the local results followed by those of each child, and the merged results
+    std::vector<NeighborType> results[2];
+    std::vector<NeighborType> merged[2];
+    std::vector<MPI_Request> recv_requests[2];
+    MPI_Request send_requests[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+    for (int b = 0; b < 2; ++b) {
+        results[b].resize(runs * chunk_neighbors);
+        merged[b].resize(chunk_neighbors);
+        recv_requests[b].resize(children.size(), MPI_REQUEST_NULL);
+    }
+    TournamentTree<NeighborType> tree(runs);
+
+    int count = 0;
+    for (size_t c = 0; c <= chunks; ++c) {
+        if (c < chunks) {
+            int b = c % 2;
+            size_t first = c * chunk_rows;
+            size_t rows = std::min(chunk_rows, queries.rows - first);
+            size_t bytes = rows * nn * sizeof(NeighborType);
+            for (size_t i = 0; i < children.size(); ++i) {
+                MPI_Irecv(&results[b][(i + 1) * chunk_neighbors], int(bytes), MPI_BYTE, children[i],
+                          int(c & 0x7fff), comm, &recv_requests[b][i]);
+            }
+            localSearch(flann::Matrix<ElementType>(queries[first], rows, queries.cols), &results[b][0], nn, radius,
+                        local_params, radius_search);
+        }
 
-    if (world.rank() == 0) {
-        for (int i = 0; i < std::min(results.indices.rows, indices.rows); ++i) {
-            for (int j = 0; j < std::min(results.indices.cols, indices.cols); ++j) {
-                indices[i][j] = results.indices[i][j];
-                dists[i][j] = results.dists[i][j];
+        if (c > 0) {
+            size_t p = c - 1;
+            int b = p % 2;
+            size_t first = p * chunk_rows;
+            size_t rows = std::min(chunk_rows, queries.rows - first);
+
+            if (!recv_requests[b].empty()) {
+                MPI_Waitall(int(recv_requests[b].size()), &recv_requests[b][0], MPI_STATUSES_IGNORE);
+            }
+            // the merged buffer may still be in use by the send of chunk p-2
+            MPI_Wait(&send_requests[b], MPI_STATUS_IGNORE);
+            for (size_t q = 0; q < rows; ++q) {
+                tree.init(runs);
+                for (size_t r = 0; r < runs; ++r) {
+                    const NeighborType* run = &results[b][r * chunk_neighbors + q * nn];
+                    tree.setRun(r, run, run + nn);
+                }
+                tree.build();
+                NeighborType* out = &merged[b][q * nn];
+                for (size_t j = 0; j < nn; ++j) {
+                    out[j] = tree.top();
+                    tree.pop();
+                }
+            }
+
+            if (parent >= 0) {
+                MPI_Isend(&merged[b][0], int(rows * nn * sizeof(NeighborType)), MPI_BYTE, parent,
+                          int(p & 0x7fff), comm, &send_requests[b]);
+            }
+            else {
+                for (size_t q = 0; q < rows; ++q) {
+                    for (size_t j = 0; j < nn; ++j) {
+                        const NeighborType& neighbor = merged[b][q * nn + j];
+                        indices[first + q][j] = IndexType(neighbor.index);
+                        dists[first + q][j] = neighbor.dist;
+                        if (neighbor.index >= 0) count++;
+                    }
+                }
             }
         }
-        delete[] results.indices.ptr();
-        delete[] results.dists.ptr();
     }
-    return 0;
+    MPI_Waitall(2, send_requests, MPI_STATUSES_IGNORE);
+
+    return count;
+}
+
+/**
+ * Searches the local index, the neighbors of each query are written to nn
+ * consecutive entries, padded with index -1 at the maximum distance.
+ */
+template<typename Distance>
+void Index<Distance>::localSearch(const flann::Matrix<ElementType>& queries, NeighborType* neighbors, size_t nn,
+        float radius, const SearchParams& params, bool radius_search)
+{
+    std::vector<std::vector<size_t> > local_indices;
+    std::vector<std::vector<DistanceType> > local_dists;
+    if (radius_search) {
+        flann_index->radiusSearch(queries, local_indices, local_dists, radius, params);
+    }
+    else {
+        flann_index->knnSearch(queries, local_indices, local_dists, nn, params);
+    }
+
+    NeighborType padding;
+    padding.dist = (std::numeric_limits<DistanceType>::max)();
+    padding.index = -1;
+    for (size_t i = 0; i < queries.rows; ++i) {
+        size_t n = std::min(local_indices[i].size(), nn);
+        for (size_t j = 0; j < n; ++j) {
+            neighbors[i * nn + j].dist = local_dists[i][j];
+            neighbors[i * nn + j].index = boost::int64_t(local_indices[i][j] + offset_);
+        }
+        std::fill(neighbors + i * nn + n, neighbors + (i + 1) * nn, padding);
+    }
 }
 
 }
 } //namespace flann::mpi
 
-namespace boost { namespace mpi {
-template<typename DistanceType>
-struct is_commutative<flann::mpi::ResultsMerger<DistanceType>, flann::mpi::SearchResults<DistanceType> > : mpl::true_ { };
-} } // end namespace boost::mpi
-
 
 #endif /* FLANN_MPI_HPP_ */
@@ -30,70 +30,99 @@
 #ifndef MPI_QUERIES_H_
 #define MPI_QUERIES_H_
 
-#include <flann/mpi/matrix.h>
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
+#include <string>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/cstdint.hpp>
+#include <flann/util/matrix.h>
 
 namespace flann
 {
 
-template<typename T>
-struct Request
-{
-	flann::Matrix<T> queries;
-	int nn;
-	int checks;
-
-	template<typename Archive>
-	void serialize(Archive& ar, const unsigned int version)
-	{
-		ar & queries & nn & checks;
-	}
-};
+using boost::asio::ip::tcp;
 
-template<typename T>
-struct Response
+/**
+ * Header of the messages exchanged by flann_mpi_client and flann_mpi_server.
+ *
+ * A request is followed by the rows x cols query points, a response by the
+ * rows x cols neighbor indices (64 bit integers, -1 for a missing neighbor)
+ * and then the rows x cols distances. The header fields are sent in network
+ * byte order, the payload in the byte order of the hosts. A response with a
+ * non-zero status carries an error message instead.
+ */
+struct MessageHeader
 {
-	flann::Matrix<int> indices;
-	flann::Matrix<T> dists;
-
-	template<typename Archive>
-	void serialize(Archive& ar, const unsigned int version)
-	{
-		ar & indices & dists;
-	}
+	boost::uint32_t magic;
+	boost::uint32_t id;     // chosen by the client, the response carries the id of its request
+	boost::uint32_t rows;
+	boost::uint32_t cols;   // point size in a request, number of neighbors in a response
+	boost::uint32_t nn;
+	boost::int32_t checks;
+	boost::uint32_t status;
+	boost::uint32_t size;   // payload size in bytes
 };
 
+const boost::uint32_t FLANN_MPI_MAGIC = 0x464c4e32; // "FLN2"
 
-using boost::asio::ip::tcp;
+enum {
+	FLANN_MPI_OK = 0,
+	FLANN_MPI_ERROR = 1
+};
 
-template <typename T>
-void read_object(tcp::socket& sock, T& val)
+inline void hton_header(MessageHeader& header)
 {
-	uint32_t size;
-	boost::asio::read(sock, boost::asio::buffer(&size, sizeof(size)));
-	size = ntohl(size);
-
-	boost::asio::streambuf archive_stream;
-	boost::asio::read(sock, archive_stream, boost::asio::transfer_at_least(size));
-
-	boost::archive::binary_iarchive archive(archive_stream);
-	archive >> val;
+	header.magic = htonl(header.magic);
+	header.id = htonl(header.id);
+	header.rows = htonl(header.rows);
+	header.cols = htonl(header.cols);
+	header.nn = htonl(header.nn);
+	header.checks = htonl(header.checks);
+	header.status = htonl(header.status);
+	header.size = htonl(header.size);
 }
 
-template <typename T>
-void write_object(tcp::socket& sock, const T& val)
+inline void ntoh_header(MessageHeader& header)
 {
-	boost::asio::streambuf archive_stream;
-	boost::archive::binary_oarchive archive(archive_stream);
-	archive << val;
+	header.magic = ntohl(header.magic);
+	header.id = ntohl(header.id);
+	header.rows = ntohl(header.rows);
+	header.cols = ntohl(header.cols);
+	header.nn = ntohl(header.nn);
+	header.checks = ntohl(header.checks);
+	header.status = ntohl(header.status);
+	header.size = ntohl(header.size);
+}
 
-	uint32_t size = archive_stream.size();
-	size = htonl(size);
-	boost::asio::write(sock, boost::asio::buffer(&size, sizeof(size)));
-	boost::asio::write(sock, archive_stream);
+/**
+ * Appends the rows of a matrix to a list of buffers, so that it can be sent or
+ * received without copying it (one buffer per row if the matrix is padded).
+ */
+template<typename T>
+void matrix_buffers(const flann::Matrix<T>& matrix, std::vector<boost::asio::const_buffer>& buffers)
+{
+	size_t row_size = matrix.cols*sizeof(T);
+	if (matrix.stride==row_size) {
+		buffers.push_back(boost::asio::buffer((const void*)matrix.ptr(), matrix.rows*row_size));
+	}
+	else {
+		for (size_t i=0;i<matrix.rows;++i) {
+			buffers.push_back(boost::asio::buffer((const void*)matrix[i], row_size));
+		}
+	}
+}
 
+template<typename T>
+void matrix_buffers(const flann::Matrix<T>& matrix, std::vector<boost::asio::mutable_buffer>& buffers)
+{
+	size_t row_size = matrix.cols*sizeof(T);
+	if (matrix.stride==row_size) {
+		buffers.push_back(boost::asio::buffer((void*)matrix.ptr(), matrix.rows*row_size));
+	}
+	else {
+		for (size_t i=0;i<matrix.rows;++i) {
+			buffers.push_back(boost::asio::buffer((void*)matrix[i], row_size));
+		}
+	}
 }
 
 }
@@ -35,10 +35,16 @@
 #include <time.h>
 
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/asio.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 
 #include "queries.h"
@@ -47,60 +53,327 @@ namespace flann {
 
 namespace mpi {
 
+/**
+ * Search server running on all the MPI processes. Process 0 accepts the client
+ * connections and handles them asynchronously on a pool of threads. The
+ * requests received on all the connections are queued and the ones waiting
+ * with the same parameters are coalesced into a batch, which is broadcast to
+ * all the processes and searched with a single call.
+ */
 template<typename Distance>
 class Server
 {
 
 	typedef typename Distance::ElementType ElementType;
 	typedef typename Distance::ResultType DistanceType;
-	typedef boost::shared_ptr<tcp::socket> socket_ptr;
 	typedef flann::mpi::Index<Distance> FlannIndex;
 
-	void session(socket_ptr sock)
+	class Session;
+	typedef boost::shared_ptr<Session> session_ptr;
+
+	struct Request
 	{
-		boost::mpi::communicator world;
-		try {
-			Request<ElementType> req;
-			if (world.rank()==0) {
-				read_object(*sock,req);
-				std::cout << "Received query\n";
+		session_ptr session;
+		unsigned int id;
+		boost::shared_array<ElementType> queries;
+		size_t rows;
+		size_t nn;
+		int checks;
+	};
+
+	/**
+	 * Requests searched together. The responses are sent directly from the
+	 * result matrices, so the batch is kept alive until they are written.
+	 */
+	struct Batch
+	{
+		std::vector<Request> requests;
+		boost::shared_array<ElementType> queries;
+		flann::Matrix<boost::int64_t> indices;
+		flann::Matrix<DistanceType> dists;
+		std::string error;
+
+		~Batch()
+		{
+			delete[] indices.ptr();
+			delete[] dists.ptr();
+		}
+	};
+	typedef boost::shared_ptr<Batch> batch_ptr;
+
+	/**
+	 * Description of a batch, broadcast to all the processes.
+	 */
+	struct BatchHeader
+	{
+		boost::uint64_t rows;
+		boost::uint64_t cols;
+		boost::uint64_t nn;
+		boost::int64_t checks;
+	};
+
+	struct Response
+	{
+		MessageHeader header;
+		batch_ptr batch;
+		std::string error;
+		std::vector<boost::asio::const_buffer> buffers;
+	};
+	typedef boost::shared_ptr<Response> response_ptr;
+
+	/**
+	 * A client connection. Requests are read one after the other and queued
+	 * without waiting for their results, responses are written in the order
+	 * in which their batches complete.
+	 */
+	class Session : public boost::enable_shared_from_this<Session>
+	{
+	public:
+		Session(boost::asio::io_service& io_service, Server* server) :
+			socket_(io_service), strand_(io_service), server_(server), writing_(false)
+		{
+		}
+
+		tcp::socket& socket()
+		{
+			return socket_;
+		}
+
+		void start()
+		{
+			// the client may have closed the connection already, the read fails then
+			boost::system::error_code error;
+			socket_.set_option(tcp::no_delay(true), error);
+			readHeader();
+		}
+
+		void sendResult(const batch_ptr& batch, const Request& req, size_t first)
+		{
+			response_ptr resp(new Response());
+			resp->batch = batch;
+			resp->header.id = req.id;
+			resp->header.nn = req.nn;
+			resp->header.checks = req.checks;
+			if (!batch->error.empty()) {
+				setError(*resp, batch->error);
+			}
+			else {
+				resp->header.magic = FLANN_MPI_MAGIC;
+				resp->header.rows = req.rows;
+				resp->header.cols = req.nn;
+				resp->header.status = FLANN_MPI_OK;
+				resp->header.size = req.rows*req.nn*(sizeof(boost::int64_t)+sizeof(DistanceType));
+				hton_header(resp->header);
+				resp->buffers.push_back(boost::asio::buffer(&resp->header, sizeof(resp->header)));
+				matrix_buffers(flann::Matrix<boost::int64_t>(batch->indices[first], req.rows, req.nn), resp->buffers);
+				matrix_buffers(flann::Matrix<DistanceType>(batch->dists[first], req.rows, req.nn), resp->buffers);
 			}
-			// broadcast request to all MPI processes
-			boost::mpi::broadcast(world, req, 0);
+			send(resp);
+		}
 
-			Response<DistanceType> resp;
-			if (world.rank()==0) {
-				int rows = req.queries.rows;
-				int cols = req.nn;
-				resp.indices = flann::Matrix<int>(new int[rows*cols], rows, cols);
-				resp.dists = flann::Matrix<DistanceType>(new DistanceType[rows*cols], rows, cols);
+		void sendError(unsigned int id, const std::string& message)
+		{
+			response_ptr resp(new Response());
+			resp->header.id = id;
+			resp->header.nn = 0;
+			resp->header.checks = 0;
+			setError(*resp, message);
+			send(resp);
+		}
+
+	private:
+		void setError(Response& resp, const std::string& message)
+		{
+			resp.error = message;
+			resp.header.magic = FLANN_MPI_MAGIC;
+			resp.header.rows = 0;
+			resp.header.cols = 0;
+			resp.header.status = FLANN_MPI_ERROR;
+			resp.header.size = resp.error.size();
+			hton_header(resp.header);
+			resp.buffers.push_back(boost::asio::buffer(&resp.header, sizeof(resp.header)));
+			resp.buffers.push_back(boost::asio::buffer(resp.error));
+		}
+
+		void send(const response_ptr& resp)
+		{
+			strand_.post(boost::bind(&Session::queueResponse, this->shared_from_this(), resp));
+		}
+
+		void readHeader()
+		{
+			boost::asio::async_read(socket_, boost::asio::buffer(&header_, sizeof(header_)),
+					strand_.wrap(boost::bind(&Session::handleHeader, this->shared_from_this(),
+							boost::asio::placeholders::error)));
+		}
+
+		void handleHeader(const boost::system::error_code& error)
+		{
+			if (error) return;
+			ntoh_header(header_);
+			if (header_.magic!=FLANN_MPI_MAGIC ||
+					header_.size!=size_t(header_.rows)*header_.cols*sizeof(ElementType)) {
+				std::cerr << "Invalid request, closing connection\n";
+				return;
 			}
+			// checked before allocating the queries, the connection is closed
+			// after the error as the payload is not read
+			std::string message = server_->checkRequest(header_);
+			if (!message.empty()) {
+				sendError(header_.id, message);
+				return;
+			}
+			queries_.reset(new ElementType[size_t(header_.rows)*header_.cols]);
+			boost::asio::async_read(socket_, boost::asio::buffer((void*)queries_.get(), header_.size),
+					strand_.wrap(boost::bind(&Session::handleQueries, this->shared_from_this(),
+							boost::asio::placeholders::error)));
+		}
 
-			std::cout << "Searching in process " << world.rank() << "\n";
-			index_->knnSearch(req.queries, resp.indices, resp.dists, req.nn, flann::SearchParams(req.checks));
+		void handleQueries(const boost::system::error_code& error)
+		{
+			if (error) return;
+			Request req;
+			req.session = this->shared_from_this();
+			req.id = header_.id;
+			req.queries = queries_;
+			req.rows = header_.rows;
+			req.nn = header_.nn;
+			req.checks = header_.checks;
+			server_->enqueue(req);
+			queries_.reset();
+			readHeader();
+		}
 
-			if (world.rank()==0) {
-				std::cout << "Sending result\n";
-				write_object(*sock,resp);
+		void queueResponse(const response_ptr& resp)
+		{
+			responses_.push_back(resp);
+			if (!writing_) {
+				writeResponse();
 			}
+		}
 
-			delete[] req.queries.ptr();
-			if (world.rank()==0) {
-				delete[] resp.indices.ptr();
-				delete[] resp.dists.ptr();
+		void writeResponse()
+		{
+			writing_ = true;
+			boost::asio::async_write(socket_, responses_.front()->buffers,
+					strand_.wrap(boost::bind(&Session::handleWrite, this->shared_from_this(),
+							boost::asio::placeholders::error)));
+		}
+
+		void handleWrite(const boost::system::error_code& error)
+		{
+			writing_ = false;
+			if (error) {
+				responses_.clear();
+				return;
+			}
+			responses_.pop_front();
+			if (!responses_.empty()) {
+				writeResponse();
 			}
+		}
+
+		tcp::socket socket_;
+		boost::asio::io_service::strand strand_;
+		Server* server_;
+		MessageHeader header_;
+		boost::shared_array<ElementType> queries_;
+		std::deque<response_ptr> responses_;
+		bool writing_;
+	};
+
+
+	void startAccept()
+	{
+		session_ptr session(new Session(*io_service_, this));
+		acceptor_->async_accept(session->socket(),
+				boost::bind(&Server::handleAccept, this, session, boost::asio::placeholders::error));
+	}
+
+	void handleAccept(session_ptr session, const boost::system::error_code& error)
+	{
+		if (!error) {
+			session->start();
+		}
+		startAccept();
+	}
+
+	/**
+	 * Memory needed to search a batch: the queries and the result matrices.
+	 */
+	size_t batchSize(size_t rows, size_t nn) const
+	{
+		return rows*(size_t(index_->veclen())*sizeof(ElementType) + nn*(sizeof(boost::int64_t)+sizeof(DistanceType)));
+	}
 
+	/**
+	 * Checks a request header against the index and the limits of the server,
+	 * returns an error message for an invalid request.
+	 */
+	std::string checkRequest(const MessageHeader& header) const
+	{
+		if (header.cols!=size_t(index_->veclen())) {
+			return "The query points do not have the dimensionality of the dataset";
+		}
+		if (header.nn==0 || header.nn>size_t(index_->size())) {
+			return "Invalid number of neighbors";
 		}
-		catch (std::exception& e) {
-			std::cerr << "Exception in thread: " << e.what() << "\n";
+		if (header.rows>max_batch_rows_ || batchSize(header.rows, header.nn)>max_batch_size_) {
+			return "The request exceeds the maximum batch size of the server";
 		}
+		return std::string();
 	}
 
+	void enqueue(const Request& req)
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		requests_.push_back(req);
+		cond_.notify_one();
+	}
+
+	/**
+	 * Waits for requests and takes the ones that can be searched together
+	 * with the oldest one: same number of neighbors and checks, up to
+	 * max_batch_rows_ queries and max_batch_size_ bytes. Returns an empty
+	 * batch once the server is stopped and the queued requests are searched.
+	 */
+	batch_ptr nextBatch()
+	{
+		batch_ptr batch(new Batch());
+		boost::mutex::scoped_lock lock(mutex_);
+		while (requests_.empty() && !stopped_) {
+			cond_.wait(lock);
+		}
+		if (requests_.empty()) {
+			return batch;
+		}
+		size_t rows = 0;
+		const Request first = requests_.front();
+		typename std::deque<Request>::iterator it = requests_.begin();
+		while (it!=requests_.end()) {
+			if (it->nn==first.nn && it->checks==first.checks &&
+					(batch->requests.empty() || (rows+it->rows<=max_batch_rows_ &&
+							batchSize(rows+it->rows, first.nn)<=max_batch_size_))) {
+				rows += it->rows;
+				batch->requests.push_back(*it);
+				it = requests_.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		return batch;
+	}
 
 
 public:
-	Server(const std::string& filename, const std::string& dataset, short port, const IndexParams& params) :
-		port_(port)
+	/**
+	 * A request with more than max_batch_rows queries or needing more than
+	 * max_batch_size bytes for its queries and results is rejected.
+	 */
+	Server(const std::string& filename, const std::string& dataset, short port, const IndexParams& params,
+			int threads = 0, size_t max_batch_rows = 65536, size_t max_batch_size = size_t(1)<<28) :
+		threads_(threads), max_batch_rows_(max_batch_rows), max_batch_size_(max_batch_size), stopped_(false)
 	{
 		boost::mpi::communicator world;
 		if (world.rank()==0) {
@@ -108,42 +381,158 @@ public:
 			std::flush(std::cout);
 		}
 		index_ = new FlannIndex(filename, dataset, params);
-		index_->buildIndex();
+		index_->buildIndex(); // does nothing for a saved index
 		world.barrier(); // wait for data to be loaded and indexes to be created
 		if (world.rank()==0) {
 			std::cout << "done.\n";
+			// the connections made before run() wait in the listen queue
+			io_service_.reset(new boost::asio::io_service());
+			acceptor_.reset(new tcp::acceptor(*io_service_, tcp::endpoint(tcp::v4(), port)));
+		}
+		if (threads_<=0) {
+			threads_ = std::max(1u, boost::thread::hardware_concurrency());
 		}
 	}
 
+	~Server()
+	{
+		delete index_;
+	}
+
+
+	/**
+	 * Port on which process 0 listens, useful when the server was created
+	 * with port 0 to let the system choose a free one.
+	 */
+	unsigned short port() const
+	{
+		return acceptor_ ? acceptor_->local_endpoint().port() : 0;
+	}
+
+
+	/**
+	 * Saves the index, so that the server can be started with
+	 * SavedIndexParams(filename) instead of building it again.
+	 */
+	void save(const std::string& filename)
+	{
+		index_->save(filename);
+	}
+
+
+	/**
+	 * Makes run() return on all the processes once the requests already
+	 * queued have been searched. Responses not yet written when run()
+	 * returns are dropped. Can be called from any thread of process 0.
+	 */
+	void stop()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		stopped_ = true;
+		cond_.notify_one();
+	}
+
 
 	void run()
 	{
 		boost::mpi::communicator world;
-		boost::shared_ptr<boost::asio::io_service> io_service;
-		boost::shared_ptr<tcp::acceptor> acceptor;
+		MPI_Comm comm = world;
+		boost::thread_group io_threads;
 
 		if (world.rank()==0) {
-			io_service.reset(new boost::asio::io_service());
-			acceptor.reset(new tcp::acceptor(*io_service, tcp::endpoint(tcp::v4(), port_)));
+			startAccept();
+			for (int i=0;i<threads_;++i) {
+				io_threads.create_thread(boost::bind(&boost::asio::io_service::run, io_service_.get()));
+			}
 			std::cout << "Start listening for queries...\n";
 		}
+
+		size_t veclen = index_->veclen();
 		for (;;) {
-			socket_ptr sock;
+			batch_ptr batch;
+			BatchHeader header;
+			if (world.rank()==0) {
+				batch = nextBatch();
+				if (batch->requests.empty()) {
+					// stopped, a batch without neighbors makes all the processes return
+					header.rows = header.cols = header.nn = header.checks = 0;
+					MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, comm);
+					break;
+				}
+				header.rows = 0;
+				for (size_t i=0;i<batch->requests.size();++i) {
+					header.rows += batch->requests[i].rows;
+				}
+				header.cols = veclen;
+				header.nn = batch->requests[0].nn;
+				header.checks = batch->requests[0].checks;
+				if (batch->requests.size()==1) {
+					batch->queries = batch->requests[0].queries;
+				}
+				else {
+					batch->queries.reset(new ElementType[header.rows*header.cols]);
+					ElementType* ptr = batch->queries.get();
+					for (size_t i=0;i<batch->requests.size();++i) {
+						size_t count = batch->requests[i].rows*header.cols;
+						std::copy(batch->requests[i].queries.get(), batch->requests[i].queries.get()+count, ptr);
+						ptr += count;
+					}
+				}
+				batch->indices = flann::Matrix<boost::int64_t>(new boost::int64_t[header.rows*header.nn], header.rows, header.nn);
+				batch->dists = flann::Matrix<DistanceType>(new DistanceType[header.rows*header.nn], header.rows, header.nn);
+			}
+			else {
+				batch.reset(new Batch());
+			}
+
+			// broadcast the batch to all MPI processes
+			MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, comm);
+			if (header.nn==0) {
+				break;
+			}
+			if (world.rank()!=0) {
+				batch->queries.reset(new ElementType[header.rows*header.cols]);
+			}
+			MPI_Bcast(batch->queries.get(), int(header.rows*header.cols*sizeof(ElementType)), MPI_BYTE, 0, comm);
+
+			try {
+				flann::Matrix<ElementType> queries(batch->queries.get(), header.rows, header.cols);
+				index_->knnSearch(queries, batch->indices, batch->dists, header.nn, flann::SearchParams(header.checks));
+			}
+			catch (std::exception& e) {
+				batch->error = e.what();
+			}
+
 			if (world.rank()==0) {
-				sock.reset(new tcp::socket(*io_service));
-				acceptor->accept(*sock);
-				std::cout << "Accepted connection\n";
+				size_t first = 0;
+				for (size_t i=0;i<batch->requests.size();++i) {
+					const Request& req = batch->requests[i];
+					req.session->sendResult(batch, req, first);
+					first += req.rows;
+				}
 			}
-			world.barrier(); // everybody waits here for a connection
-			boost::thread t(boost::bind(&Server::session, this, sock));
-			t.join();
 		}
 
+		if (world.rank()==0) {
+			acceptor_->close();
+			io_service_->stop();
+			io_threads.join_all();
+		}
 	}
 
 private:
 	FlannIndex* index_;
-	short port_;
+	int threads_;
+	size_t max_batch_rows_;
+	size_t max_batch_size_;
+
+	boost::shared_ptr<boost::asio::io_service> io_service_;
+	boost::shared_ptr<tcp::acceptor> acceptor_;
+
+	boost::mutex mutex_;
+	boost::condition_variable cond_;
+	std::deque<Request> requests_;
+	bool stopped_;
 };
 
 
@@ -34,6 +34,7 @@
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <vector>
 
 #include "flann/util/matrix.h"
 #include "flann/algorithms/nn_index.h"
@@ -82,10 +83,53 @@ typename Distance::ResultType computeDistanceRaport(const Matrix<typename Distan
     return ret;
 }
 
+/**
+ * Search quality of the neighbors found for one query, between 0 and 1
+ * @param metric FLANN_PRECISION_AT_K: fraction of the true k nearest neighbors found,
+ *      FLANN_RECALL_AT_K: 1 if the true nearest neighbor is among the k found,
+ *      FLANN_DISTANCE_RATIO: mean ratio between the true and the found neighbor distances
+ */
+template <typename Distance>
+float computeSearchQuality(const Matrix<typename Distance::ElementType>& inputData, typename Distance::ElementType* target,
+        size_t* neighbors, size_t* groundTruth, int veclen, int n, flann_precision_metric_t metric, const Distance& distance)
+{
+    typedef typename Distance::ResultType DistanceType;
+
+    switch (metric) {
+    case FLANN_RECALL_AT_K:
+        for (int i=0; i<n; ++i) {
+            if (neighbors[i]==groundTruth[0]) return 1;
+        }
+        return 0;
+    case FLANN_DISTANCE_RATIO: {
+        float ratio = 0;
+        for (int i=0; i<n; ++i) {
+            DistanceType num = distance(inputData[groundTruth[i]], target, veclen);
+            DistanceType den = distance(inputData[neighbors[i]], target, veclen);
+            ratio += (den==0) ? 1 : float(num)/float(den);
+        }
+        return ratio/n;
+    }
+    default:
+        return float(countCorrectMatches(neighbors, groundTruth, n))/n;
+    }
+}
+
+/**
+ * Search quality and time measured for a number of checks
+ */
+struct PrecisionSample
+{
+    int checks;
+    float precision;
+    float time;
+};
+
 template <typename Index, typename Distance>
 float search_with_ground_truth(Index& index, const Matrix<typename Distance::ElementType>& inputData,
                                const Matrix<typename Distance::ElementType>& testData, const Matrix<size_t>& matches, int nn, int checks,
-                               float& time, typename Distance::ResultType& dist, const Distance& distance, int skipMatches)
+                               float& time, typename Distance::ResultType& dist, const Distance& distance, int skipMatches,
+                               flann_precision_metric_t metric = FLANN_PRECISION_AT_K, std::vector<PrecisionSample>* samples = NULL)
 {
     typedef typename Distance::ElementType ElementType;
     typedef typename Distance::ResultType DistanceType;
@@ -105,19 +149,21 @@ float search_with_ground_truth(Index& index, const Matrix<typename Distance::Ele
         
     size_t* neighbors = indices + skipMatches;
 
-    int correct = 0;
+    float quality = 0;
     DistanceType distR = 0;
-    StartStopTimer t;
+    // the searches run on the calling thread, which may be one of several
+    // evaluating indexes concurrently during the autotuning
+    ThreadTimer t;
     int repeats = 0;
     while (t.value<0.2) {
         repeats++;
         t.start();
-        correct = 0;
+        quality = 0;
         distR = 0;        
         for (size_t i = 0; i < testData.rows; i++) {
             index.knnSearch(Matrix<ElementType>(testData[i], 1, testData.cols), indices_mat, dists_mat, nn+skipMatches, searchParams);
 
-            correct += countCorrectMatches(neighbors,matches[i], nn);
+            quality += computeSearchQuality<Distance>(inputData, testData[i], neighbors, matches[i], testData.cols, nn, metric, distance);
             distR += computeDistanceRaport<Distance>(inputData, testData[i], neighbors, matches[i], testData.cols, nn, distance);
         }
         t.stop();
@@ -127,13 +173,18 @@ float search_with_ground_truth(Index& index, const Matrix<typename Distance::Ele
     delete[] indices;
     delete[] dists;
 
-    float precicion = (float)correct/(nn*testData.rows);
+    float precicion = quality/testData.rows;
 
     dist = distR/(testData.rows*nn);
 
     Logger::info("%8d %10.4g %10.5g %10.5g %10.5g\n",
                  checks, precicion, time, 1000.0 * time / testData.rows, dist);
 
+    if (samples!=NULL) {
+        PrecisionSample sample = { checks, precicion, time };
+        samples->push_back(sample);
+    }
+
     return precicion;
 }
 
@@ -141,7 +192,8 @@ float search_with_ground_truth(Index& index, const Matrix<typename Distance::Ele
 template <typename Index, typename Distance>
 float test_index_checks(Index& index, const Matrix<typename Distance::ElementType>& inputData,
                         const Matrix<typename Distance::ElementType>& testData, const Matrix<size_t>& matches,
-                        int checks, float& precision, const Distance& distance, int nn = 1, int skipMatches = 0)
+                        int checks, float& precision, const Distance& distance, int nn = 1, int skipMatches = 0,
+                        flann_precision_metric_t metric = FLANN_PRECISION_AT_K)
 {
     typedef typename Distance::ResultType DistanceType;
 
@@ -150,7 +202,7 @@ float test_index_checks(Index& index, const Matrix<typename Distance::ElementTyp
 
     float time = 0;
     DistanceType dist = 0;
-    precision = search_with_ground_truth(index, inputData, testData, matches, nn, checks, time, dist, distance, skipMatches);
+    precision = search_with_ground_truth(index, inputData, testData, matches, nn, checks, time, dist, distance, skipMatches, metric);
 
     return time;
 }
@@ -158,7 +210,9 @@ float test_index_checks(Index& index, const Matrix<typename Distance::ElementTyp
 template <typename Index, typename Distance>
 float test_index_precision(Index& index, const Matrix<typename Distance::ElementType>& inputData,
                            const Matrix<typename Distance::ElementType>& testData, const Matrix<size_t>& matches,
-                           float precision, int& checks, const Distance& distance, int nn = 1, int skipMatches = 0)
+                           float precision, int& checks, const Distance& distance, int nn = 1, int skipMatches = 0,
+                           flann_precision_metric_t metric = FLANN_PRECISION_AT_K, std::vector<PrecisionSample>* samples = NULL,
+                           float maxTime = 0)
 {
     typedef typename Distance::ResultType DistanceType;
     const float SEARCH_EPS = 0.001f;
@@ -173,7 +227,7 @@ float test_index_precision(Index& index, const Matrix<typename Distance::Element
     float time;
     DistanceType dist;
 
-    p2 = search_with_ground_truth(index, inputData, testData, matches, nn, c2, time, dist, distance, skipMatches);
+    p2 = search_with_ground_truth(index, inputData, testData, matches, nn, c2, time, dist, distance, skipMatches, metric, samples);
 
     if (p2>precision) {
         Logger::info("Got as close as I can\n");
@@ -185,7 +239,12 @@ float test_index_precision(Index& index, const Matrix<typename Distance::Element
         c1 = c2;
 //         p1 = p2;
         c2 *=2;
-        p2 = search_with_ground_truth(index, inputData, testData, matches, nn, c2, time, dist, distance, skipMatches);
+        p2 = search_with_ground_truth(index, inputData, testData, matches, nn, c2, time, dist, distance, skipMatches, metric, samples);
+        if ((maxTime>0)&&(time>maxTime)&&(p2<precision)) {
+            Logger::info("Search time budget exceeded\n");
+            checks = c2;
+            return time;
+        }
     }
 
     int cx;
@@ -196,7 +255,7 @@ float test_index_precision(Index& index, const Matrix<typename Distance::Element
         // use linear approximation get a better estimation
 
         cx = (c1+c2)/2;
-        realPrecision = search_with_ground_truth(index, inputData, testData, matches, nn, cx, time, dist, distance, skipMatches);
+        realPrecision = search_with_ground_truth(index, inputData, testData, matches, nn, cx, time, dist, distance, skipMatches, metric, samples);
         while (fabs(realPrecision-precision)>SEARCH_EPS) {
 
             if (realPrecision<precision) {
@@ -210,7 +269,7 @@ float test_index_precision(Index& index, const Matrix<typename Distance::Element
                 Logger::info("Got as close as I can\n");
                 break;
             }
-            realPrecision = search_with_ground_truth(index, inputData, testData, matches, nn, cx, time, dist, distance, skipMatches);
+            realPrecision = search_with_ground_truth(index, inputData, testData, matches, nn, cx, time, dist, distance, skipMatches, metric, samples);
         }
 
         c2 = cx;
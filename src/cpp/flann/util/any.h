@@ -219,6 +219,16 @@ public:
         return assign(x);
     }
 
+    /// Assignment operator from another any, which copies the value instead
+    /// of sharing it as the implicit one would.
+    any& operator=(const any& x)
+    {
+        if (this != &x) {
+            assign(x);
+        }
+        return *this;
+    }
+
     /// Assignment operator, specialed for literal strings.
     /// They have types like const char [6] which don't work as expected.
     any& operator=(const char* x)
@@ -118,11 +118,19 @@ public:
     }
 
     /** set a bit to true
+     * The cell is written atomically, so that a single writer can set bits
+     * while other threads test them.
      * @param index the index of the bit to set to 1
      */
     void set(size_t index)
     {
-        bitset_[index / cell_bit_size_] |= size_t(1) << (index % cell_bit_size_);
+        size_t& cell = bitset_[index / cell_bit_size_];
+        size_t value = cell | (size_t(1) << (index % cell_bit_size_));
+#ifdef __GNUC__
+        __atomic_store_n(&cell, value, __ATOMIC_RELEASE);
+#else
+        cell = value;
+#endif
     }
 
     /** gives the number of contained bits
@@ -138,7 +146,12 @@ public:
      */
     bool test(size_t index) const
     {
-        return (bitset_[index / cell_bit_size_] & (size_t(1) << (index % cell_bit_size_))) != 0;
+#ifdef __GNUC__
+        size_t cell = __atomic_load_n(&bitset_[index / cell_bit_size_], __ATOMIC_RELAXED);
+#else
+        size_t cell = bitset_[index / cell_bit_size_];
+#endif
+        return (cell & (size_t(1) << (index % cell_bit_size_))) != 0;
     }
 
 private:
@@ -0,0 +1,160 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_EPOCH_H_
+#define FLANN_EPOCH_H_
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace flann
+{
+
+/**
+ * Epoch based reclamation of objects shared with concurrent readers.
+ *
+ * A reader announces the epoch in which it started in one of the reader slots and
+ * clears it when done. An object retired by the writer is deleted once no reader
+ * that started before it was retired is still active, so readers never take locks
+ * or touch shared reference counts. Retiring and reclaiming objects must be
+ * serialized by the caller.
+ */
+template <typename T>
+class EpochManager
+{
+public:
+    EpochManager() : epoch_(1)
+    {
+        for (size_t i=0;i<SLOTS;++i) {
+            slots_[i].epoch.store(0);
+        }
+    }
+
+    /**
+     * Deletes all the retired objects, there must be no active readers
+     */
+    ~EpochManager()
+    {
+        for (size_t i=0;i<retired_.size();++i) {
+            delete retired_[i].second;
+        }
+    }
+
+    /**
+     * Marks the start of a reader. At most SLOTS readers are active at the same
+     * time, further readers wait, yielding the processor, until a slot is freed.
+     * @return The slot to pass to leave()
+     */
+    size_t enter()
+    {
+        size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id()) % SLOTS;
+        for (size_t tries=1;;++tries) {
+            size_t expected = 0;
+            if (slots_[slot].epoch.compare_exchange_strong(expected, epoch_.load())) {
+                return slot;
+            }
+            slot = (slot+1) % SLOTS;
+            // all the slots are taken, let the active readers run to completion
+            if (tries%SLOTS==0) std::this_thread::yield();
+        }
+    }
+
+    /**
+     * Marks the end of a reader
+     * @param slot The slot returned by enter()
+     */
+    void leave(size_t slot)
+    {
+        slots_[slot].epoch.store(0);
+    }
+
+    /**
+     * Schedules an object that was unpublished from the readers for deletion.
+     * @param object The object to delete
+     */
+    void retire(const T* object)
+    {
+        if (object==NULL) return;
+        retired_.push_back(std::make_pair(epoch_.fetch_add(1), object));
+        reclaim();
+    }
+
+    /**
+     * Deletes the retired objects no longer used by any reader
+     */
+    void reclaim()
+    {
+        size_t min_epoch = size_t(-1);
+        for (size_t i=0;i<SLOTS;++i) {
+            size_t epoch = slots_[i].epoch.load();
+            if (epoch!=0 && epoch<min_epoch) min_epoch = epoch;
+        }
+
+        size_t last = 0;
+        for (size_t i=0;i<retired_.size();++i) {
+            // readers that entered in or before the retire epoch may still use the object
+            if (retired_[i].first<min_epoch) {
+                delete retired_[i].second;
+            }
+            else {
+                retired_[last++] = retired_[i];
+            }
+        }
+        retired_.resize(last);
+    }
+
+private:
+    EpochManager(const EpochManager&);
+    EpochManager& operator=(const EpochManager&);
+
+    static const size_t SLOTS = 64;
+
+    /** Reader slot, padded to a cache line to avoid false sharing between readers */
+    struct Slot
+    {
+        std::atomic<size_t> epoch;
+        char padding[64-sizeof(std::atomic<size_t>)];
+    };
+
+    /** Current epoch, incremented with each retired object */
+    std::atomic<size_t> epoch_;
+    /** Epoch in which each active reader started, 0 for free slots */
+    Slot slots_[SLOTS];
+    /** Retired objects with the epoch in which they were retired */
+    std::vector<std::pair<size_t, const T*> > retired_;
+};
+
+}
+
+#endif //FLANN_EPOCH_H_
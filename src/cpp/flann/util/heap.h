@@ -453,6 +453,123 @@ public:
 };
 
 
+/**
+ * Tournament tree merging sorted sequences ("runs"). Each internal node holds
+ * the run whose head wins the match between its two children, so the smallest
+ * head is at the root and advancing the winning run only replays the matches
+ * on its path to the root, log2(number of runs) comparisons.
+ * Type T must be comparable.
+ */
+template <typename T>
+class TournamentTree
+{
+    struct Run
+    {
+        const T* begin;
+        const T* end;
+    };
+
+    std::vector<Run> runs_;
+    /* winning run of each subtree, -1 if all its runs are exhausted */
+    std::vector<int> tree_;
+    size_t leaves_;
+
+public:
+    /**
+     * Constructor.
+     *
+     * Params:
+     *     runs = number of sequences to merge
+     */
+    TournamentTree(size_t runs = 0)
+    {
+        init(runs);
+    }
+
+    /**
+     * Clears the tree and sets the number of sequences to merge.
+     */
+    void init(size_t runs)
+    {
+        leaves_ = 1;
+        while (leaves_<runs) leaves_ *= 2;
+        Run empty = { NULL, NULL };
+        runs_.assign(runs, empty);
+        tree_.assign(2*leaves_, -1);
+    }
+
+    /**
+     * Sets the elements of a sequence, sorted in increasing order. The elements
+     * are not copied and must remain valid until the merge is done.
+     */
+    void setRun(size_t run, const T* begin, const T* end)
+    {
+        runs_[run].begin = begin;
+        runs_[run].end = end;
+    }
+
+    /**
+     * Plays the initial matches, call after setting the runs.
+     */
+    void build()
+    {
+        for (size_t i=0; i<leaves_; ++i) {
+            tree_[leaves_+i] = (i<runs_.size() && runs_[i].begin!=runs_[i].end) ? int(i) : -1;
+        }
+        for (size_t node=leaves_-1; node>0; --node) {
+            tree_[node] = winner(tree_[2*node], tree_[2*node+1]);
+        }
+    }
+
+    /**
+     * Returns: true if all the sequences are exhausted
+     */
+    bool empty() const
+    {
+        return tree_[1]==-1;
+    }
+
+    /**
+     * Returns: the smallest element not yet popped
+     */
+    const T& top() const
+    {
+        return *runs_[tree_[1]].begin;
+    }
+
+    /**
+     * Returns: the sequence the smallest element comes from
+     */
+    size_t topRun() const
+    {
+        return tree_[1];
+    }
+
+    /**
+     * Removes the smallest element and replays the matches of its sequence.
+     */
+    void pop()
+    {
+        int run = tree_[1];
+        ++runs_[run].begin;
+        size_t node = leaves_+run;
+        tree_[node] = (runs_[run].begin!=runs_[run].end) ? run : -1;
+        for (node/=2; node>0; node/=2) {
+            tree_[node] = winner(tree_[2*node], tree_[2*node+1]);
+        }
+    }
+
+private:
+    int winner(int a, int b) const
+    {
+        if (a<0) return b;
+        if (b<0) return a;
+        return (*runs_[b].begin < *runs_[a].begin) ? b : a;
+    }
+};
+
+
+
 
 }
 
@@ -199,6 +199,23 @@ public:
         optimize();
     }
 
+    /** Remove features from the table
+     * @param removed bitset with the values of the features to remove set
+     */
+    void removeFeatures(const DynamicBitset& removed)
+    {
+        if (speed_level_==kArray) {
+            for (size_t i = 0; i < buckets_speed_.size(); ++i) {
+                removeFeatures(buckets_speed_[i], removed);
+            }
+        }
+        else {
+            for (typename BucketsSpace::iterator it = buckets_space_.begin(); it != buckets_space_.end(); ++it) {
+                removeFeatures(it->second, removed);
+            }
+        }
+    }
+
     /** Get a bucket given the key
      * @param key
      * @return
@@ -254,6 +271,17 @@ private:
         kArray, kBitsetHash, kHash
     };
 
+    /** Remove features from a bucket, keeping the order of the others
+     */
+    static void removeFeatures(Bucket& bucket, const DynamicBitset& removed)
+    {
+        size_t last = 0;
+        for (size_t i = 0; i < bucket.size(); ++i) {
+            if (!removed.test(bucket[i])) bucket[last++] = bucket[i];
+        }
+        bucket.resize(last);
+    }
+
     /** Initialize some variables
      */
     void initialize(size_t key_size)
@@ -43,6 +43,7 @@ namespace anyimpl
 {
 SMALL_POLICY(flann_algorithm_t);
 SMALL_POLICY(flann_centers_init_t);
+SMALL_POLICY(flann_precision_metric_t);
 SMALL_POLICY(flann_log_level_t);
 SMALL_POLICY(flann_datatype_t);
 }
@@ -57,6 +58,8 @@ typedef enum {
 	FLANN_Undefined
 } tri_type;
 
+class SearchStatistics;
+
 
 struct SearchParams
 {
@@ -67,6 +70,11 @@ struct SearchParams
     	use_heap = FLANN_Undefined;
     	cores = 1;
     	matrices_in_gpu_ram = false;
+    	stall_checks = 0;
+    	time_budget_us = 0;
+    	batch_time_budget_us = 0;
+    	timed_out = NULL;
+    	stats = NULL;
     }
 
     // how many leafs to visit when searching for neighbours (-1 for unlimited)
@@ -83,6 +91,18 @@ struct SearchParams
     int cores;
     // for GPU search indicates if matrices are already in GPU ram
     bool matrices_in_gpu_ram;
+    // stop the search after this many checks without improving the neighbours found,
+    // even if fewer than 'checks' checks were done (0 to disable)
+    int stall_checks;
+    // maximum time in microseconds spent searching the neighbors of one query (0 for no limit)
+    float time_budget_us;
+    // maximum time in microseconds spent searching a whole batch of queries (0 for no limit)
+    float batch_time_budget_us;
+    // if not NULL, receives for each query whether its search was stopped by a time budget
+    bool* timed_out;
+    // if not NULL, the statistics of each query are added to it (only collected when
+    // compiled with FLANN_SEARCH_STATS)
+    SearchStatistics* stats;
 };
 
 
@@ -130,6 +150,9 @@ inline void print_params(const SearchParams& params)
 	std::cout << "eps : " << params.eps << std::endl;
 	std::cout << "sorted : " << params.sorted << std::endl;
 	std::cout << "max_neighbors : " << params.max_neighbors << std::endl;
+	std::cout << "stall_checks : " << params.stall_checks << std::endl;
+	std::cout << "time_budget_us : " << params.time_budget_us << std::endl;
+	std::cout << "batch_time_budget_us : " << params.batch_time_budget_us << std::endl;
 }
 
 
@@ -0,0 +1,264 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_QUERY_CACHE_H_
+#define FLANN_QUERY_CACHE_H_
+
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "flann/util/params.h"
+
+
+namespace flann
+{
+
+/**
+ * LRU cache of search results, for workloads where the same query vectors are
+ * searched repeatedly.
+ *
+ * Entries are keyed by a hash of the query vector and of the search parameters.
+ * The stored query is compared element by element on lookup, so only exact
+ * repeats of a query hit the cache. The cache is split in independently locked
+ * shards so that concurrent searches rarely contend on the same lock.
+ *
+ * Modifying the index invalidates the whole cache. Results of searches that
+ * started before an invalidation are not inserted afterwards, see generation().
+ */
+template <typename ElementType, typename DistanceType>
+class QueryCache
+{
+public:
+    /**
+     * Constructor
+     * @param capacity Maximum number of cached results
+     * @param shards Number of independently locked shards
+     */
+    QueryCache(size_t capacity, size_t shards = 16) : generation_(0), hits_(0), misses_(0)
+    {
+        if (shards>capacity) shards = capacity;
+        if (shards==0) shards = 1;
+        shards_ = std::vector<Shard>(shards);
+        for (size_t i=0;i<shards;++i) {
+            shards_[i].capacity = (capacity+shards-1-i)/shards;
+        }
+    }
+
+    /**
+     * Hashes the parameters of a search, the result is the seed passed to find() and insert().
+     * @param knn Number of neighbors searched, 0 for a radius search
+     * @param radius Radius of a radius search
+     * @param params Search parameters
+     */
+    static size_t searchKey(size_t knn, float radius, const SearchParams& params)
+    {
+        size_t key = hash(&knn, sizeof(knn), 0);
+        key = hash(&radius, sizeof(radius), key);
+        key = hash(&params.checks, sizeof(params.checks), key);
+        key = hash(&params.eps, sizeof(params.eps), key);
+        key = hash(&params.sorted, sizeof(params.sorted), key);
+        key = hash(&params.max_neighbors, sizeof(params.max_neighbors), key);
+        key = hash(&params.stall_checks, sizeof(params.stall_checks), key);
+        return key;
+    }
+
+    /**
+     * Looks up the result of a query
+     * @param query The query point
+     * @param veclen Dimensionality of the query
+     * @param seed Key of the search parameters, returned by searchKey()
+     * @param[out] indices Indices of the cached neighbors
+     * @param[out] dists Distances of the cached neighbors
+     * @return true if the result was found in the cache
+     */
+    bool find(const ElementType* query, size_t veclen, size_t seed,
+            std::vector<size_t>& indices, std::vector<DistanceType>& dists)
+    {
+        size_t key = hash(query, veclen*sizeof(ElementType), seed);
+        Shard& shard = shards_[key % shards_.size()];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            typename List::iterator it = lookup(shard, key, query, veclen, seed);
+            if (it!=shard.entries.end()) {
+                // move the entry to the front of the LRU list
+                shard.entries.splice(shard.entries.begin(), shard.entries, it);
+                indices = it->indices;
+                dists = it->dists;
+                hits_++;
+                return true;
+            }
+        }
+        misses_++;
+        return false;
+    }
+
+    /**
+     * Caches the result of a query, evicting the least recently used result
+     * of its shard if the shard is full.
+     * @param generation Generation of the cache when the search started
+     */
+    void insert(const ElementType* query, size_t veclen, size_t seed, size_t generation,
+            const std::vector<size_t>& indices, const std::vector<DistanceType>& dists)
+    {
+        size_t key = hash(query, veclen*sizeof(ElementType), seed);
+        Shard& shard = shards_[key % shards_.size()];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.capacity==0 || generation!=generation_.load()) return;
+
+        if (lookup(shard, key, query, veclen, seed)!=shard.entries.end()) return;
+        if (shard.entries.size()>=shard.capacity) {
+            erase(shard, --shard.entries.end());
+        }
+        shard.entries.push_front(Entry());
+        Entry& entry = shard.entries.front();
+        entry.key = key;
+        entry.seed = seed;
+        entry.query.assign(query, query+veclen);
+        entry.indices = indices;
+        entry.dists = dists;
+        shard.map.insert(std::make_pair(key, shard.entries.begin()));
+    }
+
+    /**
+     * Removes all the cached results
+     */
+    void clear()
+    {
+        generation_++;
+        for (size_t i=0;i<shards_.size();++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            shards_[i].entries.clear();
+            shards_[i].map.clear();
+        }
+    }
+
+    /**
+     * The generation is incremented by every clear(). Searches read it before
+     * searching the index and pass it to insert(), which drops the results
+     * computed before the last invalidation.
+     */
+    size_t generation() const
+    {
+        return generation_.load();
+    }
+
+    /** Number of lookups that found a cached result */
+    size_t hits() const
+    {
+        return hits_.load();
+    }
+
+    /** Number of lookups that did not find a cached result */
+    size_t misses() const
+    {
+        return misses_.load();
+    }
+
+private:
+    struct Entry
+    {
+        size_t key;
+        size_t seed;
+        std::vector<ElementType> query;
+        std::vector<size_t> indices;
+        std::vector<DistanceType> dists;
+    };
+
+    typedef std::list<Entry> List;
+    typedef std::unordered_multimap<size_t, typename List::iterator> Map;
+
+    struct Shard
+    {
+        Shard() : capacity(0) {}
+        // the mutex is not copyable, shards are only copied while empty
+        Shard(const Shard& other) : capacity(other.capacity) {}
+
+        std::mutex mutex;
+        size_t capacity;
+        /** Entries, most recently used first */
+        List entries;
+        Map map;
+    };
+
+    static typename List::iterator lookup(Shard& shard, size_t key, const ElementType* query, size_t veclen, size_t seed)
+    {
+        std::pair<typename Map::iterator, typename Map::iterator> range = shard.map.equal_range(key);
+        for (typename Map::iterator it=range.first; it!=range.second; ++it) {
+            const Entry& entry = *it->second;
+            if (entry.seed==seed && std::equal(query, query+veclen, entry.query.begin())) {
+                return it->second;
+            }
+        }
+        return shard.entries.end();
+    }
+
+    static void erase(Shard& shard, typename List::iterator entry)
+    {
+        typename Map::iterator it = shard.map.find(entry->key);
+        while (it->second!=entry) ++it;
+        shard.map.erase(it);
+        shard.entries.erase(entry);
+    }
+
+    /**
+     * FNV-1a style hash processing a word at a time.
+     */
+    static size_t hash(const void* data, size_t size, size_t seed)
+    {
+        const size_t prime = sizeof(size_t)==8 ? size_t(1099511628211ULL) : size_t(16777619UL);
+        size_t h = seed ^ (sizeof(size_t)==8 ? size_t(14695981039346656037ULL) : size_t(2166136261UL));
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        size_t i = 0;
+        for (; i+sizeof(size_t)<=size; i+=sizeof(size_t)) {
+            size_t word;
+            memcpy(&word, p+i, sizeof(word));
+            h = (h ^ word) * prime;
+            h ^= h >> 29;
+        }
+        for (; i<size; ++i) {
+            h = (h ^ p[i]) * prime;
+        }
+        return h;
+    }
+
+private:
+    std::vector<Shard> shards_;
+    std::atomic<size_t> generation_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+};
+
+}
+
+#endif // FLANN_QUERY_CACHE_H_
@@ -38,6 +38,9 @@
 #include <set>
 #include <vector>
 
+#include "flann/util/timer.h"
+#include "flann/util/search_stats.h"
+
 namespace flann
 {
 
@@ -82,6 +85,12 @@ template <typename DistanceType>
 class ResultSet
 {
 public:
+    ResultSet() : timedOut_(false), stallChecks_(0), improvedChecks_(0), improvedDist_(0)
+#ifdef FLANN_SEARCH_STATS
+        , stats_(NULL)
+#endif
+    {}
+
     virtual ~ResultSet() {}
 
     virtual bool full() const = 0;
@@ -90,6 +99,110 @@ public:
 
     virtual DistanceType worstDist() const = 0;
 
+    /**
+     * Sets the deadline of the search that fills this result set.
+     */
+    void setDeadline(const Deadline& deadline)
+    {
+        deadline_ = deadline;
+        timedOut_ = false;
+    }
+
+    /**
+     * Polled by the search, returns true once the deadline has passed and
+     * the search should stop with the neighbors found so far.
+     * @param checks Number of checks done by the search so far
+     */
+    bool expired(int checks)
+    {
+        if (!timedOut_ && deadline_.expired(checks)) {
+            timedOut_ = true;
+        }
+        return timedOut_;
+    }
+
+    /**
+     * Starts counting the checks that do not improve the neighbors found,
+     * see stalled().
+     * @param stall_checks Value of SearchParams::stall_checks, 0 to disable
+     * @param checks Number of checks done by the search so far
+     */
+    void startStallDetection(int stall_checks, int checks)
+    {
+        stallChecks_ = stall_checks;
+        improvedChecks_ = checks;
+        improvedDist_ = worstDist();
+    }
+
+    /**
+     * Polled by the search with expired(), returns true once the result is
+     * full and the last stall_checks checks did not improve it.
+     * @param checks Number of checks done by the search so far
+     */
+    bool stalled(int checks)
+    {
+        if (stallChecks_<=0) {
+            return false;
+        }
+        DistanceType dist = worstDist();
+        if (dist<improvedDist_) {
+            improvedDist_ = dist;
+            improvedChecks_ = checks;
+            return false;
+        }
+        return full() && checks-improvedChecks_>=stallChecks_;
+    }
+
+    /**
+     * Returns true if the search was stopped by the deadline.
+     */
+    bool timedOut() const
+    {
+        return timedOut_;
+    }
+
+    /**
+     * Takes over the deadline, time out and statistics of another result set,
+     * used by result sets that forward the neighbors found to another one.
+     */
+    void copySearchState(const ResultSet& other)
+    {
+        deadline_ = other.deadline_;
+        timedOut_ = other.timedOut_;
+#ifdef FLANN_SEARCH_STATS
+        stats_ = other.stats_;
+#endif
+    }
+
+#ifdef FLANN_SEARCH_STATS
+    /**
+     * Sets the statistics the search filling this result set is recorded in (NULL for none).
+     */
+    void setStats(SearchStats* stats)
+    {
+        stats_ = stats;
+    }
+
+    /**
+     * Counts an event of the search, use it through FLANN_SEARCH_STAT.
+     */
+    void countStat(int counter, size_t n)
+    {
+        if (stats_!=NULL) {
+            stats_->counters[counter] += n;
+        }
+    }
+#endif
+
+private:
+    Deadline deadline_;
+    bool timedOut_;
+    int stallChecks_;
+    int improvedChecks_;
+    DistanceType improvedDist_;
+#ifdef FLANN_SEARCH_STATS
+    SearchStats* stats_;
+#endif
 };
 
 /**
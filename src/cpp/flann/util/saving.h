@@ -40,7 +40,7 @@
 #ifdef FLANN_SIGNATURE_
 #undef FLANN_SIGNATURE_
 #endif
-#define FLANN_SIGNATURE_ "FLANN_INDEX_v1.1"
+#define FLANN_SIGNATURE_ "FLANN_INDEX_v1.2"
 
 namespace flann
 {
@@ -59,7 +59,7 @@ struct IndexHeader
         memset(h.version, 0, sizeof(h.version));
         strcpy(h.version, FLANN_VERSION_);
 
-        h.compression = 0;
+        h.compression = FLANN_COMPRESSION_LZ4;
         h.first_block_size = 0;
 	}
 
@@ -126,6 +126,7 @@ namespace serialization
 {
 ENUM_SERIALIZER(flann_algorithm_t);
 ENUM_SERIALIZER(flann_centers_init_t);
+ENUM_SERIALIZER(flann_partition_t);
 ENUM_SERIALIZER(flann_log_level_t);
 ENUM_SERIALIZER(flann_datatype_t);
 }
@@ -0,0 +1,303 @@
+/***********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ * Copyright 2008-2009  Marius Muja (mariusm@cs.ubc.ca). All rights reserved.
+ * Copyright 2008-2009  David G. Lowe (lowe@cs.ubc.ca). All rights reserved.
+ *
+ * THE BSD LICENSE
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *************************************************************************/
+
+#ifndef FLANN_SEARCH_STATS_H_
+#define FLANN_SEARCH_STATS_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+
+/**
+ * Counts an event of the search filling the given result set. The statistics
+ * are only collected when FLANN_SEARCH_STATS is defined, otherwise this
+ * compiles to nothing.
+ */
+#ifdef FLANN_SEARCH_STATS
+#define FLANN_SEARCH_STAT(result, counter, n) (result).countStat(flann::SearchStats::counter, (n))
+#else
+#define FLANN_SEARCH_STAT(result, counter, n)
+#endif
+
+
+namespace flann
+{
+
+/**
+ * What the search for one query did.
+ */
+struct SearchStats
+{
+    enum Counter
+    {
+        DISTANCE_EVALS,     // distances computed between the query and points or cluster centers
+        NODES_VISITED,      // tree nodes visited
+        HEAP_PUSHES,        // branches pushed on the branch heap
+        HEAP_POPS,          // branches popped from the branch heap
+        LEAVES_SCANNED,     // leafs (or LSH buckets) whose points were checked
+        EARLY_ABANDONS,     // branches abandoned because they cannot improve the result
+        REMOVED_SKIPS,      // removed points skipped
+        ELAPSED_US,         // search time in microseconds
+        COUNTERS
+    };
+
+    SearchStats()
+    {
+        std::fill(counters, counters+COUNTERS, 0);
+    }
+
+    static const char* name(int counter)
+    {
+        static const char* names[COUNTERS] = { "distance_evals", "nodes_visited", "heap_pushes", "heap_pops",
+                "leaves_scanned", "early_abandons", "removed_skips", "elapsed_us" };
+        return names[counter];
+    }
+
+    size_t counters[COUNTERS];
+};
+
+
+/**
+ * Log2 histograms of the counters of many searches, one per counter, without
+ * synchronization. Bucket 0 counts the queries with a value of 0 and bucket b
+ * the queries with a value in [2^(b-1), 2^b).
+ */
+struct SearchHistograms
+{
+    static const int BUCKETS = 48;
+
+    SearchHistograms()
+    {
+        reset();
+    }
+
+    void add(const SearchStats& stats)
+    {
+        queries++;
+        for (int c=0;c<SearchStats::COUNTERS;++c) {
+            size_t value = stats.counters[c];
+            totals[c] += value;
+            max[c] = std::max(max[c], value);
+            histograms[c][bucket(value)]++;
+        }
+    }
+
+    void merge(const SearchHistograms& other)
+    {
+        queries += other.queries;
+        for (int c=0;c<SearchStats::COUNTERS;++c) {
+            totals[c] += other.totals[c];
+            max[c] = std::max(max[c], other.max[c]);
+            for (int b=0;b<BUCKETS;++b) {
+                histograms[c][b] += other.histograms[c][b];
+            }
+        }
+    }
+
+    void reset()
+    {
+        queries = 0;
+        std::fill(totals, totals+SearchStats::COUNTERS, 0);
+        std::fill(max, max+SearchStats::COUNTERS, 0);
+        for (int c=0;c<SearchStats::COUNTERS;++c) {
+            std::fill(histograms[c], histograms[c]+BUCKETS, 0);
+        }
+    }
+
+    static int bucket(size_t value)
+    {
+        int b = 0;
+        while (value>0 && b<BUCKETS-1) {
+            value >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    size_t queries;
+    size_t totals[SearchStats::COUNTERS];
+    size_t max[SearchStats::COUNTERS];
+    size_t histograms[SearchStats::COUNTERS][BUCKETS];
+};
+
+
+/**
+ * Aggregates the statistics of many searches into log2 histograms, one per counter.
+ *
+ * Pass a pointer to it in SearchParams::stats to collect the statistics of the
+ * searches using those parameters. Keep one per index to compare indexes or
+ * parameter settings. Safe to use from concurrent searches.
+ */
+class SearchStatistics
+{
+public:
+    static const int BUCKETS = SearchHistograms::BUCKETS;
+
+    SearchStatistics()
+    {
+    }
+
+    /**
+     * Adds the statistics of one query.
+     */
+    void add(const SearchStats& stats)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data_.add(stats);
+    }
+
+    /**
+     * Adds the statistics of many queries, collected separately.
+     */
+    void merge(const SearchHistograms& histograms)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data_.merge(histograms);
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data_.reset();
+    }
+
+    /** Number of queries recorded */
+    size_t queries() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return data_.queries;
+    }
+
+    /** Sum of a counter over all the queries */
+    size_t total(int counter) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return data_.totals[counter];
+    }
+
+    /** Mean of a counter per query */
+    double mean(int counter) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return data_.queries>0 ? double(data_.totals[counter])/data_.queries : 0;
+    }
+
+    /** Largest value of a counter for one query */
+    size_t max(int counter) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return data_.max[counter];
+    }
+
+    /** Number of queries in a histogram bucket of a counter */
+    size_t histogram(int counter, int bucket) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return data_.histograms[counter][bucket];
+    }
+
+    /**
+     * Approximate percentile of a counter, the upper bound of the histogram
+     * bucket that contains it.
+     * @param p Percentile, between 0 and 1 (for example 0.99)
+     */
+    size_t percentile(int counter, float p) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t rank = size_t(p*data_.queries);
+        size_t seen = 0;
+        for (int b=0;b<BUCKETS;++b) {
+            seen += data_.histograms[counter][b];
+            if (seen>rank) {
+                return std::min(data_.max[counter], b==0 ? size_t(0) : (size_t(1)<<b)-1);
+            }
+        }
+        return data_.max[counter];
+    }
+
+    /**
+     * Prints the mean, 50th, 99th percentile and maximum of each counter.
+     */
+    void print(FILE* stream = stdout) const
+    {
+        fprintf(stream, "%zu queries\n", queries());
+        fprintf(stream, "%-16s %12s %12s %12s %12s\n", "counter", "mean", "p50", "p99", "max");
+        for (int c=0;c<SearchStats::COUNTERS;++c) {
+            fprintf(stream, "%-16s %12.1f %12zu %12zu %12zu\n", SearchStats::name(c), mean(c),
+                    percentile(c, 0.5f), percentile(c, 0.99f), max(c));
+        }
+    }
+
+private:
+    mutable std::mutex mutex_;
+    SearchHistograms data_;
+};
+
+
+/**
+ * Collects the statistics of the queries searched by one thread of a batch and
+ * merges them into a SearchStatistics once, when destroyed, so that the threads
+ * don't take its lock for every query.
+ */
+class SearchStatisticsBuffer
+{
+public:
+    explicit SearchStatisticsBuffer(SearchStatistics* target) : target_(target)
+    {
+    }
+
+    ~SearchStatisticsBuffer()
+    {
+        if (local_) {
+            target_->merge(*local_);
+        }
+    }
+
+    void add(const SearchStats& stats)
+    {
+        if (!local_) {
+            local_.reset(new SearchHistograms());
+        }
+        local_->add(stats);
+    }
+
+private:
+    SearchStatisticsBuffer(const SearchStatisticsBuffer&);
+    SearchStatisticsBuffer& operator=(const SearchStatisticsBuffer&);
+
+    SearchStatistics* target_;
+    std::unique_ptr<SearchHistograms> local_;
+};
+
+}
+
+#endif // FLANN_SEARCH_STATS_H_
@@ -1,6 +1,7 @@
 #ifndef SERIALIZATION_H_
 #define SERIALIZATION_H_
 
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <cstdlib>
@@ -8,6 +9,9 @@
 #include <stdio.h>
 #include <lz4.h>
 #include <lz4hc.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 namespace flann
@@ -19,8 +23,8 @@ namespace flann
         flann_algorithm_t index_type;
         size_t rows;
         size_t cols;
-        size_t compression;
-        size_t first_block_size;
+        size_t compression;         // a flann_compression_t
+        size_t first_block_size;    // size of the blocks following the header
     };
 
 namespace serialization
@@ -371,111 +375,170 @@ public:
 //    }
 //};
     
+// size of the chained blocks of the v1.1 index files
 #define BLOCK_BYTES (1024 * 64)
+// size of the independent blocks of the current index files
+#define FRAME_BLOCK_BYTES (1024 * 1024)
 
+/**
+ * An entry of the block index at the end of an archive.
+ */
+struct BlockInfo
+{
+    size_t compressed_size;    // equal to raw_size for a block stored uncompressed
+    size_t raw_size;
+};
+
+/**
+ * Number of blocks compressed or decompressed at a time.
+ */
+inline size_t archive_batch_blocks()
+{
+#ifdef _OPENMP
+    return 2*size_t(std::max(omp_get_max_threads(), 1));
+#else
+    return 2;
+#endif
+}
+
+/**
+ * Writes an archive in independent blocks, which are compressed in parallel.
+ *
+ * The archive starts with the index header (uncompressed), followed by the
+ * blocks and the block index: the number of blocks and a BlockInfo per block.
+ * The compression of the blocks is taken from the header, and its
+ * first_block_size field is set to the size of the blocks, so that the block
+ * index can be found when loading. The blocks are FRAME_BLOCK_BYTES of the
+ * serialized data each (except the last one); a block that does not get smaller
+ * when compressed is stored as it is.
+ */
 class SaveArchive : public OutputArchive<SaveArchive>
 {
-    /**
-     * Based on blockStreaming_doubleBuffer code at:
-     * https://github.com/Cyan4973/lz4/blob/master/examples/blockStreaming_doubleBuffer.c
-     */
-    
     FILE* stream_;
     bool own_stream_;
-    char *buffer_;
+    long header_pos_;
+    IndexHeaderStruct header_;
+    size_t header_size_;   // number of header bytes received
+    flann_compression_t compression_;
+
+    std::vector<char> batch_;       // blocks waiting to be compressed
     size_t offset_;
+    std::vector<char> compressed_;
+    std::vector<BlockInfo> blocks_;
+    size_t data_size_;
 
-    int first_block_;
-    char *buffer_blocks_;
-    char *compressed_buffer_;
-    LZ4_streamHC_t lz4Stream_body;
-    LZ4_streamHC_t* lz4Stream;
-
-    void initBlock()
-    {
-        // Alloc the space for both buffer blocks (each compressed block
-        // references the previous)
-        buffer_ = buffer_blocks_ = (char *)malloc(BLOCK_BYTES*2);
-        compressed_buffer_ = (char *)malloc(LZ4_COMPRESSBOUND(BLOCK_BYTES) + sizeof(size_t));
-        if (buffer_ == NULL || compressed_buffer_ == NULL) {
-            throw FLANNException("Error allocating compression buffer");
-        }
-        
-        // Init the LZ4 stream
-        lz4Stream = &lz4Stream_body;
-        LZ4_resetStreamHC(lz4Stream, 9);
-        first_block_ = true;
-        
+    void init()
+    {
+        if (stream_ == NULL) {
+            throw FLANNException("Cannot open file");
+        }
+        header_size_ = 0;
+        batch_.resize(archive_batch_blocks()*FRAME_BLOCK_BYTES);
         offset_ = 0;
+        data_size_ = 0;
     }
-    
-    void flushBlock()
-    {
-        size_t compSz = 0;
-        // Handle header
-        if (first_block_) {
-            // Copy & set the header
-            IndexHeaderStruct *head = (IndexHeaderStruct *)buffer_;
-            size_t headSz = sizeof(IndexHeaderStruct);
-            
-            assert(head->compression == 0);
-            head->compression = 1; // Bool now, enum later
-        
-            // Do the compression for the block
-            compSz = LZ4_compress_HC_continue(
-                lz4Stream, buffer_+headSz, compressed_buffer_+headSz, offset_-headSz,
-                LZ4_COMPRESSBOUND(BLOCK_BYTES));
-            
-            if(compSz <= 0) {
-                throw FLANNException("Error compressing (first block)");
+
+    void writeHeader()
+    {
+        compression_ = (flann_compression_t)header_.compression;
+        if (compression_ != FLANN_COMPRESSION_NONE && compression_ != FLANN_COMPRESSION_LZ4 &&
+                compression_ != FLANN_COMPRESSION_LZ4HC) {
+            throw FLANNException("Unknown compression type");
+        }
+        // the size of the blocks is filled in when the archive is complete
+        header_pos_ = ftell(stream_);
+        if (header_pos_ < 0) {
+            throw FLANNException("Indexes can only be saved to seekable files");
+        }
+        header_.first_block_size = 0;
+        fwrite(&header_, sizeof(header_), 1, stream_);
+    }
+
+    void write(const void* data, size_t size)
+    {
+        const char* ptr = (const char*)data;
+        if (header_size_ < sizeof(header_)) {
+            size_t n = std::min(size, sizeof(header_)-header_size_);
+            memcpy((char*)&header_+header_size_, ptr, n);
+            header_size_ += n;
+            ptr += n;
+            size -= n;
+            if (header_size_ == sizeof(header_)) {
+                writeHeader();
             }
-            
-            // Handle header
-            head->first_block_size = compSz;
-            memcpy(compressed_buffer_, buffer_, headSz);
-            
-            compSz += headSz;
-            first_block_ = false;
-        } else {
-            size_t headSz = sizeof(compSz);
-            
-            // Do the compression for the block
-            compSz = LZ4_compress_HC_continue(
-                lz4Stream, buffer_, compressed_buffer_+headSz, offset_,
-                LZ4_COMPRESSBOUND(BLOCK_BYTES));
-            
-            if(compSz <= 0) {
-                throw FLANNException("Error compressing");
+        }
+        while (size > 0) {
+            size_t n = std::min(size, batch_.size()-offset_);
+            memcpy(&batch_[offset_], ptr, n);
+            offset_ += n;
+            ptr += n;
+            size -= n;
+            if (offset_ == batch_.size()) {
+                flushBatch();
             }
-            
-            // Save the size of the compressed block as the header
-            memcpy(compressed_buffer_, &compSz, headSz);
-            compSz += headSz;
-        }
-        
-        // Write the compressed buffer
-        fwrite(compressed_buffer_, compSz, 1, stream_);
-        
-        // Switch the buffer to the *other* block
-        if (buffer_ == buffer_blocks_)
-            buffer_ = &buffer_blocks_[BLOCK_BYTES];
-        else
-            buffer_ = buffer_blocks_;
+        }
+    }
+
+    void flushBatch()
+    {
+        int count = int((offset_+FRAME_BLOCK_BYTES-1)/FRAME_BLOCK_BYTES);
+        const int bound = LZ4_COMPRESSBOUND(FRAME_BLOCK_BYTES);
+        if (compression_ != FLANN_COMPRESSION_NONE) {
+            compressed_.resize(batch_.size()/FRAME_BLOCK_BYTES*bound);
+        }
+
+        std::vector<int> sizes(count);
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < count; ++i) {
+            const char* raw = &batch_[i*FRAME_BLOCK_BYTES];
+            int raw_size = int(std::min(size_t(FRAME_BLOCK_BYTES), offset_-i*FRAME_BLOCK_BYTES));
+            char* dst = compression_ != FLANN_COMPRESSION_NONE ? &compressed_[i*bound] : NULL;
+            if (compression_ == FLANN_COMPRESSION_LZ4) {
+                sizes[i] = LZ4_compress_default(raw, dst, raw_size, bound);
+            }
+            else if (compression_ == FLANN_COMPRESSION_LZ4HC) {
+                sizes[i] = LZ4_compress_HC(raw, dst, raw_size, bound, 9);
+            }
+            // store the block as it is if it does not compress
+            if (compression_ == FLANN_COMPRESSION_NONE || sizes[i] <= 0 || sizes[i] >= raw_size) {
+                sizes[i] = raw_size;
+            }
+        }
+
+        for (int i = 0; i < count; ++i) {
+            BlockInfo block;
+            block.raw_size = std::min(size_t(FRAME_BLOCK_BYTES), offset_-i*FRAME_BLOCK_BYTES);
+            block.compressed_size = sizes[i];
+            const char* data = block.compressed_size == block.raw_size ? &batch_[i*FRAME_BLOCK_BYTES] : &compressed_[i*bound];
+            if (fwrite(data, block.compressed_size, 1, stream_) != 1) {
+                throw FLANNException("Error writing index file");
+            }
+            blocks_.push_back(block);
+            data_size_ += block.compressed_size;
+        }
         offset_ = 0;
     }
-    
-    void endBlock()
+
+    void finish()
     {
-        // Cleanup memory
-        free(buffer_blocks_);
-        buffer_blocks_ = NULL;
-        buffer_ = NULL;
-        free(compressed_buffer_);
-        compressed_buffer_ = NULL;
-        
-        // Write a '0' size for next block
-        size_t z = 0;
-        fwrite(&z, sizeof(z), 1, stream_);
+        if (header_size_ < sizeof(header_)) {
+            return;
+        }
+        if (offset_ > 0) {
+            flushBatch();
+        }
+        size_t count = blocks_.size();
+        fwrite(&count, sizeof(count), 1, stream_);
+        if (count > 0) {
+            fwrite(&blocks_[0], sizeof(BlockInfo), count, stream_);
+        }
+
+        // now that the size of the blocks is known, complete the header
+        long end = ftell(stream_);
+        header_.first_block_size = data_size_;
+        fseek(stream_, header_pos_, SEEK_SET);
+        fwrite(&header_, sizeof(header_), 1, stream_);
+        fseek(stream_, end, SEEK_SET);
     }
 
 public:
@@ -483,22 +546,17 @@ public:
     {
         stream_ = fopen(filename, "wb");
         own_stream_ = true;
-        initBlock();
+        init();
     }
 
     SaveArchive(FILE* stream) : stream_(stream), own_stream_(false)
     {
-        initBlock();
+        init();
     }
 
     ~SaveArchive()
     {
-        flushBlock();
-        endBlock();
-        if (buffer_) {
-            free(buffer_);
-            buffer_ = NULL;
-        }
+        finish();
     	if (own_stream_) {
     		fclose(stream_);
     	}
@@ -507,11 +565,13 @@ public:
     template<typename T>
     void save(const T& val)
     {
-        assert(sizeof(val) < BLOCK_BYTES);
-        if (offset_+sizeof(val) > BLOCK_BYTES)
-            flushBlock();
-        memcpy(buffer_+offset_, &val, sizeof(val));
-        offset_ += sizeof(val);
+        if (header_size_ == sizeof(header_) && offset_+sizeof(val) < batch_.size()) {
+            memcpy(&batch_[offset_], &val, sizeof(val));
+            offset_ += sizeof(val);
+        }
+        else {
+            write(&val, sizeof(val));
+        }
     }
 
     template<typename T>
@@ -524,204 +584,284 @@ public:
     template<typename T>
     void save_binary(T* ptr, size_t size)
     {
-        while (size > BLOCK_BYTES) {
-            // Flush existing block
-            flushBlock();
-            
-            // Save large chunk
-            memcpy(buffer_, ptr, BLOCK_BYTES);
-            offset_ += BLOCK_BYTES;
-            ptr = ((char *)ptr) + BLOCK_BYTES;
-            size -= BLOCK_BYTES;
-        }
-        
-        // Save existing block if new data will make it too big
-        if (offset_+size > BLOCK_BYTES)
-            flushBlock();
-        
-        // Copy out requested data
-        memcpy(buffer_+offset_, ptr, size);
-        offset_ += size;
+        write(ptr, size);
     }
 
 };
 
 
+/**
+ * Reads an archive written by SaveArchive, block by block. The blocks are read
+ * and decompressed archive_batch_blocks() at a time, in parallel.
+ *
+ * The archives of the previous versions are read as well: the v1.1 archives,
+ * made of chained LZ4 blocks that have to be decompressed in sequence, and the
+ * v1.0 archives, compressed as a single block.
+ */
 class LoadArchive : public InputArchive<LoadArchive>
 {
-    /**
-     * Based on blockStreaming_doubleBuffer code at:
-     * https://github.com/Cyan4973/lz4/blob/master/examples/blockStreaming_doubleBuffer.c
-     */
-    
+    enum Format {
+        FORMAT_V10,
+        FORMAT_V11,
+        FORMAT_BLOCKS
+    };
+
     FILE* stream_;
     bool own_stream_;
-    char *buffer_;
-    char *ptr_;
-    
-    char *buffer_blocks_;
-    char *compressed_buffer_;
+    Format format_;
+    IndexHeaderStruct header_;
+
+    // the data of the current block not read yet
+    const char* ptr_;
+    const char* end_;
+
+    // v1.0 and v1.1 formats
+    std::vector<char> buffer_;
+    size_t buffer_offset_;
+    std::vector<char> compressed_buffer_;
     LZ4_streamDecode_t lz4StreamDecode_body;
-    LZ4_streamDecode_t* lz4StreamDecode;
-    size_t block_sz_;
-
-    void decompressAndLoadV10(FILE* stream)
-    {
-        buffer_ = NULL;
-        
-        // Find file size
-        size_t pos = ftell(stream);
-        fseek(stream, 0, SEEK_END);
-        size_t fileSize = ftell(stream)-pos;
-        fseek(stream, pos, SEEK_SET);
-        size_t headSz = sizeof(IndexHeaderStruct);
-
-        // Read the (compressed) file to a buffer
-        char *compBuffer = (char *)malloc(fileSize);
-        if (compBuffer == NULL) {
-            throw FLANNException("Error allocating file buffer space");
-        }
-        if (fread(compBuffer, fileSize, 1, stream) != 1) {
-            free(compBuffer);
-            throw FLANNException("Invalid index file, cannot read from disk (compressed)");
-        }
 
-        // Extract header
-        IndexHeaderStruct *head = (IndexHeaderStruct *)(compBuffer);
-        
-        // Backward compatability
-        size_t compressedSz = fileSize-headSz;
-        size_t uncompressedSz = head->first_block_size-headSz;
-        
-        // Check for compression type
-        if (head->compression != 1) {
-            free(compBuffer);
+    // current format
+    std::vector<BlockInfo> blocks_;
+    size_t next_block_;
+    std::vector<char> raw_;
+    std::vector<const char*> batch_ptrs_;
+    size_t batch_first_;
+    size_t batch_count_;
+    long end_pos_;
+
+    void initV10()
+    {
+        format_ = FORMAT_V10;
+
+        // the rest of the file is a single block
+        long pos = ftell(stream_);
+        fseek(stream_, 0, SEEK_END);
+        size_t compressedSz = ftell(stream_)-pos;
+        fseek(stream_, pos, SEEK_SET);
+        size_t uncompressedSz = header_.first_block_size-sizeof(header_);
+        if (header_.compression != 1) {
             throw FLANNException("Compression type not supported");
         }
-        
-        // Allocate a decompressed buffer
-        ptr_ = buffer_ = (char *)malloc(uncompressedSz+headSz);
-        if (buffer_ == NULL) {
-            free(compBuffer);
-            throw FLANNException("Error (re)allocating decompression buffer");
-        }
-        
-        // Extract body
-        size_t usedSz = LZ4_decompress_safe(compBuffer+headSz,
-                                            buffer_+headSz,
-                                            compressedSz,
-                                            uncompressedSz);
-        
-        // Check if the decompression was the expected size.
-        if (usedSz != uncompressedSz) {
-            free(compBuffer);
+
+        compressed_buffer_.resize(compressedSz);
+        buffer_.resize(sizeof(header_)+uncompressedSz);
+        if (compressedSz > 0 && fread(&compressed_buffer_[0], compressedSz, 1, stream_) != 1) {
+            throw FLANNException("Invalid index file, cannot read from disk (compressed)");
+        }
+        int usedSz = LZ4_decompress_safe(&compressed_buffer_[0], &buffer_[sizeof(header_)],
+                                         int(compressedSz), int(uncompressedSz));
+        if (usedSz < 0 || size_t(usedSz) != uncompressedSz) {
             throw FLANNException("Unexpected decompression size");
         }
-        
-        // Copy header data
-        memcpy(buffer_, compBuffer, headSz);
-        free(compBuffer);
-        
-        // Put the file pointer at the end of the data we've read
-        if (compressedSz+headSz+pos != fileSize)
-            fseek(stream, compressedSz+headSz+pos, SEEK_SET);
-        block_sz_ = uncompressedSz+headSz;
+        compressed_buffer_.clear();
+        memcpy(&buffer_[0], &header_, sizeof(header_));
+        ptr_ = &buffer_[0];
+        end_ = ptr_+buffer_.size();
     }
-    
-    void initBlock(FILE *stream)
-    {
-        size_t pos = ftell(stream);
-        buffer_ = NULL;
-        buffer_blocks_ = NULL;
-        compressed_buffer_ = NULL;
-        size_t headSz = sizeof(IndexHeaderStruct);
-        
-        // Read the file header to a buffer
-        IndexHeaderStruct *head = (IndexHeaderStruct *)malloc(headSz);
-        if (head == NULL) {
-            throw FLANNException("Error allocating header buffer space");
-        }
-        if (fread(head, headSz, 1, stream) != 1) {
-            free(head);
-            throw FLANNException("Invalid index file, cannot read from disk (header)");
-        }
-        
-        // Backward compatability
-        if (head->signature[13] == '1' && head->signature[15] == '0') {
-            free(head);
-            fseek(stream, pos, SEEK_SET);
-            return decompressAndLoadV10(stream);
-        }
-        
-        // Alloc the space for both buffer blocks (each block
-        // references the previous)
-        buffer_ = buffer_blocks_ = (char *)malloc(BLOCK_BYTES*2);
-        compressed_buffer_ = (char *)malloc(LZ4_COMPRESSBOUND(BLOCK_BYTES));
-        if (buffer_ == NULL || compressed_buffer_ == NULL) {
-            free(head);
-            throw FLANNException("Error allocating compression buffer");
-        }
-        
-        // Init the LZ4 stream
-        lz4StreamDecode = &lz4StreamDecode_body;
-        LZ4_setStreamDecode(lz4StreamDecode, NULL, 0);
-        
-        // Read first block
-        memcpy(buffer_, head, headSz);
-        loadBlock(buffer_+headSz, head->first_block_size, stream);
-        block_sz_ += headSz;
-        ptr_ = buffer_;
-        free(head);
-    }
-
-    void loadBlock(char* buffer_, size_t compSz, FILE* stream)
+
+    /**
+     * Based on blockStreaming_doubleBuffer code at:
+     * https://github.com/Cyan4973/lz4/blob/master/examples/blockStreaming_doubleBuffer.c
+     */
+    void initV11()
+    {
+        format_ = FORMAT_V11;
+
+        // both buffer blocks (each compressed block references the previous),
+        // the first one starts with the header
+        buffer_.resize(BLOCK_BYTES*2);
+        compressed_buffer_.resize(LZ4_COMPRESSBOUND(BLOCK_BYTES));
+        LZ4_setStreamDecode(&lz4StreamDecode_body, NULL, 0);
+
+        memcpy(&buffer_[0], &header_, sizeof(header_));
+        size_t size = loadBlockV11(&buffer_[sizeof(header_)], header_.first_block_size);
+        buffer_offset_ = 0;
+        ptr_ = &buffer_[0];
+        end_ = ptr_+sizeof(header_)+size;
+    }
+
+    size_t loadBlockV11(char* buffer, size_t compSz)
     {
         if(compSz >= LZ4_COMPRESSBOUND(BLOCK_BYTES)) {
             throw FLANNException("Requested block size too large");
         }
-        
+
         // Read the block into the compressed buffer
-        if (fread(compressed_buffer_, compSz, 1, stream) != 1) {
+        if (fread(&compressed_buffer_[0], compSz, 1, stream_) != 1) {
             throw FLANNException("Invalid index file, cannot read from disk (block)");
         }
-        
+
         // Decompress into the regular buffer
         const int decBytes = LZ4_decompress_safe_continue(
-            lz4StreamDecode, compressed_buffer_, buffer_, compSz, BLOCK_BYTES);
+            &lz4StreamDecode_body, &compressed_buffer_[0], buffer, int(compSz), BLOCK_BYTES);
         if(decBytes <= 0) {
             throw FLANNException("Invalid index file, cannot decompress block");
         }
-        block_sz_ = decBytes;
+        return decBytes;
     }
-    
-    void preparePtr(size_t size)
+
+    void nextBlockV11()
     {
-        // Return if the new size is less than (or eq) the size of a block
-        if (ptr_+size <= buffer_+block_sz_)
-            return;
-        
         // Switch the buffer to the *other* block
-        if (buffer_ == buffer_blocks_)
-            buffer_ = &buffer_blocks_[BLOCK_BYTES];
-        else
-            buffer_ = buffer_blocks_;
-        
+        buffer_offset_ = buffer_offset_ == 0 ? BLOCK_BYTES : 0;
+
         // Find the size of the next block
         size_t cmpSz = 0;
         size_t readCnt = fread(&cmpSz, sizeof(cmpSz), 1, stream_);
         if(cmpSz <= 0 || readCnt != 1) {
             throw FLANNException("Requested to read next block past end of file");
         }
-        
-        // Load block & init ptr
-        loadBlock(buffer_, cmpSz, stream_);
-        ptr_ = buffer_;
+
+        size_t size = loadBlockV11(&buffer_[buffer_offset_], cmpSz);
+        ptr_ = &buffer_[buffer_offset_];
+        end_ = ptr_+size;
     }
-    
-    void endBlock()
+
+    void initBlocks()
     {
-        // If not v1.0 format hack...
-        if (buffer_blocks_ != NULL) {
+        format_ = FORMAT_BLOCKS;
+
+        // read the block index at the end of the archive
+        long data_pos = ftell(stream_);
+        size_t count = 0;
+        if (fseek(stream_, data_pos+long(header_.first_block_size), SEEK_SET) != 0 ||
+                fread(&count, sizeof(count), 1, stream_) != 1) {
+            throw FLANNException("Invalid index file, cannot read the block index");
+        }
+        blocks_.resize(count);
+        if (count > 0 && fread(&blocks_[0], sizeof(BlockInfo), count, stream_) != count) {
+            throw FLANNException("Invalid index file, cannot read the block index");
+        }
+        size_t data_size = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (blocks_[i].raw_size > FRAME_BLOCK_BYTES ||
+                    blocks_[i].compressed_size > size_t(LZ4_COMPRESSBOUND(FRAME_BLOCK_BYTES))) {
+                throw FLANNException("Invalid index file, block too large");
+            }
+            data_size += blocks_[i].compressed_size;
+        }
+        if (data_size != header_.first_block_size) {
+            throw FLANNException("Invalid index file, the block index does not match the data");
+        }
+        end_pos_ = ftell(stream_);
+        fseek(stream_, data_pos, SEEK_SET);
+
+        next_block_ = 0;
+        batch_first_ = 0;
+        batch_count_ = 0;
+        ptr_ = (const char*)&header_;
+        end_ = ptr_+sizeof(header_);
+    }
+
+    /**
+     * Reads the next blocks and decompresses them in parallel.
+     */
+    void loadBatch()
+    {
+        size_t count = std::min(archive_batch_blocks(), blocks_.size()-next_block_);
+        size_t compressed_size = 0;
+        for (size_t i = 0; i < count; ++i) {
+            compressed_size += blocks_[next_block_+i].compressed_size;
+        }
+        compressed_buffer_.resize(std::max(compressed_buffer_.size(), compressed_size));
+        raw_.resize(count*FRAME_BLOCK_BYTES);
+        if (compressed_size > 0 && fread(&compressed_buffer_[0], compressed_size, 1, stream_) != 1) {
+            throw FLANNException("Invalid index file, cannot read from disk (block)");
+        }
+
+        batch_ptrs_.resize(count);
+        std::vector<size_t> offsets(count);
+        for (size_t i = 0, offset = 0; i < count; ++i) {
+            offsets[i] = offset;
+            offset += blocks_[next_block_+i].compressed_size;
+        }
+        int failed = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+        for (int i = 0; i < int(count); ++i) {
+            const BlockInfo& block = blocks_[next_block_+i];
+            const char* src = &compressed_buffer_[offsets[i]];
+            if (block.compressed_size == block.raw_size) {
+                // stored uncompressed, used in place
+                batch_ptrs_[i] = src;
+            }
+            else {
+                char* dst = &raw_[i*FRAME_BLOCK_BYTES];
+                int size = LZ4_decompress_safe(src, dst, int(block.compressed_size), int(block.raw_size));
+                if (size < 0 || size_t(size) != block.raw_size) {
+                    failed++;
+                }
+                batch_ptrs_[i] = dst;
+            }
+        }
+        if (failed) {
+            throw FLANNException("Invalid index file, cannot decompress block");
+        }
+        batch_first_ = next_block_;
+        batch_count_ = count;
+    }
+
+    void nextBlock()
+    {
+        switch (format_) {
+        case FORMAT_V10:
+            throw FLANNException("Requested to read next block past end of file");
+        case FORMAT_V11:
+            nextBlockV11();
+            break;
+        case FORMAT_BLOCKS:
+            if (next_block_ >= blocks_.size()) {
+                throw FLANNException("Requested to read next block past end of file");
+            }
+            if (next_block_ >= batch_first_+batch_count_) {
+                loadBatch();
+            }
+            ptr_ = batch_ptrs_[next_block_-batch_first_];
+            end_ = ptr_+blocks_[next_block_].raw_size;
+            next_block_++;
+            break;
+        }
+    }
+
+    void read(void* data, size_t size)
+    {
+        char* dst = (char*)data;
+        while (size > 0) {
+            if (ptr_ == end_) {
+                nextBlock();
+            }
+            size_t n = std::min(size, size_t(end_-ptr_));
+            memcpy(dst, ptr_, n);
+            ptr_ += n;
+            dst += n;
+            size -= n;
+        }
+    }
+
+    void init()
+    {
+        if (stream_ == NULL) {
+            throw FLANNException("Cannot open file");
+        }
+        if (fread(&header_, sizeof(header_), 1, stream_) != 1) {
+            throw FLANNException("Invalid index file, cannot read from disk (header)");
+        }
+
+        // the format is given by the version in the signature (FLANN_INDEX_v1.x)
+        if (header_.signature[13] == '1' && header_.signature[15] == '0') {
+            initV10();
+        }
+        else if (header_.signature[13] == '1' && header_.signature[15] == '1') {
+            initV11();
+        }
+        else {
+            initBlocks();
+        }
+    }
+
+    void finish()
+    {
+        if (format_ == FORMAT_V11) {
             // Read the last '0' in the file
             size_t zero = 1;
             if (fread(&zero, sizeof(zero), 1, stream_) != 1) {
@@ -731,19 +871,12 @@ class LoadArchive : public InputArchive<LoadArchive>
                 throw FLANNException("Invalid index file, last block not zero length");
             }
         }
-        
-        // Free resources
-        if (buffer_blocks_ != NULL) {
-            free(buffer_blocks_);
-            buffer_blocks_ = NULL;
-        }
-        if (compressed_buffer_ != NULL) {
-            free(compressed_buffer_);
-            compressed_buffer_ = NULL;
+        else if (format_ == FORMAT_BLOCKS) {
+            // skip the block index, another archive may follow
+            fseek(stream_, end_pos_, SEEK_SET);
         }
-        ptr_ = NULL;
     }
-    
+
 public:
     LoadArchive(const char* filename)
     {
@@ -751,7 +884,7 @@ public:
         stream_ = fopen(filename, "rb");
         own_stream_ = true;
 
-        initBlock(stream_);
+        init();
     }
 
     LoadArchive(FILE* stream)
@@ -759,12 +892,12 @@ public:
         stream_ = stream;
         own_stream_ = false;
 
-        initBlock(stream);
+        init();
     }
 
     ~LoadArchive()
     {
-        endBlock();
+        finish();
     	if (own_stream_) {
     		fclose(stream_);
     	}
@@ -773,9 +906,13 @@ public:
     template<typename T>
     void load(T& val)
     {
-        preparePtr(sizeof(val));
-        memcpy(&val, ptr_, sizeof(val));
-        ptr_ += sizeof(val);
+        if (ptr_+sizeof(val) <= end_) {
+            memcpy(&val, ptr_, sizeof(val));
+            ptr_ += sizeof(val);
+        }
+        else {
+            read(&val, sizeof(val));
+        }
     }
 
     template<typename T>
@@ -788,23 +925,7 @@ public:
     template<typename T>
     void load_binary(T* ptr, size_t size)
     {
-        while (size > BLOCK_BYTES) {
-            // Load next block
-            preparePtr(BLOCK_BYTES);
-            
-            // Load large chunk
-            memcpy(ptr, ptr_, BLOCK_BYTES);
-            ptr_ += BLOCK_BYTES;
-            ptr = ((char *)ptr) + BLOCK_BYTES;
-            size -= BLOCK_BYTES;
-        }
-        
-        // Load next block if needed
-        preparePtr(size);
-        
-        // Load the data
-        memcpy(ptr, ptr_, size);
-        ptr_ += size;
+        read(ptr, size);
     }
 };
 
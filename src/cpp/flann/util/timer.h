@@ -90,6 +90,134 @@ public:
 
 };
 
+
+/**
+ * A start-stop timer measuring the CPU time of the calling thread.
+ *
+ * Used for code timed concurrently on several threads, which a process CPU time
+ * timer would charge for all the threads. Falls back to the process CPU time
+ * where the thread CPU time clock is not available.
+ */
+class ThreadTimer
+{
+    double startTime;
+
+    static double cpuTime()
+    {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+        timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)==0) {
+            return ts.tv_sec + ts.tv_nsec*1e-9;
+        }
+#endif
+        return (double)clock() / CLOCKS_PER_SEC;
+    }
+
+public:
+    /**
+     * Value of the timer.
+     */
+    double value;
+
+    /**
+     * Constructor.
+     */
+    ThreadTimer()
+    {
+        reset();
+    }
+
+    /**
+     * Starts the timer.
+     */
+    void start()
+    {
+        startTime = cpuTime();
+    }
+
+    /**
+     * Stops the timer and updates timer value.
+     */
+    double stop()
+    {
+        value += cpuTime() - startTime;
+
+        return value;
+    }
+
+    /**
+     * Resets the timer value to 0.
+     */
+    void reset()
+    {
+        value = 0;
+    }
+
+};
+
+
+/**
+ * A point in time after which a search has to stop.
+ *
+ * Searches poll the deadline through expired(), which only reads the clock
+ * once every CHECK_INTERVAL checks to keep the polling cheap.
+ */
+class Deadline
+{
+    double end_;
+    int nextCheck_;
+
+public:
+    static const int CHECK_INTERVAL = 16;
+
+    /**
+     * Constructor. The deadline never expires.
+     */
+    Deadline() : end_(0), nextCheck_(0)
+    {
+    }
+
+    /**
+     * Constructor.
+     * @param budget_us Time from now until the deadline, in microseconds (0 for no limit)
+     * @param limit Deadline that this one may not exceed
+     */
+    Deadline(float budget_us, const Deadline& limit = Deadline()) : end_(0), nextCheck_(0)
+    {
+        if (budget_us>0) {
+            end_ = now() + budget_us*1e-6;
+        }
+        if (limit.end_>0 && (end_==0 || limit.end_<end_)) {
+            end_ = limit.end_;
+        }
+    }
+
+    /**
+     * Checks if the deadline has passed.
+     * @param checks Number of checks done by the search so far
+     */
+    bool expired(int checks)
+    {
+        if (end_==0 || checks<nextCheck_) return false;
+        nextCheck_ = checks + CHECK_INTERVAL;
+        return now()>=end_;
+    }
+
+    /**
+     * Monotonic wall clock time, in seconds.
+     */
+    static double now()
+    {
+#ifdef CLOCK_MONOTONIC
+        timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC, &ts)==0) {
+            return ts.tv_sec + ts.tv_nsec*1e-9;
+        }
+#endif
+        return (double)clock() / CLOCKS_PER_SEC;
+    }
+};
+
 }
 
 #endif // FLANN_TIMER_H
@@ -91,6 +91,10 @@ static void matlabStructToFlannStruct( const mxArray* mexParams, FLANNParameters
     flannParams.table_number_ = (unsigned int)*(mxGetPr(mxGetField(mexParams, 0, "table_number")));
     flannParams.key_size_ = (unsigned int)*(mxGetPr(mxGetField(mexParams, 0, "key_size")));
     flannParams.multi_probe_level_ = (unsigned int)*(mxGetPr(mxGetField(mexParams, 0, "multi_probe_level")));
+
+    // distance, the one set with flann_set_distance_type
+    flannParams.distance_type = (flann_distance_t)0;
+    flannParams.distance_order = 0;
 }
 
 static mxArray* flannStructToMatlabStruct( const FLANNParameters& flannParams )
@@ -26,11 +26,13 @@
 
 #from ctypes import *
 #from ctypes.util import find_library
-from numpy import (float32, float64, uint8, int32, require)
+from numpy import (float32, float64, uint8, int32, require, asarray,
+                   ascontiguousarray)
 #import ctypes
 #import numpy as np
 from ctypes import (Structure, c_char_p, c_int, c_float, c_uint, c_long,
-                    c_void_p, cdll, POINTER)
+                    c_size_t, c_void_p, cdll, POINTER, addressof, memmove,
+                    sizeof)
 from numpy.ctypeslib import ndpointer
 import os
 import sys
@@ -72,6 +74,11 @@ class CustomStructure(Structure):
     def keys(self):
         return self.__field_names
 
+    def copy(self):
+        other = type(self)()
+        memmove(addressof(other), addressof(self), sizeof(self))
+        return other
+
     def __translate(self, k, v):
         if k in self._translation_:
             if v in self._translation_[k]:
@@ -109,6 +116,8 @@ class FLANNParameters(CustomStructure):
         ('multi_probe_level_', c_uint),
         ('log_level', c_int),
         ('random_seed', c_long),
+        ('distance_type', c_int),
+        ('distance_order', c_int),
     ]
     _defaults_ = {
         'algorithm' : 'kdtree',
@@ -131,12 +140,16 @@ class FLANNParameters(CustomStructure):
         'key_size_': 20,
         'multi_probe_level_': 2,
         'log_level' : 'warning',
-        'random_seed' : -1
+        'random_seed' : -1,
+        'distance_type' : 'default',
+        'distance_order' : 3
     }
     _translation_ = {
         'algorithm'     : {'linear'    : 0, 'kdtree'    : 1, 'kmeans'    : 2, 'composite' : 3, 'kdtree_single' : 4, 'hierarchical': 5, 'lsh': 6, 'saved': 254, 'autotuned' : 255, 'default'   : 1},
         'centers_init'  : {'random'    : 0, 'gonzales'  : 1, 'kmeanspp'  : 2, 'default'   : 0},
-        'log_level'     : {'none'      : 0, 'fatal'     : 1, 'error'     : 2, 'warning'   : 3, 'info'      : 4, 'default'   : 2}
+        'log_level'     : {'none'      : 0, 'fatal'     : 1, 'error'     : 2, 'warning'   : 3, 'info'      : 4, 'default'   : 2},
+        'distance_type' : {'default'   : 0, 'euclidean' : 1, 'manhattan' : 2, 'minkowski' : 3, 'max_dist'  : 4, 'hik'       : 5,
+                           'hellinger' : 6, 'chi_square': 7, 'cs'        : 7, 'kullback_leibler' : 8, 'kl' : 8}
     }
 
 
@@ -234,6 +247,22 @@ flannlib.flann_build_index_%(C)s.argtypes = [
 flann.build_index[%(numpy)s] = flannlib.flann_build_index_%(C)s
 """)
 
+# The strided functions take raw pointers (numpy's array.ctypes.data), the rows
+# of the arrays start stride bytes apart. ctypes releases the GIL while they run.
+flann.build_index_strided = {}
+define_functions(r"""
+flannlib.flann_build_index_strided_%(C)s.restype = FLANN_INDEX
+flannlib.flann_build_index_strided_%(C)s.argtypes = [
+        c_void_p,  # dataset
+        c_int,  # rows
+        c_int,  # cols
+        c_size_t,  # stride
+        POINTER(c_float),  # speedup
+        POINTER(FLANNParameters)  # flann_params
+]
+flann.build_index_strided[%(numpy)s] = flannlib.flann_build_index_strided_%(C)s
+""")
+
 flann.save_index = {}
 define_functions(r"""
 flannlib.flann_save_index_%(C)s.restype = None
@@ -256,6 +285,19 @@ flannlib.flann_load_index_%(C)s.argtypes = [
 flann.load_index[%(numpy)s] = flannlib.flann_load_index_%(C)s
 """)
 
+flann.load_index_with_params = {}
+define_functions(r"""
+flannlib.flann_load_index_with_params_%(C)s.restype = FLANN_INDEX
+flannlib.flann_load_index_with_params_%(C)s.argtypes = [
+        c_char_p,  #filename
+        ndpointer(%(numpy)s, ndim=2, flags='aligned, c_contiguous'),  # dataset
+        c_int,  # rows
+        c_int,  # cols
+        POINTER(FLANNParameters)  # flann_params
+]
+flann.load_index_with_params[%(numpy)s] = flannlib.flann_load_index_with_params_%(C)s
+""")
+
 flann.used_memory = {}
 define_functions(r"""
 flannlib.flann_used_memory_%(C)s.restype = c_int
@@ -265,6 +307,15 @@ flannlib.flann_used_memory_%(C)s.argtypes = [
 flann.used_memory[%(numpy)s] = flannlib.flann_used_memory_%(C)s
 """)
 
+flann.size = {}
+define_functions(r"""
+flannlib.flann_size_%(C)s.restype = c_uint
+flannlib.flann_size_%(C)s.argtypes = [
+        FLANN_INDEX, # index_id
+]
+flann.size[%(numpy)s] = flannlib.flann_size_%(C)s
+""")
+
 flann.add_points = {}
 define_functions(r"""
 flannlib.flann_add_points_%(C)s.restype = None
@@ -278,9 +329,23 @@ flannlib.flann_add_points_%(C)s.argtypes = [
 flann.add_points[%(numpy)s] = flannlib.flann_add_points_%(C)s
 """)
 
+flann.add_points_strided = {}
+define_functions(r"""
+flannlib.flann_add_points_strided_%(C)s.restype = c_int
+flannlib.flann_add_points_strided_%(C)s.argtypes = [
+        FLANN_INDEX, # index_id
+        c_void_p, # points
+        c_int, # rows
+        c_int, # cols
+        c_size_t, # stride
+        c_float, # rebuild_threshhold
+]
+flann.add_points_strided[%(numpy)s] = flannlib.flann_add_points_strided_%(C)s
+""")
+
 flann.remove_point = {}
 define_functions(r"""
-flannlib.flann_remove_point_%(C)s.restype = None
+flannlib.flann_remove_point_%(C)s.restype = c_int
 flannlib.flann_remove_point_%(C)s.argtypes = [ 
         FLANN_INDEX, # index_id
         c_uint, # point_id
@@ -349,6 +414,24 @@ flannlib.flann_find_nearest_neighbors_index_double.argtypes = [
 ]
 flann.find_nearest_neighbors_index[float64] = flannlib.flann_find_nearest_neighbors_index_double
 
+flann.find_nearest_neighbors_index_strided = {}
+define_functions(r"""
+flannlib.flann_find_nearest_neighbors_index_strided_%(C)s.restype = c_int
+flannlib.flann_find_nearest_neighbors_index_strided_%(C)s.argtypes = [
+        FLANN_INDEX,  # index_id
+        c_void_p,  # testset
+        c_int,  # tcount
+        c_size_t,  # testset_stride
+        c_void_p,  # result
+        c_size_t,  # result_stride
+        c_void_p,  # dists
+        c_size_t,  # dists_stride
+        c_int,  # nn
+        POINTER(FLANNParameters) # flann_params
+]
+flann.find_nearest_neighbors_index_strided[%(numpy)s] = flannlib.flann_find_nearest_neighbors_index_strided_%(C)s
+""")
+
 flann.radius_search = {}
 define_functions(r"""
 flannlib.flann_radius_search_%(C)s.restype = c_int
@@ -414,6 +497,30 @@ flann.free_index[%(numpy)s] = flannlib.flann_free_index_%(C)s
 """)
 
 
+def as_strided_2d_array(arr, dtype, writeable=False):
+    """
+    Returns arr as a 2d array of the given type that can be passed to the
+    strided functions without copying: the rows may be strided, but the
+    elements of a row must be contiguous and aligned. Other arrays (and arrays
+    of other types, such as float16) are converted to a contiguous copy.
+    """
+    arr = asarray(arr)
+    if arr.ndim == 1:
+        arr = arr.reshape(1, -1)
+    if arr.ndim != 2:
+        raise ValueError('Expected a 2d array')
+    if (arr.dtype != dtype or not arr.flags.aligned or
+            (arr.shape[1] > 1 and arr.strides[1] != arr.itemsize) or
+            (arr.shape[0] > 1 and arr.strides[0] < arr.shape[1] * arr.itemsize) or
+            (writeable and not arr.flags.writeable)):
+        arr = ascontiguousarray(arr, dtype=dtype)
+    return arr
+
+
+def row_stride(arr):
+    return arr.strides[0] if arr.shape[0] > 1 else arr.shape[1] * arr.itemsize
+
+
 def ensure_2d_array(arr, flags, **kwargs):
     arr = require(arr, requirements=flags, **kwargs)
     if len(arr.shape) == 1:
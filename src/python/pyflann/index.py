@@ -26,9 +26,11 @@
 
 #from pyflann.flann_ctypes import *  # NOQA
 import sys
+import threading
 from ctypes import pointer, c_float, byref, c_char_p
 from pyflann.flann_ctypes import (flannlib, FLANNParameters, allowed_types,
-                                  ensure_2d_array, default_flags, flann)
+                                  ensure_2d_array, default_flags, flann,
+                                  as_strided_2d_array, row_stride)
 import numpy as np
 
 from pyflann.exceptions import FLANNException
@@ -38,25 +40,49 @@ import numpy.random as _rn
 index_type = np.int32
 
 
+def index_dtype(dtype):
+    """
+    Returns the type in which an index is built for points of the given type:
+    the type itself if FLANN supports it, float32 for float16 points.
+    """
+    if dtype.type in allowed_types:
+        return dtype.type
+    if dtype.type == np.float16:
+        return np.float32
+    raise FLANNException('Cannot handle type: %s' % dtype)
+
+
+def output_array(out, shape, dtype, name):
+    """
+    Checks that a caller-provided output array can be written in place, or
+    allocates one. Rows may be strided, the elements of a row must be contiguous.
+    """
+    if out is None:
+        return np.empty(shape, dtype=dtype)
+    if out.dtype != dtype:
+        raise FLANNException('%s must be of type %s' % (name, np.dtype(dtype)))
+    if out.ndim == 1 and shape[1] == 1:
+        out = out[:, np.newaxis]
+    if out.shape != shape:
+        raise FLANNException('%s must have shape %s' % (name, shape))
+    if (not out.flags.writeable or not out.flags.aligned or
+            (shape[1] > 1 and out.strides[1] != out.itemsize) or
+            (shape[0] > 1 and out.strides[0] < shape[1] * out.itemsize)):
+        raise FLANNException('%s must be writeable, with contiguous rows' % name)
+    return out
+
+
 def set_distance_type(distance_type, order=0):
     """
-    Sets the distance type used. Possible values: euclidean, manhattan, minkowski, max_dist,
+    Sets the default distance type. Possible values: euclidean, manhattan, minkowski, max_dist,
     hik, hellinger, cs, kl.
+
+    The distance can also be chosen per index with the distance_type (and
+    distance_order) parameters of FLANN or build_index, which takes precedence.
     """
 
-    distance_translation = {'euclidean': 1,
-                            'manhattan': 2,
-                            'minkowski': 3,
-                            'max_dist': 4,
-                            'hik': 5,
-                            'hellinger': 6,
-                            'chi_square': 7,
-                            'cs': 7,
-                            'kullback_leibler': 8,
-                            'kl': 8,
-                            }
     if isinstance(distance_type, str):
-        distance_type = distance_translation[distance_type]
+        distance_type = FLANNParameters._translation_['distance_type'][distance_type]
 
     flannlib.flann_set_distance_type(distance_type, order)
 
@@ -90,13 +116,25 @@ class FLANN(object):
         self.__curindex = None
         self.__curindex_data = None
         self.__curindex_type = None
+        self.__curindex_size = 0
+        self.__curindex_dim = 0
 
+        self.__lock = threading.Lock()
         self.__flann_parameters = FLANNParameters()
         self.__flann_parameters.update(kwargs)
 
     def __del__(self):
         self.delete_index()
 
+    def __call_parameters(self, kwargs):
+        """
+        Updates the parameters with kwargs and returns a copy of them for a
+        single call, so that concurrent calls do not see each other's changes.
+        """
+        with self.__lock:
+            self.__flann_parameters.update(kwargs)
+            return self.__flann_parameters.copy()
+
     ##########################################################################
     # actual workhorse functions
 
@@ -130,12 +168,12 @@ class FLANN(object):
         else:
             dists = np.empty((nqpts, num_neighbors), dtype=np.float32)
 
-        self.__flann_parameters.update(kwargs)
+        params = self.__call_parameters(kwargs)
 
         flann.find_nearest_neighbors[
             pts.dtype.type](
             pts, npts, dim, qpts, nqpts, result, dists, num_neighbors,
-            pointer(self.__flann_parameters))
+            pointer(params))
 
         if num_neighbors == 1:
             return (result.reshape(nqpts), dists.reshape(nqpts))
@@ -150,33 +188,40 @@ class FLANN(object):
         work with multiple stored indices.  Use nn_index(...) to find
         the nearest neighbors in this index.
 
-        pts is a 2d numpy array or matrix. All the computation is done
-        in np.float32 type, but pts may be any type that is convertable
-        to np.float32.
+        pts is a 2d numpy array or matrix of float32, float64, uint8 or int32
+        (float16 points are converted to float32). The points are not copied
+        if their rows are contiguous, even if the array itself is strided;
+        the index refers to them, so they must not be modified while it is
+        used.
         """
 
-        if pts.dtype.type not in allowed_types:
-            raise FLANNException('Cannot handle type: %s' % pts.dtype)
-
-        pts = ensure_2d_array(pts, default_flags)
+        dtype = index_dtype(pts.dtype)
+        pts = as_strided_2d_array(pts, dtype)
         npts, dim = pts.shape
 
         self.__ensureRandomSeed(kwargs)
 
-        self.__flann_parameters.update(kwargs)
+        params = self.__call_parameters(kwargs)
 
         if self.__curindex is not None:
             flann.free_index[self.__curindex_type](
-                self.__curindex, pointer(self.__flann_parameters))
+                self.__curindex, pointer(params))
             self.__curindex = None
 
         speedup = c_float(0)
-        self.__curindex = flann.build_index[pts.dtype.type](
-            pts, npts, dim, byref(speedup), pointer(self.__flann_parameters))
-        self.__curindex_data = pts
-        self.__curindex_type = pts.dtype.type
-
-        params = dict(self.__flann_parameters)
+        self.__curindex = flann.build_index_strided[dtype](
+            pts.ctypes.data, npts, dim, row_stride(pts), byref(speedup), pointer(params))
+        if self.__curindex is None:
+            raise FLANNException('Error building the index')
+        self.__curindex_data = [pts]
+        self.__curindex_type = dtype
+        self.__curindex_size = npts
+        self.__curindex_dim = dim
+
+        with self.__lock:
+            # autotuning updates the parameters
+            self.__flann_parameters = params
+        params = dict(params)
         params['speedup'] = speedup.value
 
         return params
@@ -189,15 +234,14 @@ class FLANN(object):
             flann.save_index[self.__curindex_type](
                 self.__curindex, c_char_p(to_bytes(filename)))
 
-    def load_index(self, filename, pts):
+    def load_index(self, filename, pts, **kwargs):
         """
-        Loads an index previously saved to disk.
+        Loads an index previously saved to disk. The index must be loaded
+        with the distance_type it was built with.
         """
 
-        if pts.dtype.type not in allowed_types:
-            raise FLANNException('Cannot handle type: %s' % pts.dtype)
-
-        pts = ensure_2d_array(pts, default_flags)
+        dtype = index_dtype(pts.dtype)
+        pts = ensure_2d_array(pts.astype(dtype, copy=False), default_flags)
         npts, dim = pts.shape
 
         if self.__curindex is not None:
@@ -207,10 +251,13 @@ class FLANN(object):
             self.__curindex_data = None
             self.__curindex_type = None
 
-        self.__curindex = flann.load_index[pts.dtype.type](
-            c_char_p(to_bytes(filename)), pts, npts, dim)
-        self.__curindex_data = pts
-        self.__curindex_type = pts.dtype.type
+        params = self.__call_parameters(kwargs)
+        self.__curindex = flann.load_index_with_params[dtype](
+            c_char_p(to_bytes(filename)), pts, npts, dim, pointer(params))
+        self.__curindex_data = [pts]
+        self.__curindex_type = dtype
+        self.__curindex_size = npts
+        self.__curindex_dim = dim
         
         
     def used_memory(self):
@@ -224,72 +271,92 @@ class FLANN(object):
         Adds points to pre-built index.
 
         Params:
-            pts: 2D numpy array of points.\n
+            pts: 2D numpy array of points. As for build_index, the points \
+                are not copied if their rows are contiguous, and must not be \
+                modified while the index is used.\n
             rebuild_threshold: reallocs index when it grows by factor of \
                 `rebuild_threshold`. A smaller value results is more space \
                 efficient but less computationally efficient. Must be greater \
                 than 1.           
         """
-        if not pts.dtype.type in allowed_types:
-            raise FLANNException("Cannot handle type: %s"%pts.dtype)
-        pts = ensure_2d_array(pts,default_flags) 
+        if index_dtype(pts.dtype) != self.__curindex_type:
+            raise FLANNException('Index and points must have the same type')
+        pts = as_strided_2d_array(pts, self.__curindex_type)
         npts, dim = pts.shape
-        flann.add_points[self.__curindex_type](self.__curindex, pts, npts, dim, rebuild_threshold)
-        self.__curindex_data = np.row_stack((self.__curindex_data,pts))
+        if flann.add_points_strided[self.__curindex_type](self.__curindex, pts.ctypes.data, npts, dim,
+                                                          row_stride(pts), rebuild_threshold) < 0:
+            raise FLANNException('Error adding points to the index')
+        # the index refers to the points, keep them alive
+        self.__curindex_data.append(pts)
+        self.__curindex_size += npts
         
     def remove_point(self, idx):
         """
-        Removes a point from a pre-built index.         
+        Removes a point from a pre-built index. Ids of points not in the \
+        index are ignored.
         """
-        flann.remove_point[self.__curindex_type](self.__curindex, idx)
-        self.__curindex_data = np.delete(self.__curindex_data,idx,axis=0)
+        if flann.remove_point[self.__curindex_type](self.__curindex, idx) < 0:
+            raise FLANNException('Error removing the point from the index')
+        self.__curindex_size = flann.size[self.__curindex_type](self.__curindex)
 
-    def nn_index(self, qpts, num_neighbors=1, **kwargs):
+    def nn_index(self, qpts, num_neighbors=1, indices=None, dists=None,
+                 batch_size=None, **kwargs):
         """
         For each point in querypts, (which may be a single point), it
         returns the num_neighbors nearest points in the index built by
         calling build_index.
+
+        The queries are not copied if their rows are contiguous (float16
+        queries are converted). The results are written into indices (int32)
+        and dists (float64 for a float64 index, float32 otherwise) if given,
+        which may be strided views of larger arrays, otherwise new arrays are
+        returned.
+
+        The search releases the GIL, so several threads can search the same
+        index concurrently. The cores parameter sets the number of threads
+        used by each search (0 for all the cores). If batch_size is given,
+        the queries are searched in batches of batch_size points.
         """
 
         if self.__curindex is None:
             raise FLANNException(
                 'build_index(...) method not called first or current index deleted.')
 
-        if qpts.dtype.type not in allowed_types:
-            raise FLANNException('Cannot handle type: %s' % qpts.dtype)
-
-        if self.__curindex_type != qpts.dtype.type:
+        if index_dtype(qpts.dtype) != self.__curindex_type:
             raise FLANNException('Index and query must have the same type')
 
-        qpts = ensure_2d_array(qpts, default_flags)
-
-        npts, dim = self.__curindex_data.shape
-
-        if qpts.size == dim:
-            qpts.reshape(1, dim)
+        qpts = as_strided_2d_array(qpts, self.__curindex_type)
 
+        npts, dim = self.__curindex_size, self.__curindex_dim
         nqpts = qpts.shape[0]
 
         assert qpts.shape[1] == dim, 'data and query must have the same dims'
         assert npts >= num_neighbors, 'more neighbors than there are points'
 
-        result = np.empty((nqpts, num_neighbors), dtype=index_type)
-        if self.__curindex_type == np.float64:
-            dists = np.empty((nqpts, num_neighbors), dtype=np.float64)
-        else:
-            dists = np.empty((nqpts, num_neighbors), dtype=np.float32)
-
-        self.__flann_parameters.update(kwargs)
-
-        flann.find_nearest_neighbors_index[
-            self.__curindex_type](
-            self.__curindex, qpts, nqpts, result, dists, num_neighbors,
-            pointer(self.__flann_parameters))
-
+        dist_type = np.float64 if self.__curindex_type == np.float64 else np.float32
+        shape = (nqpts, num_neighbors)
+        result = output_array(indices, shape, index_type, 'indices')
+        result_dists = output_array(dists, shape, dist_type, 'dists')
+
+        params = self.__call_parameters(kwargs)
+
+        batch_size = nqpts if not batch_size else int(batch_size)
+        for start in range(0, nqpts, batch_size):
+            stop = min(nqpts, start + batch_size)
+            q, r, d = qpts[start:stop], result[start:stop], result_dists[start:stop]
+            if flann.find_nearest_neighbors_index_strided[self.__curindex_type](
+                    self.__curindex, q.ctypes.data, stop - start, row_stride(q),
+                    r.ctypes.data, row_stride(r), d.ctypes.data, row_stride(d),
+                    num_neighbors, pointer(params)) < 0:
+                raise FLANNException('Error searching the index')
+
+        if indices is not None or dists is not None:
+            return (indices if indices is not None else result,
+                    dists if dists is not None else result_dists)
         if num_neighbors == 1:
-            return (result.reshape(nqpts), dists.reshape(nqpts))
+            return (result.reshape(nqpts), result_dists.reshape(nqpts))
         else:
-            return (result, dists)
+            return (result, result_dists)
 
     def nn_radius(self, query, radius, **kwargs):
 
@@ -297,13 +364,12 @@ class FLANN(object):
             raise FLANNException(
                 'build_index(...) method not called first or current index deleted.')
 
-        if query.dtype.type not in allowed_types:
-            raise FLANNException('Cannot handle type: %s' % query.dtype)
-
-        if self.__curindex_type != query.dtype.type:
+        if index_dtype(query.dtype) != self.__curindex_type:
             raise FLANNException('Index and query must have the same type')
 
-        npts, dim = self.__curindex_data.shape
+        query = np.ascontiguousarray(query, dtype=self.__curindex_type)
+
+        npts, dim = self.__curindex_size, self.__curindex_dim
         assert query.shape[0] == dim, 'data and query must have the same dims'
 
         result = np.empty(npts, dtype=index_type)
@@ -312,12 +378,12 @@ class FLANN(object):
         else:
             dists = np.empty(npts, dtype=np.float32)
 
-        self.__flann_parameters.update(kwargs)
+        params = self.__call_parameters(kwargs)
 
         nn = flann.radius_search[
             self.__curindex_type](
             self.__curindex, query, result, dists, npts, radius,
-            pointer(self.__flann_parameters))
+            pointer(params))
 
         return (result[0:nn], dists[0:nn])
 
@@ -327,13 +393,15 @@ class FLANN(object):
         The memory used by the dataset that was indexed is not freed.
         """
 
-        self.__flann_parameters.update(kwargs)
+        params = self.__call_parameters(kwargs)
 
         if self.__curindex is not None:
             flann.free_index[self.__curindex_type](
-                self.__curindex, pointer(self.__flann_parameters))
+                self.__curindex, pointer(params))
             self.__curindex = None
             self.__curindex_data = None
+            self.__curindex_size = 0
+            self.__curindex_dim = 0
 
     ##########################################################################
     # Clustering functions
@@ -422,11 +490,11 @@ class FLANN(object):
                   'branching': branch_size,
                   'random_seed': kwargs['random_seed']}
 
-        self.__flann_parameters.update(params)
+        params = self.__call_parameters(params)
 
         numclusters = flann.compute_cluster_centers[pts.dtype.type](
             pts, npts, dim, num_clusters, result,
-            pointer(self.__flann_parameters))
+            pointer(params))
         if numclusters <= 0:
             raise FLANNException('Error occured during clustering procedure.')
 
@@ -66,6 +66,58 @@ TEST_F(Autotuned_SIFT100K, TestSearch)
 }
 
 
+TEST_F(Autotuned_SIFT100K, TestSearchParallel)
+{
+    // evaluate the candidate parameters on all cores
+    Index<L2<float> > index(data, flann::AutotunedIndexParams(0.8,0.01,0,0.1,1,FLANN_PRECISION_AT_K,0,0));
+
+    start_timer("Building autotuned index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, 5, flann::SearchParams(FLANN_CHECKS_AUTOTUNED) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+
+TEST_F(Autotuned_SIFT100K, TestTuningProfile)
+{
+    remove("autotuned.profile");
+
+    flann::AutotunedIndex<L2<float> > index(data, flann::AutotunedIndexParams(std::string("autotuned.profile"), 0.8));
+    start_timer("Building autotuned index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    flann::AutotunedProfile profile;
+    ASSERT_TRUE(flann::load_profile("autotuned.profile", profile));
+    EXPECT_EQ(index.getProfile().algorithm, profile.algorithm);
+    EXPECT_EQ(index.getProfile().checks, profile.checks);
+    EXPECT_EQ(data.rows, profile.rows);
+    EXPECT_GT(profile.intrinsic_dim, 0);
+
+    // the second tuning starts from the saved profile
+    flann::AutotunedIndex<L2<float> > index2(data, flann::AutotunedIndexParams(std::string("autotuned.profile"), 0.8));
+    start_timer("Building autotuned index from profile...");
+    index2.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+    EXPECT_EQ(profile.algorithm, index2.getProfile().algorithm);
+
+    start_timer("Searching KNN...");
+    index2.knnSearch(query, indices, dists, 5, flann::SearchParams(FLANN_CHECKS_AUTOTUNED) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(match, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+}
+
+
 TEST_F(Autotuned_SIFT100K, SavedTest)
 {
     float precision;
@@ -179,6 +231,124 @@ TEST_F(Autotuned_SIFT100K, TestCopy2)
 }
 
 
+TEST_F(Autotuned_SIFT100K, TestParetoFrontier)
+{
+    const size_t nn = 5;
+
+    // tune for precision@5 instead of 1-NN precision
+    flann::AutotunedIndex<L2<float> > index(data, flann::AutotunedIndexParams(0.8,0.01,0,0.1,nn,FLANN_PRECISION_AT_K));
+
+    start_timer("Building autotuned index...");
+    index.buildIndex();
+    printf("done (%g seconds)\n", stop_timer());
+
+    const std::vector<flann::AutotunedOperatingPoint>& frontier = index.getParetoFrontier();
+    ASSERT_FALSE(frontier.empty());
+    for (size_t i=1;i<frontier.size();++i) {
+        EXPECT_LE(frontier[i].precision, frontier[i-1].precision);
+        EXPECT_GT(frontier[i].qps, frontier[i-1].qps);
+    }
+
+    flann::Matrix<size_t> gt_indices(new size_t[query.rows*nn], query.rows, nn);
+    flann::compute_ground_truth<L2<float> >(data, query, gt_indices);
+
+    start_timer("Searching KNN...");
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(FLANN_CHECKS_AUTOTUNED) );
+    printf("done (%g seconds)\n", stop_timer());
+
+    float precision = compute_precision(gt_indices, indices);
+    EXPECT_GE(precision, 0.75);
+    printf("Precision: %g\n", precision);
+
+    delete[] gt_indices.ptr();
+}
+
+TEST(Autotuned_Random, TestBuildWithIds)
+{
+    const size_t rows = 2000;
+    const size_t cols = 4;
+    const size_t nn = 1;
+    std::vector<float> points(rows*cols);
+    for (size_t i=0;i<points.size();++i) {
+        points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+    }
+    flann::Matrix<float> data(&points[0], rows, cols);
+    flann::Matrix<float> query(&points[0], 100, cols);
+    std::vector<size_t> ids(rows);
+    for (size_t i=0;i<rows;++i) {
+        ids[i] = 1000+3*i;
+    }
+
+    // the index is tuned and built once, with the ids
+    flann::AutotunedIndex<L2<float> > index(data, flann::AutotunedIndexParams(0.9,0.01,0,0.1));
+    index.buildIndex(data, ids);
+
+    flann::Matrix<size_t> gt_indices(new size_t[query.rows*nn], query.rows, nn);
+    flann::compute_ground_truth<L2<float> >(data, query, gt_indices);
+    for (size_t i=0;i<query.rows;++i) {
+        gt_indices[i][0] = ids[gt_indices[i][0]];
+    }
+    flann::Matrix<size_t> indices(new size_t[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists(new float[query.rows*nn], query.rows, nn);
+    index.knnSearch(query, indices, dists, nn, flann::SearchParams(FLANN_CHECKS_AUTOTUNED));
+
+    float precision = compute_precision(gt_indices, indices);
+    EXPECT_GE(precision, 0.8);
+    printf("Precision: %g\n", precision);
+
+    delete[] gt_indices.ptr();
+    delete[] indices.ptr();
+    delete[] dists.ptr();
+}
+
+TEST(Autotuned_Random, TestCachedRadiusSearch)
+{
+    const size_t rows = 2000;
+    const size_t cols = 4;
+    const size_t nn = 4;
+    const float radius = 0.05f;
+    std::vector<float> points(rows*cols);
+    for (size_t i=0;i<points.size();++i) {
+        points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+    }
+    flann::Matrix<float> data(&points[0], rows, cols);
+    flann::Matrix<float> query(&points[0], 50, cols);
+
+    Index<L2<float> > index(data, flann::AutotunedIndexParams(0.9,0.01,0,0.1));
+    index.buildIndex();
+    index.save("autotuned.idx");
+    flann::IndexParams cached_params = flann::SavedIndexParams("autotuned.idx");
+    cached_params["cache_size"] = 100;
+    Index<L2<float> > cached(data, cached_params);
+
+    // the tuned checks replace FLANN_CHECKS_AUTOTUNED only, the matrices
+    // still limit the number of neighbors returned
+    flann::SearchParams params(FLANN_CHECKS_AUTOTUNED);
+    flann::Matrix<size_t> indices(new size_t[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> dists(new float[query.rows*nn], query.rows, nn);
+    flann::Matrix<size_t> cached_indices(new size_t[query.rows*nn], query.rows, nn);
+    flann::Matrix<float> cached_dists(new float[query.rows*nn], query.rows, nn);
+    int count = index.radiusSearch(query, indices, dists, radius, params);
+    EXPECT_GE(int(query.rows*nn), count);
+    for (int pass=0;pass<2;++pass) {
+        EXPECT_EQ(count, cached.radiusSearch(query, cached_indices, cached_dists, radius, params));
+        for (size_t i=0;i<query.rows;++i) {
+            for (size_t j=0;j<nn && indices[i][j]!=size_t(-1);++j) {
+                EXPECT_EQ(indices[i][j], cached_indices[i][j]);
+                EXPECT_EQ(dists[i][j], cached_dists[i][j]);
+            }
+        }
+    }
+    EXPECT_EQ(query.rows, cached.cacheHits());
+
+    delete[] indices.ptr();
+    delete[] dists.ptr();
+    delete[] cached_indices.ptr();
+    delete[] cached_dists.ptr();
+    remove("autotuned.idx");
+}
+
+
 
 int main(int argc, char** argv)
 {
@@ -88,6 +88,12 @@ TEST_F(HierarchicalIndex_Brief100K, TestRemove)
 			query, indices, dists, k_nn_, flann::SearchParams(2000));
 }
 
+TEST_F(HierarchicalIndex_Brief100K, TestRemoveWithIds)
+{
+	TestRemoveWithIds<Distance>(data, flann::HierarchicalClusteringIndexParams(),
+			query, indices, dists, k_nn_, flann::SearchParams(2000), 0.8);
+}
+
 TEST_F(HierarchicalIndex_Brief100K, TestSave)
 {
 	TestSave<Distance>(data, flann::HierarchicalClusteringIndexParams(),
@@ -57,6 +57,12 @@ TEST_F(KDTreeSingle, TestRemove)
 			query, indices, dists, knn, flann::SearchParams(-1));
 }
 
+TEST_F(KDTreeSingle, TestRemoveWithIds)
+{
+	TestRemoveWithIds<L2_Simple<float> >(data, flann::KDTreeSingleIndexParams(12, true),
+			query, indices, dists, knn, flann::SearchParams(-1), 1.0);
+}
+
 
 TEST_F(KDTreeSingle, TestSave)
 {
@@ -305,6 +311,164 @@ TEST_F(KDTreeSinglePointCloud, TestKNearestSearch)
 
 }
 
+TEST_F(KDTreeSinglePointCloud, TestKnnSearchBatch)
+{
+	size_t no_of_neighbors = 8;
+	flann::Matrix<float> query(cloud_big_mat_.ptr(), 20000, 3);
+
+	flann::Matrix<size_t> indices(new size_t[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+	flann::Matrix<float> dists(new float[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+	flann::Matrix<size_t> indices2(new size_t[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+	flann::Matrix<float> dists2(new float[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+
+	flann::KDTreeSingleIndex<L2_Simple<float> > index(cloud_big_mat_, flann::KDTreeSingleIndexParams(10));
+	index.buildIndex();
+
+	// remove some points so that the packet traversal has to skip them as well
+	for (size_t i=0;i<cloud_big_mat_.rows;i+=7) {
+		index.removePoint(i);
+	}
+
+	start_timer("K nearest neighbour search...");
+	index.knnSearch(query, indices, dists, no_of_neighbors, flann::SearchParams(-1));
+	printf("done (%g seconds)\n", stop_timer());
+
+	start_timer("K nearest neighbour batch search...");
+	index.knnSearchBatch(query, indices2, dists2, no_of_neighbors, flann::SearchParams(-1));
+	printf("done (%g seconds)\n", stop_timer());
+
+	for (size_t i=0;i<query.rows;++i) {
+		for (size_t j=0;j<no_of_neighbors;++j) {
+			EXPECT_EQ(indices[i][j], indices2[i][j]);
+			EXPECT_EQ(dists[i][j], dists2[i][j]);
+		}
+	}
+
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+	delete[] indices2.ptr();
+	delete[] dists2.ptr();
+}
+
+TEST_F(KDTreeSinglePointCloud, TestLowDimensional)
+{
+	size_t no_of_neighbors = 5;
+	size_t rows = 10000;
+	size_t query_rows = 1000;
+
+	// the 2, 3 and 4 dimensional cases use the fixed dimension kernels, 5 the generic one
+	for (size_t dim=2; dim<=5; ++dim) {
+		std::vector<float> points(rows*dim);
+		for (size_t i=0;i<points.size();++i) {
+			points[i] = static_cast<float> (1024 * rand () / (RAND_MAX + 1.0));
+		}
+		flann::Matrix<float> data(&points[0], rows, dim);
+		flann::Matrix<float> query(&points[0], query_rows, dim);
+
+		flann::Matrix<size_t> indices(new size_t[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+		flann::Matrix<float> dists(new float[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+		flann::Matrix<size_t> gt_indices(new size_t[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+		flann::Matrix<float> gt_dists(new float[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+
+		flann::Index<L2_Simple<float> > linear(data, flann::LinearIndexParams());
+		linear.buildIndex();
+		linear.knnSearch(query, gt_indices, gt_dists, no_of_neighbors, flann::SearchParams(-1));
+
+		flann::Index<L2_Simple<float> > index(data, flann::KDTreeSingleIndexParams(12));
+		index.buildIndex();
+		index.knnSearch(query, indices, dists, no_of_neighbors, flann::SearchParams(-1));
+
+		for (size_t i=0;i<query.rows;++i) {
+			for (size_t j=0;j<no_of_neighbors;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+		}
+
+		delete[] indices.ptr();
+		delete[] dists.ptr();
+		delete[] gt_indices.ptr();
+		delete[] gt_dists.ptr();
+	}
+}
+
+struct CompareX
+{
+	bool operator()(const MyPoint& a, const MyPoint& b) const { return a.x<b.x; }
+};
+
+TEST_F(KDTreeSinglePointCloud, TestIncrementalInsert)
+{
+	size_t no_of_neighbors = 10;
+	size_t chunk = 1000;
+	flann::Matrix<float> query(cloud_big_mat_.ptr(), 1000, 3);
+
+	flann::Matrix<size_t> indices(new size_t[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+	flann::Matrix<float> dists(new float[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+	flann::Matrix<size_t> gt_indices(new size_t[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+	flann::Matrix<float> gt_dists(new float[query.rows*no_of_neighbors], query.rows, no_of_neighbors);
+
+	// stream the points sorted along x so that new points keep falling in the same part of the tree
+	std::vector<MyPoint> points(cloud_big_.begin(), cloud_big_.begin()+100000);
+	std::sort(points.begin(), points.end(), CompareX());
+	flann::Matrix<float> data(&points[0].x, points.size(), 3);
+
+	for (int reorder=0; reorder<2; ++reorder) {
+		flann::Index<L2_Simple<float> > index(flann::Matrix<float>(data.ptr(), chunk, 3), flann::KDTreeSingleIndexParams(10, reorder!=0));
+		flann::Index<L2_Simple<float> > linear(flann::Matrix<float>(data.ptr(), chunk, 3), flann::LinearIndexParams());
+		index.buildIndex();
+		linear.buildIndex();
+
+		start_timer("Inserting points...");
+		for (size_t i=chunk; i<data.rows; i+=chunk) {
+			flann::Matrix<float> points_chunk(data[i], std::min(chunk, data.rows-i), 3);
+			index.addPoints(points_chunk, 0);
+			linear.addPoints(points_chunk, 0);
+			// remove some of the points, they must be dropped by the partial rebuilds
+			index.removePoint(i/2);
+			linear.removePoint(i/2);
+		}
+		printf("done (%g seconds)\n", stop_timer());
+		EXPECT_EQ(index.size(), linear.size());
+
+		// the nodes of the rebuilt subtrees and the entries of the moved leaves are reused, the
+		// index takes less than twice the memory of a new one (its arrays grow by doubling)
+		flann::Index<L2_Simple<float> > rebuilt(data, flann::KDTreeSingleIndexParams(10, reorder!=0));
+		rebuilt.buildIndex();
+		printf("Memory: %zu inserted, %zu rebuilt\n", index.usedMemory(), rebuilt.usedMemory());
+		EXPECT_LT(index.usedMemory(), 2*rebuilt.usedMemory());
+
+		linear.knnSearch(query, gt_indices, gt_dists, no_of_neighbors, flann::SearchParams(-1));
+		index.knnSearch(query, indices, dists, no_of_neighbors, flann::SearchParams(-1));
+		for (size_t i=0;i<query.rows;++i) {
+			for (size_t j=0;j<no_of_neighbors;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+		}
+
+		// the incrementally built tree must survive saving and copying
+		index.save("test_saved_index.idx");
+		flann::Index<L2_Simple<float> > index2(data, flann::SavedIndexParams("test_saved_index.idx"));
+		flann::Index<L2_Simple<float> > index3(index);
+		index2.knnSearch(query, indices, dists, no_of_neighbors, flann::SearchParams(-1));
+		for (size_t i=0;i<query.rows;++i) {
+			for (size_t j=0;j<no_of_neighbors;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+		}
+		index3.knnSearch(query, indices, dists, no_of_neighbors, flann::SearchParams(-1));
+		for (size_t i=0;i<query.rows;++i) {
+			for (size_t j=0;j<no_of_neighbors;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+		}
+	}
+
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+	delete[] gt_indices.ptr();
+	delete[] gt_dists.ptr();
+}
+
 int main(int argc, char** argv)
 {
     testing::InitGoogleTest(&argc, argv);
@@ -29,6 +29,14 @@ TEST_F(KDTree_SIFT10K, TestSearch2)
 }
 
 
+TEST_F(KDTree_SIFT10K, TestSearchStallChecks)
+{
+	flann::SearchParams search_params(1024);
+	search_params.stall_checks = 256;
+	TestSearch<flann::L2<float> >(data, flann::KDTreeIndexParams(4), query, indices,
+			dists, knn, search_params, 0.75, gt_indices);
+}
+
 TEST_F(KDTree_SIFT10K, TestAddIncremental)
 {
 	TestAddIncremental<flann::L2<float> >(data, flann::KDTreeIndexParams(4), query, indices,
@@ -47,6 +55,12 @@ TEST_F(KDTree_SIFT10K, TestRemove)
 			dists, knn, flann::SearchParams(256) );
 }
 
+TEST_F(KDTree_SIFT10K, TestRemoveWithIds)
+{
+	TestRemoveWithIds<flann::L2<float> >(data, flann::KDTreeIndexParams(4), query, indices,
+			dists, knn, flann::SearchParams(256), 0.75);
+}
+
 
 TEST_F(KDTree_SIFT10K, TestSave)
 {
@@ -54,6 +68,84 @@ TEST_F(KDTree_SIFT10K, TestSave)
 			dists, knn, flann::SearchParams(256), 0.75, gt_indices);
 }
 
+TEST_F(KDTree_SIFT10K, TestSaveCompression)
+{
+	flann_compression_t compressions[] = { FLANN_COMPRESSION_NONE, FLANN_COMPRESSION_LZ4, FLANN_COMPRESSION_LZ4HC };
+	for (size_t i=0;i<sizeof(compressions)/sizeof(compressions[0]);++i) {
+		flann::KDTreeIndexParams params(4);
+		params["save_compression"] = compressions[i];
+		params["save_dataset"] = true;
+		TestSave<flann::L2<float> >(data, params, query, indices,
+				dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+	}
+}
+
+TEST_F(KDTree_SIFT10K, TestLoadMapped)
+{
+	flann::seed_random(0);
+	Index<L2<float> > index(data, flann::KDTreeIndexParams(4));
+	index.buildIndex();
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(256));
+	index.save("test_saved_index.idx");
+
+	flann::MappedDataset<float> mapped;
+	flann::map_from_file(mapped, filename_, "dataset");
+	EXPECT_EQ(mapped.rows(), data.rows);
+	EXPECT_EQ(mapped.cols(), data.cols);
+
+	Index<L2<float> > loaded(mapped.matrix(), flann::SavedIndexParams("test_saved_index.idx"));
+	flann::Matrix<size_t> loaded_indices(new size_t[query.rows*knn], query.rows, knn);
+	loaded.knnSearch(query, loaded_indices, dists, knn, flann::SearchParams(256));
+	for (size_t i=0;i<query.rows*knn;++i) {
+		EXPECT_EQ(indices.ptr()[i], loaded_indices.ptr()[i]);
+	}
+	delete[] loaded_indices.ptr();
+
+	// the dataset must have the shape the index was built with
+	EXPECT_THROW(Index<L2<float> >(flann::Matrix<float>(data.ptr(), data.rows-1, data.cols),
+			flann::SavedIndexParams("test_saved_index.idx")), flann::FLANNException);
+}
+
+
+/**
+ * The fixtures are kd-tree indexes of the dataset below, saved with the dataset:
+ * kdtree_v1.1.idx by FLANN 1.9.2 (chained LZ4 blocks) and kdtree_v1.0.idx holding
+ * the same data compressed as a single LZ4 block.
+ */
+TEST(KDTree_Saved, TestLoadPreviousVersions)
+{
+	size_t rows = 2500;
+	size_t cols = 4;
+	size_t knn = 5;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<rows;++i) {
+		for (size_t j=0;j<cols;++j) {
+			points[i*cols+j] = float((i*(j+3)*7919 + j*104729) % 97);
+		}
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	Matrix<float> query(&points[0], 200, cols);
+
+	Index<L2<float> > linear(data, flann::LinearIndexParams());
+	linear.buildIndex();
+	std::vector<std::vector<size_t> > gt_indices;
+	std::vector<std::vector<float> > gt_dists;
+	linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+
+	const char* files[] = { "../datasets/kdtree_v1.0.idx", "../datasets/kdtree_v1.1.idx" };
+	for (size_t f=0;f<2;++f) {
+		Index<L2<float> > index(data, flann::SavedIndexParams(files[f]));
+		EXPECT_EQ(FLANN_INDEX_KDTREE, index.getType());
+		EXPECT_EQ(rows, index.size());
+		EXPECT_EQ(cols, index.veclen());
+
+		std::vector<std::vector<size_t> > indices;
+		std::vector<std::vector<float> > dists;
+		index.knnSearch(query, indices, dists, knn, flann::SearchParams(flann::FLANN_CHECKS_UNLIMITED));
+		EXPECT_EQ(gt_dists, dists) << files[f];
+	}
+}
+
 
 TEST_F(KDTree_SIFT10K, TestCopy)
 {
@@ -67,6 +159,400 @@ TEST_F(KDTree_SIFT10K, TestCopy2)
 			dists, knn, flann::SearchParams(256), 0.75, gt_indices);
 }
 
+TEST(KDTree_Random, TestBackgroundRebuild)
+{
+	size_t rows = 20000;
+	size_t cols = 8;
+	size_t knn = 5;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	Matrix<float> query(&points[0], 500, cols);
+
+	flann::IndexParams params = flann::KDTreeIndexParams(1);
+	params["background_rebuild"] = true;
+	Index<L2<float> > index(Matrix<float>(data[0], 2000, cols), params);
+	index.buildIndex();
+	Index<L2<float> > linear(Matrix<float>(data[0], 2000, cols), flann::LinearIndexParams());
+	linear.buildIndex();
+
+	Matrix<size_t> indices(new size_t[query.rows*knn], query.rows, knn);
+	Matrix<float> dists(new float[query.rows*knn], query.rows, knn);
+	Matrix<size_t> gt_indices(new size_t[query.rows*knn], query.rows, knn);
+	Matrix<float> gt_dists(new float[query.rows*knn], query.rows, knn);
+
+	// searches run against the old index and the delta points while rebuilds are in progress
+	for (size_t offset=2000; offset<rows; offset+=1000) {
+		Matrix<float> chunk(data[offset], 1000, cols);
+		index.addPoints(chunk);
+		linear.addPoints(chunk);
+		for (size_t id=offset-1000; id<offset+1000; id+=97) {
+			index.removePoint(id);
+			linear.removePoint(id);
+		}
+		EXPECT_EQ(linear.size(), index.size());
+
+		index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+		linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+		for (size_t i=0;i<query.rows;++i) {
+			for (size_t j=0;j<knn;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+		}
+	}
+
+	index.waitForRebuild();
+	EXPECT_EQ(linear.size(), index.size());
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+	EXPECT_EQ(1.0, compute_precision(gt_indices, indices));
+
+	std::vector<std::vector<size_t> > radius_indices;
+	std::vector<std::vector<float> > radius_dists;
+	std::vector<std::vector<size_t> > gt_radius_indices;
+	std::vector<std::vector<float> > gt_radius_dists;
+	index.addPoints(Matrix<float>(data[0], 100, cols));
+	linear.addPoints(Matrix<float>(data[0], 100, cols));
+	index.radiusSearch(query, radius_indices, radius_dists, 0.1f, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	linear.radiusSearch(query, gt_radius_indices, gt_radius_dists, 0.1f, flann::SearchParams());
+	for (size_t i=0;i<query.rows;++i) {
+		// the re-added points are at the same distance as the original ones
+		std::sort(radius_indices[i].begin(), radius_indices[i].end());
+		std::sort(gt_radius_indices[i].begin(), gt_radius_indices[i].end());
+		EXPECT_EQ(gt_radius_indices[i], radius_indices[i]);
+	}
+
+	// a new index is built over other points, replacing the rebuilt one
+	Matrix<float> rest(data[rows-5000], 5000, cols);
+	index.buildIndex(rest);
+	Index<L2<float> > rest_linear(rest, flann::LinearIndexParams());
+	rest_linear.buildIndex();
+	EXPECT_EQ(rest.rows, index.size());
+	index.removePoint(7);
+	rest_linear.removePoint(7);
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	rest_linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+	EXPECT_EQ(1.0, compute_precision(gt_indices, indices));
+
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+	delete[] gt_indices.ptr();
+	delete[] gt_dists.ptr();
+}
+
+TEST(KDTree_Random, TestStreamFromFile)
+{
+	size_t rows = 20000;
+	size_t cols = 8;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	remove("test_stream.h5");
+	flann::save_to_file(data, "test_stream.h5", "dataset", 6);
+
+	// the index is built while the rest of the dataset is read
+	Matrix<float> loaded;
+	Index<L2<float> >* index = NULL;
+	size_t blocks = 0;
+	flann::stream_from_file(loaded, "test_stream.h5", "dataset", [&](const Matrix<float>& block) {
+		if (index==NULL) {
+			index = new Index<L2<float> >(block, flann::KDTreeIndexParams(4));
+			index->buildIndex();
+		}
+		else {
+			index->addPoints(block);
+		}
+		++blocks;
+	}, 3000);
+
+	EXPECT_EQ(7u, blocks);
+	ASSERT_EQ(rows, loaded.rows);
+	ASSERT_EQ(cols, loaded.cols);
+	EXPECT_TRUE(std::equal(points.begin(), points.end(), loaded.ptr()));
+	EXPECT_EQ(rows, index->size());
+
+	// chunked datasets cannot be mapped, but are read in blocks as well
+	flann::MappedDataset<float> mapped;
+	EXPECT_THROW(flann::map_from_file(mapped, "test_stream.h5", "dataset"), flann::FLANNException);
+	flann::Hdf5DatasetReader<float> reader("test_stream.h5", "dataset");
+	EXPECT_FALSE(reader.isMapped());
+	std::vector<float> range(100*cols);
+	reader.read(12345, 100, &range[0]);
+	EXPECT_TRUE(std::equal(range.begin(), range.end(), data[12345]));
+
+	delete index;
+	delete[] loaded.ptr();
+}
+
+TEST(KDTree_Random, TestTimeBudget)
+{
+	size_t rows = 50000;
+	size_t cols = 32;
+	size_t knn = 5;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	Matrix<float> query(&points[0], 200, cols);
+
+	Index<L2<float> > index(data, flann::KDTreeIndexParams(4));
+	index.buildIndex();
+
+	std::vector<std::vector<size_t> > indices;
+	std::vector<std::vector<float> > dists;
+	bool* timed_out = new bool[query.rows];
+	flann::SearchParams search_params(20000);
+	search_params.timed_out = timed_out;
+
+	index.knnSearch(query, indices, dists, knn, search_params);
+	for (size_t i=0;i<query.rows;++i) {
+		EXPECT_FALSE(timed_out[i]);
+		EXPECT_EQ(knn, indices[i].size());
+	}
+
+	// the searches return the neighbors found when the budget runs out
+	search_params.time_budget_us = 20;
+	index.knnSearch(query, indices, dists, knn, search_params);
+	size_t timed_out_count = 0;
+	for (size_t i=0;i<query.rows;++i) {
+		if (timed_out[i]) timed_out_count++;
+		ASSERT_LE(1u, indices[i].size());
+		EXPECT_EQ(0.0f, dists[i][0]);
+	}
+	EXPECT_GT(timed_out_count, query.rows/2);
+
+	// once the batch deadline passes all remaining queries stop early
+	search_params.time_budget_us = 0;
+	search_params.batch_time_budget_us = 1000;
+	index.knnSearch(query, indices, dists, knn, search_params);
+	EXPECT_TRUE(timed_out[query.rows-1]);
+
+	delete[] timed_out;
+}
+
+TEST(KDTree_Random, TestQueryCache)
+{
+	size_t rows = 10000;
+	size_t cols = 8;
+	size_t knn = 5;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows-1000, cols);
+	Matrix<float> query(&points[0], 100, cols);
+
+	flann::IndexParams params = flann::KDTreeIndexParams(1);
+	params["cache_size"] = 150;
+	params["cache_shards"] = 1;
+	Index<L2<float> > index(data, params);
+	index.buildIndex();
+	Index<L2<float> > linear(data, flann::LinearIndexParams());
+	linear.buildIndex();
+
+	Matrix<size_t> indices(new size_t[query.rows*knn], query.rows, knn);
+	Matrix<float> dists(new float[query.rows*knn], query.rows, knn);
+	Matrix<size_t> gt_indices(new size_t[query.rows*knn], query.rows, knn);
+	Matrix<float> gt_dists(new float[query.rows*knn], query.rows, knn);
+
+	// repeated queries are answered from the cache
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	EXPECT_EQ(0u, index.cacheHits());
+	EXPECT_EQ(query.rows, index.cacheMisses());
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	EXPECT_EQ(query.rows, index.cacheHits());
+	linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+	EXPECT_EQ(1.0, compute_precision(gt_indices, indices));
+
+	// different search parameters do not share cached results
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(32));
+	EXPECT_EQ(query.rows, index.cacheHits());
+
+	// the least recently used results are evicted
+	index.knnSearch(Matrix<float>(query[0], 10, cols), indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	EXPECT_EQ(query.rows, index.cacheHits());
+
+	// adding and removing points invalidates the cache
+	index.addPoints(Matrix<float>(&points[(rows-1000)*cols], 1000, cols));
+	linear.addPoints(Matrix<float>(&points[(rows-1000)*cols], 1000, cols));
+	index.removePoint(3);
+	linear.removePoint(3);
+	size_t hits = index.cacheHits();
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	EXPECT_EQ(hits, index.cacheHits());
+	linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+	EXPECT_EQ(1.0, compute_precision(gt_indices, indices));
+
+	std::vector<std::vector<size_t> > radius_indices;
+	std::vector<std::vector<float> > radius_dists;
+	std::vector<std::vector<size_t> > cached_indices;
+	std::vector<std::vector<float> > cached_dists;
+	index.radiusSearch(query, radius_indices, radius_dists, 0.1f, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	hits = index.cacheHits();
+	index.radiusSearch(query, cached_indices, cached_dists, 0.1f, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	EXPECT_EQ(hits+query.rows, index.cacheHits());
+	EXPECT_EQ(radius_indices, cached_indices);
+
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+	delete[] gt_indices.ptr();
+	delete[] gt_dists.ptr();
+}
+
+TEST(KDTree_Random, TestQueryCacheRadius)
+{
+	size_t rows = 10000;
+	size_t cols = 8;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	Matrix<float> query(&points[0], 100, cols);
+	float radius = 0.2f;
+
+	flann::IndexParams params = flann::KDTreeIndexParams(1);
+	Index<L2<float> > index(data, params);
+	index.buildIndex();
+	// the same trees, with the results cached
+	index.save("test_saved_index.idx");
+	flann::IndexParams cached_params = flann::SavedIndexParams("test_saved_index.idx");
+	cached_params["cache_size"] = 1000;
+	Index<L2<float> > cached(data, cached_params);
+
+	// the number of neighbors is limited by max_neighbors or by the size of the matrices
+	int max_neighbors[] = { 3, -1, -1 };
+	size_t nn[] = { 10, 4, 10 };
+	bool sorted[] = { true, false, true };
+	for (int t=0;t<3;++t) {
+		flann::SearchParams search_params(128);
+		search_params.max_neighbors = max_neighbors[t];
+		search_params.sorted = sorted[t];
+		Matrix<size_t> indices(new size_t[query.rows*nn[t]], query.rows, nn[t]);
+		Matrix<float> dists(new float[query.rows*nn[t]], query.rows, nn[t]);
+		Matrix<size_t> cached_indices(new size_t[query.rows*nn[t]], query.rows, nn[t]);
+		Matrix<float> cached_dists(new float[query.rows*nn[t]], query.rows, nn[t]);
+
+		int count = index.radiusSearch(query, indices, dists, radius, search_params);
+		// searched, then answered from the cache
+		for (int pass=0;pass<2;++pass) {
+			EXPECT_EQ(count, cached.radiusSearch(query, cached_indices, cached_dists, radius, search_params));
+			for (size_t i=0;i<query.rows;++i) {
+				std::set<size_t> found(indices[i], std::find(indices[i], indices[i]+nn[t], size_t(-1)));
+				std::set<size_t> cached_found(cached_indices[i], std::find(cached_indices[i], cached_indices[i]+nn[t], size_t(-1)));
+				EXPECT_EQ(found, cached_found);
+				if (sorted[t]) {
+					for (size_t j=0;j<nn[t] && indices[i][j]!=size_t(-1);++j) {
+						EXPECT_EQ(indices[i][j], cached_indices[i][j]);
+						EXPECT_EQ(dists[i][j], cached_dists[i][j]);
+					}
+				}
+			}
+		}
+		EXPECT_LT(int(query.rows), count);
+		EXPECT_GT(cached.cacheHits(), 0u);
+
+		delete[] indices.ptr();
+		delete[] dists.ptr();
+		delete[] cached_indices.ptr();
+		delete[] cached_dists.ptr();
+	}
+	remove("test_saved_index.idx");
+}
+
+TEST(KDTree_Random, TestSearchStats)
+{
+	size_t rows = 20000;
+	size_t cols = 16;
+	size_t knn = 5;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	Matrix<float> query(&points[0], 300, cols);
+
+	Index<L2<float> > index(data, flann::KDTreeIndexParams(4));
+	index.buildIndex();
+	index.removePoint(0);
+
+	std::vector<std::vector<size_t> > indices;
+	std::vector<std::vector<float> > dists;
+	flann::SearchStatistics stats;
+	flann::SearchParams search_params(128);
+	search_params.stats = &stats;
+	index.knnSearch(query, indices, dists, knn, search_params);
+
+	EXPECT_EQ(query.rows, stats.queries());
+	// every checked leaf holds one point, and the search stops at 128 checks
+	EXPECT_EQ(stats.total(SearchStats::LEAVES_SCANNED), stats.total(SearchStats::DISTANCE_EVALS));
+	EXPECT_GE(128u, stats.max(SearchStats::DISTANCE_EVALS));
+	EXPECT_GT(stats.mean(SearchStats::HEAP_POPS), 0);
+	EXPECT_GE(stats.total(SearchStats::HEAP_PUSHES), stats.total(SearchStats::HEAP_POPS));
+	// the removed point is the nearest neighbor of the first query, found once by each tree
+	EXPECT_GE(stats.total(SearchStats::REMOVED_SKIPS), 1u);
+	EXPECT_GE(stats.percentile(SearchStats::NODES_VISITED, 0.99f), stats.percentile(SearchStats::NODES_VISITED, 0.5f));
+
+	size_t histogram_queries = 0;
+	for (int b=0;b<SearchStatistics::BUCKETS;++b) {
+		histogram_queries += stats.histogram(SearchStats::NODES_VISITED, b);
+	}
+	EXPECT_EQ(query.rows, histogram_queries);
+
+	// searches without a statistics sink are not recorded
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(128));
+	EXPECT_EQ(query.rows, stats.queries());
+}
+
+TEST(KDTree_Random, TestStallChecks)
+{
+	size_t rows = 20000;
+	size_t cols = 8;
+	size_t knn = 5;
+	std::vector<float> points(rows*cols);
+	for (size_t i=0;i<points.size();++i) {
+		points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+	}
+	Matrix<float> data(&points[0], rows, cols);
+	Matrix<float> query(&points[0], 300, cols);
+
+	Index<L2<float> > index(data, flann::KDTreeIndexParams(4));
+	index.buildIndex();
+
+	Matrix<size_t> gt_indices(new size_t[query.rows*knn], query.rows, knn);
+	flann::compute_ground_truth<L2<float> >(data, query, gt_indices);
+	Matrix<size_t> indices(new size_t[query.rows*knn], query.rows, knn);
+	Matrix<float> dists(new float[query.rows*knn], query.rows, knn);
+
+	flann::SearchStatistics stats;
+	flann::SearchParams search_params(2048);
+	search_params.stats = &stats;
+	index.knnSearch(query, indices, dists, knn, search_params);
+	size_t checks = stats.total(SearchStats::DISTANCE_EVALS);
+	EXPECT_GE(compute_precision(gt_indices, indices), 0.99);
+
+	// the low dimensional queries converge long before the checks budget is used up
+	flann::SearchStatistics stall_stats;
+	search_params.stall_checks = 64;
+	search_params.stats = &stall_stats;
+	index.knnSearch(query, indices, dists, knn, search_params);
+	size_t stall_checks = stall_stats.total(SearchStats::DISTANCE_EVALS);
+	float stall_precision = compute_precision(gt_indices, indices);
+	printf("Checks: %zu, with stall_checks: %zu (precision %g)\n", checks, stall_checks, stall_precision);
+
+	EXPECT_LT(4*stall_checks, checks);
+	EXPECT_GE(stall_precision, 0.9);
+
+	delete[] gt_indices.ptr();
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+}
+
 /**
  * Test fixture for SIFT 100K dataset
  */
@@ -32,6 +32,14 @@ TEST_F(KMeans_SIFT10K, TestSearch2)
 }
 
 
+TEST_F(KMeans_SIFT10K, TestSearchStallChecks)
+{
+	flann::SearchParams search_params(1024);
+	search_params.stall_checks = 256;
+	TestSearch<flann::L2<float> >(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4),
+			query, indices, dists, knn, search_params, 0.75, gt_indices);
+}
+
 TEST_F(KMeans_SIFT10K, TestAddIncremental)
 {
 	TestAddIncremental<flann::L2<float> >(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4),
@@ -50,6 +58,12 @@ TEST_F(KMeans_SIFT10K, TestRemove)
 			query, indices, dists, knn, flann::SearchParams(128));
 }
 
+TEST_F(KMeans_SIFT10K, TestRemoveWithIds)
+{
+	TestRemoveWithIds<flann::L2<float> >(data, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4),
+			query, indices, dists, knn, flann::SearchParams(128), 0.75);
+}
+
 
 
 TEST_F(KMeans_SIFT10K, TestSave)
@@ -0,0 +1,349 @@
+#include <gtest/gtest.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/mpi.hpp>
+#include <boost/thread/thread.hpp>
+#include <flann/flann.h>
+#include <flann/io/hdf5.h>
+#include <flann/mpi/index.h>
+#include <flann/mpi/server.h>
+#include <flann/mpi/client.h>
+
+#include "flann_tests.h"
+
+using namespace flann;
+
+/**
+ * Run with mpirun: each process loads its part of a random dataset written by
+ * process 0, and the results gathered in process 0 are compared with a linear
+ * search of the whole dataset. The processes search their part linearly too,
+ * so that the results match exactly.
+ */
+class MPI_Random : public FLANNTestFixture {
+protected:
+	boost::mpi::communicator world;
+	std::vector<float> points;
+	flann::Matrix<float> data;
+	flann::Matrix<float> query;
+
+	void SetUp()
+	{
+		size_t rows = 10000;
+		size_t cols = 8;
+		// all the processes generate the same points
+		srand(42);
+		points.resize(rows*cols);
+		for (size_t i=0;i<points.size();++i) {
+			points[i] = static_cast<float> (rand () / (RAND_MAX + 1.0));
+		}
+		data = flann::Matrix<float>(&points[0], rows, cols);
+		query = flann::Matrix<float>(&points[0], 500, cols);
+		if (world.rank()==0) {
+			remove("test_mpi.h5");
+			flann::save_to_file(data, "test_mpi.h5", "dataset");
+		}
+		world.barrier();
+	}
+
+	void TearDown()
+	{
+		world.barrier();
+		if (world.rank()==0) {
+			remove("test_mpi.h5");
+		}
+	}
+};
+
+
+TEST_F(MPI_Random, TestKnnSearch)
+{
+	size_t knn = 5;
+	flann::mpi::Index<L2<float> > index("test_mpi.h5", "dataset", flann::LinearIndexParams());
+	index.buildIndex();
+	EXPECT_EQ(data.rows, index.size());
+
+	flann::Matrix<size_t> indices(new size_t[query.rows*knn], query.rows, knn);
+	flann::Matrix<float> dists(new float[query.rows*knn], query.rows, knn);
+	index.knnSearch(query, indices, dists, knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+
+	if (world.rank()==0) {
+		flann::Index<L2<float> > linear(data, flann::LinearIndexParams());
+		linear.buildIndex();
+		flann::Matrix<size_t> gt_indices(new size_t[query.rows*knn], query.rows, knn);
+		flann::Matrix<float> gt_dists(new float[query.rows*knn], query.rows, knn);
+		linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+		for (size_t i=0;i<query.rows;++i) {
+			for (size_t j=0;j<knn;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+		}
+		EXPECT_EQ(1.0, compute_precision(gt_indices, indices));
+		delete[] gt_indices.ptr();
+		delete[] gt_dists.ptr();
+	}
+
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+}
+
+TEST_F(MPI_Random, TestRadiusSearch)
+{
+	size_t max_nn = 50;
+	float radius = 0.1f;
+	flann::IndexParams params = flann::LinearIndexParams();
+	// several chunks are reduced while the next ones are searched
+	params["chunk_size"] = 64;
+	flann::mpi::Index<L2<float> > index("test_mpi.h5", "dataset", params);
+	index.buildIndex();
+
+	flann::Matrix<int> indices(new int[query.rows*max_nn], query.rows, max_nn);
+	flann::Matrix<float> dists(new float[query.rows*max_nn], query.rows, max_nn);
+	int count = index.radiusSearch(query, indices, dists, radius, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+
+	if (world.rank()==0) {
+		flann::Index<L2<float> > linear(data, flann::LinearIndexParams());
+		linear.buildIndex();
+		std::vector<std::vector<int> > gt_indices;
+		std::vector<std::vector<float> > gt_dists;
+		linear.radiusSearch(query, gt_indices, gt_dists, radius, flann::SearchParams());
+		int gt_count = 0;
+		for (size_t i=0;i<query.rows;++i) {
+			size_t n = std::min(gt_indices[i].size(), max_nn);
+			gt_count += n;
+			for (size_t j=0;j<n;++j) {
+				EXPECT_EQ(gt_dists[i][j], dists[i][j]);
+			}
+			// the missing neighbors are reported as -1
+			for (size_t j=n;j<max_nn;++j) {
+				EXPECT_EQ(-1, indices[i][j]);
+			}
+		}
+		EXPECT_GT(gt_count, int(query.rows));
+		EXPECT_EQ(gt_count, count);
+	}
+
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+}
+
+/**
+ * Loads the saved index on all the processes, which must all fail. Process 0
+ * checks the error it got.
+ */
+static void expect_load_error(const boost::mpi::communicator& world, const std::string& message)
+{
+	try {
+		flann::mpi::Index<L2<float> > index("test_mpi.h5", "dataset", flann::SavedIndexParams("test_mpi.idx"));
+		ADD_FAILURE() << "The index was loaded";
+	}
+	catch (flann::FLANNException& e) {
+		if (world.rank()==0) {
+			EXPECT_EQ(message, std::string(e.what()).substr(0, message.size()));
+		}
+	}
+	world.barrier();
+}
+
+TEST_F(MPI_Random, TestSaveLoad)
+{
+	size_t knn = 5;
+	flann::SearchParams params(64);
+	flann::Matrix<size_t> indices(new size_t[query.rows*knn], query.rows, knn);
+	flann::Matrix<float> dists(new float[query.rows*knn], query.rows, knn);
+	{
+		flann::mpi::Index<L2<float> > index("test_mpi.h5", "dataset", flann::KDTreeIndexParams(4));
+		index.buildIndex();
+		index.knnSearch(query, indices, dists, knn, params);
+		index.save("test_mpi.idx");
+	}
+	std::ostringstream part_name;
+	part_name << "test_mpi.idx." << world.rank();
+
+	// the same trees are loaded, the approximate search finds the same neighbors
+	{
+		flann::mpi::Index<L2<float> > index("test_mpi.h5", "dataset", flann::SavedIndexParams("test_mpi.idx"));
+		EXPECT_EQ(data.rows, index.size());
+		flann::Matrix<size_t> loaded_indices(new size_t[query.rows*knn], query.rows, knn);
+		flann::Matrix<float> loaded_dists(new float[query.rows*knn], query.rows, knn);
+		index.knnSearch(query, loaded_indices, loaded_dists, knn, params);
+		if (world.rank()==0) {
+			for (size_t i=0;i<query.rows;++i) {
+				for (size_t j=0;j<knn;++j) {
+					EXPECT_EQ(indices[i][j], loaded_indices[i][j]);
+					EXPECT_EQ(dists[i][j], loaded_dists[i][j]);
+				}
+			}
+		}
+		delete[] loaded_indices.ptr();
+		delete[] loaded_dists.ptr();
+	}
+
+	flann::mpi::IndexManifest manifest;
+	manifest.load("test_mpi.idx");
+	ASSERT_EQ(size_t(world.size()), manifest.parts.size());
+	EXPECT_EQ(data.rows, manifest.size);
+	EXPECT_EQ(data.cols, manifest.veclen);
+	EXPECT_EQ(part_name.str(), manifest.parts[world.rank()].filename);
+	world.barrier();
+
+	// saved for another dataset
+	if (world.rank()==0) {
+		flann::mpi::IndexManifest modified = manifest;
+		modified.dataset_name = "query";
+		modified.save("test_mpi.idx");
+	}
+	world.barrier();
+	expect_load_error(world, "The index was saved for a different dataset");
+
+	// saved with another number of processes
+	if (world.rank()==0) {
+		flann::mpi::IndexManifest modified = manifest;
+		modified.parts.push_back(modified.parts.back());
+		modified.save("test_mpi.idx");
+	}
+	world.barrier();
+	expect_load_error(world, "The index was saved with a different number of MPI processes");
+
+	// corrupted manifest
+	if (world.rank()==0) {
+		std::ofstream out("test_mpi.idx");
+		out << "FLANN_MPI_INDEX 1\nprocesses 1\npart 0 10000\n";
+	}
+	world.barrier();
+	expect_load_error(world, "Invalid MPI index manifest");
+
+	// truncated index file of process 0, the other processes fail with it
+	if (world.rank()==0) {
+		manifest.save("test_mpi.idx");
+		// the other processes would wait for process 0 if it returned here
+		EXPECT_EQ(0, truncate(part_name.str().c_str(), manifest.parts[0].file_size/2));
+	}
+	world.barrier();
+	expect_load_error(world, "Missing or incomplete index file");
+
+	remove(part_name.str().c_str());
+	world.barrier();
+	if (world.rank()==0) {
+		remove("test_mpi.idx");
+	}
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+}
+
+/**
+ * Loopback clients of a server running on all the processes. Each client
+ * keeps several requests in flight, with two numbers of neighbors so that
+ * some requests are coalesced and others are not.
+ */
+static void run_client(const std::string& port, const flann::Matrix<float>& query,
+		const flann::Matrix<float>& gt_dists, size_t first, size_t rows)
+{
+	const size_t requests = 10;
+	flann::mpi::Client client("localhost", port);
+	std::vector<flann::Matrix<size_t> > indices(requests);
+	std::vector<flann::Matrix<float> > dists(requests);
+	std::vector<unsigned int> ids(requests);
+	for (size_t r=0;r<requests;++r) {
+		size_t knn = 1+r%2;
+		indices[r] = flann::Matrix<size_t>(new size_t[rows*knn], rows, knn);
+		dists[r] = flann::Matrix<float>(new float[rows*knn], rows, knn);
+		flann::Matrix<float> queries(query[first+r*rows], rows, query.cols);
+		ids[r] = client.sendKnnSearch(queries, indices[r], dists[r], knn, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+	}
+	// the responses are collected in the reverse order of the requests
+	for (size_t r=requests;r-->0;) {
+		client.wait(ids[r]);
+		for (size_t i=0;i<rows;++i) {
+			for (size_t j=0;j<indices[r].cols;++j) {
+				EXPECT_EQ(gt_dists[first+r*rows+i][j], dists[r][i][j]);
+			}
+		}
+		delete[] indices[r].ptr();
+		delete[] dists[r].ptr();
+	}
+}
+
+/**
+ * Sends a single request on a new connection, the server answers an invalid
+ * request with an error and closes the connection.
+ */
+static void expect_error(const std::string& port, const flann::Matrix<float>& queries, size_t knn,
+		const std::string& message)
+{
+	flann::mpi::Client client("localhost", port);
+	flann::Matrix<int> indices(new int[queries.rows*knn], queries.rows, knn);
+	flann::Matrix<float> dists(new float[queries.rows*knn], queries.rows, knn);
+	try {
+		client.knnSearch(queries, indices, dists, knn, flann::SearchParams());
+		ADD_FAILURE() << "The request did not fail";
+	}
+	catch (flann::FLANNException& e) {
+		EXPECT_EQ(message, e.what());
+	}
+	delete[] indices.ptr();
+	delete[] dists.ptr();
+}
+
+static void run_clients(flann::mpi::Server<L2<float> >* server, const flann::Matrix<float>& data,
+		const flann::Matrix<float>& query, const flann::Matrix<float>& gt_dists)
+{
+	std::string port = boost::lexical_cast<std::string>(server->port());
+	const size_t clients = 4;
+	const size_t rows = query.rows/(clients*10);
+	boost::thread_group threads;
+	for (size_t c=0;c<clients;++c) {
+		threads.create_thread(boost::bind(&run_client, port, query, gt_dists, c*10*rows, rows));
+	}
+	threads.join_all();
+
+	// points of the wrong dimensionality
+	std::vector<float> points(2*(data.cols+1));
+	expect_error(port, flann::Matrix<float>(&points[0], 2, data.cols+1), 1,
+			"The query points do not have the dimensionality of the dataset");
+	// more neighbors than points in the index
+	expect_error(port, flann::Matrix<float>(query[0], 1, query.cols), data.rows+1,
+			"Invalid number of neighbors");
+
+	// the server still answers the other connections
+	run_client(port, query, gt_dists, 0, rows);
+
+	server->stop();
+}
+
+TEST_F(MPI_Random, TestServer)
+{
+	flann::mpi::Server<L2<float> > server("test_mpi.h5", "dataset", 0, flann::LinearIndexParams(), 2);
+
+	if (world.rank()==0) {
+		size_t knn = 2;
+		flann::Index<L2<float> > linear(data, flann::LinearIndexParams());
+		linear.buildIndex();
+		flann::Matrix<size_t> gt_indices(new size_t[query.rows*knn], query.rows, knn);
+		flann::Matrix<float> gt_dists(new float[query.rows*knn], query.rows, knn);
+		linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+
+		// the processes search in the main thread while the clients run
+		boost::thread clients(boost::bind(&run_clients, &server, data, query, gt_dists));
+		server.run();
+		clients.join();
+
+		delete[] gt_indices.ptr();
+		delete[] gt_dists.ptr();
+	}
+	else {
+		server.run();
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	boost::mpi::environment env(argc, argv);
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
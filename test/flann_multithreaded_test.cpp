@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 #include <time.h>
+#include <atomic>
+#include <thread>
 
 #include <flann/flann.h>
 #include <flann/io/hdf5.h>
@@ -304,6 +306,107 @@ TEST_F(FlannCompareRadiusTest, CompareMultiSingleCoreRadiusSearchUnsorted)
 }
 
 
+/* Searches from several threads while another thread adds and removes points */
+class FlannConcurrentUpdateTest : public FLANNTestFixture {
+protected:
+    std::vector<float> points_;
+    flann::Matrix<float> data_;
+    flann::Matrix<float> query_;
+
+    void SetUp()
+    {
+        size_t rows = 40000;
+        size_t cols = 4;
+        points_.resize(rows*cols);
+        for (size_t i=0;i<points_.size();++i) {
+            points_[i] = float(rand()) / RAND_MAX;
+        }
+        data_ = flann::Matrix<float>(&points_[0], rows, cols);
+        query_ = flann::Matrix<float>(&points_[0], 200, cols);
+    }
+
+    static void search(const flann::Index<L2<float> >* index, const flann::Matrix<float>* query,
+            const std::atomic<bool>* done, std::atomic<int>* errors)
+    {
+        flann::Matrix<size_t> indices(new size_t[query->rows*2], query->rows, 2);
+        flann::Matrix<float> dists(new float[query->rows*2], query->rows, 2);
+        while (!done->load()) {
+            index->knnSearch(*query, indices, dists, 2, flann::SearchParams(FLANN_CHECKS_UNLIMITED));
+            // the queries are never removed, so each one finds itself
+            for (size_t i=0;i<query->rows;++i) {
+                if (dists[i][0]!=0) (*errors)++;
+            }
+        }
+        delete[] indices.ptr();
+        delete[] dists.ptr();
+    }
+};
+
+TEST_F(FlannConcurrentUpdateTest, SearchWhileUpdating)
+{
+    flann::IndexParams params = flann::KDTreeIndexParams(1);
+    params["background_rebuild"] = true;
+    flann::Index<L2<float> > index(flann::Matrix<float>(data_[0], 1000, data_.cols), params);
+    index.buildIndex();
+
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for (int i=0;i<4;++i) {
+        readers.push_back(std::thread(&FlannConcurrentUpdateTest::search, &index, &query_, &done, &errors));
+    }
+
+    start_timer("Adding and removing points while searching...");
+    size_t removed = 0;
+    for (size_t offset=1000; offset<data_.rows; offset+=500) {
+        index.addPoints(flann::Matrix<float>(data_[offset], 500, data_.cols));
+        for (size_t id=offset-500; id<offset; id+=10) {
+            if (id>=query_.rows) {
+                index.removePoint(id);
+                removed++;
+            }
+        }
+    }
+    index.waitForRebuild();
+    done.store(true);
+    for (size_t i=0;i<readers.size();++i) {
+        readers[i].join();
+    }
+    printf("done (%g seconds)\n", stop_timer());
+
+    EXPECT_EQ(0, errors.load());
+    EXPECT_EQ(data_.rows-removed, index.size());
+}
+
+TEST_F(FlannConcurrentUpdateTest, MoreReadersThanSlots)
+{
+    flann::IndexParams params = flann::KDTreeIndexParams(1);
+    params["background_rebuild"] = true;
+    flann::Index<L2<float> > index(flann::Matrix<float>(data_[0], 1000, data_.cols), params);
+    index.buildIndex();
+
+    // more concurrent searches than reader slots, the extra ones wait for a free slot
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for (int i=0;i<100;++i) {
+        readers.push_back(std::thread(&FlannConcurrentUpdateTest::search, &index, &query_, &done, &errors));
+    }
+
+    for (size_t offset=1000; offset<5000; offset+=500) {
+        index.addPoints(flann::Matrix<float>(data_[offset], 500, data_.cols));
+    }
+    index.waitForRebuild();
+    done.store(true);
+    for (size_t i=0;i<readers.size();++i) {
+        readers[i].join();
+    }
+
+    EXPECT_EQ(0, errors.load());
+    EXPECT_EQ(size_t(5000), index.size());
+}
+
+
 int main(int argc, char** argv)
 {
     testing::InitGoogleTest(&argc, argv);
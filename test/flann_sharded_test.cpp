@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+#include <time.h>
+
+#include <flann/flann.h>
+#include <flann/io/hdf5.h>
+
+#include "flann_tests.h"
+
+using namespace flann;
+
+/**
+ * Test fixture for SIFT 10K dataset
+ */
+class Sharded_SIFT10K : public DatasetTestFixture<float, float> {
+protected:
+	Sharded_SIFT10K() : DatasetTestFixture("../datasets/sift10K.h5") {}
+};
+
+
+TEST_F(Sharded_SIFT10K, TestSearch)
+{
+	TestSearch<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestSearch2)
+{
+	TestSearch2<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestSearchKMeansPartition)
+{
+	TestSearch<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_KMEANS, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestSearchRangePartition)
+{
+	TestSearch<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANGE, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestSearchMixedShards)
+{
+	flann::ShardedIndexParams index_params(3, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4));
+	index_params.setShardParams(1, flann::KMeansIndexParams(7, 3, FLANN_CENTERS_RANDOM, 0.4));
+	index_params.setShardParams(2, flann::LinearIndexParams());
+	TestSearch<flann::L2<float> >(data, index_params,
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestAddIncremental)
+{
+	TestAddIncremental<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_KMEANS, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestRemove)
+{
+	TestRemove<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256));
+}
+
+TEST_F(Sharded_SIFT10K, TestSave)
+{
+	TestSave<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANGE, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K, TestCopy)
+{
+	TestCopy<flann::L2<float> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+
+/**
+ * Test fixture for SIFT 10K dataset with byte feature elements
+ */
+class Sharded_SIFT10K_byte : public DatasetTestFixture<unsigned char, float> {
+protected:
+	Sharded_SIFT10K_byte() : DatasetTestFixture("../datasets/sift10K_byte.h5") {}
+};
+
+TEST_F(Sharded_SIFT10K_byte, TestSearch)
+{
+	TestSearch<flann::L2<unsigned char> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_KMEANS, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, flann::SearchParams(256), 0.75, gt_indices);
+}
+
+TEST_F(Sharded_SIFT10K_byte, TestSaveCompression)
+{
+	// the shards are saved with the compression of the sharded index
+	flann_compression_t compressions[] = { FLANN_COMPRESSION_NONE, FLANN_COMPRESSION_LZ4 };
+	long sizes[2];
+	for (size_t i=0;i<2;++i) {
+		flann::ShardedIndexParams params(4, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4));
+		params["save_compression"] = compressions[i];
+		TestSave<flann::L2<unsigned char> >(data, params, query, indices, dists, knn,
+				flann::SearchParams(256), 0.75, gt_indices);
+		FILE* fin = fopen("test_saved_index.idx", "rb");
+		ASSERT_TRUE(fin!=NULL);
+		fseek(fin, 0, SEEK_END);
+		sizes[i] = ftell(fin);
+		fclose(fin);
+	}
+	printf("Saved index size: %ld uncompressed, %ld compressed\n", sizes[0], sizes[1]);
+	EXPECT_GT(4*sizes[0], 5*sizes[1]);
+}
+
+TEST_F(Sharded_SIFT10K_byte, TestSearchParallel)
+{
+	flann::SearchParams search_params(256);
+	search_params.cores = 0;
+	TestSearch<flann::L2<unsigned char> >(data, flann::ShardedIndexParams(4, FLANN_PARTITION_RANDOM, flann::KDTreeIndexParams(4)),
+			query, indices, dists, knn, search_params, 0.75, gt_indices);
+}
+
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -99,6 +99,7 @@ const char* index_type_to_name(flann_algorithm_t index_type)
 	case FLANN_INDEX_KDTREE_SINGLE: return "single kd-tree";
 	case FLANN_INDEX_HIERARCHICAL: return "hierarchical";
 	case FLANN_INDEX_LSH: return "LSH";
+	case FLANN_INDEX_SHARDED: return "sharded";
 #ifdef FLANN_USE_CUDA
 	case FLANN_INDEX_KDTREE_CUDA: return "kd-tree CUDA";
 #endif
@@ -669,6 +670,80 @@ protected:
 		}
 	}
 
+	template<typename Distance>
+	void TestRemoveWithIds(const flann::Matrix<typename Distance::ElementType>& data,
+			const flann::IndexParams& index_params,
+			const flann::Matrix<typename Distance::ElementType>& query,
+			flann::Matrix<size_t>& indices,
+			flann::Matrix<typename Distance::ResultType>& dists,
+			size_t knn,
+			const flann::SearchParams& search_params,
+			float precision)
+	{
+		// sparse 64-bit ids, the first half of the points is used to build the index
+		size_t size1 = data.rows/2;
+		std::vector<size_t> ids(data.rows);
+		for (size_t i=0;i<data.rows;++i) {
+			ids[i] = (size_t(1)<<40) + i*7919;
+		}
+		std::vector<size_t> ids1(ids.begin(), ids.begin()+size1);
+		std::vector<size_t> ids2(ids.begin()+size1, ids.end());
+		flann::Matrix<typename Distance::ElementType> data1(data[0], size1, data.cols);
+		flann::Matrix<typename Distance::ElementType> data2(data[size1], data.rows-size1, data.cols);
+
+		flann::seed_random(0);
+		flann::IndexParams params = index_params;
+		params["compaction_threshold"] = 0.05f;
+		Index<Distance> index(params);
+		char message[256];
+		const char* index_name = index_type_to_name(index.getType());
+		sprintf(message, "Building %s index... ", index_name);
+		start_timer( message );
+		index.buildIndex(data1, ids1);
+		printf("done (%g seconds)\n", stop_timer());
+		Index<Distance> linear((flann::LinearIndexParams()));
+		linear.buildIndex(data1, ids1);
+
+		// remove about 30% of the points, compacting the index several times
+		flann::DynamicBitset removed(data.rows);
+		for (size_t i=0;i<size1;++i) {
+			if (rand_double()<0.3) {
+				index.removePoint(ids[i]);
+				linear.removePoint(ids[i]);
+				removed.set(i);
+			}
+		}
+		EXPECT_EQ(linear.size(), index.size());
+
+		index.addPoints(data2, ids2);
+		linear.addPoints(data2, ids2);
+		EXPECT_EQ(linear.size(), index.size());
+		EXPECT_EQ(data2[0], index.getPoint(ids2[0]));
+
+		start_timer("Searching KNN after removing points...");
+		index.knnSearch(query, indices, dists, knn, search_params );
+		printf("done (%g seconds)\n", stop_timer());
+
+		for (size_t i=0;i<indices.rows;++i) {
+			for (size_t j=0;j<indices.cols;++j) {
+				size_t point = (indices[i][j]-ids[0])/7919;
+				ASSERT_LT(point, data.rows);
+				EXPECT_EQ(ids[point], indices[i][j]);
+				EXPECT_FALSE(removed.test(point));
+			}
+		}
+
+		flann::Matrix<size_t> gt_indices(new size_t[query.rows*knn], query.rows, knn);
+		flann::Matrix<typename Distance::ResultType> gt_dists(new typename Distance::ResultType[query.rows*knn], query.rows, knn);
+		linear.knnSearch(query, gt_indices, gt_dists, knn, flann::SearchParams());
+		float result_precision = computePrecisionDiscrete(gt_dists, dists);
+		printf("Precision: %g\n", result_precision);
+		EXPECT_GE(result_precision, precision);
+
+		delete[] gt_indices.ptr();
+		delete[] gt_dists.ptr();
+	}
+
 };
 
 
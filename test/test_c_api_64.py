@@ -0,0 +1,142 @@
+#!/usr/bin/env python
+
+from pyflann.flann_ctypes import flannlib, FLANNParameters, FLANN_INDEX
+from ctypes import *
+from numpy import *
+from numpy.random import *
+import unittest
+
+# the _64 functions of the C bindings, which are not used by pyflann itself
+size_p = POINTER(c_size_t)
+float_p = POINTER(c_float)
+uint_p = POINTER(c_uint)
+ubyte_p = POINTER(c_ubyte)
+params_p = POINTER(FLANNParameters)
+
+flannlib.flann_build_index_64_float.restype = FLANN_INDEX
+flannlib.flann_build_index_64_float.argtypes = [float_p, c_size_t, c_size_t, float_p, params_p]
+flannlib.flann_build_index_64_hamming.restype = FLANN_INDEX
+flannlib.flann_build_index_64_hamming.argtypes = [ubyte_p, c_size_t, c_size_t, float_p, params_p]
+flannlib.flann_add_points_64_float.restype = c_int
+flannlib.flann_add_points_64_float.argtypes = [FLANN_INDEX, float_p, c_size_t, c_size_t, c_float]
+flannlib.flann_remove_point_64_float.restype = c_int
+flannlib.flann_remove_point_64_float.argtypes = [FLANN_INDEX, c_size_t]
+flannlib.flann_get_point_64_float.restype = float_p
+flannlib.flann_get_point_64_float.argtypes = [FLANN_INDEX, c_size_t]
+flannlib.flann_size_64_float.restype = c_size_t
+flannlib.flann_size_64_float.argtypes = [FLANN_INDEX]
+flannlib.flann_used_memory_64_float.restype = c_size_t
+flannlib.flann_used_memory_64_float.argtypes = [FLANN_INDEX]
+flannlib.flann_find_nearest_neighbors_index_64_float.restype = c_int
+flannlib.flann_find_nearest_neighbors_index_64_float.argtypes = [FLANN_INDEX, float_p, c_size_t,
+                                                                 size_p, float_p, c_size_t, params_p]
+flannlib.flann_find_nearest_neighbors_index_64_hamming.restype = c_int
+flannlib.flann_find_nearest_neighbors_index_64_hamming.argtypes = [FLANN_INDEX, ubyte_p, c_size_t,
+                                                                   size_p, uint_p, c_size_t, params_p]
+flannlib.flann_radius_search_64_float.restype = c_int
+flannlib.flann_radius_search_64_float.argtypes = [FLANN_INDEX, float_p, size_p, float_p, c_size_t,
+                                                  c_float, params_p]
+flannlib.flann_free_index_float.restype = c_int
+flannlib.flann_free_index_float.argtypes = [FLANN_INDEX, params_p]
+flannlib.flann_free_index_byte.restype = c_int
+flannlib.flann_free_index_byte.argtypes = [FLANN_INDEX, params_p]
+
+
+def ptr(array, ctype):
+    return array.ctypes.data_as(POINTER(ctype))
+
+
+class Test_FLANN_C_API_64(unittest.TestCase):
+
+    def setUp(self):
+        self.params = FLANNParameters()
+        self.params.update({'algorithm': 'linear', 'checks': 32, 'log_level': 'none'})
+        self.data = rand(100, 8).astype(float32)
+        self.speedup = c_float(0)
+        self.index = flannlib.flann_build_index_64_float(ptr(self.data, c_float), 100, 8,
+                                                         pointer(self.speedup), pointer(self.params))
+        self.assertTrue(self.index)
+
+    def tearDown(self):
+        flannlib.flann_free_index_float(self.index, pointer(self.params))
+
+    def test_size(self):
+        self.assertEqual(flannlib.flann_size_64_float(self.index), 100)
+        self.assertTrue(flannlib.flann_used_memory_64_float(self.index) >= 0)
+
+    def test_knn_missing_neighbors(self):
+        # more neighbors than points, the last slots are reported as missing
+        nn = 150
+        indices = full((1, nn), 77, dtype=uint64)
+        dists = full((1, nn), 77, dtype=float32)
+        query = self.data[3:4].copy()
+        res = flannlib.flann_find_nearest_neighbors_index_64_float(self.index, ptr(query, c_float), 1,
+                                                                   ptr(indices, c_size_t), ptr(dists, c_float),
+                                                                   nn, pointer(self.params))
+        self.assertEqual(res, 0)
+        self.assertEqual(indices[0, 0], 3)
+        self.assertEqual(sorted(indices[0, :100].tolist()), list(range(100)))
+        self.assertTrue((indices[0, 100:] == iinfo(uint64).max).all())
+        self.assertTrue((dists[0, 100:] == finfo(float32).max).all())
+
+    def test_radius(self):
+        query = self.data[0].copy()
+        radius = 0.5
+        gt = ((self.data - query)**2).sum(1)
+        expected = sorted(nonzero(gt <= radius)[0].tolist())
+        indices = zeros(100, dtype=uint64)
+        dists = zeros(100, dtype=float32)
+        count = flannlib.flann_radius_search_64_float(self.index, ptr(query, c_float), ptr(indices, c_size_t),
+                                                      ptr(dists, c_float), 100, radius, pointer(self.params))
+        self.assertEqual(count, len(expected))
+        self.assertEqual(sorted(indices[:count].tolist()), expected)
+
+    def test_add_remove_get(self):
+        points = rand(20, 8).astype(float32)
+        res = flannlib.flann_add_points_64_float(self.index, ptr(points, c_float), 20, 8, 2.0)
+        self.assertEqual(res, 0)
+        self.assertEqual(flannlib.flann_size_64_float(self.index), 120)
+        point = flannlib.flann_get_point_64_float(self.index, 105)
+        self.assertTrue(allclose([point[i] for i in range(8)], points[5]))
+        self.assertEqual(flannlib.flann_remove_point_64_float(self.index, 105), 0)
+        self.assertEqual(flannlib.flann_size_64_float(self.index), 119)
+
+    def test_too_many_points(self):
+        # the indexes use int point ids, larger indexes are rejected before reading the points
+        rows = 2**31
+        index = flannlib.flann_build_index_64_float(ptr(self.data, c_float), rows, 8, pointer(self.speedup),
+                                                    pointer(self.params))
+        self.assertFalse(index)
+        res = flannlib.flann_add_points_64_float(self.index, ptr(self.data, c_float), rows, 8, 2.0)
+        self.assertEqual(res, -1)
+        self.assertEqual(flannlib.flann_size_64_float(self.index), 100)
+
+    def test_hamming(self):
+        data = randint(0, 256, size=(50, 4)).astype(uint8)
+        params = FLANNParameters()
+        params.update({'algorithm': 'linear', 'log_level': 'none'})
+        index = flannlib.flann_build_index_64_hamming(ptr(data, c_ubyte), 50, 4, pointer(self.speedup),
+                                                      pointer(params))
+        self.assertTrue(index)
+        indices = zeros((1, 60), dtype=uint64)
+        dists = zeros((1, 60), dtype=uint32)
+        query = data[7:8].copy()
+        res = flannlib.flann_find_nearest_neighbors_index_64_hamming(index, ptr(query, c_ubyte), 1,
+                                                                     ptr(indices, c_size_t), ptr(dists, c_uint),
+                                                                     60, pointer(params))
+        self.assertEqual(res, 0)
+        self.assertEqual(dists[0, 0], 0)
+        self.assertTrue((indices[0, 50:] == iinfo(uint64).max).all())
+        flannlib.flann_free_index_byte(index, pointer(params))
+
+    def test_free_other_type(self):
+        # an index is freed by the free function of any element type
+        data = rand(10, 4).astype(float32)
+        index = flannlib.flann_build_index_64_float(ptr(data, c_float), 10, 4, pointer(self.speedup),
+                                                    pointer(self.params))
+        self.assertTrue(index)
+        self.assertEqual(flannlib.flann_free_index_byte(index, pointer(self.params)), 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
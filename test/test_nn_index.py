@@ -76,6 +76,104 @@ class Test_PyFLANN_nn_index(unittest.TestCase):
        
         self.assertRaises(FLANNException, lambda: nn.nn_index(rand(5,5)))
 
+    def testnn_index_strided(self):
+        dim = 10
+        N = 100
+
+        # every other row and column of a larger array, not copied
+        base = rand(2*N, 2*dim).astype(float32)
+        x = base[::2, :dim]
+        nn = FLANN()
+        nn.build_index(x)
+
+        nnidx, nndist = nn.nn_index(base[::2, :dim])
+        self.assertTrue(all(nnidx == arange(N, dtype = index_type)))
+
+        # results written in place, in a view of a larger array
+        out_idx = zeros((N, 6), dtype=index_type)
+        out_dist = zeros((N, 6), dtype=float32)
+        res = nn.nn_index(x, 3, indices=out_idx[:, 1:4], dists=out_dist[:, 1:4], batch_size=7)
+        self.assertTrue(all(out_idx[:, 1] == arange(N, dtype = index_type)))
+        self.assertTrue(all(out_idx[:, 0] == 0) and all(out_idx[:, 4:] == 0))
+        self.assertTrue(all(res[0] == out_idx[:, 1:4]))
+        self.assertTrue(all(out_dist[:, 2] >= out_dist[:, 1]))
+
+        self.assertRaises(FLANNException, lambda: nn.nn_index(x, 3, indices=zeros((N, 3), dtype=int64)))
+        self.assertRaises(FLANNException, lambda: nn.nn_index(x, 3, indices=zeros((N, 6), dtype=index_type)[:, ::2]))
+
+    def testnn_index_float16(self):
+        dim = 10
+        N = 100
+
+        x = rand(N, dim).astype(float16)
+        nn = FLANN()
+        nn.build_index(x)
+        nnidx, nndist = nn.nn_index(x)
+        self.assertTrue(all(nnidx == arange(N, dtype = index_type)))
+        self.assertEqual(nndist.dtype, float32)
+
+    def testnn_index_threads(self):
+        import threading
+        dim = 10
+        N = 1000
+
+        x = rand(N, dim).astype(float32)
+        nn = FLANN()
+        nn.build_index(x)
+        correct = []
+
+        def search(i):
+            nnidx, nndist = nn.nn_index(x, cores=1, batch_size=100)
+            correct.append(all(nnidx == arange(N, dtype = index_type)))
+
+        threads = [threading.Thread(target=search, args=(i,)) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertTrue(len(correct) == 4 and all(correct))
+
+
+    def testnn_index_distance_type(self):
+        dim = 2
+        N = 100
+
+        x = rand(N, dim).astype(float32)
+        q = rand(20, dim).astype(float32)
+        l1 = FLANN(algorithm='linear', distance_type='manhattan')
+        l1.build_index(x)
+        l2 = FLANN(algorithm='linear')
+        l2.build_index(x)
+
+        # the distance is kept in each index, whatever the default distance is
+        set_distance_type('euclidean')
+        idx1, dist1 = l1.nn_index(q)
+        idx2, dist2 = l2.nn_index(q)
+        self.assertTrue(allclose(dist1, abs(x[idx1] - q).sum(1), rtol=1e-4))
+        self.assertTrue(allclose(dist2, ((x[idx2] - q)**2).sum(1), rtol=1e-4))
+
+        set_distance_type('manhattan')
+        idx2, dist2 = l2.nn_index(q)
+        set_distance_type('euclidean')
+        self.assertTrue(allclose(dist2, ((x[idx2] - q)**2).sum(1), rtol=1e-4))
+
+
+    def testnn_index_remove_point(self):
+        dim = 4
+        N = 20
+
+        x = rand(N, dim).astype(float32)
+        nn = FLANN(algorithm='linear')
+        nn.build_index(x)
+
+        # removing the same point twice or an unknown id leaves the other points
+        nn.remove_point(3)
+        nn.remove_point(3)
+        nn.remove_point(1000)
+        idx, dist = nn.nn_index(x[:1], num_neighbors=N - 1)
+        self.assertEqual(sorted(idx[0].tolist()), [i for i in range(N) if i != 3])
+        self.assertRaises(AssertionError, nn.nn_index, x[:1], num_neighbors=N)
+
 
 if __name__ == '__main__':
     unittest.main()